@@ -0,0 +1,345 @@
+#include "binary_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "config.h"
+
+namespace fatdog
+{
+    // ids a thread has already seen defined, for one appender and one file at a time
+    struct BinaryLogCache
+    {
+        uint64_t appender = 0;
+        uint64_t generation = 0;
+        std::map<std::pair<const char *, int>, uint32_t> sites;
+        std::map<std::string, uint32_t> names;
+    };
+
+    static thread_local BinaryLogCache t_binary_cache;
+    static std::atomic<uint64_t> s_binary_id = {0};
+
+    static BinaryLogCache &LocalCache(uint64_t appender, uint64_t generation)
+    {
+        BinaryLogCache &c = t_binary_cache;
+        if (c.appender != appender || c.generation != generation)
+        {
+            c.appender = appender;
+            c.generation = generation;
+            c.sites.clear();
+            c.names.clear();
+        }
+        return c;
+    }
+
+    static uint32_t Padded(size_t size)
+    {
+        return (size + 3) & ~(size_t)3;
+    }
+
+    // the size goes in last, a reader never sees a record before it is complete
+    static void Finish(char *p, uint32_t size, uint8_t type, uint8_t level, uint16_t padding)
+    {
+        p[4] = type;
+        p[5] = level;
+        memcpy(p + 6, &padding, 2);
+        __atomic_store_n((uint32_t *)p, size, __ATOMIC_RELEASE);
+    }
+
+    BinaryLogAppender::BinaryLogAppender(const std::string &filename, uint64_t max_size, uint32_t max_files, LogLevel::Level level)
+        : LogAppender(level), m_filename(filename), m_id(++s_binary_id), m_maxSize(max_size), m_maxFiles(max_files)
+    {
+        m_maxSize = std::max<uint64_t>(m_maxSize, 64 * 1024);
+        m_maxSize = std::min<uint64_t>(m_maxSize, 0xffffffffull);
+
+        // don't append to what an earlier run left, it goes to file.1 like a full file
+        struct stat st;
+        RWMutexType::WriteLock lock(m_mutex);
+        if (!stat(m_filename.c_str(), &st) && st.st_size > 0)
+        {
+            rotate(m_generation);
+        }
+        else
+        {
+            open();
+        }
+    }
+
+    BinaryLogAppender::~BinaryLogAppender()
+    {
+        RWMutexType::WriteLock lock(m_mutex);
+        close();
+    }
+
+    bool BinaryLogAppender::open()
+    {
+        m_fd = ::open(m_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd == -1)
+        {
+            std::cout << "BinaryLogAppender open " << m_filename << " errno=" << errno << std::endl;
+            return false;
+        }
+        void *data = MAP_FAILED;
+        if (!ftruncate(m_fd, m_maxSize))
+        {
+            data = mmap(nullptr, m_maxSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        }
+        if (data == MAP_FAILED)
+        {
+            std::cout << "BinaryLogAppender map " << m_filename << " errno=" << errno << std::endl;
+            ::close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+
+        m_data = (char *)data;
+        memcpy(m_data, BinaryLog::MAGIC, sizeof(BinaryLog::MAGIC));
+        memcpy(m_data + 8, &BinaryLog::VERSION, 4);
+        memcpy(m_data + 12, &BinaryLog::HEADER_SIZE, 4);
+        m_offset = BinaryLog::HEADER_SIZE;
+        return true;
+    }
+
+    void BinaryLogAppender::close()
+    {
+        if (!m_data)
+        {
+            return;
+        }
+        uint64_t used = std::min<uint64_t>(m_offset, m_maxSize);
+        munmap(m_data, m_maxSize);
+        m_data = nullptr;
+        if (ftruncate(m_fd, used))
+        {
+            std::cout << "BinaryLogAppender truncate " << m_filename << " errno=" << errno << std::endl;
+        }
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+    void BinaryLogAppender::rotate(uint64_t generation)
+    {
+        if (m_generation != generation)
+        {
+            return; // someone else did
+        }
+        close();
+        for (uint32_t i = m_maxFiles; i > 1; --i)
+        {
+            rename((m_filename + "." + std::to_string(i - 1)).c_str(), (m_filename + "." + std::to_string(i)).c_str());
+        }
+        if (m_maxFiles)
+        {
+            rename(m_filename.c_str(), (m_filename + ".1").c_str());
+        }
+        open();
+        ++m_generation;
+    }
+
+    char *BinaryLogAppender::reserve(uint32_t size)
+    {
+        uint64_t off = m_offset.fetch_add(size);
+        if (off + size > m_maxSize)
+        {
+            return nullptr;
+        }
+        return m_data + off;
+    }
+
+    bool BinaryLogAppender::define(uint32_t id, BinaryLog::Type type, uint32_t num, const char *str, size_t len)
+    {
+        uint32_t fixed = BinaryLog::RECORD_HEADER_SIZE + (type == BinaryLog::SITE ? 8 : 4);
+        uint32_t size = Padded(fixed + len);
+        char *p = reserve(size);
+        if (!p)
+        {
+            return false;
+        }
+        memcpy(p + BinaryLog::RECORD_HEADER_SIZE, &id, 4);
+        if (type == BinaryLog::SITE)
+        {
+            memcpy(p + BinaryLog::RECORD_HEADER_SIZE + 4, &num, 4);
+        }
+        memcpy(p + fixed, str, len);
+        Finish(p, size, type, 0, size - fixed - len);
+        return true;
+    }
+
+    bool BinaryLogAppender::siteId(const char *file, int line, uint32_t &id)
+    {
+        BinaryLogCache &c = LocalCache(m_id, m_generation);
+        std::pair<const char *, int> key(file, line);
+        auto it = c.sites.find(key);
+        if (it != c.sites.end())
+        {
+            id = it->second;
+            return true;
+        }
+
+        Mutex::Lock lock(m_idMutex);
+        auto r = m_sites.insert(std::make_pair(key, (uint32_t)m_defined.size()));
+        if (r.second)
+        {
+            m_defined.push_back(0);
+        }
+        id = r.first->second;
+        if (m_defined[id] != m_generation + 1)
+        {
+            if (!define(id, BinaryLog::SITE, line, file, strlen(file)))
+            {
+                return false;
+            }
+            m_defined[id] = m_generation + 1;
+        }
+        c.sites[key] = id;
+        return true;
+    }
+
+    bool BinaryLogAppender::nameId(const std::string &name, uint32_t &id)
+    {
+        BinaryLogCache &c = LocalCache(m_id, m_generation);
+        auto it = c.names.find(name);
+        if (it != c.names.end())
+        {
+            id = it->second;
+            return true;
+        }
+
+        Mutex::Lock lock(m_idMutex);
+        auto r = m_names.insert(std::make_pair(name, (uint32_t)m_defined.size()));
+        if (r.second)
+        {
+            m_defined.push_back(0);
+        }
+        id = r.first->second;
+        if (m_defined[id] != m_generation + 1)
+        {
+            if (!define(id, BinaryLog::NAME, 0, name.data(), name.size()))
+            {
+                return false;
+            }
+            m_defined[id] = m_generation + 1;
+        }
+        c.names[name] = id;
+        return true;
+    }
+
+    bool BinaryLogAppender::writeEvent(LogLevel::Level level, uint32_t site, uint32_t logger, uint32_t thread_name,
+                                       LogEvent *event, const iovec *iov, int iovcnt)
+    {
+        // a record must fit into an empty file with room for its definitions
+        size_t len = 0;
+        size_t max_len = m_maxSize / 4;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            len += iov[i].iov_len;
+        }
+        len = std::min(len, max_len);
+
+        uint32_t size = Padded(BinaryLog::EVENT_SIZE + len);
+        char *p = reserve(size);
+        if (!p)
+        {
+            return false;
+        }
+        uint32_t fields[6] = {site, logger, thread_name, 0, 0, 0};
+        uint64_t time = 0;
+        if (event)
+        {
+            fields[3] = event->getThreadId();
+            fields[4] = event->getFiberId();
+            fields[5] = event->getElapse();
+            time = event->getTime();
+        }
+        memcpy(p + BinaryLog::RECORD_HEADER_SIZE, fields, sizeof(fields));
+        memcpy(p + BinaryLog::RECORD_HEADER_SIZE + sizeof(fields), &time, 8);
+
+        char *out = p + BinaryLog::EVENT_SIZE;
+        size_t left = len;
+        for (int i = 0; i < iovcnt && left; ++i)
+        {
+            size_t n = std::min(left, iov[i].iov_len);
+            memcpy(out, iov[i].iov_base, n);
+            out += n;
+            left -= n;
+        }
+        Finish(p, size, BinaryLog::EVENT, level, size - BinaryLog::EVENT_SIZE - len);
+        return true;
+    }
+
+    void BinaryLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
+    {
+        if (level < m_level)
+        {
+            return;
+        }
+        LogBuffer &content = event->getContentBuffer();
+        iovec iov;
+        iov.iov_base = (void *)content.data();
+        iov.iov_len = content.size();
+
+        while (true)
+        {
+            uint64_t generation;
+            {
+                RWMutexType::ReadLock lock(m_mutex);
+                if (!m_data)
+                {
+                    return;
+                }
+                generation = m_generation;
+                uint32_t site, name, thread_name;
+                if (siteId(event->getFile(), event->getLine(), site) && nameId(logger->getName(), name) &&
+                    nameId(event->getThreadName(), thread_name) &&
+                    writeEvent(level, site, name, thread_name, event.get(), &iov, 1))
+                {
+                    return;
+                }
+            }
+            RWMutexType::WriteLock lock(m_mutex);
+            rotate(generation);
+        }
+    }
+
+    void BinaryLogAppender::write(const iovec *iov, int iovcnt)
+    {
+        while (true)
+        {
+            uint64_t generation;
+            {
+                RWMutexType::ReadLock lock(m_mutex);
+                if (!m_data)
+                {
+                    return;
+                }
+                generation = m_generation;
+                if (writeEvent(LogLevel::UNKNOWN, 0, 0, 0, nullptr, iov, iovcnt))
+                {
+                    return;
+                }
+            }
+            RWMutexType::WriteLock lock(m_mutex);
+            rotate(generation);
+        }
+    }
+
+    std::string BinaryLogAppender::toYamlString()
+    {
+        YAML::Node node;
+        node["type"] = "BinaryLogAppender";
+        node["file"] = m_filename;
+        node["max_size"] = m_maxSize;
+        node["max_files"] = m_maxFiles;
+        node["level"] = LogLevel::ToString(m_level);
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+} // namespace fatdog
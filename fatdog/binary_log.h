@@ -0,0 +1,102 @@
+#ifndef __FATDOG_BINARY_LOG_H__
+#define __FATDOG_BINARY_LOG_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "log.h"
+
+namespace fatdog
+{
+    /*
+     * binary log file, host byte order:
+     *
+     *      header  "FDBLOG01" u32 version u32 header_size
+     *      record  u32 size (whole record, a multiple of 4) u8 type u8 level u16 padding at the
+     *              end, then by type
+     *          SITE    u32 id u32 line, file name
+     *          NAME    u32 id, logger or thread name
+     *          EVENT   u32 site u32 logger u32 thread_name u32 thread_id u32 fiber_id u32 elapse
+     *                  u64 time, message
+     *
+     * the size is stored last, a size of 0 ends the file (the rest was never written). every file
+     * carries the SITE and NAME records its events refer to, so each one decodes on its own,
+     * but a definition may come after the first event using it.
+    */
+    namespace BinaryLog
+    {
+        static const char MAGIC[8] = {'F', 'D', 'B', 'L', 'O', 'G', '0', '1'};
+        static const uint32_t VERSION = 1;
+        static const uint32_t HEADER_SIZE = 16;
+        static const uint32_t RECORD_HEADER_SIZE = 8;
+        static const uint32_t EVENT_SIZE = RECORD_HEADER_SIZE + 6 * 4 + 8;
+
+        enum Type
+        {
+            SITE = 1,
+            NAME = 2,
+            EVENT = 3
+        };
+    } // namespace BinaryLog
+
+    /*
+     * writes records without formatting them: the message text as built by operator<<, the
+     * event fields as numbers, file:line and names as ids defined once per file.
+     * the file is mapped and written with memcpy, threads reserve their bytes with one
+     * atomic add, the kernel writes it back even if the process dies. a full file is
+     * renamed to file.1 (file.1 to file.2 ... up to max_files) and a new one started.
+     * tools/fatdog_logcat turns the files back into text.
+    */
+    class BinaryLogAppender : public LogAppender
+    {
+    public:
+        typedef std::shared_ptr<BinaryLogAppender> ptr;
+        typedef RWMutex RWMutexType;
+
+        BinaryLogAppender(const std::string &filename, uint64_t max_size = 64 * 1024 * 1024, uint32_t max_files = 5,
+                          LogLevel::Level level = LogLevel::INFO);
+        ~BinaryLogAppender();
+
+        void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+        // formatted text is kept as an event without site and names
+        void write(const iovec *iov, int iovcnt) override;
+        std::string toYamlString() override;
+
+    private:
+        // with m_mutex read locked
+        char *reserve(uint32_t size);
+        bool define(uint32_t id, BinaryLog::Type type, uint32_t num, const char *str, size_t len);
+        // the id, defined in the current file if it was not yet. false if the file is full
+        bool siteId(const char *file, int line, uint32_t &id);
+        bool nameId(const std::string &name, uint32_t &id);
+
+        bool writeEvent(LogLevel::Level level, uint32_t site, uint32_t logger, uint32_t thread_name,
+                        LogEvent *event, const iovec *iov, int iovcnt);
+
+        bool open();
+        void close();
+        void rotate(uint64_t generation);
+
+    private:
+        std::string m_filename;
+        uint64_t m_id; // keys the thread local id caches
+        uint64_t m_maxSize;
+        uint32_t m_maxFiles;
+
+        // read locked to write records, write locked to switch files
+        RWMutexType m_mutex;
+        int m_fd = -1;
+        char *m_data = nullptr;
+        std::atomic<uint64_t> m_offset = {0};
+        std::atomic<uint64_t> m_generation = {0};
+
+        // ids and which of them the current file has defined
+        Mutex m_idMutex;
+        std::map<std::pair<const char *, int>, uint32_t> m_sites; // __FILE__ is the same pointer in a file
+        std::map<std::string, uint32_t> m_names;
+        std::vector<uint64_t> m_defined = {0}; // by id, generation + 1 of the file which has it. 0 is no id
+    };
+} // namespace fatdog
+
+#endif
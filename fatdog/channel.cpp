@@ -0,0 +1,201 @@
+#include "channel.h"
+
+#include <algorithm>
+
+#include "clock.h"
+#include "iomanager.h"
+
+namespace fatdog
+{
+    void ChannelBase::close()
+    {
+        m_closed = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        onClose();
+
+        // everyone waiting looks again and finds it closed
+        std::list<ChannelWaiter::ptr> waiters;
+        {
+            MutexType::Lock lock(m_mutex);
+            waiters.swap(m_receivers);
+            waiters.splice(waiters.end(), m_senders);
+            m_receiversWaiting = 0;
+            m_sendersWaiting = 0;
+        }
+        for (auto &i : waiters)
+        {
+            i->fire();
+        }
+    }
+
+    void ChannelBase::addReceiver(const ChannelWaiter::ptr &waiter)
+    {
+        MutexType::Lock lock(m_mutex);
+        m_receivers.push_back(waiter);
+        ++m_receiversWaiting;
+    }
+
+    void ChannelBase::delReceiver(const ChannelWaiter::ptr &waiter)
+    {
+        MutexType::Lock lock(m_mutex);
+        auto it = std::find(m_receivers.begin(), m_receivers.end(), waiter);
+        if (it != m_receivers.end())
+        {
+            m_receivers.erase(it);
+            --m_receiversWaiting;
+        }
+    }
+
+    void ChannelBase::addSender(const ChannelWaiter::ptr &waiter)
+    {
+        MutexType::Lock lock(m_mutex);
+        m_senders.push_back(waiter);
+        ++m_sendersWaiting;
+    }
+
+    void ChannelBase::delSender(const ChannelWaiter::ptr &waiter)
+    {
+        MutexType::Lock lock(m_mutex);
+        auto it = std::find(m_senders.begin(), m_senders.end(), waiter);
+        if (it != m_senders.end())
+        {
+            m_senders.erase(it);
+            --m_sendersWaiting;
+        }
+    }
+
+    void ChannelBase::wakeOne(std::list<ChannelWaiter::ptr> &waiters, std::atomic<int> &count)
+    {
+        if (!count.load())
+        {
+            return;
+        }
+        // waiters of a select may have been claimed through another channel, skip them
+        ChannelWaiter::ptr woken;
+        {
+            MutexType::Lock lock(m_mutex);
+            while (!waiters.empty())
+            {
+                ChannelWaiter::ptr waiter = std::move(waiters.front());
+                waiters.pop_front();
+                --count;
+                if (waiter->claim())
+                {
+                    woken = std::move(waiter);
+                    break;
+                }
+            }
+        }
+        if (woken)
+        {
+            woken->waiter.wake();
+        }
+    }
+
+    int ChannelSelect::poll()
+    {
+        size_t closed = 0;
+        for (size_t i = 0; i < m_cases.size(); ++i)
+        {
+            int rt = m_cases[i].tryRecv();
+            if (rt > 0)
+            {
+                return i + 1;
+            }
+            if (rt < 0)
+            {
+                ++closed;
+            }
+        }
+        return closed == m_cases.size() ? -1 : 0;
+    }
+
+    int ChannelSelect::wait(uint64_t timeout_ms)
+    {
+        uint64_t deadline = timeout_ms == ~0ull ? ~0ull : Clock::NowMS() + timeout_ms;
+        while (true)
+        {
+            int rt = poll();
+            if (rt)
+            {
+                return rt > 0 ? rt - 1 : -2;
+            }
+            uint64_t now = Clock::NowMS();
+            if (now >= deadline)
+            {
+                return -1;
+            }
+
+            // get on every list, then look again: a send in between saw us waiting
+            Semaphore sem;
+            ChannelWaiter::ptr waiter(new ChannelWaiter);
+            IOManager *iom = IOManager::GetThis();
+            if (deadline != ~0ull && !iom)
+            {
+                waiter->waiter.sem = &sem; // no timers here, block the thread for a timed wait
+            }
+            else
+            {
+                waiter->waiter.init(sem);
+            }
+            for (auto &i : m_cases)
+            {
+                i.channel->addReceiver(waiter);
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            rt = poll();
+
+            TimerManager::Timer::ptr timer;
+            if (!rt)
+            {
+                if (deadline == ~0ull)
+                {
+                    waiter->waiter.park();
+                }
+                else if (iom && !waiter->waiter.sem)
+                {
+                    timer = iom->addTimer(deadline - now, [waiter]() {
+                        if (waiter->claim())
+                        {
+                            waiter->timedOut = true;
+                            waiter->waiter.wake();
+                        }
+                    });
+                    waiter->waiter.park();
+                }
+                else if (!sem.waitFor(deadline - now))
+                {
+                    if (waiter->claim())
+                    {
+                        waiter->timedOut = true;
+                    }
+                    else
+                    {
+                        sem.wait(); // woken just now, take it
+                    }
+                }
+            }
+            else if (!waiter->claim())
+            {
+                waiter->waiter.park(); // already woken, take it
+            }
+
+            if (timer)
+            {
+                timer->cancel();
+            }
+            for (auto &i : m_cases)
+            {
+                i.channel->delReceiver(waiter);
+            }
+            if (rt)
+            {
+                return rt > 0 ? rt - 1 : -2;
+            }
+            if (waiter->timedOut)
+            {
+                return -1;
+            }
+        }
+    }
+} // namespace fatdog
@@ -0,0 +1,303 @@
+#ifndef __FATDOG_CHANNEL_H__
+#define __FATDOG_CHANNEL_H__
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include "fiber_sync.h"
+#include "lockfree_queue.h"
+#include "noncopyable.h"
+
+/*
+ * Channel<T>: typed pipe between fibers (or threads), like go's chan.
+ *
+ *      buffered    Channel<T>(n): values sit in a BoundedQueue of n slots (rounded up to a
+ *                  power of 2). send() and recv() are one lock-free push or pop while the
+ *                  queue is neither full nor empty, producers and consumers on different
+ *                  threads never take a common lock.
+ *      unbuffered  Channel<T>(0): send() returns once a receiver took the value.
+ *
+ * a full send() or empty recv() parks the calling fiber (FiberWaiter) until the other side
+ * makes progress. the wait lists are only touched by whoever has to wait, and by the other
+ * side when it sees someone waiting.
+ *
+ * close(): send() fails from then on, recv() gets what is left and then fails. an unbuffered
+ * send() still waiting for its receiver fails too.
+ *
+ * ChannelSelect waits on the recv side of several channels at once, with a timeout from the
+ * IOManager's timers (a plain thread uses a timed semaphore wait).
+ *
+ * T must be default constructible and movable.
+*/
+
+namespace fatdog
+{
+    class ChannelSelect;
+
+    // parked on one or more channels, whoever claim()s it first wakes it
+    struct ChannelWaiter
+    {
+        typedef std::shared_ptr<ChannelWaiter> ptr;
+
+        FiberWaiter waiter;
+        std::atomic<bool> fired = {false};
+        bool ok = true;        // unbuffered send: false if the channel closed before a receiver came
+        bool timedOut = false;
+
+        bool claim()
+        {
+            bool expected = false;
+            return fired.compare_exchange_strong(expected, true);
+        }
+        // wake it if nobody did yet
+        bool fire()
+        {
+            if (!claim())
+            {
+                return false;
+            }
+            waiter.wake();
+            return true;
+        }
+    };
+
+    class ChannelBase : Noncopyable
+    {
+        friend class ChannelSelect;
+
+    public:
+        virtual ~ChannelBase() {}
+
+        bool isClosed() const { return m_closed; }
+        void close();
+
+    protected:
+        typedef Spinlock MutexType;
+
+        void addReceiver(const ChannelWaiter::ptr &waiter);
+        void delReceiver(const ChannelWaiter::ptr &waiter);
+        void addSender(const ChannelWaiter::ptr &waiter);
+        void delSender(const ChannelWaiter::ptr &waiter);
+
+        // a value went in / a slot came free
+        void wakeReceiver() { wakeOne(m_receivers, m_receiversWaiting); }
+        void wakeSender() { wakeOne(m_senders, m_sendersWaiting); }
+
+        // unbuffered values still queued when closing
+        virtual void onClose() {}
+
+    private:
+        void wakeOne(std::list<ChannelWaiter::ptr> &waiters, std::atomic<int> &count);
+
+    protected:
+        std::atomic<bool> m_closed = {false};
+
+    private:
+        MutexType m_mutex;
+        std::list<ChannelWaiter::ptr> m_receivers;
+        std::list<ChannelWaiter::ptr> m_senders;
+        // sizes of the lists, so the fast path can tell without the lock
+        std::atomic<int> m_receiversWaiting = {0};
+        std::atomic<int> m_sendersWaiting = {0};
+    };
+
+    class ChannelSelect
+    {
+    public:
+        template <class T>
+        ChannelSelect &recv(T &channel, typename T::value_type &out);
+
+        // index of the case which received into its out, -1 on timeout, -2 once every
+        // channel is closed and empty
+        int wait(uint64_t timeout_ms = ~0ull);
+
+    private:
+        struct Case
+        {
+            ChannelBase *channel;
+            // 1 received, 0 nothing yet, -1 closed and empty
+            std::function<int()> tryRecv;
+        };
+        // 1 + the index received, or -1 if all closed, 0 nothing
+        int poll();
+
+    private:
+        std::vector<Case> m_cases;
+    };
+
+    template <class T>
+    class Channel : public ChannelBase
+    {
+    public:
+        typedef std::shared_ptr<Channel> ptr;
+        typedef T value_type;
+
+        Channel(size_t capacity = 0)
+            : m_unbuffered(capacity == 0), m_queue(capacity ? capacity : 1)
+        {
+        }
+
+        ~Channel() { onClose(); }
+
+        size_t capacity() const { return m_unbuffered ? 0 : m_queue.capacity(); }
+        // only a hint
+        size_t size() const { return m_queue.size(); }
+
+        // false if closed
+        bool send(T value)
+        {
+            Slot slot;
+            slot.value = std::move(value);
+            ChannelWaiter::ptr sender;
+            Semaphore sem;
+            if (m_unbuffered)
+            {
+                sender.reset(new ChannelWaiter);
+                sender->waiter.init(sem);
+                slot.sender = sender;
+            }
+
+            while (!trySend(slot))
+            {
+                if (m_closed)
+                {
+                    return false;
+                }
+                // full: wait for a slot, look again once we are on the list
+                ChannelWaiter::ptr waiter(new ChannelWaiter);
+                Semaphore full_sem;
+                waiter->waiter.init(full_sem);
+                addSender(waiter);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                bool sent = trySend(slot);
+                if (sent || m_closed)
+                {
+                    delSender(waiter);
+                    if (!waiter->claim())
+                    {
+                        waiter->waiter.park(); // already woken, take it
+                    }
+                    if (sent)
+                    {
+                        break;
+                    }
+                    return false;
+                }
+                waiter->waiter.park();
+                delSender(waiter);
+            }
+
+            if (sender)
+            {
+                // until a receiver took it, or close() threw it away
+                sender->waiter.park();
+                return sender->ok;
+            }
+            return true;
+        }
+
+        // false if closed and nothing is left
+        bool recv(T &out)
+        {
+            if (tryRecv(out))
+            {
+                return true;
+            }
+            return ChannelSelect().recv(*this, out).wait() == 0;
+        }
+
+        // 1 received, 0 timed out, -1 closed and nothing is left
+        int recv(T &out, uint64_t timeout_ms)
+        {
+            if (tryRecv(out))
+            {
+                return 1;
+            }
+            int rt = ChannelSelect().recv(*this, out).wait(timeout_ms);
+            return rt == 0 ? 1 : rt == -1 ? 0 : -1;
+        }
+
+        bool tryRecv(T &out)
+        {
+            Slot slot;
+            if (!m_queue.pop(slot))
+            {
+                return false;
+            }
+            out = std::move(slot.value);
+            if (slot.sender)
+            {
+                slot.sender->fire();
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wakeSender();
+            return true;
+        }
+
+    private:
+        struct Slot
+        {
+            T value;
+            ChannelWaiter::ptr sender; // unbuffered, woken once the value is taken
+        };
+
+        bool trySend(Slot &slot)
+        {
+            if (m_closed || !m_queue.push(slot))
+            {
+                return false;
+            }
+            // pairs with the fence of a receiver between getting on the list and looking again
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_closed)
+            {
+                onClose(); // raced with close(), don't leave an unbuffered sender behind
+            }
+            wakeReceiver();
+            return true;
+        }
+
+        void onClose() override
+        {
+            if (!m_unbuffered)
+            {
+                return;
+            }
+            Slot slot;
+            while (m_queue.pop(slot))
+            {
+                slot.sender->ok = false;
+                slot.sender->fire();
+            }
+        }
+
+    private:
+        bool m_unbuffered;
+        BoundedQueue<Slot> m_queue;
+    };
+
+    template <class T>
+    ChannelSelect &ChannelSelect::recv(T &channel, typename T::value_type &out)
+    {
+        T *ch = &channel;
+        typename T::value_type *o = &out;
+        m_cases.push_back(Case{ch, [ch, o]() {
+                                   if (ch->tryRecv(*o))
+                                   {
+                                       return 1;
+                                   }
+                                   // whatever was sent before close() still comes out
+                                   if (ch->isClosed())
+                                   {
+                                       return ch->tryRecv(*o) ? 1 : -1;
+                                   }
+                                   return 0;
+                               }});
+        return *this;
+    }
+} // namespace fatdog
+
+#endif
@@ -0,0 +1,250 @@
+#include "clock.h"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include "log.h"
+#include "config.h"
+
+namespace fatdog
+{
+    static Logger::ptr g_logger = FATDOG_LOG_NAME("system");
+
+    static ConfigVar<bool>::ptr g_clock_tsc =
+        Config::lookUp("clock.tsc", false, "read monotonic time from rdtsc, needs invariant tsc");
+
+    static ConfigVar<bool>::ptr g_clock_update_on_switch =
+        Config::lookUp("clock.update_on_switch", true, "refresh the cached clock before every task, not only in idle");
+
+    static std::atomic<bool> s_update_on_switch = {true};
+
+    // 0 until a scheduler thread calls Update()
+    static thread_local uint64_t t_coarse_ms = 0;
+
+    static uint64_t MonotonicNS()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    /*
+     * tsc time is ns_base + (tsc - tsc_base) * mult / 2^32. the parameters sit behind a
+     * seqlock, one thread at a time (s_tsc_busy) re-scales them every second so they keep
+     * following CLOCK_MONOTONIC. each re-scale starts where the old scale is, so time
+     * never goes back.
+    */
+    enum TscState
+    {
+        TSC_OFF,
+        TSC_CALIBRATING,
+        TSC_READY
+    };
+
+    static const uint64_t s_calibrate_ns = 100 * 1000 * 1000;
+    static const uint64_t s_rescale_ns = 1000 * 1000 * 1000;
+
+    static std::atomic<int> s_tsc_state = {TSC_OFF};
+    static std::atomic<bool> s_tsc_busy = {false};
+    static std::atomic<uint32_t> s_tsc_seq = {0};
+    static std::atomic<uint64_t> s_tsc_base = {0};
+    static std::atomic<uint64_t> s_ns_base = {0};
+    static std::atomic<uint64_t> s_tsc_mult = {0};
+    static std::atomic<uint64_t> s_next_rescale = {~0ull}; // in tsc ticks
+    // first sample, ticks per second are always measured from it. written with s_tsc_busy held
+    static std::atomic<uint64_t> s_ref_tsc = {0};
+    static std::atomic<uint64_t> s_ref_ns = {0};
+
+#if defined(__x86_64__)
+    static bool HasInvariantTsc()
+    {
+        unsigned int a, b, c, d;
+        if (!__get_cpuid(0x80000007, &a, &b, &c, &d))
+        {
+            return false;
+        }
+        return d & (1u << 8);
+    }
+
+    static uint64_t ReadTsc() { return __rdtsc(); }
+#else
+    static bool HasInvariantTsc() { return false; }
+    static uint64_t ReadTsc() { return 0; }
+#endif
+
+    static uint64_t TscToNS(uint64_t tsc)
+    {
+        uint32_t seq;
+        uint64_t base, ns, mult;
+        do
+        {
+            seq = s_tsc_seq.load(std::memory_order_acquire);
+            base = s_tsc_base.load(std::memory_order_relaxed);
+            ns = s_ns_base.load(std::memory_order_relaxed);
+            mult = s_tsc_mult.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((seq & 1) || seq != s_tsc_seq.load(std::memory_order_relaxed));
+
+        if (tsc < base) // read before someone else re-scaled
+        {
+            return ns;
+        }
+        return ns + (uint64_t)(((unsigned __int128)(tsc - base) * mult) >> 32);
+    }
+
+    // with s_tsc_busy held
+    static void SetTscScale(uint64_t tsc, uint64_t ns, uint64_t mult, uint64_t ticks_per_sec)
+    {
+        s_tsc_seq.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s_tsc_base.store(tsc, std::memory_order_relaxed);
+        s_ns_base.store(ns, std::memory_order_relaxed);
+        s_tsc_mult.store(mult, std::memory_order_relaxed);
+        s_tsc_seq.fetch_add(1, std::memory_order_release);
+        s_next_rescale = tsc + ticks_per_sec * (s_rescale_ns / 1000000000ull);
+    }
+
+    static void RescaleTsc(uint64_t tsc)
+    {
+        bool expected = false;
+        if (!s_tsc_busy.compare_exchange_strong(expected, true))
+        {
+            return;
+        }
+        uint64_t mono = MonotonicNS();
+        uint64_t ticks_per_sec = (uint64_t)((unsigned __int128)(tsc - s_ref_tsc) * 1000000000ull / (mono - s_ref_ns));
+        if (ticks_per_sec)
+        {
+            if (s_tsc_state == TSC_CALIBRATING)
+            {
+                SetTscScale(tsc, mono, (1000000000ull << 32) / ticks_per_sec, ticks_per_sec);
+                s_tsc_state = TSC_READY;
+                FATDOG_LOG_INFO(g_logger) << "clock: tsc at " << ticks_per_sec << " ticks/s";
+            }
+            else
+            {
+                // steer so that we meet CLOCK_MONOTONIC again at the next re-scale, jump
+                // forward when far behind (a suspended vm), slow down to half when ahead
+                uint64_t now = TscToNS(tsc);
+                if (now + 1000000 < mono)
+                {
+                    now = mono;
+                }
+                uint64_t target = mono + s_rescale_ns > now ? mono + s_rescale_ns - now : 0;
+                target = std::max(target, s_rescale_ns / 2);
+                uint64_t mult = (uint64_t)(((unsigned __int128)target << 32) / ticks_per_sec);
+                SetTscScale(tsc, now, mult, ticks_per_sec);
+            }
+        }
+        s_tsc_busy = false;
+    }
+
+    static void EnableTsc(bool on)
+    {
+        if (!on)
+        {
+            s_tsc_state = TSC_OFF;
+            return;
+        }
+        if (!HasInvariantTsc())
+        {
+            FATDOG_LOG_WARN(g_logger) << "clock.tsc: no invariant tsc, keep CLOCK_MONOTONIC";
+            return;
+        }
+        bool expected = false;
+        while (!s_tsc_busy.compare_exchange_weak(expected, true))
+        {
+            expected = false;
+        }
+        s_ref_ns = MonotonicNS();
+        s_ref_tsc = ReadTsc();
+        s_tsc_state = TSC_CALIBRATING;
+        s_tsc_busy = false;
+    }
+
+    struct ClockIniter
+    {
+        ClockIniter()
+        {
+            g_clock_tsc->addListener([](const bool &old_value, const bool &new_value) {
+                EnableTsc(new_value);
+            });
+            g_clock_update_on_switch->addListener([](const bool &old_value, const bool &new_value) {
+                s_update_on_switch = new_value;
+            });
+        }
+    };
+
+    static ClockIniter __clock_init;
+
+    uint64_t Clock::NowNS()
+    {
+        int state = s_tsc_state.load(std::memory_order_relaxed);
+        if (state == TSC_READY)
+        {
+            uint64_t tsc = ReadTsc();
+            if (tsc >= s_next_rescale.load(std::memory_order_relaxed))
+            {
+                RescaleTsc(tsc);
+            }
+            return TscToNS(tsc);
+        }
+
+        uint64_t ns = MonotonicNS();
+        if (state == TSC_CALIBRATING && ns - s_ref_ns >= s_calibrate_ns)
+        {
+            RescaleTsc(ReadTsc());
+        }
+        return ns;
+    }
+
+    uint64_t Clock::NowUS()
+    {
+        return NowNS() / 1000;
+    }
+
+    uint64_t Clock::NowMS()
+    {
+        return NowNS() / 1000000;
+    }
+
+    uint64_t Clock::CoarseMS()
+    {
+        return t_coarse_ms ? t_coarse_ms : NowMS();
+    }
+
+    uint64_t Clock::Update()
+    {
+        uint64_t now = NowMS();
+        if (now > t_coarse_ms)
+        {
+            t_coarse_ms = now;
+        }
+        return t_coarse_ms;
+    }
+
+    void Clock::Invalidate()
+    {
+        t_coarse_ms = 0;
+    }
+
+    bool Clock::UpdateOnSwitch()
+    {
+        return s_update_on_switch.load(std::memory_order_relaxed);
+    }
+
+    time_t Clock::WallSeconds()
+    {
+        return time(nullptr);
+    }
+
+    bool Clock::IsTscEnabled()
+    {
+        return s_tsc_state == TSC_READY;
+    }
+} // namespace fatdog
@@ -0,0 +1,45 @@
+#ifndef __FATDOG_CLOCK_H__
+#define __FATDOG_CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+namespace fatdog
+{
+    /*
+     * monotonic time for timers and timeouts, wall clock jumps (ntp, date -s) don't move it.
+     *
+     * NowMS()/NowUS() read the clock every call: CLOCK_MONOTONIC, or with clock.tsc on an
+     * x86_64 cpu with invariant tsc, rdtsc scaled against CLOCK_MONOTONIC (calibrated over
+     * the first 100ms, re-scaled every second, never goes back). tsc only pays off where
+     * clock_gettime() is not served by the vdso, e.g. vms whose clocksource is not tsc.
+     *
+     * CoarseMS() is a per thread copy refreshed by Update(). scheduler threads refresh it
+     * every IOManager::idle() round and, with clock.update_on_switch (default on), before
+     * every task they run. threads not inside a scheduler get NowMS().
+     * the copy lags by at most the time a task runs without yielding, a timer added from
+     * such a task fires that much early.
+    */
+    class Clock
+    {
+    public:
+        static uint64_t NowMS();
+        static uint64_t NowUS();
+        static uint64_t NowNS();
+
+        static uint64_t CoarseMS();
+        // refresh this thread's CoarseMS(), return it
+        static uint64_t Update();
+        // back to NowMS(), when the thread leaves the scheduler
+        static void Invalidate();
+        static bool UpdateOnSwitch();
+
+        // wall clock seconds for log lines. time() in the vdso returns the second the kernel
+        // keeps per tick, no hardware read, cheaper than any clock_gettime()
+        static time_t WallSeconds();
+
+        static bool IsTscEnabled();
+    };
+} // namespace fatdog
+
+#endif
@@ -13,6 +13,11 @@ namespace fatdog
         init();
     }
 
+    FdCtx::FdCtx(int fd, bool is_socket, bool sys_nonblock)
+        : m_isInit(true), m_isSocket(is_socket), m_sysNonblock(sys_nonblock), m_userNonblock(false), m_isClosed(false), m_fd(fd), m_recvTimeout(-1), m_sendTimeout(-1)
+    {
+    }
+
     FdCtx::~FdCtx()
     {
     }
@@ -92,22 +97,30 @@ namespace fatdog
         {
             return nullptr;
         }
-        if ((int)m_datas.size() <= fd)
         {
-            if (auto_create == false)
+            RWMutexType::ReadLock lock(m_mutex);
+            if ((int)m_datas.size() <= fd)
             {
-                return nullptr;
+                if (auto_create == false)
+                {
+                    return nullptr;
+                }
             }
-        }
-        else
-        {
-            if (m_datas[fd] || !auto_create)
+            else
             {
-                return m_datas[fd];
+                if (m_datas[fd] || !auto_create)
+                {
+                    return m_datas[fd];
+                }
             }
         }
 
         FdCtx::ptr ctx(new FdCtx(fd));
+        RWMutexType::WriteLock lock(m_mutex);
+        if (fd < (int)m_datas.size() && m_datas[fd])
+        {
+            return m_datas[fd]; // someone else created it meanwhile
+        }
         if (fd >= (int)m_datas.size())
         {
             m_datas.resize(fd * 1.5);
@@ -116,8 +129,30 @@ namespace fatdog
         return ctx;
     }
 
+    FdCtx::ptr FdManager::add(int fd, bool is_socket, bool sys_nonblock)
+    {
+        if (fd == -1)
+        {
+            return nullptr;
+        }
+        FdCtx::ptr ctx(new FdCtx(fd, is_socket, sys_nonblock));
+        set(fd, ctx);
+        return ctx;
+    }
+
+    void FdManager::set(int fd, FdCtx::ptr ctx)
+    {
+        RWMutexType::WriteLock lock(m_mutex);
+        if (fd >= (int)m_datas.size())
+        {
+            m_datas.resize(fd * 1.5);
+        }
+        m_datas[fd] = ctx;
+    }
+
     void FdManager::del(int fd)
     {
+        RWMutexType::WriteLock lock(m_mutex);
         if ((int)m_datas.size() <= fd)
         {
             return;
@@ -14,6 +14,9 @@ namespace fatdog
     public:
         typedef std::shared_ptr<FdCtx> ptr;
         FdCtx(int fd);
+        // the caller knows what fd is (e.g. it asked socket()/accept4() for SOCK_NONBLOCK),
+        // nothing is probed
+        FdCtx(int fd, bool is_socket, bool sys_nonblock);
         ~FdCtx();
 
         bool init();
@@ -49,9 +52,16 @@ namespace fatdog
         FdManager();
 
         FdCtx::ptr get(int fd, bool auto_create = false);
+        // a new context from known flags, replaces whatever fd had
+        FdCtx::ptr add(int fd, bool is_socket, bool sys_nonblock);
         void del(int fd);
 
     private:
+        void set(int fd, FdCtx::ptr ctx);
+
+    private:
+        // hooked calls look up from every thread while accept()/socket() grow the table
+        RWMutexType m_mutex;
         std::vector<FdCtx::ptr> m_datas;
     };
 
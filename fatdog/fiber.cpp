@@ -1,10 +1,13 @@
 #include "fiber.h"
 
+#include "config.h"
 #include "log.h"
 #include "macro.h"
 #include "scheduler.h"
 
 #include <atomic>
+#include <stdlib.h>
+#include <string.h>
 
 namespace fatdog
 {
@@ -16,72 +19,83 @@ namespace fatdog
     static thread_local Fiber *t_fiber;                     // 当前协程
     static thread_local Fiber::ptr t_threadFiber = nullptr; // 线程主协程
 
-    class StackMalloc
+    static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+        Config::lookUp("fiber.shared_stack_size", (uint32_t)(1024 * 1024), "fiber shared stack size");
+
+    // 共享栈, 每个线程一个, occupant 是当前栈上的协程
+    struct SharedStack
     {
-    public:
-        static void *Alloc(size_t s)
-        {
-            return malloc(s);
-        }
+        void *stack = nullptr;
+        size_t size = 0;
+        Fiber::ptr occupant;
 
-        static void Dealloc(void *p)
+        ~SharedStack()
         {
-            return free(p);
+            occupant.reset();
+            if (stack)
+            {
+                StackAllocator::Get("mmap")->dealloc(stack, size);
+            }
         }
     };
 
-    using StackAllocator = StackMalloc;
+    static thread_local SharedStack t_sharedStack;
 
     Fiber::Fiber()
     {
         m_state = EXEC;
         SetThis(this);
 
-        if (getcontext(&m_ctx))
-        {
-            FATDOG_ASSERT2(false, "getcontext");
-        }
+        // m_ctx is filled by the first switch away from this fiber
         ++s_fiber_count;
 
-        FATDOG_LOG_INFO(g_logger) << "Fiber::Fiber, main fiber";
+        FATDOG_LOG_DEBUG(g_logger) << "Fiber::Fiber, main fiber";
     }
 
-    Fiber::Fiber(std::function<void(void)> cb, size_t stacksize, bool use_caller)
+    Fiber::Fiber(std::function<void(void)> cb, size_t stacksize, bool use_caller, bool shared_stack)
         : m_id(++s_fiber_id), m_cb(cb)
     {
         m_state = INIT;
         ++s_fiber_count;
-        m_stacksize = stacksize;
-        m_stack = StackAllocator::Alloc(m_stacksize);
 
-        if (getcontext(&m_ctx))
+#ifdef FATDOG_FIBER_HAS_STACK_POINTER
+        if (shared_stack)
         {
-            FATDOG_ASSERT2(false, "getcontext");
+            FATDOG_ASSERT2(!use_caller, "caller fiber can't use shared stack");
+            m_sharedStack = true; // context is made by prepareStack()
+            FATDOG_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id << " shared stack";
+            return;
         }
+#endif
 
-        m_ctx.uc_link = nullptr;
-        m_ctx.uc_stack.ss_size = m_stacksize;
-        m_ctx.uc_stack.ss_sp = m_stack;
+        m_stacksize = stacksize ? stacksize : StackAllocator::GetDefaultStackSize();
+        m_allocator = StackAllocator::GetDefault();
+        m_stack = m_allocator->alloc(m_stacksize);
+        FATDOG_ASSERT2(m_stack, "alloc fiber stack");
 
         if (!use_caller)
         {
-            makecontext(&m_ctx, &Fiber::MainFunc, 0);
+            MakeContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc);
         }
         else
         {
-            makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+            MakeContext(&m_ctx, m_stack, m_stacksize, &Fiber::CallerMainFunc);
         }
 
-        FATDOG_LOG_INFO(g_logger) << "Fiber::Fiber id=" << m_id;
+        FATDOG_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
     }
 
     Fiber::Fiber::~Fiber()
     {
         --s_fiber_count;
-        if (m_stack)
+        if (m_stack || m_sharedStack)
         {
             FATDOG_ASSERT(m_state == INIT || m_state == TERM || m_state == EXCEPT);
-            StackAllocator::Dealloc(m_stack);
+            if (m_stack)
+            {
+                m_allocator->dealloc(m_stack, m_stacksize);
+            }
+            free(m_saved);
         }
         else
         {
@@ -95,7 +109,7 @@ namespace fatdog
             }
         }
 
-        FATDOG_LOG_INFO(g_logger) << "Fiber::~Fiber id=" << m_id;
+        FATDOG_LOG_DEBUG(g_logger) << "Fiber::~Fiber id=" << m_id;
     }
 
     uint64_t Fiber::GetFiberId()
@@ -112,10 +126,8 @@ namespace fatdog
         // FATDOG_LOG_INFO(g_logger) << "from " << GetThis()->getId() << " call to " << getId() << ", current context keep in thread's main fiber";
         SetThis(this);
         m_state = EXEC;
-        if (swapcontext(&(t_threadFiber->m_ctx), &m_ctx))
-        {
-            FATDOG_ASSERT2(false, "swapcontext");
-        }
+        prepareStack();
+        JumpContext(&t_threadFiber->m_ctx, &m_ctx);
         // FATDOG_LOG_INFO(g_logger) << "call bye " << getId();
     }
 
@@ -123,10 +135,7 @@ namespace fatdog
     {
         // FATDOG_LOG_INFO(g_logger) << "from " << GetThis()->getId() << " back to " << t_threadFiber->getId() << ", go to thread's main fiber context";
         SetThis(t_threadFiber.get());
-        if (swapcontext(&m_ctx, &t_threadFiber->m_ctx))
-        {
-            FATDOG_ASSERT2(false, "swapcontext");
-        }
+        JumpContext(&m_ctx, &t_threadFiber->m_ctx);
         // FATDOG_LOG_INFO(g_logger) << "back bye " << getId();
     }
 
@@ -136,10 +145,8 @@ namespace fatdog
         SetThis(this);
         FATDOG_ASSERT(m_state != EXEC);
         m_state = EXEC;
-        if (swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx))
-        {
-            FATDOG_ASSERT2(false, "swapcontext");
-        }
+        prepareStack();
+        JumpContext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx);
         // FATDOG_LOG_INFO(g_logger) << "swapIn bye " << getId();
     }
 
@@ -148,30 +155,87 @@ namespace fatdog
         // FATDOG_LOG_INFO(g_logger) << "from " << GetThis()->getId() << " swap out to " << Scheduler::GetMainFiber()->getId() << ", go to Scheduler's main fiber context";
         SetThis(Scheduler::GetMainFiber());
 
-        if (swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx))
-        {
-            FATDOG_ASSERT2(false, "swapcontext");
-        }
+        JumpContext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx);
         // FATDOG_LOG_INFO(g_logger) << "swapOut bye " << getId();
     }
 
     void Fiber::reset(std::function<void(void)> cb)
     {
         FATDOG_ASSERT(m_state == INIT || m_state == TERM || m_state == EXCEPT);
-        FATDOG_ASSERT(m_stack);
+        FATDOG_ASSERT(m_stack || m_sharedStack);
 
         m_cb = cb;
-        if (getcontext(&m_ctx))
+        if (m_sharedStack)
+        {
+            // the shared stack may hold another fiber right now
+            m_ctxReady = false;
+            m_savedSize = 0;
+        }
+        else
+        {
+            MakeContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc);
+        }
+        m_state = INIT;
+    }
+
+    void Fiber::prepareStack()
+    {
+        if (!m_sharedStack)
         {
-            FATDOG_ASSERT2(false, "getcontext");
+            return;
         }
+        FATDOG_ASSERT2(m_thread == -1 || m_thread == GetThreadId(),
+                       "shared stack fiber id=" + std::to_string(m_id) + " switched in on another thread");
 
-        m_ctx.uc_link = nullptr;
-        m_ctx.uc_stack.ss_size = m_stacksize;
-        m_ctx.uc_stack.ss_sp = m_stack;
+        SharedStack &ss = t_sharedStack;
+        if (!ss.stack)
+        {
+            ss.size = g_fiber_shared_stack_size->getValue();
+            ss.stack = StackAllocator::Get("mmap")->alloc(ss.size);
+            FATDOG_ASSERT2(ss.stack, "alloc shared stack");
+        }
 
-        makecontext(&m_ctx, Fiber::MainFunc, 0);
-        m_state = INIT;
+        if (ss.occupant.get() != this)
+        {
+            if (ss.occupant)
+            {
+                ss.occupant->saveStack();
+            }
+            ss.occupant = shared_from_this();
+            if (m_ctxReady && m_savedSize)
+            {
+                memcpy((char *)ss.stack + ss.size - m_savedSize, m_saved, m_savedSize);
+            }
+        }
+
+        if (!m_ctxReady)
+        {
+            m_thread = GetThreadId();
+            MakeContext(&m_ctx, ss.stack, ss.size, &Fiber::MainFunc);
+            m_ctxReady = true;
+        }
+    }
+
+    void Fiber::saveStack()
+    {
+        m_savedSize = 0;
+        if (!m_ctxReady || m_state == TERM || m_state == EXCEPT)
+        {
+            return; // nothing live on the stack
+        }
+
+        char *top = (char *)t_sharedStack.stack + t_sharedStack.size;
+        char *sp = (char *)ContextStackPointer(&m_ctx);
+        size_t need = top - sp;
+        if (need > m_savedCap || need < m_savedCap / 4)
+        {
+            free(m_saved);
+            m_saved = (char *)malloc(need);
+            FATDOG_ASSERT2(m_saved, "alloc saved stack");
+            m_savedCap = need;
+        }
+        memcpy(m_saved, sp, need);
+        m_savedSize = need;
     }
 
     void Fiber::SetThis(Fiber *f)
@@ -203,7 +267,8 @@ namespace fatdog
     {
         Fiber::ptr cur = GetThis();
         FATDOG_ASSERT(cur->m_state == EXEC);
-        cur->m_state = HOLD;
+        // stays EXEC until the switch is done, Scheduler::run() marks it HOLD. otherwise
+        // another thread could resume it while it is still on this one's stack
         cur->swapOut();
     }
 
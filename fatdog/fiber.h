@@ -3,10 +3,23 @@
 
 #include <memory>
 #include <functional>
-#include <ucontext.h>
+
+#include "fiber_context.h"
+#include "stack_allocator.h"
 
 namespace fatdog
 {
+    /*
+     * shared stack mode: the fiber owns no stack, it runs on a per-thread shared stack
+     * (config "fiber.shared_stack_size"). when another shared fiber is switched in on that
+     * thread, the used part of the occupant's stack is copied out to a heap buffer of
+     * just that size, and copied back before the occupant runs again. an idle fiber then
+     * costs its live stack (usually a few KB) instead of a whole stack.
+     *
+     * the copy comes back at the same address, so a shared fiber is pinned to the thread
+     * it first ran on (Scheduler honours getPinnedThread()), and the address of a local
+     * variable must not be handed to anyone else while the fiber is switched out.
+    */
     class Fiber : public std::enable_shared_from_this<Fiber>
     {
     public:
@@ -21,7 +34,9 @@ namespace fatdog
         };
 
         typedef std::shared_ptr<Fiber> ptr;
-        Fiber(std::function<void(void)>, size_t stacksize = 1024 * 1024, bool use_caller = false);
+        // stacksize 0 means config "fiber.stack_size", the stack comes from StackAllocator::GetDefault()
+        // stacksize is ignored with shared_stack
+        Fiber(std::function<void(void)>, size_t stacksize = 0, bool use_caller = false, bool shared_stack = false);
         ~Fiber();
 
     public:
@@ -34,6 +49,10 @@ namespace fatdog
         uint64_t getId() const { return m_id; }
         State getState() const { return m_state; }
         void setState(const State &s) { m_state = s; }
+        bool isSharedStack() const { return m_sharedStack; }
+        // thread a shared stack fiber is bound to, -1 if it hasn't run yet or isn't shared
+        int getPinnedThread() const { return m_thread; }
+        size_t getSavedStackSize() const { return m_savedSize; }
 
         // deal with thread's main fiber
         void call();
@@ -53,15 +72,26 @@ namespace fatdog
     private:
         Fiber();
 
+        void prepareStack(); // before switching in, bring a shared stack fiber onto the shared stack
+        void saveStack();    // copy the live part of the shared stack out
+
     private:
         uint64_t m_id = 0;
         uint32_t m_stacksize = 0;
         State m_state = INIT;
 
-        ucontext_t m_ctx;
+        FiberContext m_ctx;
         void *m_stack = nullptr;
+        StackAllocator *m_allocator = nullptr; // who gave m_stack, config may change meanwhile
 
         std::function<void(void)> m_cb;
+
+        bool m_sharedStack = false;
+        bool m_ctxReady = false; // shared stack fiber's context is made when it first runs
+        int m_thread = -1;
+        char *m_saved = nullptr;
+        size_t m_savedSize = 0;
+        size_t m_savedCap = 0;
     };
 } // namespace fatdog
 
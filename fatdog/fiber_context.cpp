@@ -0,0 +1,191 @@
+#include "fiber_context.h"
+
+#include "macro.h"
+
+#ifdef FATDOG_FIBER_ASM_CONTEXT
+
+#if defined(__x86_64__)
+/*
+ * saved context, from the saved stack pointer up:
+ *      +0  pad         +8  mxcsr       +12 x87 control word
+ *      +16 r12         +24 r13         +32 r14         +40 r15
+ *      +48 rbx         +56 rbp         +64 return address
+ * the fiber entry is kept in r12, the first jump "returns" into the trampoline
+ * which calls it with a 16 byte aligned stack. the trampoline marks the outermost
+ * frame for unwinders and backtrace().
+*/
+asm(R"(
+    .text
+    .globl  fatdog_jump_fcontext
+    .type   fatdog_jump_fcontext, @function
+    .align  16
+fatdog_jump_fcontext:
+    pushq   %rbp
+    pushq   %rbx
+    pushq   %r15
+    pushq   %r14
+    pushq   %r13
+    pushq   %r12
+    leaq    -16(%rsp), %rsp
+    stmxcsr 8(%rsp)
+    fnstcw  12(%rsp)
+
+    movq    %rsp, (%rdi)
+    movq    %rsi, %rsp
+
+    ldmxcsr 8(%rsp)
+    fldcw   12(%rsp)
+    leaq    16(%rsp), %rsp
+    popq    %r12
+    popq    %r13
+    popq    %r14
+    popq    %r15
+    popq    %rbx
+    popq    %rbp
+    ret
+    .size   fatdog_jump_fcontext, .-fatdog_jump_fcontext
+
+    .globl  fatdog_make_fcontext
+    .type   fatdog_make_fcontext, @function
+    .align  16
+fatdog_make_fcontext:
+    movq    %rdi, %rax
+    andq    $-16, %rax
+    leaq    -88(%rax), %rax
+    stmxcsr 8(%rax)
+    fnstcw  12(%rax)
+    movq    %rdx, 16(%rax)
+    movq    $0, 56(%rax)
+    leaq    fatdog_fcontext_trampoline(%rip), %rcx
+    movq    %rcx, 64(%rax)
+    ret
+    .size   fatdog_make_fcontext, .-fatdog_make_fcontext
+
+    .type   fatdog_fcontext_trampoline, @function
+    .align  16
+fatdog_fcontext_trampoline:
+    .cfi_startproc
+    .cfi_undefined rip
+    callq   *%r12
+    ud2
+    .cfi_endproc
+    .size   fatdog_fcontext_trampoline, .-fatdog_fcontext_trampoline
+
+    .section .note.GNU-stack,"",%progbits
+    .text
+)");
+
+#elif defined(__aarch64__)
+/*
+ * saved context, from the saved stack pointer up:
+ *      +0  d8 - d15    +64 x19 - x28   +144 x29 (fp)   +152 x30 (lr)   +160 fpcr
+ * the fiber entry is kept in x19, the first jump returns through lr into the
+ * trampoline which calls it.
+*/
+asm(R"(
+    .text
+    .globl  fatdog_jump_fcontext
+    .type   fatdog_jump_fcontext, %function
+    .align  4
+fatdog_jump_fcontext:
+    sub     sp, sp, #176
+    stp     d8, d9, [sp, #0]
+    stp     d10, d11, [sp, #16]
+    stp     d12, d13, [sp, #32]
+    stp     d14, d15, [sp, #48]
+    stp     x19, x20, [sp, #64]
+    stp     x21, x22, [sp, #80]
+    stp     x23, x24, [sp, #96]
+    stp     x25, x26, [sp, #112]
+    stp     x27, x28, [sp, #128]
+    stp     x29, x30, [sp, #144]
+    mrs     x9, fpcr
+    str     x9, [sp, #160]
+
+    mov     x9, sp
+    str     x9, [x0]
+    mov     sp, x1
+
+    ldp     d8, d9, [sp, #0]
+    ldp     d10, d11, [sp, #16]
+    ldp     d12, d13, [sp, #32]
+    ldp     d14, d15, [sp, #48]
+    ldp     x19, x20, [sp, #64]
+    ldp     x21, x22, [sp, #80]
+    ldp     x23, x24, [sp, #96]
+    ldp     x25, x26, [sp, #112]
+    ldp     x27, x28, [sp, #128]
+    ldp     x29, x30, [sp, #144]
+    ldr     x9, [sp, #160]
+    msr     fpcr, x9
+    add     sp, sp, #176
+    ret
+    .size   fatdog_jump_fcontext, .-fatdog_jump_fcontext
+
+    .globl  fatdog_make_fcontext
+    .type   fatdog_make_fcontext, %function
+    .align  4
+fatdog_make_fcontext:
+    and     x0, x0, #-16
+    sub     x0, x0, #176
+    str     x2, [x0, #64]
+    str     xzr, [x0, #144]
+    adr     x9, fatdog_fcontext_trampoline
+    str     x9, [x0, #152]
+    mrs     x9, fpcr
+    str     x9, [x0, #160]
+    ret
+    .size   fatdog_make_fcontext, .-fatdog_make_fcontext
+
+    .type   fatdog_fcontext_trampoline, %function
+    .align  4
+fatdog_fcontext_trampoline:
+    .cfi_startproc
+    .cfi_undefined x30
+    blr     x19
+    brk     #0
+    .cfi_endproc
+    .size   fatdog_fcontext_trampoline, .-fatdog_fcontext_trampoline
+
+    .section .note.GNU-stack,"",%progbits
+    .text
+)");
+#endif
+
+#else
+
+namespace fatdog
+{
+    void MakeContext(FiberContext *ctx, void *stack, size_t size, void (*fn)())
+    {
+        if (getcontext(&ctx->uc))
+        {
+            FATDOG_ASSERT2(false, "getcontext");
+        }
+        ctx->uc.uc_link = nullptr;
+        ctx->uc.uc_stack.ss_size = size;
+        ctx->uc.uc_stack.ss_sp = stack;
+        makecontext(&ctx->uc, fn, 0);
+    }
+
+    void JumpContext(FiberContext *from, FiberContext *to)
+    {
+        if (swapcontext(&from->uc, &to->uc))
+        {
+            FATDOG_ASSERT2(false, "swapcontext");
+        }
+    }
+
+    void *ContextStackPointer(const FiberContext *ctx)
+    {
+#if defined(__x86_64__)
+        return (void *)ctx->uc.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+        return (void *)ctx->uc.uc_mcontext.sp;
+#else
+        return nullptr;
+#endif
+    }
+} // namespace fatdog
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __FATDOG_FIBER_CONTEXT_H__
+#define __FATDOG_FIBER_CONTEXT_H__
+
+#include <stddef.h>
+#include <ucontext.h>
+
+/*
+ * how Fiber switches, fixed at compile time.
+ *
+ * with FATDOG_FIBER_USE_ASM (cmake option, on by default) x86_64 and aarch64 use a
+ * hand written switch in the style of boost.context fcontext: push the callee-saved
+ * registers and fp control words on the current stack, swap stack pointers, pop.
+ * no rt_sigprocmask syscall like swapcontext does, the signal mask is per thread and
+ * fibers never change it anyway.
+ * other architectures, or the option off, fall back to ucontext.
+*/
+#if defined(FATDOG_FIBER_USE_ASM) && (defined(__x86_64__) || defined(__aarch64__))
+#define FATDOG_FIBER_ASM_CONTEXT 1
+#endif
+
+// ContextStackPointer() works, shared stack fibers depend on it
+#if defined(FATDOG_FIBER_ASM_CONTEXT) || defined(__x86_64__) || defined(__aarch64__)
+#define FATDOG_FIBER_HAS_STACK_POINTER 1
+#endif
+
+#ifdef FATDOG_FIBER_ASM_CONTEXT
+extern "C"
+{
+    // save current context into *from (its stack pointer), resume to
+    void fatdog_jump_fcontext(void **from, void *to);
+    // lay out a context at the top of [stack, stack + size) which calls fn at the first
+    // jump, fn must never return
+    void *fatdog_make_fcontext(void *top, size_t size, void (*fn)());
+}
+#endif
+
+namespace fatdog
+{
+#ifdef FATDOG_FIBER_ASM_CONTEXT
+    struct FiberContext
+    {
+        void *sp = nullptr;
+    };
+
+    inline void MakeContext(FiberContext *ctx, void *stack, size_t size, void (*fn)())
+    {
+        ctx->sp = fatdog_make_fcontext((char *)stack + size, size, fn);
+    }
+
+    inline void JumpContext(FiberContext *from, FiberContext *to)
+    {
+        fatdog_jump_fcontext(&from->sp, to->sp);
+    }
+
+    // stack pointer of a switched out context, everything live is at or above it
+    inline void *ContextStackPointer(const FiberContext *ctx) { return ctx->sp; }
+
+    inline const char *ContextBackend() { return "asm"; }
+#else
+    struct FiberContext
+    {
+        ucontext_t uc;
+    };
+
+    void MakeContext(FiberContext *ctx, void *stack, size_t size, void (*fn)());
+    void JumpContext(FiberContext *from, FiberContext *to);
+    // nullptr if the architecture is unknown
+    void *ContextStackPointer(const FiberContext *ctx);
+
+    inline const char *ContextBackend() { return "ucontext"; }
+#endif
+} // namespace fatdog
+
+#endif
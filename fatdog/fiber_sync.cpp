@@ -0,0 +1,294 @@
+#include "fiber_sync.h"
+
+#include "scheduler.h"
+
+namespace fatdog
+{
+    void FiberWaiter::init(Semaphore &s)
+    {
+        // a task fiber parks. the thread's own fiber and the scheduler's can't, they block
+        scheduler = Scheduler::GetThis();
+        if (scheduler)
+        {
+            fiber = Fiber::GetThis();
+            if (fiber->getId() == 0 || fiber.get() == Scheduler::GetMainFiber())
+            {
+                fiber.reset();
+            }
+        }
+        if (!fiber)
+        {
+            scheduler = nullptr;
+            sem = &s;
+        }
+    }
+
+    void FiberWaiter::park()
+    {
+        if (sem)
+        {
+            sem->wait();
+        }
+        else
+        {
+            // woken before we are out is fine, the scheduler gives us back to this
+            // thread and we run again after the switch
+            Fiber::YieldToHold();
+        }
+    }
+
+    void FiberWaiter::wake()
+    {
+        if (sem)
+        {
+            sem->notify();
+        }
+        else
+        {
+            scheduler->schedule(std::move(fiber));
+        }
+    }
+
+    void FiberWaitQueue::wait(MutexType::Lock &lock, FiberMutex *release)
+    {
+        Semaphore sem;
+        Waiter waiter;
+        waiter.init(sem);
+        Semaphore *parked_on = waiter.sem;
+        m_waiters.push_back(std::move(waiter));
+        lock.unlock();
+        if (release)
+        {
+            release->unlock();
+        }
+        if (parked_on)
+        {
+            parked_on->wait();
+        }
+        else
+        {
+            Fiber::YieldToHold();
+        }
+    }
+
+    bool FiberWaitQueue::pop(Waiter &waiter)
+    {
+        if (m_waiters.empty())
+        {
+            return false;
+        }
+        waiter = std::move(m_waiters.front());
+        m_waiters.pop_front();
+        return true;
+    }
+
+    void FiberWaitQueue::Wake(Waiter &waiter)
+    {
+        waiter.wake();
+    }
+
+    FiberSemaphore::FiberSemaphore(int64_t count)
+        : m_count(count)
+    {
+    }
+
+    void FiberSemaphore::wait()
+    {
+        if (m_count.fetch_sub(1, std::memory_order_acq_rel) > 0)
+        {
+            return;
+        }
+        FiberWaitQueue::MutexType::Lock lock(m_queue.mutex);
+        if (m_pending)
+        {
+            --m_pending;
+            return;
+        }
+        m_queue.wait(lock);
+    }
+
+    bool FiberSemaphore::tryWait()
+    {
+        int64_t count = m_count.load(std::memory_order_relaxed);
+        while (count > 0)
+        {
+            if (m_count.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void FiberSemaphore::notify()
+    {
+        if (m_count.fetch_add(1, std::memory_order_acq_rel) >= 0)
+        {
+            return;
+        }
+        // someone is in wait() or about to be, the permit goes to them
+        FiberWaitQueue::Waiter waiter;
+        {
+            FiberWaitQueue::MutexType::Lock lock(m_queue.mutex);
+            if (!m_queue.pop(waiter))
+            {
+                ++m_pending;
+                return;
+            }
+        }
+        FiberWaitQueue::Wake(waiter);
+    }
+
+    void FiberCondition::wait(FiberMutex &mutex)
+    {
+        // queued before the mutex goes, a notify() made under the mutex can't miss us
+        FiberWaitQueue::MutexType::Lock lock(m_queue.mutex);
+        m_queue.wait(lock, &mutex);
+        mutex.lock();
+    }
+
+    void FiberCondition::notify()
+    {
+        FiberWaitQueue::Waiter waiter;
+        {
+            FiberWaitQueue::MutexType::Lock lock(m_queue.mutex);
+            if (!m_queue.pop(waiter))
+            {
+                return;
+            }
+        }
+        FiberWaitQueue::Wake(waiter);
+    }
+
+    void FiberCondition::notifyAll()
+    {
+        std::deque<FiberWaitQueue::Waiter> woken;
+        {
+            FiberWaitQueue::MutexType::Lock lock(m_queue.mutex);
+            FiberWaitQueue::Waiter waiter;
+            while (m_queue.pop(waiter))
+            {
+                woken.push_back(std::move(waiter));
+            }
+        }
+        for (auto &i : woken)
+        {
+            FiberWaitQueue::Wake(i);
+        }
+    }
+
+    void FiberRWMutex::rdlock()
+    {
+        int32_t state = m_state.load(std::memory_order_relaxed);
+        while (state >= 0 && m_writersWaiting.load() == 0)
+        {
+            if (m_state.compare_exchange_weak(state, state + 1))
+            {
+                return;
+            }
+        }
+
+        FiberWaitQueue::MutexType::Lock lock(m_readers.mutex);
+        ++m_readersWaiting;
+        while (true)
+        {
+            state = m_state.load();
+            if (state < 0 || m_writersWaiting.load())
+            {
+                // wakeLocked() hands us a share and takes us off m_readersWaiting
+                m_readers.wait(lock);
+                return;
+            }
+            if (m_state.compare_exchange_weak(state, state + 1))
+            {
+                --m_readersWaiting;
+                return;
+            }
+        }
+    }
+
+    void FiberRWMutex::wrlock()
+    {
+        int32_t state = 0;
+        if (m_state.compare_exchange_strong(state, -1))
+        {
+            return;
+        }
+
+        FiberWaitQueue::MutexType::Lock lock(m_readers.mutex);
+        ++m_writersWaiting;
+        state = 0;
+        if (m_state.compare_exchange_strong(state, -1))
+        {
+            --m_writersWaiting;
+            return;
+        }
+        m_writers.wait(lock);
+    }
+
+    void FiberRWMutex::unlock()
+    {
+        // the state and the waiting counts are written and read in opposite order by the two
+        // sides (seq_cst), so either the waiter sees the lock free or we see the waiter
+        if (m_state.load(std::memory_order_relaxed) == -1)
+        {
+            m_state.store(0);
+            if (m_writersWaiting.load() || m_readersWaiting.load())
+            {
+                wake();
+            }
+        }
+        else if (m_state.fetch_sub(1) == 1 && m_writersWaiting.load())
+        {
+            wake();
+        }
+    }
+
+    void FiberRWMutex::wake()
+    {
+        std::deque<FiberWaitQueue::Waiter> woken;
+        {
+            FiberWaitQueue::MutexType::Lock lock(m_readers.mutex);
+            wakeLocked(woken);
+        }
+        for (auto &i : woken)
+        {
+            FiberWaitQueue::Wake(i);
+        }
+    }
+
+    void FiberRWMutex::wakeLocked(std::deque<FiberWaitQueue::Waiter> &woken)
+    {
+        // whoever took it through the fast path meanwhile wakes them on its unlock
+        int32_t state = m_state.load();
+        FiberWaitQueue::Waiter waiter;
+        if (m_writers.size())
+        {
+            if (state == 0 && m_state.compare_exchange_strong(state, -1))
+            {
+                m_writers.pop(waiter);
+                --m_writersWaiting;
+                woken.push_back(std::move(waiter));
+            }
+            return;
+        }
+
+        int32_t n = m_readers.size();
+        if (!n)
+        {
+            return;
+        }
+        while (state >= 0)
+        {
+            if (m_state.compare_exchange_weak(state, state + n))
+            {
+                while (m_readers.pop(waiter))
+                {
+                    woken.push_back(std::move(waiter));
+                }
+                m_readersWaiting -= n;
+                return;
+            }
+        }
+    }
+} // namespace fatdog
@@ -0,0 +1,143 @@
+#ifndef __FATDOG_FIBER_SYNC_H__
+#define __FATDOG_FIBER_SYNC_H__
+
+#include <atomic>
+#include <deque>
+#include <memory>
+
+#include "fiber.h"
+#include "thread.h"
+#include "noncopyable.h"
+
+/*
+ * locks for code running in scheduler fibers. the ones in thread.h block the whole thread,
+ * and every fiber queued on it with it. these park only the waiting fiber (YieldToHold) and
+ * schedule() it again on the scheduler it waited on when it is its turn, the thread runs
+ * other fibers meanwhile.
+ *
+ * the uncontended path is one atomic operation. a release hands the lock (or the permit)
+ * straight to the first waiter, so waiters are served in order and nobody barges in.
+ * a thread outside any scheduler fiber (e.g. main() before start()) may use them too, it
+ * waits on a Semaphore then.
+*/
+
+namespace fatdog
+{
+    class Scheduler;
+    class FiberMutex;
+
+    // the calling task fiber, or a thread outside one (it waits on sem), in a form another
+    // thread can wake. a wake() that comes before park() is not lost
+    struct FiberWaiter
+    {
+        Scheduler *scheduler = nullptr;
+        Fiber::ptr fiber;
+        Semaphore *sem = nullptr;
+
+        void init(Semaphore &s);
+        void park();
+        void wake();
+    };
+
+    // parked fibers and threads of one primitive, guarded by mutex
+    class FiberWaitQueue : Noncopyable
+    {
+    public:
+        typedef Spinlock MutexType;
+        typedef FiberWaiter Waiter;
+
+        // lock holds mutex, it is released before parking, and so is release if given.
+        // returns once woken
+        void wait(MutexType::Lock &lock, FiberMutex *release = nullptr);
+        // with mutex held. Wake() the waiter after releasing it
+        bool pop(Waiter &waiter);
+        size_t size() const { return m_waiters.size(); }
+
+        static void Wake(Waiter &waiter);
+
+    public:
+        MutexType mutex;
+
+    private:
+        std::deque<Waiter> m_waiters;
+    };
+
+    class FiberSemaphore : Noncopyable
+    {
+    public:
+        FiberSemaphore(int64_t count = 0);
+
+        void wait();
+        bool tryWait();
+        void notify();
+
+    private:
+        // permits left, below 0 the number of waiters
+        std::atomic<int64_t> m_count;
+        // notify() that found its waiter not parked yet, the waiter takes it instead of parking
+        uint64_t m_pending = 0;
+        FiberWaitQueue m_queue;
+    };
+
+    class FiberMutex : Noncopyable
+    {
+    public:
+        typedef ScopedLockImpl<FiberMutex> Lock;
+
+        FiberMutex()
+            : m_sem(1)
+        {
+        }
+
+        void lock() { m_sem.wait(); }
+        bool tryLock() { return m_sem.tryWait(); }
+        void unlock() { m_sem.notify(); }
+
+    private:
+        FiberSemaphore m_sem;
+    };
+
+    class FiberCondition : Noncopyable
+    {
+    public:
+        // releases mutex while parked, holds it again on return. wakeups are not counted,
+        // check the condition in a loop
+        void wait(FiberMutex &mutex);
+        void notify();
+        void notifyAll();
+
+    private:
+        FiberWaitQueue m_queue;
+    };
+
+    /*
+     * writers first: once a writer waits, new readers wait behind it. a writer's unlock
+     * hands over to the next writer, or to all waiting readers at once if there is none
+    */
+    class FiberRWMutex : Noncopyable
+    {
+    public:
+        typedef ReadScopedLockImpl<FiberRWMutex> ReadLock;
+        typedef WriteScopedLockImpl<FiberRWMutex> WriteLock;
+
+        void rdlock();
+        void wrlock();
+        void unlock();
+
+    private:
+        // with m_readers.mutex held
+        void wakeLocked(std::deque<FiberWaitQueue::Waiter> &woken);
+        void wake();
+
+    private:
+        // readers holding it, -1 a writer
+        std::atomic<int32_t> m_state = {0};
+        std::atomic<int32_t> m_writersWaiting = {0};
+        std::atomic<int32_t> m_readersWaiting = {0};
+        // both queues are guarded by m_readers.mutex
+        FiberWaitQueue m_readers;
+        FiberWaitQueue m_writers;
+    };
+} // namespace fatdog
+
+#endif
@@ -22,6 +22,7 @@ namespace fatdog
     XX(socket)       \
     XX(connect)      \
     XX(accept)       \
+    XX(accept4)      \
     XX(read)         \
     XX(readv)        \
     XX(recv)         \
@@ -32,6 +33,7 @@ namespace fatdog
     XX(send)         \
     XX(sendto)       \
     XX(sendmsg)      \
+    XX(sendfile)     \
     XX(close)        \
     XX(fcntl)        \
     XX(ioctl)        \
@@ -79,8 +81,20 @@ struct timer_info
     int cancelled = 0;
 };
 
-template <typename OriginFun, typename... Args>
-static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
+// do_io() callers without an io_uring counterpart pass nullptr as prep
+template <typename Prep>
+static bool can_submit(const Prep &)
+{
+    return true;
+}
+
+static bool can_submit(std::nullptr_t)
+{
+    return false;
+}
+
+template <typename OriginFun, typename Prep, typename... Args>
+static ssize_t do_io(int fd, OriginFun fun, Prep prep, const char *hook_fun_name,
                      uint32_t event, int timeout_so, Args &&... args)
 {
     if (!fatdog::t_hook_enable)
@@ -128,6 +142,14 @@ retry:
     if (n == -1 && errno == EAGAIN) // 这时候属于阻塞了，我们需要设置定时器
     {
         fatdog::IOManager *iom = fatdog::IOManager::GetThis();
+
+        // io_uring: 直接把操作交给内核，完成时唤醒。共享栈协程的 buffer 换出后地址会失效，只能走 poll
+        if (can_submit(prep) && iom->getBackend() == fatdog::IOManager::IO_URING
+            && !fatdog::Fiber::GetThis()->isSharedStack())
+        {
+            return iom->submitIO(fd, (fatdog::IOManager::Event)(event), prep, to);
+        }
+
         fatdog::TimerManager::Timer::ptr timer;
         std::weak_ptr<timer_info> winfo(tinfo);
 
@@ -238,12 +260,13 @@ extern "C"
         {
             return socket_f(domain, type, protocol);
         }
-        int fd = socket_f(domain, type, protocol);
+        // non blocking from the start, no fcntl() round trips afterwards
+        int fd = socket_f(domain, type | SOCK_NONBLOCK, protocol);
         if (fd == -1)
         {
             return fd;
         }
-        fatdog::FdMgr::GetInstance()->get(fd, true);
+        fatdog::FdMgr::GetInstance()->add(fd, true, true)->setUserNonblock(type & SOCK_NONBLOCK);
         return fd;
     }
 
@@ -270,6 +293,16 @@ extern "C"
             return connect_f(fd, addr, addrlen);
         }
 
+        fatdog::IOManager *iom = fatdog::IOManager::GetThis();
+        if (iom->getBackend() == fatdog::IOManager::IO_URING && !fatdog::Fiber::GetThis()->isSharedStack())
+        {
+            // 非阻塞 connect 之后内核只会回 EALREADY，所以直接交给 io_uring
+            return iom->submitIO(
+                fd, fatdog::IOManager::WRITE,
+                [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepConnect(sqe, fd, addr, addrlen); },
+                timeout_ms);
+        }
+
         int n = connect_f(fd, addr, addrlen);
         if (n == 0)
         {
@@ -280,7 +313,6 @@ extern "C"
             return n;
         }
 
-        fatdog::IOManager *iom = fatdog::IOManager::GetThis();
         fatdog::TimerManager::Timer::ptr timer;
         std::shared_ptr<timer_info> tinfo(new timer_info);
         std::weak_ptr<timer_info> winfo(tinfo);
@@ -345,64 +377,96 @@ extern "C"
         return connect_with_timeout(sockfd, addr, addrlen, fatdog::s_connect_timeout);
     }
 
-    int accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+    int accept4(int s, struct sockaddr *addr, socklen_t *addrlen, int flags)
     {
-        int fd = do_io(s, accept_f, "accept", fatdog::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+        // the new socket is non blocking underneath whatever the caller asked for. accept4()
+        // makes it so at once, and its context is built from that instead of probed
+        int sys_flags = flags | SOCK_NONBLOCK;
+        int fd = do_io(s, accept4_f,
+                       [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepAccept(sqe, s, addr, addrlen, sys_flags); },
+                       "accept4", fatdog::IOManager::READ, SO_RCVTIMEO, addr, addrlen, sys_flags);
         if (fd >= 0)
         {
-            fatdog::FdMgr::GetInstance()->get(fd, true);
+            fatdog::FdMgr::GetInstance()->add(fd, true, true)->setUserNonblock(flags & SOCK_NONBLOCK);
         }
         return fd;
     }
 
+    int accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+    {
+        return accept4(s, addr, addrlen, 0);
+    }
+
     ssize_t read(int fd, void *buf, size_t count)
     {
-        return do_io(fd, read_f, "read", fatdog::IOManager::READ, SO_RCVTIMEO, buf, count);
+        return do_io(fd, read_f,
+                     [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepRead(sqe, fd, buf, count); },
+                     "read", fatdog::IOManager::READ, SO_RCVTIMEO, buf, count);
     }
 
     ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
     {
-        return do_io(fd, readv_f, "readv", fatdog::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+        return do_io(fd, readv_f,
+                     [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepReadv(sqe, fd, iov, iovcnt); },
+                     "readv", fatdog::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
     }
 
     ssize_t recv(int sockfd, void *buf, size_t len, int flags)
     {
-        return do_io(sockfd, recv_f, "recv", fatdog::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+        return do_io(sockfd, recv_f,
+                     [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepRecv(sqe, sockfd, buf, len, flags); },
+                     "recv", fatdog::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
     }
 
     ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
     {
-        return do_io(sockfd, recvfrom_f, "recvfrom", fatdog::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+        return do_io(sockfd, recvfrom_f, nullptr, "recvfrom", fatdog::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
     }
 
     ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
     {
-        return do_io(sockfd, recvmsg_f, "recvmsg", fatdog::IOManager::READ, SO_RCVTIMEO, msg, flags);
+        return do_io(sockfd, recvmsg_f,
+                     [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepRecvmsg(sqe, sockfd, msg, flags); },
+                     "recvmsg", fatdog::IOManager::READ, SO_RCVTIMEO, msg, flags);
     }
 
     ssize_t write(int fd, const void *buf, size_t count)
     {
-        return do_io(fd, write_f, "write", fatdog::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+        return do_io(fd, write_f,
+                     [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepWrite(sqe, fd, buf, count); },
+                     "write", fatdog::IOManager::WRITE, SO_SNDTIMEO, buf, count);
     }
 
     ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
     {
-        return do_io(fd, writev_f, "writev", fatdog::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+        return do_io(fd, writev_f,
+                     [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepWritev(sqe, fd, iov, iovcnt); },
+                     "writev", fatdog::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
     }
 
     ssize_t send(int s, const void *msg, size_t len, int flags)
     {
-        return do_io(s, send_f, "send", fatdog::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+        return do_io(s, send_f,
+                     [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepSend(sqe, s, msg, len, flags); },
+                     "send", fatdog::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
     }
 
     ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen)
     {
-        return do_io(s, sendto_f, "sendto", fatdog::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+        return do_io(s, sendto_f, nullptr, "sendto", fatdog::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
     }
 
     ssize_t sendmsg(int s, const struct msghdr *msg, int flags)
     {
-        return do_io(s, sendmsg_f, "sendmsg", fatdog::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+        return do_io(s, sendmsg_f,
+                     [=](io_uring_sqe *sqe) { fatdog::IoUring::PrepSendmsg(sqe, s, msg, flags); },
+                     "sendmsg", fatdog::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+    }
+
+    // io_uring has no sendfile, both backends wait for out_fd to be writable
+    ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+    {
+        return do_io(out_fd, sendfile_f, nullptr, "sendfile", fatdog::IOManager::WRITE, SO_SNDTIMEO, in_fd, offset, count);
     }
 
     int close(int fd)
@@ -59,6 +59,65 @@ namespace fatdog
             }
         }
 
+        namespace
+        {
+            // "HTTP/1.1 200 OK\r\n" for every known status, by code
+            StringView s_status_lines[600];
+
+            struct _StatusLinesIniter
+            {
+                _StatusLinesIniter()
+                {
+#define XX(code, name, msg) s_status_lines[code] = "HTTP/1.1 " #code " " #msg "\r\n";
+                    HTTP_STATUS_MAP(XX);
+#undef XX
+                }
+            };
+
+            static _StatusLinesIniter _init;
+        } // namespace
+
+        static void AppendUint(std::string &out, uint64_t v)
+        {
+            char buf[20];
+            char *p = buf + sizeof(buf);
+            do
+            {
+                *--p = '0' + v % 10;
+                v /= 10;
+            } while (v);
+            out.append(p, buf + sizeof(buf) - p);
+        }
+
+        static std::string &AppendVersion(std::string &out, uint8_t version)
+        {
+            char buf[8] = {'H', 'T', 'T', 'P', '/', (char)('0' + (version >> 4)), '.', (char)('0' + (version & 0x0F))};
+            return out.append(buf, sizeof(buf));
+        }
+
+        // Connection is written from isClose()
+        static void AppendHeader(std::string &out, StringView name, StringView value)
+        {
+            if (name.size() == 10 && strncasecmp(name.data(), "connection", 10) == 0)
+            {
+                return;
+            }
+            out.append(name.data(), name.size());
+            out.append(": ", 2);
+            out.append(value.data(), value.size());
+            out.append("\r\n", 2);
+        }
+
+        static void AppendContentLength(std::string &out, size_t length)
+        {
+            if (length > 0)
+            {
+                out.append("content-length: ", 16);
+                AppendUint(out, length);
+                out.append("\r\n", 2);
+            }
+        }
+
         bool CaseInsensitiveLess::operator()(const std::string &lhs, const std::string &rhs) const
         {
             return strcasecmp(lhs.c_str(), rhs.c_str()) < 0;
@@ -67,12 +126,170 @@ namespace fatdog
         HttpRequest::HttpRequest(uint8_t version, bool close)
             : m_method(HttpMethod::GET), m_version(version), m_close(close), m_path("/")
         {
+            m_headerViews.reserve(16);
+        }
+
+        uint32_t HttpRequest::HashHeaderName(const char *name, size_t len)
+        {
+            uint32_t h = 2166136261u;
+            for (size_t i = 0; i < len; ++i)
+            {
+                h ^= (uint8_t)tolower((uint8_t)name[i]);
+                h *= 16777619u;
+            }
+            return h;
+        }
+
+        void HttpRequest::materializeUri() const
+        {
+            if (m_uriOwned)
+            {
+                return;
+            }
+            if (!m_pathView.empty())
+            {
+                m_path.assign(m_pathView.data(), m_pathView.size());
+            }
+            m_query.assign(m_queryView.data(), m_queryView.size());
+            m_fragment.assign(m_fragmentView.data(), m_fragmentView.size());
+            m_uriOwned = true;
+        }
+
+        void HttpRequest::materializeHeaders() const
+        {
+            if (m_headersOwned)
+            {
+                return;
+            }
+            for (auto &i : m_headerViews)
+            {
+                m_headers[std::string(i.name.data(), i.name.size())].assign(i.value.data(), i.value.size());
+            }
+            m_headersOwned = true;
+        }
+
+        const std::string &HttpRequest::getPath() const
+        {
+            materializeUri();
+            return m_path;
+        }
+
+        const std::string &HttpRequest::getQuery() const
+        {
+            materializeUri();
+            return m_query;
+        }
+
+        const std::string &HttpRequest::getFragment() const
+        {
+            materializeUri();
+            return m_fragment;
+        }
+
+        const HttpRequest::MapType &HttpRequest::getHeaders() const
+        {
+            materializeHeaders();
+            return m_headers;
+        }
+
+        StringView HttpRequest::getPathView() const
+        {
+            if (m_uriOwned)
+            {
+                return m_path;
+            }
+            return m_pathView.empty() ? StringView("/") : m_pathView;
+        }
+
+        StringView HttpRequest::getQueryView() const
+        {
+            return m_uriOwned ? StringView(m_query) : m_queryView;
+        }
+
+        StringView HttpRequest::getFragmentView() const
+        {
+            return m_uriOwned ? StringView(m_fragment) : m_fragmentView;
+        }
+
+        bool HttpRequest::getHeaderView(const std::string &key, StringView &val) const
+        {
+            if (m_headersOwned)
+            {
+                auto it = m_headers.find(key);
+                if (it == m_headers.end())
+                {
+                    return false;
+                }
+                val = it->second;
+                return true;
+            }
+            uint32_t hash = HashHeaderName(key.c_str(), key.size());
+            // from the back, a repeated header's last value wins like in the map
+            for (auto it = m_headerViews.rbegin(); it != m_headerViews.rend(); ++it)
+            {
+                if (it->hash == hash && it->name.size() == key.size() && strncasecmp(it->name.data(), key.c_str(), key.size()) == 0)
+                {
+                    val = it->value;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void HttpRequest::setPath(const std::string &v)
+        {
+            materializeUri();
+            m_path = v;
+        }
+
+        void HttpRequest::setQuery(const std::string &v)
+        {
+            materializeUri();
+            m_query = v;
+        }
+
+        void HttpRequest::setFragment(const std::string &v)
+        {
+            materializeUri();
+            m_fragment = v;
+        }
+
+        void HttpRequest::addHeaderView(StringView name, StringView value)
+        {
+            m_headerViews.push_back({name, value, HashHeaderName(name.data(), name.size())});
+        }
+
+        void HttpRequest::setHeaders(const MapType &v)
+        {
+            m_headers = v;
+            m_headersOwned = true;
+        }
+
+        const std::string &HttpRequest::getBody() const
+        {
+            if (m_bodyStream)
+            {
+                char buf[4096];
+                int len;
+                while ((len = m_bodyStream->read(buf, sizeof(buf))) > 0)
+                {
+                    m_body.append(buf, len);
+                }
+                m_bodyStream.reset();
+            }
+            return m_body;
+        }
+
+        void HttpRequest::setBody(const std::string &v)
+        {
+            m_body = v;
+            m_bodyStream.reset();
         }
 
         std::string HttpRequest::getHeader(const std::string &key, const std::string &def) const
         {
-            auto it = m_headers.find(key);
-            return it == m_headers.end() ? def : it->second;
+            StringView v;
+            return getHeaderView(key, v) ? std::string(v.data(), v.size()) : def;
         }
 
         std::string HttpRequest::getParam(const std::string &key, const std::string &def) const
@@ -89,6 +306,7 @@ namespace fatdog
 
         void HttpRequest::setHeader(const std::string &key, const std::string &val)
         {
+            materializeHeaders();
             m_headers[key] = val;
         }
 
@@ -104,6 +322,7 @@ namespace fatdog
 
         void HttpRequest::delHeader(const std::string &key)
         {
+            materializeHeaders();
             m_headers.erase(key);
         }
 
@@ -119,14 +338,14 @@ namespace fatdog
 
         bool HttpRequest::hasHeader(const std::string &key, std::string *val)
         {
-            auto it = m_headers.find(key);
-            if (it == m_headers.end())
+            StringView v;
+            if (!getHeaderView(key, v))
             {
                 return false;
             }
             if (val)
             {
-                *val = it->second;
+                val->assign(v.data(), v.size());
             }
             return true;
         }
@@ -167,42 +386,53 @@ namespace fatdog
         }
 
         std::ostream &HttpRequest::dump(std::ostream &os) const
+        {
+            std::string head;
+            serializeHead(head);
+            return os << head << m_body;
+        }
+
+        void HttpRequest::serializeHead(std::string &out) const
         {
             //GET /uri HTTP/1.1
             //Host: wwww.sylar.top
             //
             //
-            os << HttpMethodToString(m_method) << " "
-               << m_path
-               << (m_query.empty() ? "" : "?")
-               << m_query
-               << (m_fragment.empty() ? "" : "#")
-               << m_fragment
-               << " HTTP/"
-               << ((uint32_t)(m_version >> 4))
-               << "."
-               << ((uint32_t)(m_version & 0x0F))
-               << "\r\n";
-            os << "connection: " << (m_close ? "close" : "keep-alive") << "\r\n";
-            for (auto &i : m_headers)
+            StringView path = getPathView();
+            StringView query = getQueryView();
+            StringView fragment = getFragmentView();
+            out.append(HttpMethodToString(m_method));
+            out.push_back(' ');
+            out.append(path.data(), path.size());
+            if (!query.empty())
             {
-                if (strcasecmp(i.first.c_str(), "connection") == 0)
-                {
-                    continue;
-                }
-                os << i.first << ":" << i.second << "\r\n";
+                out.push_back('?');
+                out.append(query.data(), query.size());
             }
-
-            if (!m_body.empty())
+            if (!fragment.empty())
+            {
+                out.push_back('#');
+                out.append(fragment.data(), fragment.size());
+            }
+            AppendVersion(out.append(" ", 1), m_version);
+            out.append("\r\n", 2);
+            out.append(m_close ? "connection: close\r\n" : "connection: keep-alive\r\n");
+            if (m_headersOwned)
             {
-                os << "content-length: " << m_body.size() << "\r\n\r\n"
-                   << m_body;
+                for (auto &i : m_headers)
+                {
+                    AppendHeader(out, i.first, i.second);
+                }
             }
             else
             {
-                os << "\r\n";
+                for (auto &i : m_headerViews)
+                {
+                    AppendHeader(out, i.name, i.value);
+                }
             }
-            return os;
+            AppendContentLength(out, m_body.size());
+            out.append("\r\n", 2);
         }
 
         HttpResponse::HttpResponse(uint8_t version, bool close)
@@ -235,36 +465,41 @@ namespace fatdog
 
         std::ostream &HttpResponse::dump(std::ostream &os) const
         {
-            os << "HTTP/"
-               << ((uint32_t)(m_version >> 4))
-               << "."
-               << ((uint32_t)(m_version & 0x0F))
-               << " "
-               << (uint32_t)m_status
-               << " "
-               << (m_reason.empty() ? HttpStatusToString(m_status) : m_reason)
-               << "\r\n";
+            std::string head;
+            serializeHead(head);
+            return os << head << m_body;
+        }
 
-            for (auto &i : m_headers)
+        void HttpResponse::serializeHead(std::string &out) const
+        {
+            uint32_t code = (uint32_t)m_status;
+            if (m_version == 0x11 && m_reason.empty() && code < 600 && !s_status_lines[code].empty())
             {
-                if (strcasecmp(i.first.c_str(), "connection") == 0)
-                {
-                    continue;
-                }
-                os << i.first << ": " << i.second << "\r\n";
+                out.append(s_status_lines[code].data(), s_status_lines[code].size());
             }
-            os << "connection: " << (m_close ? "close" : "keep-alive") << "\r\n";
-
-            if (!m_body.empty())
+            else
             {
-                os << "content-length: " << m_body.size() << "\r\n\r\n"
-                   << m_body;
+                AppendVersion(out, m_version);
+                out.push_back(' ');
+                AppendUint(out, code);
+                out.push_back(' ');
+                out.append(m_reason.empty() ? HttpStatusToString(m_status) : m_reason.c_str());
+                out.append("\r\n", 2);
             }
-            else
+            for (auto &i : m_headers)
+            {
+                AppendHeader(out, i.first, i.second);
+            }
+            out.append(m_close ? "connection: close\r\n" : "connection: keep-alive\r\n");
+            AppendContentLength(out, m_body.size());
+            // an empty body on a kept connection still needs a length, or the peer waits for close.
+            // 1xx, 204 and 304 have none by definition
+            if (m_body.empty() && !m_close && code >= 200 && code != 204 && code != 304 &&
+                m_headers.find("content-length") == m_headers.end() && m_headers.find("transfer-encoding") == m_headers.end())
             {
-                os << "\r\n";
+                out.append("content-length: 0\r\n", 19);
             }
-            return os;
+            out.append("\r\n", 2);
         }
 
         std::ostream &operator<<(std::ostream &os, const HttpRequest &req)
@@ -6,7 +6,10 @@
 #include <map>
 #include <iostream>
 #include <sstream>
+#include <vector>
 #include <boost/lexical_cast.hpp>
+#include <boost/utility/string_ref.hpp>
+#include "../stream.h"
 
 namespace fatdog
 {
@@ -140,6 +143,9 @@ namespace fatdog
         const char *HttpMethodToString(const HttpMethod &m);
         const char *HttpStatusToString(const HttpStatus &s);
 
+        // c++11 has no std::string_view
+        typedef boost::string_ref StringView;
+
         struct CaseInsensitiveLess
         {
             bool operator()(const std::string &lhs, const std::string &rhs) const;
@@ -184,33 +190,72 @@ namespace fatdog
             return def;
         }
 
+        /*
+         * a parsed request refers into the connection's input buffer: path, query, fragment and
+         * headers are views, the buffer is kept alive by the request. headers are a flat vector
+         * in arrival order, each with the hash of its lowercased name, a lookup is a scan
+         * comparing hashes first. the std::string getters copy the views out on first use
+         * (path, query and fragment as one, all headers as one), the setters do the same first,
+         * after that the owned copies are what counts.
+        */
         class HttpRequest
         {
         public:
             typedef std::shared_ptr<HttpRequest> ptr;
             typedef std::map<std::string, std::string, CaseInsensitiveLess> MapType;
+
+            struct HeaderView
+            {
+                StringView name;
+                StringView value;
+                uint32_t hash;
+            };
+            typedef std::vector<HeaderView> HeaderViews;
+
             HttpRequest(uint8_t version = 0x11, bool close = true);
 
             HttpMethod getMethod() const { return m_method; }
             uint8_t getVersion() const { return m_version; }
-            const std::string &getPath() const { return m_path; }
-            const std::string &getQuery() const { return m_query; }
-            const std::string &getBody() const { return m_body; }
-            const MapType &getHeaders() const { return m_headers; }
+            const std::string &getPath() const;
+            const std::string &getQuery() const;
+            const std::string &getFragment() const;
+            // reads what is left of a streamed body first
+            const std::string &getBody() const;
+            const MapType &getHeaders() const;
             const MapType &getParams() const { return m_params; }
             const MapType &getCookies() const { return m_cookies; }
 
+            // no copy, valid as long as the request is
+            StringView getPathView() const;
+            StringView getQueryView() const;
+            StringView getFragmentView() const;
+            // the headers as parsed, setHeader()/delHeader() don't show here
+            const HeaderViews &getHeaderViews() const { return m_headerViews; }
+            bool getHeaderView(const std::string &key, StringView &val) const;
+
             void setMethod(HttpMethod v) { m_method = v; }
             void setVersion(uint8_t v) { m_version = v; }
-            void setPath(const std::string &v) { m_path = v; }
-            void setQuery(const std::string &v) { m_query = v; }
-            void setFragment(const std::string &v) { m_fragment = v; }
-            void setBody(const std::string &v) { m_body = v; }
+            void setPath(const std::string &v);
+            void setQuery(const std::string &v);
+            void setFragment(const std::string &v);
+            void setBody(const std::string &v);
+
+            // the body as it arrives, read it before the servlet returns. nullptr if there is
+            // none or getBody() already read it
+            Stream::ptr getBodyStream() const { return m_bodyStream; }
+            void setBodyStream(Stream::ptr v) { m_bodyStream = v; }
+
+            // parser side: views into buffer, which the request holds on to
+            void setBuffer(const std::shared_ptr<char> &buffer) { m_buffer = buffer; }
+            void setPathView(StringView v) { m_pathView = v; }
+            void setQueryView(StringView v) { m_queryView = v; }
+            void setFragmentView(StringView v) { m_fragmentView = v; }
+            void addHeaderView(StringView name, StringView value);
 
             bool isClose() const { return m_close; }
             void setClose(bool v) { m_close = v; }
 
-            void setHeaders(const MapType &v) { m_headers = v; }
+            void setHeaders(const MapType &v);
             void setParams(const MapType &v) { m_params = v; }
             void setCookies(const MapType &v) { m_cookies = v; }
 
@@ -233,13 +278,30 @@ namespace fatdog
             template <class T>
             bool checkGetHeaderAs(const std::string &key, T &val, const T &def = T())
             {
-                return checkGetAs(m_headers, key, val, def);
+                StringView v;
+                if (!getHeaderView(key, v))
+                {
+                    val = def;
+                    return false;
+                }
+                try
+                {
+                    val = boost::lexical_cast<T>(v.data(), v.size());
+                    return true;
+                }
+                catch (...)
+                {
+                    val = def;
+                }
+                return false;
             }
 
             template <class T>
             T getHeaderAs(const std::string &key, const T &def = T())
             {
-                return getAs(m_headers, key, def);
+                T val;
+                checkGetHeaderAs(key, val, def);
+                return val;
             }
 
             template <class T>
@@ -266,20 +328,42 @@ namespace fatdog
                 return getAs(m_headers, key, def);
             }
 
+            // neither reads a body still in the stream, logging a request leaves it to the servlet
             std::ostream &dump(std::ostream &os) const;
             std::string toString() const;
+            // request line and headers up to the empty line, appended to out. the body is
+            // sent on its own
+            void serializeHead(std::string &out) const;
+
+            // fnv-1a of the lowercased name
+            static uint32_t HashHeaderName(const char *name, size_t len);
+
+        private:
+            // copy the views out, once
+            void materializeUri() const;
+            void materializeHeaders() const;
 
         private:
             HttpMethod m_method;
             uint8_t m_version;
             bool m_close;
 
-            std::string m_path;
-            std::string m_query;
-            std::string m_fragment;
-            std::string m_body;
-
-            MapType m_headers;
+            std::shared_ptr<char> m_buffer;
+            StringView m_pathView;
+            StringView m_queryView;
+            StringView m_fragmentView;
+            HeaderViews m_headerViews;
+
+            // owned copies, filled on demand
+            mutable bool m_uriOwned = false;
+            mutable bool m_headersOwned = false;
+            mutable std::string m_path;
+            mutable std::string m_query;
+            mutable std::string m_fragment;
+            mutable MapType m_headers;
+
+            mutable std::string m_body;
+            mutable Stream::ptr m_bodyStream;
             MapType m_params;
             MapType m_cookies;
         };
@@ -324,6 +408,9 @@ namespace fatdog
 
             std::ostream &dump(std::ostream &os) const;
             std::string toString() const;
+            // status line and headers up to the empty line, appended to out. the body is
+            // sent on its own
+            void serializeHead(std::string &out) const;
 
         private:
             HttpStatus m_status;
@@ -281,10 +281,13 @@ size_t http_parser_execute(http_parser *parser, const char *buffer, size_t len,
 {
   if(len == 0) return 0;
 
-  parser->nread = 0;
-  parser->mark = 0;
-  parser->field_len = 0;
-  parser->field_start = 0;
+  /* off > 0 resumes in the same buffer, the marks of a token cut by the
+   * previous call stay valid. nread is where parsing got to in buffer */
+  if(off == 0) {
+    parser->mark = 0;
+    parser->field_len = 0;
+    parser->field_start = 0;
+  }
 
   const char *p, *pe;
   int cs = parser->cs;
@@ -304,7 +307,7 @@ size_t http_parser_execute(http_parser *parser, const char *buffer, size_t len,
       parser->cs = cs;
   }
 
-  parser->nread += p - (buffer + off);
+  parser->nread = p - buffer;
 
   assert(parser->nread <= len && "nread longer than length");
   assert(parser->body_start <= len && "body starts after buffer end");
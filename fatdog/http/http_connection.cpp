@@ -158,12 +158,13 @@ namespace fatdog
             return parser->getData();
         }
 
-        int HttpConnection::sendRequest(HttpRequest::ptr rsp)
+        int HttpConnection::sendRequest(HttpRequest::ptr req)
         {
-            std::stringstream ss;
-            ss << *rsp;
-            std::string data = ss.str();
-            return writeFixSize(data.c_str(), data.size());
+            m_out.clear();
+            req->serializeHead(m_out);
+            const std::string &body = req->getBody();
+            iovec iovs[2] = {{(void *)m_out.c_str(), m_out.size()}, {(void *)body.c_str(), body.size()}};
+            return writevFixSize(iovs, body.empty() ? 1 : 2);
         }
 
         HttpResult::ptr HttpConnection::DoGet(const std::string& url
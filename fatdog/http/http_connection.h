@@ -4,7 +4,7 @@
 #include "../socket_stream.h"
 #include "http.h"
 #include "../uri.h"
-#include "../thread.h"
+#include "../fiber_sync.h"
 
 #include <list>
 
@@ -81,13 +81,15 @@ namespace fatdog
         private:
             uint64_t m_createTime = 0;
             uint64_t m_request = 0;
+            // serialized head, reused by the next request
+            std::string m_out;
         };
 
         class HttpConnectionPool
         {
         public:
             typedef std::shared_ptr<HttpConnectionPool> ptr;
-            typedef Mutex MutexType;
+            typedef FiberMutex MutexType;
 
             HttpConnectionPool(const std::string &host, const std::string &vhost, uint32_t port, uint32_t max_size, uint32_t max_alive_time, uint32_t max_request);
 
@@ -58,19 +58,19 @@ namespace fatdog
         void on_request_fragment(void *data, const char *at, size_t length)
         {
             HttpRequestParser *parser = static_cast<HttpRequestParser *>(data);
-            parser->getData()->setFragment(std::string(at, length));
+            parser->getData()->setFragmentView(StringView(at, length));
         }
 
         void on_request_path(void *data, const char *at, size_t length)
         {
             HttpRequestParser *parser = static_cast<HttpRequestParser *>(data);
-            parser->getData()->setPath(std::string(at, length));
+            parser->getData()->setPathView(StringView(at, length));
         }
 
         void on_request_query(void *data, const char *at, size_t length)
         {
             HttpRequestParser *parser = static_cast<HttpRequestParser *>(data);
-            parser->getData()->setQuery(std::string(at, length));
+            parser->getData()->setQueryView(StringView(at, length));
         }
 
         void on_request_version(void *data, const char *at, size_t length)
@@ -97,7 +97,19 @@ namespace fatdog
 
         void on_request_header_done(void *data, const char *at, size_t length)
         {
-            //HttpRequestParser* parser = static_cast<HttpRequestParser*>(data);
+            HttpRequestParser *parser = static_cast<HttpRequestParser *>(data);
+            HttpRequest::ptr req = parser->getData();
+            // 1.1 keeps the connection unless told to close, 1.0 only if told to keep it
+            StringView conn;
+            bool has = req->getHeaderView("connection", conn);
+            if (req->getVersion() == 0x11)
+            {
+                req->setClose(has && conn.size() == 5 && strncasecmp(conn.data(), "close", 5) == 0);
+            }
+            else
+            {
+                req->setClose(!(has && conn.size() == 10 && strncasecmp(conn.data(), "keep-alive", 10) == 0));
+            }
         }
 
         void on_request_http_field(void *data, const char *field, size_t flen, const char *value, size_t vlen)
@@ -109,11 +121,11 @@ namespace fatdog
                 //parser->setError(1002);
                 return;
             }
-            parser->getData()->setHeader(std::string(field, flen), std::string(value, vlen));
+            parser->getData()->addHeaderView(StringView(field, flen), StringView(value, vlen));
         }
 
         HttpRequestParser::HttpRequestParser()
-            : m_error(0)
+            : m_parsed(0), m_error(0)
         {
             m_data.reset(new fatdog::http::HttpRequest);
             http_parser_init(&m_parser);
@@ -128,19 +140,66 @@ namespace fatdog
             m_parser.data = this;
         }
 
+        void HttpRequestParser::reset()
+        {
+            // http_parser_init() leaves the callbacks alone
+            m_error = 0;
+            m_parsed = 0;
+            m_data.reset(new fatdog::http::HttpRequest);
+            http_parser_init(&m_parser);
+        }
+
         uint64_t HttpRequestParser::getContentLength()
         {
             return m_data->getHeaderAs<uint64_t>("content-length", 0);
         }
 
-        //1: 成功
-        //-1: 有错误
-        //>0: 已处理的字节数，且data有效数据为len - v;
+        static bool ParseContentLength(const StringView &s, uint64_t &v)
+        {
+            v = 0;
+            if (s.empty())
+            {
+                return false;
+            }
+            for (char c : s)
+            {
+                if (c < '0' || c > '9' || v > (UINT64_MAX - (c - '0')) / 10)
+                {
+                    return false;
+                }
+                v = v * 10 + (c - '0');
+            }
+            return true;
+        }
+
+        bool HttpRequestParser::getContentLength(uint64_t &len)
+        {
+            static const char s_name[] = "content-length";
+            static const size_t s_len = sizeof(s_name) - 1;
+            len = 0;
+            bool seen = false;
+            for (auto &i : m_data->getHeaderViews())
+            {
+                if (i.name.size() != s_len || strncasecmp(i.name.data(), s_name, s_len))
+                {
+                    continue;
+                }
+                uint64_t v = 0;
+                if (!ParseContentLength(i.value, v) || (seen && v != len))
+                {
+                    return false;
+                }
+                len = v;
+                seen = true;
+            }
+            return true;
+        }
+
+        // data 从上次结束处继续解析, 不移动数据, 返回已处理到的位置
         size_t HttpRequestParser::execute(char *data, size_t len)
         {
-            size_t offset = http_parser_execute(&m_parser, data, len, 0);
-            memmove(data, data + offset, (len - offset));
-            return offset;
+            m_parsed = http_parser_execute(&m_parser, data, len, m_parsed);
+            return m_parsed;
         }
 
         int HttpRequestParser::isFinished()
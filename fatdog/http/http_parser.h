@@ -15,14 +15,24 @@ namespace fatdog
         public:
             typedef std::shared_ptr<HttpRequestParser> ptr;
             HttpRequestParser();
+            // data is the whole input so far, same address every call, len grows as more
+            // arrives. parsing resumes where the last call stopped, nothing is moved, the
+            // request's fields point into data. returns how far data is parsed
             size_t execute(char *data, size_t len);
             int isFinished();
             int hasError();
+            // ready for the next request, with a new HttpRequest
+            void reset();
 
             HttpRequest::ptr getData() const { return m_data; }
             void setError(int v) { m_error = v; }
 
             uint64_t getContentLength();
+            /*
+             * strict, for delimiting the body. len is 0 without the header. false if a value isn't plain decimal digits or
+             * the header is repeated with different values, the body can't be delimited then
+            */
+            bool getContentLength(uint64_t &len);
 
         public:
             static uint64_t GetHttpRequestBufferSize();
@@ -31,6 +41,7 @@ namespace fatdog
         private:
             http_parser m_parser;
             HttpRequest::ptr m_data;
+            size_t m_parsed;
             //1000: invalid method
             //1001: invalid version
             //1002: invalid field
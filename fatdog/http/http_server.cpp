@@ -1,4 +1,5 @@
 #include "http_server.h"
+#include "../config.h"
 #include "../log.h"
 
 namespace fatdog
@@ -8,19 +9,58 @@ namespace fatdog
 
         static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
 
+        static fatdog::ConfigVar<uint32_t>::ptr g_http_pipeline_batch =
+            fatdog::Config::lookUp("http.pipeline_batch", (uint32_t)16, "responses to pipelined requests sent in one writev");
+
         HttpServer::HttpServer(bool keepalive, fatdog::IOManager *worker, fatdog::IOManager *accept_worker)
             : TcpServer(worker, accept_worker), m_isKeepalive(keepalive)
         {
             m_dispatch.reset(new ServletDispatch);
         }
 
+        HttpServer::HttpServer(bool keepalive, const std::vector<fatdog::IOManager *> &reactors)
+            : TcpServer(reactors), m_isKeepalive(keepalive)
+        {
+            m_dispatch.reset(new ServletDispatch);
+        }
+
+        void HttpServer::rejectClient(Socket::ptr client)
+        {
+            static const char s_rsp[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                        "Connection: close\r\n"
+                                        "Content-Length: 0\r\n"
+                                        "Retry-After: 1\r\n\r\n";
+            // a new socket's send buffer is empty, this doesn't wait
+            client->send(s_rsp, sizeof(s_rsp) - 1, MSG_NOSIGNAL);
+            client->close();
+        }
+
         void HttpServer::handleClient(Socket::ptr client)
         {
             FATDOG_LOG_DEBUG(g_logger) << "handleClient " << *client;
             HttpSession::ptr session(new HttpSession(client));
+            size_t batch = std::max(g_http_pipeline_batch->getValue(), (uint32_t)1);
             do
             {
+                // responses wait in the session while pipelined requests are already buffered
+                bool buffered = session->getQueuedCount() < batch && session->hasBufferedRequest();
+                if (!buffered)
+                {
+                    if (session->flushResponses() < 0)
+                    {
+                        break;
+                    }
+                    // between requests drain() may close the connection
+                    if (!setIdle(client, true))
+                    {
+                        break;
+                    }
+                }
                 auto req = session->recvRequest();
+                if (!buffered)
+                {
+                    setIdle(client, false);
+                }
                 if (!req)
                 {
                     FATDOG_LOG_DEBUG(g_logger) << "recv http request fail, errno="
@@ -29,15 +69,18 @@ namespace fatdog
                     break;
                 }
 
-                HttpResponse::ptr rsp(new HttpResponse(req->getVersion(), req->isClose() || !m_isKeepalive));
+                // draining: this is the last one, Connection: close
+                bool close = req->isClose() || !m_isKeepalive || isDraining();
+                HttpResponse::ptr rsp(new HttpResponse(req->getVersion(), close));
                 rsp->setHeader("Server", getName());
                 m_dispatch->handle(req, rsp, session);
-                session->sendResponse(rsp);
-                if (!m_isKeepalive || req->isClose())
+                // a streamed response may have been set to close
+                if (!session->finishResponse(rsp) || rsp->isClose() || isDraining())
                 {
                     break;
                 }
             } while (true);
+            session->flushResponses();
             session->close();
         }
 
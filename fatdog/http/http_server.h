@@ -15,12 +15,16 @@ namespace fatdog
         public:
             typedef std::shared_ptr<HttpServer> ptr;
             HttpServer(bool keepalive = false, fatdog::IOManager *worker = fatdog::IOManager::GetThis(), fatdog::IOManager *accept_worker = fatdog::IOManager::GetThis());
+            // multi reactor, see TcpServer
+            HttpServer(bool keepalive, const std::vector<fatdog::IOManager *> &reactors);
 
             ServletDispatch::ptr getServletDispatch() const { return m_dispatch; }
             void setServletDispatch(ServletDispatch::ptr v) { m_dispatch = v; }
 
         protected:
             virtual void handleClient(Socket::ptr client) override;
+            // a canned 503, the request is not read
+            virtual void rejectClient(Socket::ptr client) override;
 
         private:
             bool m_isKeepalive;
@@ -1,5 +1,8 @@
 #include "http_session.h"
 #include "http_parser.h"
+#include <limits.h>
+#include <string.h>
+#include <sys/sendfile.h>
 
 namespace fatdog
 {
@@ -7,77 +10,445 @@ namespace fatdog
     {
 
         HttpSession::HttpSession(Socket::ptr sock, bool owner)
-            : SocketStream(sock, owner)
+            : SocketStream(sock, owner), m_parser(new HttpRequestParser)
         {
         }
 
+        void HttpSession::compact()
+        {
+            size_t left = m_end - m_begin;
+            if (m_buffer.use_count() == 1)
+            {
+                memmove(m_buffer.get(), m_buffer.get() + m_begin, left);
+            }
+            else
+            {
+                // an earlier request still points into it
+                std::shared_ptr<char> buffer(
+                    new char[m_bufferSize], [](char *ptr) {
+                        delete[] ptr;
+                    });
+                memcpy(buffer.get(), m_buffer.get() + m_begin, left);
+                m_buffer = buffer;
+            }
+            m_begin = 0;
+            m_end = left;
+        }
+
+        bool HttpSession::hasBufferedRequest() const
+        {
+            // past the unread body
+            size_t begin = m_begin + std::min<uint64_t>(m_bodyLeft, m_end - m_begin);
+            return m_end > begin && memmem(m_buffer.get() + begin, m_end - begin, "\r\n\r\n", 4);
+        }
+
         HttpRequest::ptr HttpSession::recvRequest()
         {
-            HttpRequestParser::ptr parser(new HttpRequestParser);
-            uint64_t buff_size = HttpRequestParser::GetHttpRequestBufferSize();
-            //uint64_t buff_size = 100;
-            std::shared_ptr<char> buffer(
-                new char[buff_size], [](char *ptr) {
+            if (!m_buffer)
+            {
+                m_bufferSize = HttpRequestParser::GetHttpRequestBufferSize();
+                m_buffer.reset(new char[m_bufferSize], [](char *ptr) {
                     delete[] ptr;
                 });
-            char *data = buffer.get();
-            int offset = 0;
+            }
+            // what the last servlet left of its body
+            if (m_bodyLeft > 0 && !skipBody())
+            {
+                return nullptr;
+            }
+            ++m_seq;
+            if (m_begin == m_end && m_buffer.use_count() == 1)
+            {
+                m_begin = m_end = 0;
+            }
+            m_parser->reset();
+            size_t head_end = 0;
             do
             {
-                int len = read(data + offset, buff_size - offset);
+                if (m_end > m_begin)
+                {
+                    size_t nparse = m_parser->execute(m_buffer.get() + m_begin, m_end - m_begin);
+                    if (m_parser->hasError())
+                    {
+                        return nullptr;
+                    }
+                    if (m_parser->isFinished())
+                    {
+                        head_end = m_begin + nparse;
+                        break;
+                    }
+                }
+                if (m_end == m_bufferSize)
+                {
+                    // the head alone fills the buffer
+                    if (m_begin == 0)
+                    {
+                        return nullptr;
+                    }
+                    // the views parsed so far would dangle, parse again from the front
+                    compact();
+                    m_parser->reset();
+                    continue;
+                }
+                int len = read(m_buffer.get() + m_end, m_bufferSize - m_end);
                 if (len <= 0)
                 {
                     return nullptr;
                 }
-                len += offset;
-                size_t nparse = parser->execute(data, len);
-                if (parser->hasError())
+                m_end += len;
+            } while (true);
+
+            HttpRequest::ptr req = m_parser->getData();
+            req->setBuffer(m_buffer);
+            m_begin = head_end;
+            StringView te;
+            if (req->getHeaderView("transfer-encoding", te))
+            {
+                // no chunked bodies here. going by Content-Length would parse the chunks as
+                // the next pipelined request, so answer what came before, refuse and close
+                static const char s_rsp[] = "HTTP/1.1 501 Not Implemented\r\n"
+                                            "connection: close\r\n"
+                                            "content-length: 0\r\n\r\n";
+                if (flushResponses() >= 0)
                 {
-                    return nullptr;
+                    writeFixSize(s_rsp, sizeof(s_rsp) - 1);
                 }
-                offset = len - nparse;
-                if (offset == (int)buff_size)
+                return nullptr;
+            }
+            if (!m_parser->getContentLength(m_bodyLeft))
+            {
+                // where the body ends is unknown, so is where the next request starts
+                static const char s_rsp[] = "HTTP/1.1 400 Bad Request\r\n"
+                                            "connection: close\r\n"
+                                            "content-length: 0\r\n\r\n";
+                if (flushResponses() >= 0)
                 {
-                    return nullptr;
+                    writeFixSize(s_rsp, sizeof(s_rsp) - 1);
                 }
-                if (parser->isFinished())
+                return nullptr;
+            }
+            if (m_bodyLeft > 0)
+            {
+                req->setBodyStream(HttpBodyStream::ptr(new HttpBodyStream(shared_from_this(), m_seq)));
+            }
+            return req;
+        }
+
+        int HttpSession::readBody(uint64_t seq, void *buffer, size_t length)
+        {
+            if (seq != m_seq || m_bodyLeft == 0)
+            {
+                return 0;
+            }
+            size_t n = std::min<uint64_t>(length, m_bodyLeft);
+            if (m_end > m_begin)
+            {
+                n = std::min(n, m_end - m_begin);
+                memcpy(buffer, m_buffer.get() + m_begin, n);
+                m_begin += n;
+                m_bodyLeft -= n;
+                return n;
+            }
+            int rt = read(buffer, n);
+            if (rt > 0)
+            {
+                m_bodyLeft -= rt;
+            }
+            return rt;
+        }
+
+        bool HttpSession::skipBody()
+        {
+            size_t n = std::min<uint64_t>(m_bodyLeft, m_end - m_begin);
+            m_begin += n;
+            m_bodyLeft -= n;
+            char buf[4096];
+            while (m_bodyLeft > 0)
+            {
+                int rt = read(buf, std::min<uint64_t>(sizeof(buf), m_bodyLeft));
+                if (rt <= 0)
                 {
-                    break;
+                    return false;
                 }
-            } while (true);
-            int64_t length = parser->getContentLength();
-            if (length > 0)
+                m_bodyLeft -= rt;
+            }
+            return true;
+        }
+
+        int HttpSession::sendResponse(HttpResponse::ptr rsp)
+        {
+            m_out.clear();
+            rsp->serializeHead(m_out);
+            const std::string &body = rsp->getBody();
+            iovec iovs[2] = {{(void *)m_out.c_str(), m_out.size()}, {(void *)body.c_str(), body.size()}};
+            return writevFixSize(iovs, body.empty() ? 1 : 2);
+        }
+
+        int HttpSession::sendResponses(const std::vector<HttpResponse::ptr> &rsps)
+        {
+            if (rsps.empty())
+            {
+                return 0;
+            }
+            // heads one after another in m_out, bodies are sent from where they are
+            m_out.clear();
+            m_iovs.clear();
+            for (auto &i : rsps)
+            {
+                size_t begin = m_out.size();
+                i->serializeHead(m_out);
+                // m_out may still move, the head's offset for now
+                m_iovs.push_back({(void *)begin, m_out.size() - begin});
+                const std::string &body = i->getBody();
+                if (!body.empty())
+                {
+                    m_iovs.push_back({(void *)body.c_str(), body.size()});
+                }
+            }
+            size_t n = 0;
+            for (auto &i : rsps)
+            {
+                m_iovs[n].iov_base = (char *)m_out.c_str() + (size_t)m_iovs[n].iov_base;
+                n += i->getBody().empty() ? 1 : 2;
+            }
+            return writevFixSize(&m_iovs[0], m_iovs.size());
+        }
+
+        int HttpSession::flushResponses()
+        {
+            if (m_queued.empty())
             {
-                std::string body;
-                body.reserve(length);
+                return 0;
+            }
+            int rt = sendResponses(m_queued);
+            m_queued.clear();
+            return rt;
+        }
 
-                if (length >= offset)
+        HttpResponseStream::ptr HttpSession::beginResponse(HttpResponse::ptr rsp, int64_t length)
+        {
+            if (flushResponses() < 0)
+            {
+                return nullptr;
+            }
+            bool chunked = length < 0 && rsp->getVersion() >= 0x11;
+            if (length >= 0)
+            {
+                rsp->setHeader("Content-Length", std::to_string(length));
+            }
+            else if (chunked)
+            {
+                rsp->setHeader("Transfer-Encoding", "chunked");
+            }
+            else
+            {
+                rsp->setClose(true);
+            }
+            std::string head;
+            rsp->serializeHead(head);
+            m_streamed = rsp;
+            m_rspStream.reset(new HttpResponseStream(shared_from_this(), head, chunked, length));
+            return m_rspStream;
+        }
+
+        bool HttpSession::finishResponse(HttpResponse::ptr rsp)
+        {
+            if (m_streamed != rsp)
+            {
+                queueResponse(rsp);
+                return true;
+            }
+            bool ok = m_rspStream->finish();
+            m_streamed.reset();
+            m_rspStream.reset();
+            return ok;
+        }
+
+        HttpBodyStream::HttpBodyStream(std::weak_ptr<HttpSession> session, uint64_t seq)
+            : m_session(session), m_seq(seq)
+        {
+        }
+
+        int HttpBodyStream::read(void *buffer, size_t length)
+        {
+            HttpSession::ptr session = m_session.lock();
+            return session ? session->readBody(m_seq, buffer, length) : 0;
+        }
+
+        int HttpBodyStream::read(ByteArray::ptr ba, size_t length)
+        {
+            std::vector<iovec> iovs;
+            ba->getWriteBuffers(iovs, length);
+            int rt = read(iovs[0].iov_base, iovs[0].iov_len);
+            if (rt > 0)
+            {
+                ba->setPosition(ba->getPosition() + rt);
+            }
+            return rt;
+        }
+
+        HttpResponseStream::HttpResponseStream(std::weak_ptr<HttpSession> session, const std::string &head, bool chunked, int64_t length)
+            : m_session(session), m_head(head), m_chunked(chunked), m_left(length)
+        {
+        }
+
+        int HttpResponseStream::write(const void *buffer, size_t length)
+        {
+            HttpSession::ptr session = m_session.lock();
+            if (!session || m_finished || !m_ok)
+            {
+                return -1;
+            }
+            if (m_left >= 0)
+            {
+                if (m_left == 0 && length > 0)
+                {
+                    // more than Content-Length
+                    return -1;
+                }
+                length = std::min<uint64_t>(length, m_left);
+            }
+            if (length == 0)
+            {
+                return 0;
+            }
+            std::vector<iovec> iovs;
+            iovs.reserve(4);
+            if (!m_head.empty())
+            {
+                iovs.push_back({(void *)m_head.c_str(), m_head.size()});
+            }
+            char size[20];
+            if (m_chunked)
+            {
+                int n = snprintf(size, sizeof(size), "%zx\r\n", length);
+                iovs.push_back({size, (size_t)n});
+            }
+            iovs.push_back({(void *)buffer, length});
+            if (m_chunked)
+            {
+                iovs.push_back({(void *)"\r\n", 2});
+            }
+            if (session->writevFixSize(&iovs[0], iovs.size()) < 0)
+            {
+                m_ok = false;
+                return -1;
+            }
+            m_head.clear();
+            if (m_left > 0)
+            {
+                m_left -= length;
+            }
+            return length;
+        }
+
+        int HttpResponseStream::write(ByteArray::ptr ba, size_t length)
+        {
+            std::vector<iovec> iovs;
+            ba->getReadBuffers(iovs, length);
+            int rt = write(iovs[0].iov_base, iovs[0].iov_len);
+            if (rt > 0)
+            {
+                ba->setPosition(ba->getPosition() + rt);
+            }
+            return rt;
+        }
+
+        int HttpResponseStream::sendFile(int fd, off_t offset, size_t length)
+        {
+            HttpSession::ptr session = m_session.lock();
+            if (!session || m_finished || !m_ok)
+            {
+                return -1;
+            }
+            if (m_left >= 0)
+            {
+                if (m_left == 0 && length > 0)
                 {
-                    body.append(data, offset);
+                    return -1;
                 }
-                else
+                length = std::min<uint64_t>(length, m_left);
+            }
+            if (length == 0)
+            {
+                return 0;
+            }
+            std::vector<iovec> iovs;
+            if (!m_head.empty())
+            {
+                iovs.push_back({(void *)m_head.c_str(), m_head.size()});
+            }
+            char size[20];
+            if (m_chunked)
+            {
+                int n = snprintf(size, sizeof(size), "%zx\r\n", length);
+                iovs.push_back({size, (size_t)n});
+            }
+            // MSG_MORE: the head leaves in the same segment as the start of the file
+            if (!iovs.empty() && session->writevFixSize(&iovs[0], iovs.size(), MSG_MORE) < 0)
+            {
+                m_ok = false;
+                return -1;
+            }
+            m_head.clear();
+            int sock = session->getSocket()->getSocket();
+            size_t left = length;
+            while (left > 0)
+            {
+                ssize_t rt = ::sendfile(sock, fd, &offset, left);
+                if (rt <= 0)
                 {
-                    body.append(data, length);
+                    // the file got shorter, or the peer is gone
+                    m_ok = false;
+                    return -1;
                 }
-                length -= offset;
-                if (length > 0)
+                left -= rt;
+            }
+            if (m_chunked)
+            {
+                iovec crlf = {(void *)"\r\n", 2};
+                if (session->writevFixSize(&crlf, 1) < 0)
                 {
-                    if (readFixSize(&body[body.size()], length) <= 0)
-                    {
-                        return nullptr;
-                    }
+                    m_ok = false;
+                    return -1;
                 }
-                parser->getData()->setBody(body);
             }
-            return parser->getData();
+            if (m_left > 0)
+            {
+                m_left -= length;
+            }
+            return length;
         }
 
-        int HttpSession::sendResponse(HttpResponse::ptr rsp)
+        bool HttpResponseStream::finish()
         {
-            std::stringstream ss;
-            ss << *rsp;
-            std::string data = ss.str();
-            return writeFixSize(data.c_str(), data.size());
+            if (m_finished)
+            {
+                return m_ok;
+            }
+            m_finished = true;
+            HttpSession::ptr session = m_session.lock();
+            if (!session || !m_ok)
+            {
+                return m_ok = false;
+            }
+            std::vector<iovec> iovs;
+            if (!m_head.empty())
+            {
+                iovs.push_back({(void *)m_head.c_str(), m_head.size()});
+            }
+            if (m_chunked)
+            {
+                iovs.push_back({(void *)"0\r\n\r\n", 5});
+            }
+            if (!iovs.empty() && session->writevFixSize(&iovs[0], iovs.size()) < 0)
+            {
+                return m_ok = false;
+            }
+            m_head.clear();
+            // short of Content-Length, the peer would wait for the rest
+            m_ok = m_left <= 0;
+            return m_ok;
         }
 
     } // namespace http
@@ -1,6 +1,7 @@
 #ifndef __FATDOG_HTTP_SESSION_H__
 #define __FATDOG_HTTP_SESSION_H__
 
+#include <vector>
 #include "../socket_stream.h"
 #include "http.h"
 
@@ -8,14 +9,130 @@ namespace fatdog
 {
     namespace http
     {
+        class HttpRequestParser;
+        class HttpSession;
 
-        class HttpSession : public SocketStream
+        // a request body, read from the connection as the servlet asks for it. ends (0) at
+        // Content-Length, or once the session moved on to the next request
+        class HttpBodyStream : public Stream
+        {
+        public:
+            typedef std::shared_ptr<HttpBodyStream> ptr;
+            HttpBodyStream(std::weak_ptr<HttpSession> session, uint64_t seq);
+
+            virtual int read(void *buffer, size_t length) override;
+            virtual int read(ByteArray::ptr ba, size_t length) override;
+            virtual int write(const void *buffer, size_t length) override { return -1; }
+            virtual int write(ByteArray::ptr ba, size_t length) override { return -1; }
+            // the rest is skipped before the next request
+            virtual void close() override {}
+
+        private:
+            std::weak_ptr<HttpSession> m_session;
+            uint64_t m_seq;
+        };
+
+        /*
+         * a response body after HttpSession::beginResponse(): each write() one chunk with
+         * Transfer-Encoding: chunked, or raw bytes up to the Content-Length given. the head
+         * goes out with the first write, not on its own
+        */
+        class HttpResponseStream : public Stream
+        {
+        public:
+            typedef std::shared_ptr<HttpResponseStream> ptr;
+            HttpResponseStream(std::weak_ptr<HttpSession> session, const std::string &head, bool chunked, int64_t length);
+
+            virtual int read(void *buffer, size_t length) override { return -1; }
+            virtual int read(ByteArray::ptr ba, size_t length) override { return -1; }
+            virtual int write(const void *buffer, size_t length) override;
+            virtual int write(ByteArray::ptr ba, size_t length) override;
+            // length bytes of fd from offset with sendfile(), the file is not read into user
+            // space. length or -1
+            int sendFile(int fd, off_t offset, size_t length);
+            // finish(), the connection stays open
+            virtual void close() override { finish(); }
+
+            // the last chunk, or the head if nothing was written. false if the write failed or
+            // less than Content-Length was written, the connection is no good then
+            bool finish();
+
+        private:
+            std::weak_ptr<HttpSession> m_session;
+            std::string m_head;
+            bool m_chunked;
+            // bytes still owed, -1 until the connection closes
+            int64_t m_left;
+            bool m_finished = false;
+            bool m_ok = true;
+        };
+
+        /*
+         * one parser and one input buffer for the whole connection. bytes read past the end
+         * of a request stay in the buffer and start the next one, so pipelined requests are
+         * not lost. requests point into the buffer (HttpRequest views): while one is alive the
+         * buffer is not moved, a request that does not fit behind it moves to a new one.
+         *
+         * the body is left on the connection, the request's body stream reads it, whatever
+         * the servlet did not read is skipped by the next recvRequest(). bodies go by
+         * Content-Length only, a request with Transfer-Encoding gets 501 and the connection closes.
+         * responses are queued and sent together, beginResponse() sends the queue first.
+         * create it with a shared_ptr, the streams hold a weak one
+        */
+        class HttpSession : public SocketStream, public std::enable_shared_from_this<HttpSession>
         {
         public:
             typedef std::shared_ptr<HttpSession> ptr;
             HttpSession(Socket::ptr sock, bool owner = true);
             HttpRequest::ptr recvRequest();
             int sendResponse(HttpResponse::ptr rsp);
+            // all of them with as few writev() as it takes
+            int sendResponses(const std::vector<HttpResponse::ptr> &rsps);
+
+            // the buffer holds a whole request head, recvRequest() won't wait for the peer
+            bool hasBufferedRequest() const;
+
+            void queueResponse(HttpResponse::ptr rsp) { m_queued.push_back(rsp); }
+            size_t getQueuedCount() const { return m_queued.size(); }
+            // -1 if the write failed
+            int flushResponses();
+
+            // send rsp's head, its body follows through the stream: length bytes, or with -1
+            // chunked (HTTP/1.0: until the connection closes, rsp is set to close).
+            // nullptr if the queued responses could not be sent
+            HttpResponseStream::ptr beginResponse(HttpResponse::ptr rsp, int64_t length = -1);
+            // after the servlet: queue rsp, or if it was streamed finish its stream.
+            // false if the connection can't carry another response
+            bool finishResponse(HttpResponse::ptr rsp);
+
+        private:
+            friend class HttpBodyStream;
+            friend class HttpResponseStream;
+
+            // move the unparsed bytes to the front of a buffer nobody else points into
+            void compact();
+            // body of request seq, buffered bytes first
+            int readBody(uint64_t seq, void *buffer, size_t length);
+            bool skipBody();
+
+        private:
+            std::shared_ptr<HttpRequestParser> m_parser;
+            std::shared_ptr<char> m_buffer;
+            size_t m_bufferSize = 0;
+            // unparsed bytes are [m_begin, m_end)
+            size_t m_begin = 0;
+            size_t m_end = 0;
+
+            // of the current request, counts requests
+            uint64_t m_seq = 0;
+            uint64_t m_bodyLeft = 0;
+
+            std::vector<HttpResponse::ptr> m_queued;
+            HttpResponse::ptr m_streamed;
+            HttpResponseStream::ptr m_rspStream;
+            // serialized heads and the iovecs sending them, kept for the next responses
+            std::string m_out;
+            std::vector<iovec> m_iovs;
         };
 
     } // namespace http
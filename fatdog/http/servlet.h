@@ -8,7 +8,7 @@
 #include <unordered_map>
 #include "http.h"
 #include "http_session.h"
-#include "../thread.h"
+#include "../fiber_sync.h"
 
 namespace fatdog
 {
@@ -48,7 +48,8 @@ namespace fatdog
         {
         public:
             typedef std::shared_ptr<ServletDispatch> ptr;
-            typedef RWMutex RWMutexType;
+            // looked up by every request fiber, a pthread lock would stall the whole thread
+            typedef FiberRWMutex RWMutexType;
 
             ServletDispatch();
             virtual int32_t handle(fatdog::http::HttpRequest::ptr request, fatdog::http::HttpResponse::ptr response, fatdog::http::HttpSession::ptr session) override;
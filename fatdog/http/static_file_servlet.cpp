@@ -0,0 +1,445 @@
+#include "static_file_servlet.h"
+#include "../clock.h"
+#include "../config.h"
+#include "../log.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace fatdog
+{
+    namespace http
+    {
+
+        static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
+
+        static fatdog::ConfigVar<uint32_t>::ptr g_static_file_cache_size =
+            fatdog::Config::lookUp("http.static_file.cache_size", (uint32_t)256, "open files kept by a StaticFileServlet");
+
+        static fatdog::ConfigVar<uint32_t>::ptr g_static_file_cache_ttl =
+            fatdog::Config::lookUp("http.static_file.cache_ttl", (uint32_t)1000, "ms a cached file is served before stat() checks it again");
+
+        static const char *ContentType(const std::string &path)
+        {
+            static const struct
+            {
+                const char *ext;
+                const char *type;
+            } s_types[] = {
+                {"html", "text/html; charset=utf-8"},
+                {"htm", "text/html; charset=utf-8"},
+                {"css", "text/css"},
+                {"js", "application/javascript"},
+                {"json", "application/json"},
+                {"txt", "text/plain; charset=utf-8"},
+                {"xml", "application/xml"},
+                {"svg", "image/svg+xml"},
+                {"png", "image/png"},
+                {"jpg", "image/jpeg"},
+                {"jpeg", "image/jpeg"},
+                {"gif", "image/gif"},
+                {"ico", "image/x-icon"},
+                {"webp", "image/webp"},
+                {"woff", "font/woff"},
+                {"woff2", "font/woff2"},
+                {"wasm", "application/wasm"},
+                {"pdf", "application/pdf"},
+                {"mp4", "video/mp4"},
+            };
+            size_t dot = path.rfind('.');
+            if (dot != std::string::npos && path.find('/', dot) == std::string::npos)
+            {
+                const char *ext = path.c_str() + dot + 1;
+                for (auto &i : s_types)
+                {
+                    if (strcasecmp(ext, i.ext) == 0)
+                    {
+                        return i.type;
+                    }
+                }
+            }
+            return "application/octet-stream";
+        }
+
+        static bool ParseUint(StringView v, uint64_t &val)
+        {
+            if (v.empty() || v.size() > 19)
+            {
+                return false;
+            }
+            val = 0;
+            for (char c : v)
+            {
+                if (c < '0' || c > '9')
+                {
+                    return false;
+                }
+                val = val * 10 + (c - '0');
+            }
+            return true;
+        }
+
+        // "bytes=a-b", "bytes=a-" or "bytes=-n". false to ignore the header (malformed, or
+        // more than one range), else satisfiable tells whether [start, start + len) is in the file
+        static bool ParseRange(StringView v, uint64_t size, uint64_t &start, uint64_t &len, bool &satisfiable)
+        {
+            if (!v.starts_with("bytes=") || v.find(',') != StringView::npos)
+            {
+                return false;
+            }
+            v.remove_prefix(6);
+            size_t dash = v.find('-');
+            if (dash == StringView::npos)
+            {
+                return false;
+            }
+            StringView first = v.substr(0, dash);
+            StringView last = v.substr(dash + 1);
+            uint64_t a = 0;
+            uint64_t b = 0;
+            if (first.empty())
+            {
+                // the last b bytes
+                if (!ParseUint(last, b))
+                {
+                    return false;
+                }
+                satisfiable = b > 0 && size > 0;
+                len = std::min(b, size);
+                start = size - len;
+                return true;
+            }
+            if (!ParseUint(first, a))
+            {
+                return false;
+            }
+            if (last.empty())
+            {
+                b = size - 1;
+            }
+            else if (!ParseUint(last, b) || b < a)
+            {
+                return false;
+            }
+            satisfiable = a < size;
+            start = a;
+            len = satisfiable ? std::min(b, size - 1) - a + 1 : 0;
+            return true;
+        }
+
+        // If-None-Match: "*" or a list of tags, W/ compares weakly
+        static bool MatchEtag(StringView header, const std::string &etag)
+        {
+            while (!header.empty())
+            {
+                size_t comma = header.find(',');
+                StringView tag = header.substr(0, comma);
+                while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+                {
+                    tag.remove_prefix(1);
+                }
+                while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+                {
+                    tag.remove_suffix(1);
+                }
+                if (tag.starts_with("W/"))
+                {
+                    tag.remove_prefix(2);
+                }
+                if (tag == "*" || tag == etag)
+                {
+                    return true;
+                }
+                if (comma == StringView::npos)
+                {
+                    break;
+                }
+                header.remove_prefix(comma + 1);
+            }
+            return false;
+        }
+
+        static int HexValue(char c)
+        {
+            if (c >= '0' && c <= '9')
+            {
+                return c - '0';
+            }
+            c |= 0x20;
+            return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        }
+
+        // percent-decode path and resolve . and .. in it, out starts with / and keeps a
+        // trailing /. false for a bad escape, a NUL or a .. above the top
+        static bool NormalizePath(StringView path, std::string &out)
+        {
+            std::string decoded;
+            decoded.reserve(path.size());
+            for (size_t i = 0; i < path.size(); ++i)
+            {
+                char c = path[i];
+                if (c == '%')
+                {
+                    int hi = i + 2 < path.size() ? HexValue(path[i + 1]) : -1;
+                    int lo = hi >= 0 ? HexValue(path[i + 2]) : -1;
+                    if (lo < 0)
+                    {
+                        return false;
+                    }
+                    c = (char)(hi << 4 | lo);
+                    i += 2;
+                }
+                if (c == '\0')
+                {
+                    return false;
+                }
+                decoded.push_back(c);
+            }
+
+            std::vector<StringView> segments;
+            StringView rest(decoded);
+            while (!rest.empty())
+            {
+                size_t slash = rest.find('/');
+                StringView seg = rest.substr(0, slash);
+                if (seg == "..")
+                {
+                    if (segments.empty())
+                    {
+                        return false;
+                    }
+                    segments.pop_back();
+                }
+                else if (!seg.empty() && seg != ".")
+                {
+                    segments.push_back(seg);
+                }
+                if (slash == StringView::npos)
+                {
+                    break;
+                }
+                rest.remove_prefix(slash + 1);
+            }
+
+            out.clear();
+            for (auto &i : segments)
+            {
+                out.push_back('/');
+                out.append(i.data(), i.size());
+            }
+            StringView last = decoded.empty() ? StringView() : StringView(decoded).substr(decoded.rfind('/') + 1);
+            if (segments.empty() || last.empty() || last == "." || last == "..")
+            {
+                out.push_back('/');
+            }
+            return true;
+        }
+
+        static bool SameFile(const struct stat &a, const struct stat &b)
+        {
+            return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+        }
+
+        StaticFileServlet::File::~File()
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+
+        StaticFileServlet::StaticFileServlet(const std::string &root, const std::string &prefix)
+            : Servlet("StaticFileServlet"), m_root(root), m_prefix(prefix)
+        {
+            while (!m_root.empty() && m_root.back() == '/')
+            {
+                m_root.pop_back();
+            }
+            char real[PATH_MAX];
+            if (realpath(m_root.empty() ? "/" : m_root.c_str(), real))
+            {
+                m_realRoot = real;
+                if (m_realRoot.back() != '/')
+                {
+                    m_realRoot.push_back('/');
+                }
+            }
+            else
+            {
+                FATDOG_LOG_WARN(g_logger) << "StaticFileServlet root " << root << " errno=" << errno
+                                          << " errstr=" << strerror(errno);
+            }
+        }
+
+        StaticFileServlet::File::ptr StaticFileServlet::getFile(const std::string &path)
+        {
+            uint64_t now = Clock::CoarseMS();
+            File::ptr cached;
+            {
+                MutexType::Lock lock(m_mutex);
+                auto it = m_files.find(path);
+                if (it != m_files.end())
+                {
+                    m_lru.splice(m_lru.begin(), m_lru, it->second);
+                    cached = it->second->second;
+                    if (now - cached->checked < g_static_file_cache_ttl->getValue())
+                    {
+                        return cached;
+                    }
+                }
+            }
+
+            struct stat st;
+            if (cached && ::stat(path.c_str(), &st) == 0 && SameFile(st, cached->st))
+            {
+                MutexType::Lock lock(m_mutex);
+                cached->checked = now;
+                return cached;
+            }
+
+            File::ptr file;
+            // symlinks included, the file must be under the root. the resolved name is opened
+            char real[PATH_MAX];
+            int fd = -1;
+            if (!m_realRoot.empty() && realpath(path.c_str(), real) && strncmp(real, m_realRoot.c_str(), m_realRoot.size()) == 0)
+            {
+                fd = ::open(real, O_RDONLY | O_CLOEXEC);
+            }
+            if (fd >= 0)
+            {
+                file.reset(new File);
+                file->fd = fd;
+                if (fstat(fd, &file->st) != 0 || !S_ISREG(file->st.st_mode))
+                {
+                    file.reset();
+                }
+            }
+
+            MutexType::Lock lock(m_mutex);
+            auto it = m_files.find(path);
+            if (!file)
+            {
+                // gone or changed into something else
+                if (it != m_files.end())
+                {
+                    m_lru.erase(it->second);
+                    m_files.erase(it);
+                }
+                return nullptr;
+            }
+
+            char buf[64];
+            snprintf(buf, sizeof(buf), "\"%lx-%lx.%lx\"", (unsigned long)file->st.st_size,
+                     (unsigned long)file->st.st_mtim.tv_sec, (unsigned long)file->st.st_mtim.tv_nsec);
+            file->etag = buf;
+            struct tm tm;
+            gmtime_r(&file->st.st_mtim.tv_sec, &tm);
+            strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            file->lastModified = buf;
+            file->checked = now;
+
+            if (it != m_files.end())
+            {
+                // whoever is still sending the old one keeps its fd open
+                it->second->second = file;
+                m_lru.splice(m_lru.begin(), m_lru, it->second);
+            }
+            else
+            {
+                m_lru.push_front(std::make_pair(path, file));
+                m_files[path] = m_lru.begin();
+                size_t max = std::max(g_static_file_cache_size->getValue(), (uint32_t)1);
+                while (m_lru.size() > max)
+                {
+                    m_files.erase(m_lru.back().first);
+                    m_lru.pop_back();
+                }
+            }
+            return file;
+        }
+
+        int32_t StaticFileServlet::handle(fatdog::http::HttpRequest::ptr request, fatdog::http::HttpResponse::ptr response, fatdog::http::HttpSession::ptr session)
+        {
+            HttpMethod method = request->getMethod();
+            if (method != HttpMethod::GET && method != HttpMethod::HEAD)
+            {
+                response->setStatus(HttpStatus::METHOD_NOT_ALLOWED);
+                response->setHeader("Allow", "GET, HEAD");
+                return 0;
+            }
+
+            StringView path = request->getPathView();
+            if (path.starts_with(m_prefix))
+            {
+                path.remove_prefix(m_prefix.size());
+            }
+            // nothing above root, getFile() checks where symlinks lead
+            std::string file_path;
+            if (!NormalizePath(path, file_path))
+            {
+                response->setStatus(HttpStatus::NOT_FOUND);
+                return 0;
+            }
+            file_path.insert(0, m_root);
+            if (file_path.back() == '/')
+            {
+                file_path.append("index.html");
+            }
+
+            File::ptr file = getFile(file_path);
+            if (!file)
+            {
+                response->setStatus(HttpStatus::NOT_FOUND);
+                return 0;
+            }
+
+            response->setHeader("ETag", file->etag);
+            response->setHeader("Last-Modified", file->lastModified);
+            response->setHeader("Accept-Ranges", "bytes");
+            StringView val;
+            if (request->getHeaderView("if-none-match", val) && MatchEtag(val, file->etag))
+            {
+                response->setStatus(HttpStatus::NOT_MODIFIED);
+                return 0;
+            }
+            response->setHeader("Content-Type", ContentType(file_path));
+
+            uint64_t size = file->st.st_size;
+            uint64_t start = 0;
+            uint64_t length = size;
+            bool satisfiable = true;
+            StringView if_range;
+            // If-Range with another tag: the file changed, all of it
+            if (request->getHeaderView("range", val) && (!request->getHeaderView("if-range", if_range) || if_range == file->etag) &&
+                ParseRange(val, size, start, length, satisfiable))
+            {
+                if (!satisfiable)
+                {
+                    response->setStatus(HttpStatus::RANGE_NOT_SATISFIABLE);
+                    response->setHeader("Content-Range", "bytes */" + std::to_string(size));
+                    return 0;
+                }
+                response->setStatus(HttpStatus::PARTIAL_CONTENT);
+                response->setHeader("Content-Range", "bytes " + std::to_string(start) + "-" + std::to_string(start + length - 1) +
+                                                         "/" + std::to_string(size));
+            }
+
+            if (method == HttpMethod::HEAD || length == 0)
+            {
+                response->setHeader("Content-Length", std::to_string(length));
+                return 0;
+            }
+            HttpResponseStream::ptr out = session->beginResponse(response, length);
+            if (!out || out->sendFile(file->fd, start, length) < 0)
+            {
+                FATDOG_LOG_DEBUG(g_logger) << "sendfile " << file_path << " failed errno=" << errno
+                                           << " errstr=" << strerror(errno);
+            }
+            return 0;
+        }
+
+    } // namespace http
+} // namespace fatdog
@@ -0,0 +1,68 @@
+#ifndef __FATDOG_HTTP_STATIC_FILE_SERVLET_H__
+#define __FATDOG_HTTP_STATIC_FILE_SERVLET_H__
+
+#include <list>
+#include <sys/stat.h>
+#include "servlet.h"
+
+namespace fatdog
+{
+    namespace http
+    {
+
+        /*
+         * files under a directory, GET and HEAD. one Range per request, ETag with If-None-Match,
+         * Last-Modified. the body goes out with sendfile(), it never passes through user space.
+         *
+         * open fds and their stat are kept in an lru cache of http.static_file.cache_size
+         * entries. an entry is trusted for http.static_file.cache_ttl ms, a hit in that time
+         * costs no open()/fstat(), after it one stat() tells whether the file changed.
+         *
+         * the path is percent-decoded and its . and .. resolved, what it names must lie
+         * under root once symlinks are followed. serve it on a glob of prefix:
+        */
+        //      sd->addGlobServlet("/static/*", StaticFileServlet::ptr(new StaticFileServlet("/var/www", "/static")));
+        class StaticFileServlet : public Servlet
+        {
+        public:
+            typedef std::shared_ptr<StaticFileServlet> ptr;
+            typedef FiberMutex MutexType;
+
+            // a request for prefix + "/a/b" gets root + "/a/b", a path ending in / its index.html
+            StaticFileServlet(const std::string &root, const std::string &prefix = "");
+            virtual int32_t handle(fatdog::http::HttpRequest::ptr request, fatdog::http::HttpResponse::ptr response, fatdog::http::HttpSession::ptr session) override;
+
+        private:
+            struct File
+            {
+                typedef std::shared_ptr<File> ptr;
+                ~File();
+
+                int fd = -1;
+                struct stat st;
+                std::string etag;
+                std::string lastModified;
+                // Clock::CoarseMS() of the last stat, with m_mutex held
+                uint64_t checked = 0;
+            };
+            typedef std::list<std::pair<std::string, File::ptr>> LruList;
+
+            // open or cached, nullptr if it is not a regular file we can read
+            File::ptr getFile(const std::string &path);
+
+        private:
+            std::string m_root;
+            // realpath() of m_root with a trailing /, empty if it can't be resolved
+            std::string m_realRoot;
+            std::string m_prefix;
+
+            MutexType m_mutex;
+            // most recently used first
+            LruList m_lru;
+            std::unordered_map<std::string, LruList::iterator> m_files;
+        };
+
+    } // namespace http
+} // namespace fatdog
+
+#endif
@@ -1,9 +1,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "clock.h"
+#include "config.h"
 #include "iomanager.h"
 #include "log.h"
 #include "macro.h"
@@ -12,6 +16,71 @@ namespace fatdog
 {
     static Logger::ptr g_logger = FATDOG_LOG_ROOT();
 
+    static ConfigVar<std::string>::ptr g_iomanager_backend =
+        Config::lookUp("iomanager.backend", std::string("epoll"), "iomanager backend, epoll|io_uring");
+
+    static ConfigVar<uint32_t>::ptr g_iomanager_uring_entries =
+        Config::lookUp("iomanager.uring_entries", (uint32_t)1024, "io_uring submission queue size");
+
+    // user_data of sqes nobody waits for (cancels, linked timeouts) and of the tickle poll
+    static const uint64_t s_uring_ignore = 0;
+    static const uint64_t s_uring_tickle = 1;
+    // a fiber submits on its own once this many sqes wait for the next idle() round
+    static const uint32_t s_uring_submit_batch = 32;
+
+    /*
+     * tickleThread() sends it to one thread. workers keep it blocked and let it in only
+     * while they wait in epoll_pwait / io_uring_enter, which then fail with EINTR. sent
+     * at any other time it stays pending until the next wait, so it's never lost.
+     * SIGURG because nobody uses it, its default action is to ignore.
+    */
+    static const int s_wake_signal = SIGURG;
+
+    static void OnWakeSignal(int)
+    {
+    }
+
+    static void InstallWakeSignal()
+    {
+        static bool s_installed = []() {
+            struct sigaction old;
+            sigaction(s_wake_signal, nullptr, &old);
+            if (old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN)
+            {
+                return false; // the application's own handler interrupts the wait as well
+            }
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = OnWakeSignal;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            return sigaction(s_wake_signal, &sa, nullptr) == 0;
+        }();
+        (void)s_installed;
+    }
+
+    struct IOManager::UringOp
+    {
+        enum Type
+        {
+            POLL,  // addEvent, wakes the waiter like epoll would
+            DIRECT // submitIO, the waiter reads res
+        };
+
+        UringOp(Type t, FdContext *ctx, Event e)
+            : type(t), fd_ctx(ctx), event(e)
+        {
+        }
+
+        Type type;
+        FdContext *fd_ctx;
+        Event event;
+        bool cancelled = false; // POLL: the waiter was already woken, drop the completion
+        bool closed = false;    // DIRECT: cancelled by cancelAll
+        int res = 0;
+        IoUring::Timespec ts;
+    };
+
     IOManager::FdContext::EventContext &IOManager::FdContext::getContext(IOManager::Event event)
     {
         switch (event)
@@ -30,6 +99,7 @@ namespace fatdog
         ctx.scheduler = nullptr;
         ctx.fiber.reset();
         ctx.cb = nullptr;
+        ctx.op = nullptr;
     }
 
     void IOManager::FdContext::triggerEvent(IOManager::Event event)
@@ -37,37 +107,54 @@ namespace fatdog
         FATDOG_ASSERT(events & event);
         events = (Event)(events & ~event);
         EventContext &ctx = getContext(event);
+        // move out, addEvent() expects an empty context next time
         if (ctx.cb)
         {
-            ctx.scheduler->schedule(ctx.cb);
+            ctx.scheduler->schedule(std::move(ctx.cb));
         }
         else
         {
-            ctx.scheduler->schedule(ctx.fiber);
+            ctx.scheduler->schedule(std::move(ctx.fiber));
         }
         ctx.scheduler = nullptr;
+        ctx.cb = nullptr;
+        ctx.fiber.reset();
         return;
     }
 
-    IOManager::IOManager(const std::string &name, size_t thread, bool use_caller)
-        : Scheduler(name, thread, use_caller)
+    IOManager::IOManager(const std::string &name, size_t thread, bool use_caller,
+                         TimerManager::Type timer_type)
+        : Scheduler(name, thread, use_caller), TimerManager(timer_type)
     {
-        m_epfd = epoll_create(1000);
-        FATDOG_ASSERT(m_epfd > 0);
+        m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        FATDOG_ASSERT(m_tickleFd >= 0);
+        int rt = 0;
+        InstallWakeSignal();
 
-        int rt = pipe(m_tickleFds);
-        FATDOG_ASSERT(!rt);
+        if (g_iomanager_backend->getValue() == "io_uring")
+        {
+            m_ring = new IoUring;
+            if (!m_ring->init(g_iomanager_uring_entries->getValue()))
+            {
+                FATDOG_LOG_WARN(g_logger) << "IOManager " << name << " io_uring unavailable, use epoll";
+                delete m_ring;
+                m_ring = nullptr;
+            }
+        }
 
-        epoll_event event;
-        memset(&event, 0, sizeof(epoll_event));
-        event.events = EPOLLIN | EPOLLET;
-        event.data.fd = m_tickleFds[0];
+        if (!m_ring)
+        {
+            m_epfd = epoll_create(1000);
+            FATDOG_ASSERT(m_epfd > 0);
 
-        rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-        FATDOG_ASSERT(!rt);
+            epoll_event event;
+            memset(&event, 0, sizeof(epoll_event));
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = m_tickleFd;
 
-        rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-        FATDOG_ASSERT(!rt);
+            rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
+            FATDOG_ASSERT(!rt);
+        }
 
         contextResize(32);
 
@@ -77,9 +164,15 @@ namespace fatdog
     IOManager::~IOManager()
     {
         stop();
-        close(m_epfd);
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
+        if (m_ring)
+        {
+            delete m_ring;
+        }
+        else
+        {
+            close(m_epfd);
+        }
+        close(m_tickleFd);
 
         for (size_t i = 0; i < m_fdContexts.size(); ++i)
         {
@@ -90,18 +183,21 @@ namespace fatdog
         }
     }
 
-    int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
+    IOManager::FdContext *IOManager::getFdContext(int fd)
     {
-        FdContext *fd_ctx = nullptr;
-        if ((int)m_fdContexts.size() > fd)
-        {
-            fd_ctx = m_fdContexts[fd];
-        }
-        else
+        if ((int)m_fdContexts.size() <= fd)
         {
             contextResize(fd * 1.5);
-            fd_ctx = m_fdContexts[fd];
         }
+        return m_fdContexts[fd];
+    }
+
+    int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
+    {
+        FdContext *fd_ctx = getFdContext(fd);
+
+        // io_uring keeps all fds under one lock, the sq is shared anyway
+        MutexType::Lock lock(m_ring ? m_uringMutex : fd_ctx->mutex);
 
         if (fd_ctx->events & event)
         {
@@ -111,18 +207,31 @@ namespace fatdog
             FATDOG_ASSERT(!(fd_ctx->events & event));
         }
 
-        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-        epoll_event epevent;
-        epevent.events = EPOLLET | fd_ctx->events | event;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if (rt)
+        UringOp *uop = nullptr;
+        if (m_ring)
         {
-            FATDOG_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                       << op << "," << fd << "," << epevent.events << "):"
-                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return -1;
+            reserveSqes(1);
+            io_uring_sqe *sqe = m_ring->getSqe();
+            uop = new UringOp(UringOp::POLL, fd_ctx, event);
+            IoUring::PrepPollAdd(sqe, fd, event == WRITE);
+            IoUring::SetUserData(sqe, (uint64_t)uop);
+            m_ring->publish();
+        }
+        else
+        {
+            int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            epoll_event epevent;
+            epevent.events = EPOLLET | fd_ctx->events | event;
+            epevent.data.ptr = fd_ctx;
+
+            int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+            if (rt)
+            {
+                FATDOG_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                                           << op << "," << fd << "," << epevent.events << "):"
+                                           << rt << " (" << errno << ") (" << strerror(errno) << ")";
+                return -1;
+            }
         }
 
         ++m_pendingEventCount;
@@ -140,6 +249,13 @@ namespace fatdog
             event_ctx.fiber = Fiber::GetThis();
             FATDOG_ASSERT2(event_ctx.fiber->getState() == Fiber::EXEC, "state=" << event_ctx.fiber->getState());
         }
+
+        if (uop)
+        {
+            event_ctx.op = uop;
+            lock.unlock();
+            submitIfNeeded();
+        }
         return 0;
     }
 
@@ -151,6 +267,20 @@ namespace fatdog
         }
         FdContext *fd_ctx = m_fdContexts[fd];
 
+        if (m_ring)
+        {
+            MutexType::Lock lock(m_uringMutex);
+            if (!(fd_ctx->events & event))
+            {
+                return false;
+            }
+            cancelUring(fd_ctx, event, false, false);
+            lock.unlock();
+            submitIfNeeded();
+            return true;
+        }
+
+        MutexType::Lock lock(fd_ctx->mutex);
         if (!(fd_ctx->events & event))
         {
             return false;
@@ -186,6 +316,20 @@ namespace fatdog
         }
         FdContext *fd_ctx = m_fdContexts[fd];
 
+        if (m_ring)
+        {
+            MutexType::Lock lock(m_uringMutex);
+            if (!(fd_ctx->events & event))
+            {
+                return false;
+            }
+            cancelUring(fd_ctx, event, true, false);
+            lock.unlock();
+            submitIfNeeded();
+            return true;
+        }
+
+        MutexType::Lock lock(fd_ctx->mutex);
         if (!(fd_ctx->events & event))
         {
             return false;
@@ -219,6 +363,27 @@ namespace fatdog
         }
         FdContext *fd_ctx = m_fdContexts[fd];
 
+        if (m_ring)
+        {
+            MutexType::Lock lock(m_uringMutex);
+            if (!fd_ctx->events)
+            {
+                return false;
+            }
+            if (fd_ctx->events & READ)
+            {
+                cancelUring(fd_ctx, READ, true, true);
+            }
+            if (fd_ctx->events & WRITE)
+            {
+                cancelUring(fd_ctx, WRITE, true, true);
+            }
+            lock.unlock();
+            submitIfNeeded();
+            return true;
+        }
+
+        MutexType::Lock lock(fd_ctx->mutex);
         if (!fd_ctx->events)
         {
             return false;
@@ -241,10 +406,12 @@ namespace fatdog
         if (fd_ctx->events & READ)
         {
             fd_ctx->triggerEvent(READ);
+            --m_pendingEventCount;
         }
         if (fd_ctx->events & WRITE)
         {
             fd_ctx->triggerEvent(WRITE);
+            --m_pendingEventCount;
         }
 
         FATDOG_ASSERT(fd_ctx->events == 0);
@@ -256,14 +423,48 @@ namespace fatdog
         return dynamic_cast<IOManager *>(Scheduler::GetThis());
     }
 
+    /*
+     * wake an idle thread. with epoll the eventfd sits edge-triggered in the shared
+     * instance, one write makes one ready event and only one epoll_wait returns it.
+     * with io_uring a single poll sqe is armed on it (m_tickleArmed), its completion is
+     * reaped by one thread which re-arms it; other threads blocked in io_uring_enter
+     * may wake too and find nothing for them.
+     * while a wakeup is in flight further tickles are coalesced into it, the woken
+     * thread clears m_tickling before it looks at the queues, so their tasks are seen.
+     * a busy thread isn't woken at all, it checks the queues before it sleeps, see
+     * hasLocalWork().
+    */
     void IOManager::tickle()
     {
-        if (hasIdleThreads())
+        if (!hasIdleThreads())
+        {
+            return;
+        }
+        bool expected = false;
+        if (!m_tickling.compare_exchange_strong(expected, true))
         {
+            ++m_tickleCoalesced;
             return;
         }
-        int rt = write(m_tickleFds[1], "T", 1);
-        FATDOG_ASSERT(rt == 1);
+        ++m_tickleSent;
+        uint64_t one = 1;
+        int rt = write(m_tickleFd, &one, sizeof(one));
+        FATDOG_ASSERT(rt == sizeof(one));
+    }
+
+    // only an idle thread is sent the signal, see Scheduler::wakeOwner()
+    void IOManager::tickleThread(int thread)
+    {
+        // ESRCH if it has just left run() for good, nothing to wake then
+        syscall(SYS_tgkill, getpid(), thread, s_wake_signal);
+    }
+
+    void IOManager::consumeTickle()
+    {
+        uint64_t dummy;
+        while (read(m_tickleFd, &dummy, sizeof(dummy)) > 0)
+            ;
+        m_tickling = false;
     }
 
     bool IOManager::stopping(uint64_t &timeout)
@@ -293,6 +494,25 @@ namespace fatdog
     }
 
     void IOManager::idle()
+    {
+        sigset_t wake;
+        sigemptyset(&wake);
+        sigaddset(&wake, s_wake_signal);
+        sigset_t wait_mask;
+        pthread_sigmask(SIG_BLOCK, &wake, &wait_mask);
+        sigdelset(&wait_mask, s_wake_signal);
+
+        if (m_ring)
+        {
+            idleUring(wait_mask);
+        }
+        else
+        {
+            idleEpoll(wait_mask);
+        }
+    }
+
+    void IOManager::idleEpoll(const sigset_t &wait_mask)
     {
         FATDOG_LOG_INFO(g_logger) << "IOManager::idle() begin";
         epoll_event *events = new epoll_event[64]();
@@ -302,38 +522,40 @@ namespace fatdog
 
         while (true)
         {
+            Clock::Update();
             uint64_t next_timeout = 0;
             if (stopping(next_timeout))
             {
                 FATDOG_LOG_INFO(g_logger) << "name=" << getName()
                                           << " idle stopping exit";
+                tickle(); // stop() tickles were coalesced, pass it on to the next idle thread
                 break;
             }
 
+            if (hasLocalWork())
+            {
+                next_timeout = 0;
+            }
+
             int rt = 0;
-            do
+            static const int MAX_TIMEOUT = 5000;
+            if (next_timeout != ~0ull)
             {
-                static const int MAX_TIMEOUT = 5000;
-                if (next_timeout != ~0ull)
-                {
-                    next_timeout = (int)next_timeout > MAX_TIMEOUT
-                                       ? MAX_TIMEOUT
-                                       : next_timeout;
-                }
-                else
-                {
-                    next_timeout = MAX_TIMEOUT;
-                }
-                rt = epoll_wait(m_epfd, events, 64, (int)next_timeout);
-                if (rt < 0 && errno == EINTR)
-                {
-                }
-                else
-                {
-                    break;
-                }
-            } while (true);
+                next_timeout = (int)next_timeout > MAX_TIMEOUT
+                                   ? MAX_TIMEOUT
+                                   : next_timeout;
+            }
+            else
+            {
+                next_timeout = MAX_TIMEOUT;
+            }
+            rt = epoll_pwait(m_epfd, events, 64, (int)next_timeout, &wait_mask);
+            if (rt < 0 && errno == EINTR)
+            {
+                rt = 0; // tickleThread(), look at the queue
+            }
 
+            Clock::Update(); // timers and the fibers woken below see the time after the wait
             std::vector<std::function<void()>> cbs;
             listExpiredCb(cbs);
             if (!cbs.empty())
@@ -345,15 +567,14 @@ namespace fatdog
             for (int i = 0; i < rt; ++i)
             {
                 epoll_event &event = events[i];
-                if (event.data.fd == m_tickleFds[0])
+                if (event.data.fd == m_tickleFd)
                 {
-                    uint8_t dummy;
-                    while (read(m_tickleFds[0], &dummy, 1) == 1)
-                        ;
+                    consumeTickle();
                     continue;
                 }
 
                 FdContext *fd_ctx = (FdContext *)event.data.ptr;
+                MutexType::Lock lock(fd_ctx->mutex);
                 if (event.events & (EPOLLERR | EPOLLHUP))
                 {
                     event.events |= EPOLLIN | EPOLLOUT;
@@ -368,7 +589,9 @@ namespace fatdog
                     real_events |= WRITE;
                 }
 
-                if ((fd_ctx->events & real_events) == NONE)
+                // EPOLLERR/EPOLLHUP turn on both, only wake what is waited for
+                real_events &= fd_ctx->events;
+                if (real_events == NONE)
                 {
                     continue;
                 }
@@ -410,4 +633,234 @@ namespace fatdog
     {
         tickle();
     }
+
+    void IOManager::reserveSqes(uint32_t n)
+    {
+        // sq full, hand it to the kernel now. linked sqes must not be split, so make room first
+        while (m_ring->getEntries() - m_ring->pending() < n)
+        {
+            m_ring->submit();
+        }
+    }
+
+    void IOManager::submitIfNeeded()
+    {
+        // scheduler threads submit in idle(), others would wait for one of them
+        if (Scheduler::GetThis() != this || m_ring->pending() >= s_uring_submit_batch)
+        {
+            m_ring->submit();
+        }
+    }
+
+    void IOManager::armTickle()
+    {
+        bool expected = false;
+        if (!m_tickleArmed.compare_exchange_strong(expected, true))
+        {
+            return;
+        }
+        MutexType::Lock lock(m_uringMutex);
+        reserveSqes(1);
+        io_uring_sqe *sqe = m_ring->getSqe();
+        IoUring::PrepPollAdd(sqe, m_tickleFd, false);
+        IoUring::SetUserData(sqe, s_uring_tickle);
+        m_ring->publish();
+    }
+
+    // with m_uringMutex held
+    void IOManager::cancelUring(FdContext *fd_ctx, Event event, bool trigger, bool closed)
+    {
+        FdContext::EventContext &ctx = fd_ctx->getContext(event);
+        UringOp *op = ctx.op;
+        FATDOG_ASSERT(op);
+
+        reserveSqes(1);
+        io_uring_sqe *sqe = m_ring->getSqe();
+        IoUring::PrepCancel(sqe, (uint64_t)op);
+        IoUring::SetUserData(sqe, s_uring_ignore);
+        m_ring->publish();
+
+        if (op->type == UringOp::DIRECT)
+        {
+            // the kernel may still be writing the buffer, the op's own completion wakes the fiber
+            op->closed = op->closed || closed;
+            return;
+        }
+
+        op->cancelled = true;
+        ctx.op = nullptr;
+        if (trigger)
+        {
+            fd_ctx->triggerEvent(event);
+        }
+        else
+        {
+            fd_ctx->events = (Event)(fd_ctx->events & ~event);
+            fd_ctx->resetContext(ctx);
+        }
+        --m_pendingEventCount;
+    }
+
+    void IOManager::completeUring(const IoUring::Completion &c)
+    {
+        if (c.user_data == s_uring_ignore)
+        {
+            return;
+        }
+        if (c.user_data == s_uring_tickle)
+        {
+            consumeTickle();
+            m_tickleArmed = false;
+            armTickle(); // re-arm now, other threads may be waiting on the ring
+            m_ring->submit();
+            return;
+        }
+
+        UringOp *op = (UringOp *)c.user_data;
+        MutexType::Lock lock(m_uringMutex);
+        if (op->cancelled)
+        {
+            lock.unlock();
+            delete op;
+            return;
+        }
+
+        FdContext *fd_ctx = op->fd_ctx;
+        FATDOG_ASSERT(fd_ctx->getContext(op->event).op == op);
+        fd_ctx->getContext(op->event).op = nullptr;
+        op->res = c.res;
+        bool direct = op->type == UringOp::DIRECT;
+        fd_ctx->triggerEvent(op->event);
+        --m_pendingEventCount;
+        lock.unlock();
+
+        if (!direct)
+        {
+            delete op; // a DIRECT op belongs to the fiber in submitIO()
+        }
+    }
+
+    ssize_t IOManager::submitIO(int fd, Event event, const std::function<void(io_uring_sqe *)> &prep,
+                                uint64_t timeout_ms)
+    {
+        FATDOG_ASSERT(m_ring);
+        FdContext *fd_ctx = getFdContext(fd);
+        UringOp *op = new UringOp(UringOp::DIRECT, fd_ctx, event);
+
+        MutexType::Lock lock(m_uringMutex);
+        if (fd_ctx->events & event)
+        {
+            FATDOG_LOG_ERROR(g_logger) << "submitIO assert fd=" << fd
+                                       << " event=" << event
+                                       << " fd_ctx.event=" << fd_ctx->events;
+            FATDOG_ASSERT(!(fd_ctx->events & event));
+        }
+
+        reserveSqes(timeout_ms == ~0ull ? 1 : 2);
+        io_uring_sqe *sqe = m_ring->getSqe();
+        prep(sqe);
+        IoUring::SetUserData(sqe, (uint64_t)op);
+        if (timeout_ms != ~0ull)
+        {
+            // the kernel cancels the op when the timeout fires, it completes with -ECANCELED
+            op->ts.tv_sec = timeout_ms / 1000;
+            op->ts.tv_nsec = timeout_ms % 1000 * 1000 * 1000;
+            IoUring::SetLink(sqe);
+            io_uring_sqe *tsqe = m_ring->getSqe();
+            IoUring::PrepLinkTimeout(tsqe, &op->ts);
+            IoUring::SetUserData(tsqe, s_uring_ignore);
+        }
+        m_ring->publish();
+
+        ++m_pendingEventCount;
+        fd_ctx->events = (Event)(fd_ctx->events | event);
+        FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
+        event_ctx.scheduler = Scheduler::GetThis();
+        event_ctx.fiber = Fiber::GetThis();
+        event_ctx.op = op;
+        lock.unlock();
+
+        submitIfNeeded();
+        Fiber::YieldToHold();
+
+        int res = op->res;
+        bool closed = op->closed;
+        delete op;
+        if (res >= 0)
+        {
+            return res;
+        }
+        errno = -res;
+        if (errno == ECANCELED)
+        {
+            errno = closed ? EBADF : ETIMEDOUT;
+        }
+        return -1;
+    }
+
+    void IOManager::idleUring(const sigset_t &wait_mask)
+    {
+        FATDOG_LOG_INFO(g_logger) << "IOManager::idle() begin, io_uring";
+        static const uint32_t MAX_CQES = 64;
+        IoUring::Completion cqes[MAX_CQES];
+
+        while (true)
+        {
+            Clock::Update();
+            uint64_t next_timeout = 0;
+            if (stopping(next_timeout))
+            {
+                FATDOG_LOG_INFO(g_logger) << "name=" << getName()
+                                          << " idle stopping exit";
+                tickle(); // stop() tickles were coalesced, pass it on to the next idle thread
+                break;
+            }
+
+            static const uint64_t MAX_TIMEOUT = 5000;
+            next_timeout = next_timeout > MAX_TIMEOUT ? MAX_TIMEOUT : next_timeout;
+            if (hasLocalWork())
+            {
+                next_timeout = 0;
+            }
+
+            // everything queued by fibers of this round goes to the kernel in one go
+            armTickle();
+            m_ring->submit();
+            if (m_ring->wait(next_timeout, &wait_mask) && errno != ETIME && errno != EINTR)
+            {
+                FATDOG_LOG_ERROR(g_logger) << "io_uring wait errno=" << errno << " errstr=" << strerror(errno);
+            }
+
+            Clock::Update(); // timers and the fibers woken below see the time after the wait
+            std::vector<std::function<void()>> cbs;
+            listExpiredCb(cbs);
+            if (!cbs.empty())
+            {
+                schedule(cbs.begin(), cbs.end());
+                cbs.clear();
+            }
+
+            while (true)
+            {
+                Spinlock::Lock lock(m_cqMutex);
+                uint32_t n = m_ring->reap(cqes, MAX_CQES);
+                lock.unlock();
+
+                for (uint32_t i = 0; i < n; ++i)
+                {
+                    completeUring(cqes[i]);
+                }
+                if (n < MAX_CQES)
+                {
+                    break;
+                }
+            }
+
+            Fiber::ptr cur = Fiber::GetThis();
+            auto raw_ptr = cur.get();
+            cur.reset();
+
+            raw_ptr->swapOut();
+        }
+    }
 } // namespace fatdog
\ No newline at end of file
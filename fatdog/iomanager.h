@@ -1,11 +1,23 @@
 #ifndef __FATDOG_IOMANAGER_H__
 #define __FATDOG_IOMANAGER_H__
 
+#include <signal.h>
+
 #include "scheduler.h"
 #include "timer.h"
+#include "uring.h"
 
 namespace fatdog
 {
+    /*
+     * two backends, picked by config "iomanager.backend" when constructed:
+     *      epoll       readiness, epoll_ctl per wait
+     *      io_uring    one ring per IOManager. addEvent() queues a one-shot POLL_ADD, and
+     *                  submitIO() hands the whole operation to the kernel, the fiber wakes
+     *                  on its completion. sqes are queued by the waiting fibers and
+     *                  submitted in one io_uring_enter per idle() round (or once 32 pile
+     *                  up). falls back to epoll if the kernel can't do it.
+    */
     class IOManager : public Scheduler, public TimerManager
     {
     public:
@@ -18,7 +30,15 @@ namespace fatdog
             WRITE = 0x4 // EPOLLOUT
         };
 
-        IOManager(const std::string &name, size_t thread = 1, bool use_caller = true);
+        enum Backend
+        {
+            EPOLL,
+            IO_URING
+        };
+
+        // timer_type WHEEL suits many short per-connection timeouts, see TimerManager
+        IOManager(const std::string &name, size_t thread = 1, bool use_caller = true,
+                  TimerManager::Type timer_type = TimerManager::SET);
         ~IOManager();
 
         int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
@@ -27,16 +47,51 @@ namespace fatdog
 
         bool cancelAll(int fd);
 
+        Backend getBackend() const { return m_ring ? IO_URING : EPOLL; }
+
+        // eventfd writes done by tickle(), and tickles folded into one already in flight
+        uint64_t getTickleSent() const { return m_tickleSent; }
+        uint64_t getTickleCoalesced() const { return m_tickleCoalesced; }
+
+        /*
+         * io_uring only. run the operation prep fills into the sqe as the waiter of fd's
+         * event, park the current fiber until it completes and return its result like the
+         * syscall would: -1 and errno on failure, ETIMEDOUT after timeout_ms, EBADF when
+         * cancelAll(fd) got in first. buffers must stay put until then, so not for shared
+         * stack fibers.
+        */
+        ssize_t submitIO(int fd, Event event, const std::function<void(io_uring_sqe *)> &prep,
+                         uint64_t timeout_ms = ~0ull);
+
         static IOManager *GetThis();
         void contextResize(size_t size);
 
     protected:
         void tickle() override;
+        void tickleThread(int thread) override;
         bool stopping() override;
         void idle() override;
         void onTimerInsertedAtFront() override;
         bool stopping(uint64_t &timeout);
 
+    private:
+        // not a spinlock, triggerEvent() runs under it and may wake a thread that preempts us
+        typedef Mutex MutexType;
+
+        struct UringOp;
+        struct FdContext;
+
+        FdContext *getFdContext(int fd);
+        void consumeTickle();
+        // wait_mask: signal mask while blocked in the kernel, lets tickleThread() in
+        void idleEpoll(const sigset_t &wait_mask);
+        void idleUring(const sigset_t &wait_mask);
+        void reserveSqes(uint32_t n); // with m_uringMutex held
+        void submitIfNeeded();
+        void armTickle();
+        void cancelUring(FdContext *fd_ctx, Event event, bool trigger, bool closed);
+        void completeUring(const IoUring::Completion &c);
+
     private:
         /*
              * for the reason epoll_event.data's type is epoll_data_t, 
@@ -51,6 +106,7 @@ namespace fatdog
                 Scheduler *scheduler = nullptr;
                 Fiber::ptr fiber;
                 std::function<void()> cb;
+                UringOp *op = nullptr; // in-flight sqe with io_uring
             };
 
             EventContext &getContext(Event event);
@@ -61,13 +117,22 @@ namespace fatdog
             EventContext write;
             int fd = 0;
             Event events = NONE;
+            MutexType mutex; // epoll only, io_uring uses m_uringMutex
         };
 
     private:
         int m_epfd = 0;
-        int m_tickleFds[2]; // 管道，0 读 1 写
+        int m_tickleFd = -1; // eventfd
+        std::atomic<bool> m_tickling = {false}; // a wakeup is written and not consumed yet
+        std::atomic<uint64_t> m_tickleSent = {0};
+        std::atomic<uint64_t> m_tickleCoalesced = {0};
         std::atomic<size_t> m_pendingEventCount = {0};
         std::vector<FdContext *> m_fdContexts;
+
+        IoUring *m_ring = nullptr;
+        MutexType m_uringMutex; // sq side and FdContext bookkeeping, io_uring only
+        Spinlock m_cqMutex;
+        std::atomic<bool> m_tickleArmed = {false};
     };
 } // namespace fatdog
 
@@ -0,0 +1,179 @@
+#ifndef __FATDOG_LOCKFREE_QUEUE_H__
+#define __FATDOG_LOCKFREE_QUEUE_H__
+
+#include <atomic>
+#include <iterator>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "noncopyable.h"
+
+namespace fatdog
+{
+
+    /*
+     * bounded multi-producer multi-consumer queue, Dmitry Vyukov's algorithm.
+     * http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+     *
+     * every cell carries a sequence number, for the position pos mapped to it:
+     *      seq == pos              cell is free, the producer of pos may fill it
+     *      seq == pos + 1          cell holds the value of pos, the consumer of pos may take it
+     *      seq == pos + capacity   cell was consumed, free for pos + capacity (next lap)
+     *
+     * push() and pop() never block, they return false when the queue is full or empty.
+    */
+    template <class T>
+    class BoundedQueue : Noncopyable
+    {
+    public:
+        // capacity is rounded up to a power of 2
+        BoundedQueue(size_t capacity)
+        {
+            size_t size = 2;
+            while (size < capacity)
+            {
+                size <<= 1;
+            }
+            m_mask = size - 1;
+            m_cells = new Cell[size];
+            for (size_t i = 0; i < size; ++i)
+            {
+                m_cells[i].seq.store(i, std::memory_order_relaxed);
+            }
+            m_enqueuePos.store(0, std::memory_order_relaxed);
+            m_dequeuePos.store(0, std::memory_order_relaxed);
+        }
+
+        ~BoundedQueue()
+        {
+            delete[] m_cells;
+        }
+
+        size_t capacity() const { return m_mask + 1; }
+
+        // only a hint, producers and consumers may be in flight
+        size_t size() const
+        {
+            size_t e = m_enqueuePos.load(std::memory_order_relaxed);
+            size_t d = m_dequeuePos.load(std::memory_order_relaxed);
+            return e > d ? e - d : 0;
+        }
+
+        bool push(T &v)
+        {
+            T *p = &v;
+            return push(p, p + 1);
+        }
+
+        /*
+         * reserve [begin, end) with one CAS on the enqueue position, so the whole batch
+         * is published as one unit: no other producer's item can land in the middle of it.
+         * all or nothing, return false if there isn't room for every item.
+         * items are moved out of [begin, end) on success.
+        */
+        template <class ForwardIterator>
+        bool push(ForwardIterator begin, ForwardIterator end)
+        {
+            size_t n = std::distance(begin, end);
+            if (n == 0)
+            {
+                return true;
+            }
+            if (n > capacity())
+            {
+                return false;
+            }
+
+            size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                bool stale = false;
+                for (size_t i = 0; i < n; ++i)
+                {
+                    size_t seq = m_cells[(pos + i) & m_mask].seq.load(std::memory_order_acquire);
+                    intptr_t dif = (intptr_t)seq - (intptr_t)(pos + i);
+                    if (dif < 0)
+                    {
+                        return false; // full, the cell still holds an item of the last lap
+                    }
+                    if (dif > 0)
+                    {
+                        stale = true; // another producer already took pos + i
+                        break;
+                    }
+                }
+
+                if (stale)
+                {
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+                    continue;
+                }
+
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+
+            for (size_t i = 0; i < n; ++i, ++begin)
+            {
+                Cell &cell = m_cells[(pos + i) & m_mask];
+                cell.data = std::move(*begin);
+                cell.seq.store(pos + i + 1, std::memory_order_release);
+            }
+            return true;
+        }
+
+        bool pop(T &v)
+        {
+            Cell *cell = nullptr;
+            size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                cell = &m_cells[pos & m_mask];
+                size_t seq = cell->seq.load(std::memory_order_acquire);
+                intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+                if (dif == 0)
+                {
+                    if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (dif < 0)
+                {
+                    return false; // empty, or the producer of pos hasn't finished yet
+                }
+                else
+                {
+                    pos = m_dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+
+            v = std::move(cell->data);
+            cell->data = T(); // drop references held by the cell now, not a lap later
+            cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> seq;
+            T data;
+        };
+
+        // keep producers and consumers off each other's cache line
+        char m_pad0[64];
+        Cell *m_cells = nullptr;
+        size_t m_mask = 0;
+        char m_pad1[64];
+        std::atomic<size_t> m_enqueuePos;
+        char m_pad2[64];
+        std::atomic<size_t> m_dequeuePos;
+        char m_pad3[64];
+    };
+
+} // namespace fatdog
+
+#endif
@@ -5,8 +5,21 @@
 #include <functional>
 #include <tuple>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <zlib.h>
 
 #include "config.h"
+#include "binary_log.h"
 
 namespace fatdog
 {
@@ -54,30 +67,220 @@ namespace fatdog
         return LogLevel::UNKNOWN;
     }
 
+    static const char *LevelName(LogLevel::Level level)
+    {
+        switch (level)
+        {
+        case LogLevel::DEBUG:
+            return "DEBUG";
+        case LogLevel::INFO:
+            return "INFO";
+        case LogLevel::WARN:
+            return "WARN";
+        case LogLevel::ERROR:
+            return "ERROR";
+        case LogLevel::FATAL:
+            return "FATAL";
+        default:
+            return "UNKNOWN";
+        }
+    }
+
+    LogBuffer::LogBuffer(size_t capacity)
+        : m_data(capacity ? capacity : 1)
+    {
+        clear();
+    }
+
+    void LogBuffer::reserve(size_t len)
+    {
+        size_t used = size();
+        if (used + len <= m_data.size())
+        {
+            return;
+        }
+        m_data.resize(std::max(m_data.size() * 2, used + len));
+        setp(&m_data[0], &m_data[0] + m_data.size());
+        pbump((int)used);
+    }
+
+    void LogBuffer::shrink(size_t capacity)
+    {
+        std::vector<char>(capacity ? capacity : 1).swap(m_data);
+        clear();
+    }
+
+    void LogBuffer::append(const char *str, size_t len)
+    {
+        reserve(len);
+        memcpy(pptr(), str, len);
+        pbump((int)len);
+    }
+
+    void LogBuffer::append(const char *str)
+    {
+        append(str, strlen(str));
+    }
+
+    void LogBuffer::append(char c)
+    {
+        reserve(1);
+        *pptr() = c;
+        pbump(1);
+    }
+
+    void LogBuffer::appendUInt(uint64_t v)
+    {
+        char buf[24];
+        char *p = buf + sizeof(buf);
+        do
+        {
+            *--p = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        append(p, buf + sizeof(buf) - p);
+    }
+
+    void LogBuffer::appendFormat(const char *fmt, va_list ap)
+    {
+        va_list copy;
+        va_copy(copy, ap);
+        size_t room = epptr() - pptr();
+        int len = vsnprintf(pptr(), room, fmt, ap);
+        if (len >= 0 && (size_t)len >= room)
+        {
+            reserve(len + 1);
+            len = vsnprintf(pptr(), len + 1, fmt, copy);
+        }
+        va_end(copy);
+        if (len > 0)
+        {
+            pbump(len);
+        }
+    }
+
+    LogBuffer::int_type LogBuffer::overflow(int_type c)
+    {
+        if (c != traits_type::eof())
+        {
+            append((char)c);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize LogBuffer::xsputn(const char *s, std::streamsize n)
+    {
+        append(s, n);
+        return n;
+    }
+
+    LogStream::LogStream()
+        : std::ostream(nullptr)
+    {
+        rdbuf(&m_buffer);
+    }
+
+    void LogStream::reset()
+    {
+        if (m_buffer.capacity() > 64 * 1024)
+        {
+            m_buffer.shrink(256);
+        }
+        m_buffer.clear();
+        clear();
+        flags(std::ios_base::skipws | std::ios_base::dec);
+        precision(6);
+        width(0);
+        fill(' ');
+    }
+
     LogEvent::LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string &thread_name)
         : m_filename(file), m_line(line), m_elapse(elapse), m_threadID(thread_id), m_fiberID(fiber_id), m_time(time), m_threadName(thread_name), m_logger(logger), m_level(level)
     {
     }
 
-    void LogEvent::format(const char *fmt, ...)
+    LogEvent::ptr LogEvent::Acquire(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string &thread_name)
     {
-        va_list al;
-        va_start(al, fmt);
+        // more than one is busy when something logs while a record is being built
+        static thread_local std::vector<LogEvent::ptr> t_pool;
+        for (auto &i : t_pool)
+        {
+            if (i.use_count() == 1)
+            {
+                LogEvent *e = i.get();
+                e->m_filename = file;
+                e->m_line = line;
+                e->m_elapse = elapse;
+                e->m_threadID = thread_id;
+                e->m_fiberID = fiber_id;
+                e->m_time = time;
+                e->m_threadName.assign(thread_name);
+                e->m_logger = logger;
+                e->m_level = level;
+                e->m_ss.reset();
+                return i;
+            }
+        }
 
-        char *buf = nullptr;
-        int len = vasprintf(&buf, fmt, al);
-        if (len != -1)
+        LogEvent::ptr event(new LogEvent(logger, level, file, line, elapse, thread_id, fiber_id, time, thread_name));
+        if (t_pool.size() < 4)
         {
-            m_ss << std::string(buf, len);
-            free(buf);
+            event->m_pooled = true;
+            t_pool.push_back(event);
         }
+        return event;
+    }
 
+    void LogEvent::format(const char *fmt, ...)
+    {
+        va_list al;
+        va_start(al, fmt);
+        m_ss.buffer().appendFormat(fmt, al);
         va_end(al);
     }
 
     LogEventWrapper::~LogEventWrapper()
     {
+        if (m_suppressed)
+        {
+            LogBuffer &content = m_event->getContentBuffer();
+            content.append(" (suppressed ");
+            content.appendUInt(m_suppressed);
+            content.append(')');
+        }
         m_event->getLogger()->log(m_event->getLevel(), m_event);
+        if (m_event->m_pooled)
+        {
+            m_event->m_logger.reset();
+        }
+    }
+
+    uint64_t LogRateLimit::pass()
+    {
+        return m_suppressed.exchange(0, std::memory_order_relaxed) + 1;
+    }
+
+    uint64_t LogRateLimit::everyN(uint64_t n)
+    {
+        if (n <= 1 || m_count.fetch_add(1, std::memory_order_relaxed) % n == 0)
+        {
+            return pass();
+        }
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    uint64_t LogRateLimit::everyMS(uint64_t ms)
+    {
+        uint64_t now = Clock::CoarseMS();
+        uint64_t last = m_last.load(std::memory_order_relaxed);
+        // one thread wins the slot, the others count as suppressed
+        if ((!last || now >= last + ms) && m_last.compare_exchange_strong(last, now, std::memory_order_relaxed))
+        {
+            return pass();
+        }
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return 0;
     }
 
     Logger::Logger(const std::string &name, const LogLevel::Level level)
@@ -219,9 +422,28 @@ namespace fatdog
         return m_formatter;
     }
 
+    // formatting scratch of the calling thread, appenders don't log while they hold it
+    static LogBuffer &FormatBuffer()
+    {
+        static thread_local LogBuffer t_buffer(1024);
+        t_buffer.clear();
+        return t_buffer;
+    }
+
     void StdoutLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
     {
-        std::cout << m_formatter->format(logger, level, event);
+        LogBuffer &buf = FormatBuffer();
+        m_formatter->format(buf, logger, level, event);
+        std::cout.write(buf.data(), buf.size());
+    }
+
+    void StdoutLogAppender::write(const iovec *iov, int iovcnt)
+    {
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            std::cout.write((const char *)iov[i].iov_base, iov[i].iov_len);
+        }
+        std::cout.flush();
     }
 
     std::string StdoutLogAppender::toYamlString()
@@ -239,39 +461,324 @@ namespace fatdog
         return ss.str();
     }
 
-    FileLogAppender::FileLogAppender(const std::string &filename, LogLevel::Level level)
-        : LogAppender(level), m_filename(filename)
+    static std::atomic<uint32_t> s_reopen_seq = {0};
+
+    static void OnSighup(int)
+    {
+        FileLogAppender::ReopenAll();
+    }
+
+    // file.gz.tmp, renamed to file.gz when complete, then file goes
+    static void CompressFile(const std::string &path)
+    {
+        std::string tmp = path + ".gz.tmp";
+        int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in == -1 && errno == ENOENT)
+        {
+            return; // already gone with max_files
+        }
+        gzFile out = in == -1 ? nullptr : gzopen(tmp.c_str(), "wb");
+        bool ok = out != nullptr;
+        char buf[64 * 1024];
+        ssize_t n;
+        while (ok && (n = read(in, buf, sizeof(buf))) > 0)
+        {
+            ok = gzwrite(out, buf, n) == n;
+        }
+        ok = ok && n == 0;
+        if (out && gzclose(out) != Z_OK)
+        {
+            ok = false;
+        }
+        // removeOld() may have dropped it meanwhile, don't bring it back as file.gz
+        bool gone = false;
+        struct stat st;
+        if (in != -1)
+        {
+            gone = !fstat(in, &st) && st.st_nlink == 0;
+            close(in);
+        }
+        if (gone)
+        {
+            unlink(tmp.c_str());
+        }
+        else if (ok && !rename(tmp.c_str(), (path + ".gz").c_str()))
+        {
+            unlink(path.c_str());
+        }
+        else
+        {
+            std::cout << "FileLogAppender compress " << path << " failed" << std::endl;
+            unlink(tmp.c_str());
+        }
+    }
+
+    FileLogAppender::Rotate FileLogAppender::RotateFromString(const std::string &str)
+    {
+        if (str == "hour" || str == "HOUR")
+        {
+            return ROTATE_HOURLY;
+        }
+        if (str == "day" || str == "DAY")
+        {
+            return ROTATE_DAILY;
+        }
+        return ROTATE_NONE;
+    }
+
+    std::string FileLogAppender::ToString(Rotate rotate)
+    {
+        return rotate == ROTATE_HOURLY ? "hour" : rotate == ROTATE_DAILY ? "day" : "none";
+    }
+
+    void FileLogAppender::ReopenAll()
+    {
+        s_reopen_seq.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    FileLogAppender::FileLogAppender(const std::string &filename, LogLevel::Level level, uint64_t max_size,
+                                     Rotate rotate, uint32_t max_files, bool compress)
+        : LogAppender(level), m_filename(filename), m_maxSize(max_size), m_rotate(rotate), m_maxFiles(max_files),
+          m_compress(compress), m_reopenSeq(s_reopen_seq.load())
     {
         reopen();
+        // a file left from before keeps its size and period, a stale one rotates on the first write
+        struct stat st;
+        if (m_fd != -1 && !fstat(m_fd, &st) && st.st_size)
+        {
+            m_size = st.st_size;
+            setPeriod(st.st_mtime);
+        }
+        else
+        {
+            setPeriod(Clock::WallSeconds());
+        }
+    }
+
+    FileLogAppender::~FileLogAppender()
+    {
+        if (m_fd != -1)
+        {
+            close(m_fd);
+        }
     }
 
     void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
     {
         if (level >= m_level)
         {
-            uint64_t now = time(0);
-            if (now != m_lastTime)
+            LogBuffer &buf = FormatBuffer();
+            m_formatter->format(buf, logger, level, event);
+            iovec iov;
+            iov.iov_base = (void *)buf.data();
+            iov.iov_len = buf.size();
+            write(&iov, 1);
+        }
+    }
+
+    void FileLogAppender::write(const iovec *iov, int iovcnt)
+    {
+        check();
+
+        // writev() may stop early, and takes at most IOV_MAX entries
+        std::vector<iovec> rest;
+        while (iovcnt > 0)
+        {
+            int n = std::min(iovcnt, IOV_MAX);
+            ssize_t rt = ::writev(m_fd, iov, n);
+            if (rt < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                std::cout << "FileLogAppender writev " << m_filename << " errno=" << errno << std::endl;
+                return;
+            }
+            m_size.fetch_add(rt, std::memory_order_relaxed);
+            while (n > 0 && (size_t)rt >= iov->iov_len)
+            {
+                rt -= iov->iov_len;
+                ++iov;
+                --iovcnt;
+                --n;
+            }
+            if (rt > 0)
+            {
+                if (rest.empty())
+                {
+                    rest.assign(iov, iov + iovcnt);
+                    iov = rest.data();
+                }
+                iovec *first = (iovec *)iov; // inside rest from here on
+                first->iov_base = (char *)first->iov_base + rt;
+                first->iov_len -= rt;
+            }
+        }
+    }
+
+    void FileLogAppender::setPeriod(time_t opened)
+    {
+        m_opened = opened;
+        if (m_rotate == ROTATE_NONE)
+        {
+            m_nextRotate = 0;
+            return;
+        }
+        // next full hour or midnight, local time
+        struct tm tm;
+        localtime_r(&opened, &tm);
+        tm.tm_min = 0;
+        tm.tm_sec = 0;
+        if (m_rotate == ROTATE_HOURLY)
+        {
+            tm.tm_hour += 1;
+        }
+        else
+        {
+            tm.tm_hour = 0;
+            tm.tm_mday += 1;
+        }
+        tm.tm_isdst = -1;
+        m_nextRotate = mktime(&tm);
+    }
+
+    void FileLogAppender::check()
+    {
+        // a few relaxed loads, nothing else unless something is due
+        bool rotate_due = (m_maxSize && m_size.load(std::memory_order_relaxed) >= m_maxSize) ||
+                          (m_nextRotate.load(std::memory_order_relaxed) &&
+                           Clock::WallSeconds() >= m_nextRotate.load(std::memory_order_relaxed));
+        bool reopen_due = s_reopen_seq.load(std::memory_order_relaxed) != m_reopenSeq.load(std::memory_order_relaxed);
+        if (!rotate_due && !reopen_due)
+        {
+            return;
+        }
+
+        Mutex::Lock lock(m_rotateMutex);
+        // someone else may have done it while we waited
+        time_t now = Clock::WallSeconds();
+        if ((m_maxSize && m_size >= m_maxSize) || (m_nextRotate && now >= m_nextRotate))
+        {
+            rotate();
+        }
+        uint32_t seq = s_reopen_seq.load();
+        if (seq != m_reopenSeq)
+        {
+            m_reopenSeq = seq;
+            if (reopen())
             {
-                reopen();
-                m_lastTime = now;
+                struct stat st;
+                m_size = fstat(m_fd, &st) ? 0 : st.st_size;
             }
+        }
+    }
+
+    // with m_rotateMutex held
+    void FileLogAppender::rotate()
+    {
+        char stamp[32];
+        time_t opened = m_opened;
+        struct tm tm;
+        localtime_r(&opened, &tm);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+        // several rotations in one second (a small max_size) get .001, .002 ...
+        std::string path = m_filename + "." + stamp;
+        struct stat st;
+        for (int i = 1; !stat(path.c_str(), &st) || !stat((path + ".gz").c_str(), &st); ++i)
+        {
+            char seq[8];
+            snprintf(seq, sizeof(seq), ".%03d", i);
+            path = m_filename + "." + stamp + seq;
+        }
+
+        if (rename(m_filename.c_str(), path.c_str()))
+        {
+            std::cout << "FileLogAppender rename " << m_filename << " errno=" << errno << std::endl;
+        }
+        reopen();
+        m_size = 0;
+        setPeriod(Clock::WallSeconds());
+
+        if (m_compress)
+        {
+            // a detached thread, rotations are rare
+            Thread::ptr(new Thread("log_gzip", std::bind(CompressFile, path)));
+        }
+        removeOld();
+    }
+
+    void FileLogAppender::removeOld()
+    {
+        if (!m_maxFiles)
+        {
+            return;
+        }
+        size_t slash = m_filename.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : m_filename.substr(0, slash + 1);
+        std::string prefix = (slash == std::string::npos ? m_filename : m_filename.substr(slash + 1)) + ".";
 
-            if (!(m_filestream << m_formatter->format(logger, level, event)))
+        DIR *d = opendir(dir.c_str());
+        if (!d)
+        {
+            return;
+        }
+        // the stamps sort by time. file.x, file.x.gz and file.x.gz.tmp are one rotated file
+        std::set<std::string> rotated;
+        while (dirent *e = readdir(d))
+        {
+            std::string name = e->d_name;
+            if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) ||
+                !isdigit((unsigned char)name[prefix.size()]))
+            {
+                continue;
+            }
+            for (const char *ext : {".gz.tmp", ".gz"})
             {
-                std::cout << "error" << std::endl;
+                size_t len = strlen(ext);
+                if (name.size() > len && !name.compare(name.size() - len, len, ext))
+                {
+                    name.resize(name.size() - len);
+                    break;
+                }
             }
+            rotated.insert(name);
+        }
+        closedir(d);
+
+        std::string base = slash == std::string::npos ? "" : dir;
+        while (rotated.size() > m_maxFiles)
+        {
+            std::string path = base + *rotated.begin();
+            unlink(path.c_str());
+            unlink((path + ".gz").c_str());
+            unlink((path + ".gz.tmp").c_str());
+            rotated.erase(rotated.begin());
         }
     }
 
     bool FileLogAppender::reopen()
     {
+        int fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            std::cout << "FileLogAppender open " << m_filename << " errno=" << errno << std::endl;
+            return false;
+        }
+
         MutexType::Lock lock(m_mutex);
-        if (m_filestream.is_open())
+        if (m_fd == -1)
         {
-            m_filestream.close();
+            m_fd = fd;
         }
-        m_filestream.open(m_filename, std::ios::app);
-        return !!m_filestream;
+        else
+        {
+            // writers keep using m_fd, it just points at the new file from now on
+            dup2(fd, m_fd);
+            close(fd);
+        }
+        return true;
     }
 
     std::string FileLogAppender::toYamlString()
@@ -279,6 +786,22 @@ namespace fatdog
         YAML::Node node;
         node["type"] = "FileLogAppender";
         node["file"] = m_filename;
+        if (m_maxSize)
+        {
+            node["max_size"] = m_maxSize;
+        }
+        if (m_rotate != ROTATE_NONE)
+        {
+            node["rotate"] = ToString(m_rotate);
+        }
+        if (m_maxFiles)
+        {
+            node["max_files"] = m_maxFiles;
+        }
+        if (m_compress)
+        {
+            node["compress"] = true;
+        }
         node["level"] = LogLevel::ToString(m_level);
 
         if (m_formatter)
@@ -290,13 +813,332 @@ namespace fatdog
         return ss.str();
     }
 
+    // 单生产者单消费者的字节环, head/tail 只增不减, 生产者是所属线程, 消费者是写线程
+    struct AsyncLogAppender::Ring
+    {
+        Ring(size_t size)
+            : data(new char[size]), mask(size - 1)
+        {
+        }
+        ~Ring() { delete[] data; }
+
+        char *data;
+        size_t mask;
+        std::atomic<uint64_t> head = {0};
+        std::atomic<uint64_t> tail = {0};
+        // the thread exited or the appender is gone, whoever is left lets go
+        std::atomic<bool> closed = {false};
+    };
+
+    // rings of the current thread, keyed by AsyncLogAppender::m_id which is never reused
+    struct AsyncLogLocal
+    {
+        ~AsyncLogLocal()
+        {
+            for (auto &i : rings)
+            {
+                i.second->closed = true;
+            }
+        }
+
+        std::vector<std::pair<uint64_t, std::shared_ptr<AsyncLogAppender::Ring>>> rings;
+    };
+
+    static thread_local AsyncLogLocal t_async_local;
+    // the writer thread never waits for itself
+    static thread_local AsyncLogAppender *t_async_writer = nullptr;
+    static std::atomic<uint64_t> s_async_id = {0};
+
+    // write out at exit, static destructors may run too late or never for leaked loggers
+    static Mutex s_async_mutex;
+    static std::set<AsyncLogAppender *> s_async_appenders;
+
+    static void FlushAsyncAppenders()
+    {
+        Mutex::Lock lock(s_async_mutex);
+        for (auto &i : s_async_appenders)
+        {
+            i->flush();
+        }
+    }
+
+    AsyncLogAppender::Overflow AsyncLogAppender::OverflowFromString(const std::string &str)
+    {
+        return str == "block" || str == "BLOCK" ? BLOCK : DROP;
+    }
+
+    std::string AsyncLogAppender::ToString(Overflow overflow)
+    {
+        return overflow == BLOCK ? "block" : "drop";
+    }
+
+    AsyncLogAppender::AsyncLogAppender(LogAppender::ptr appender, size_t queue_size, Overflow overflow)
+        : LogAppender(appender->getLevel()), m_appender(appender), m_overflow(overflow), m_id(++s_async_id)
+    {
+        m_queueSize = 4096;
+        while (m_queueSize < queue_size)
+        {
+            m_queueSize <<= 1;
+        }
+        m_formatter = appender->getFormatter();
+        m_thread.reset(new Thread("log_writer", std::bind(&AsyncLogAppender::run, this)));
+
+        Mutex::Lock lock(s_async_mutex);
+        static bool s_atexit = (atexit(FlushAsyncAppenders), true);
+        (void)s_atexit;
+        s_async_appenders.insert(this);
+    }
+
+    AsyncLogAppender::~AsyncLogAppender()
+    {
+        {
+            Mutex::Lock lock(s_async_mutex);
+            s_async_appenders.erase(this);
+        }
+        m_stopping = true;
+        m_sem.notify();
+        m_thread->join();
+
+        Mutex::Lock lock(m_ringsMutex);
+        for (auto &i : m_rings)
+        {
+            i->closed = true;
+        }
+    }
+
+    void AsyncLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
+    {
+        if (level < m_level)
+        {
+            return;
+        }
+        LogBuffer &buf = FormatBuffer();
+        m_formatter->format(buf, logger, level, event);
+        iovec iov;
+        iov.iov_base = (void *)buf.data();
+        iov.iov_len = buf.size();
+        push(&iov, 1, m_overflow == BLOCK);
+        if (level >= LogLevel::FATAL)
+        {
+            flush();
+        }
+    }
+
+    void AsyncLogAppender::write(const iovec *iov, int iovcnt)
+    {
+        push(iov, iovcnt, m_overflow == BLOCK);
+    }
+
+    AsyncLogAppender::Ring *AsyncLogAppender::getRing()
+    {
+        auto &rings = t_async_local.rings;
+        for (auto &i : rings)
+        {
+            if (i.first == m_id)
+            {
+                return i.second.get();
+            }
+        }
+
+        for (auto it = rings.begin(); it != rings.end();)
+        {
+            it = it->second->closed ? rings.erase(it) : it + 1;
+        }
+        std::shared_ptr<Ring> ring(new Ring(m_queueSize));
+        rings.push_back(std::make_pair(m_id, ring));
+
+        Mutex::Lock lock(m_ringsMutex);
+        m_rings.push_back(ring);
+        return ring.get();
+    }
+
+    void AsyncLogAppender::push(const iovec *iov, int iovcnt, bool wait)
+    {
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            len += iov[i].iov_len;
+        }
+
+        Ring *ring = getRing();
+        size_t size = ring->mask + 1;
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        if (len > size - (head - ring->tail.load(std::memory_order_acquire)))
+        {
+            if (!wait || len > size || t_async_writer == this || m_stopping)
+            {
+                ++m_dropped;
+                ++m_droppedTotal;
+                return;
+            }
+            while (len > size - (head - ring->tail.load(std::memory_order_acquire)))
+            {
+                if (m_stopping)
+                {
+                    ++m_dropped;
+                    ++m_droppedTotal;
+                    return;
+                }
+                wakeup();
+                sched_yield();
+            }
+        }
+
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            const char *p = (const char *)iov[i].iov_base;
+            size_t n = iov[i].iov_len;
+            while (n)
+            {
+                size_t off = head & ring->mask;
+                size_t c = std::min(n, size - off);
+                memcpy(ring->data + off, p, c);
+                head += c;
+                p += c;
+                n -= c;
+            }
+        }
+        ring->head.store(head, std::memory_order_release);
+
+        if (head - ring->tail.load(std::memory_order_relaxed) >= size / 2)
+        {
+            wakeup();
+        }
+    }
+
+    void AsyncLogAppender::wakeup()
+    {
+        if (!m_notified.exchange(true))
+        {
+            m_sem.notify();
+        }
+    }
+
+    void AsyncLogAppender::flush()
+    {
+        if (t_async_writer == this)
+        {
+            return;
+        }
+        uint64_t req = ++m_flushRequest;
+        m_sem.notify();
+        while (m_flushDone < req && !m_stopping)
+        {
+            sched_yield();
+        }
+    }
+
+    void AsyncLogAppender::run()
+    {
+        t_async_writer = this;
+        while (true)
+        {
+            m_sem.waitFor(100);
+            m_notified = false;
+            bool stopping = m_stopping;
+            uint64_t req = m_flushRequest;
+
+            drain();
+            m_flushDone = req;
+            if (stopping)
+            {
+                break;
+            }
+        }
+    }
+
+    void AsyncLogAppender::drain()
+    {
+        std::vector<std::shared_ptr<Ring>> rings;
+        {
+            Mutex::Lock lock(m_ringsMutex);
+            rings = m_rings;
+        }
+
+        std::vector<iovec> iov;
+        std::vector<uint64_t> heads(rings.size());
+        for (size_t i = 0; i < rings.size(); ++i)
+        {
+            Ring *ring = rings[i].get();
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            heads[i] = head;
+            while (tail < head)
+            {
+                size_t off = tail & ring->mask;
+                size_t c = std::min<uint64_t>(head - tail, ring->mask + 1 - off);
+                iovec v;
+                v.iov_base = ring->data + off;
+                v.iov_len = c;
+                iov.push_back(v);
+                tail += c;
+            }
+        }
+
+        std::string dropped;
+        uint64_t n = m_dropped.exchange(0);
+        if (n)
+        {
+            dropped = "AsyncLogAppender dropped " + std::to_string(n) + " records\n";
+            iovec v;
+            v.iov_base = (void *)dropped.data();
+            v.iov_len = dropped.size();
+            iov.push_back(v);
+        }
+
+        if (!iov.empty())
+        {
+            m_appender->write(iov.data(), iov.size());
+        }
+
+        bool has_closed = false;
+        for (size_t i = 0; i < rings.size(); ++i)
+        {
+            rings[i]->tail.store(heads[i], std::memory_order_release);
+            has_closed = has_closed || rings[i]->closed;
+        }
+        if (has_closed)
+        {
+            // a closed ring gets no more records, drop it once it is empty
+            Mutex::Lock lock(m_ringsMutex);
+            for (auto it = m_rings.begin(); it != m_rings.end();)
+            {
+                Ring *ring = it->get();
+                if (ring->closed && ring->head == ring->tail)
+                {
+                    it = m_rings.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    std::string AsyncLogAppender::toYamlString()
+    {
+        YAML::Node node = YAML::Load(m_appender->toYamlString());
+        node["async"] = true;
+        node["queue_size"] = m_queueSize;
+        node["overflow"] = ToString(m_overflow);
+        node["level"] = LogLevel::ToString(m_level);
+        if (m_formatter)
+        {
+            node["formatter"] = m_formatter->getPattern();
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
     class MessageFormatItem : public LogFormatter::FormatItem
     {
     public:
         MessageFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << event->getContent();
+            out.append(event->getContentBuffer().data(), event->getContentBuffer().size());
         }
     };
 
@@ -304,9 +1146,9 @@ namespace fatdog
     {
     public:
         LevelFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << LogLevel::ToString(event->getLevel());
+            out.append(LevelName(event->getLevel()));
         }
     };
 
@@ -314,9 +1156,9 @@ namespace fatdog
     {
     public:
         ElapseFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << event->getElapse();
+            out.appendUInt(event->getElapse());
         }
     };
 
@@ -324,9 +1166,9 @@ namespace fatdog
     {
     public:
         LogNameFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << event->getLogger()->getName();
+            out.append(event->getLogger()->getName());
         }
     };
 
@@ -334,9 +1176,9 @@ namespace fatdog
     {
     public:
         ThreadIdFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << event->getThreadId();
+            out.appendUInt(event->getThreadId());
         }
     };
 
@@ -344,9 +1186,9 @@ namespace fatdog
     {
     public:
         FiberIdFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << event->getFiberId();
+            out.appendUInt(event->getFiberId());
         }
     };
 
@@ -354,12 +1196,14 @@ namespace fatdog
     {
     public:
         ThreadNameFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << event->getThreadName();
+            out.append(event->getThreadName());
         }
     };
 
+    static std::atomic<uint64_t> s_datetime_id = {0};
+
     class DateTimeFormatItem : public LogFormatter::FormatItem
     {
     public:
@@ -372,27 +1216,63 @@ namespace fatdog
             }
         }
 
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            struct tm tm;
+            // strftime() once a second per thread, the last few formats are remembered
+            struct Cache
+            {
+                uint64_t item = 0;
+                time_t time = -1;
+                size_t len = 0;
+                char buf[64];
+            };
+            static thread_local Cache t_cache[4];
+            static thread_local size_t t_next = 0;
+
             time_t time = event->getTime();
+            for (auto &c : t_cache)
+            {
+                if (c.item == m_id && c.time == time)
+                {
+                    out.append(c.buf, c.len);
+                    return;
+                }
+            }
+
+            Cache *c = nullptr;
+            for (auto &i : t_cache)
+            {
+                if (i.item == m_id)
+                {
+                    c = &i;
+                    break;
+                }
+            }
+            if (!c)
+            {
+                c = &t_cache[t_next++ % 4];
+            }
+            struct tm tm;
             localtime_r(&time, &tm);
-            char buf[64];
-            strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-            os << buf;
+            c->item = m_id;
+            c->time = time;
+            c->len = strftime(c->buf, sizeof(c->buf), m_format.c_str(), &tm);
+            out.append(c->buf, c->len);
         }
 
     private:
         std::string m_format;
+        // an address may come back with another format, ids do not
+        uint64_t m_id = ++s_datetime_id;
     };
 
     class FilenameFormatItem : public LogFormatter::FormatItem
     {
     public:
         FilenameFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << event->getFile();
+            out.append(event->getFile());
         }
     };
 
@@ -400,9 +1280,9 @@ namespace fatdog
     {
     public:
         LineFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << event->getLine();
+            out.appendUInt(event->getLine());
         }
     };
 
@@ -410,9 +1290,9 @@ namespace fatdog
     {
     public:
         NewLineFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << std::endl;
+            out.append('\n');
         }
     };
 
@@ -421,9 +1301,9 @@ namespace fatdog
     public:
         StringFormatItem(const std::string &str)
             : m_string(str) {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << m_string;
+            out.append(m_string);
         }
 
     private:
@@ -434,9 +1314,9 @@ namespace fatdog
     {
     public:
         TabFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override
+        void format(LogBuffer &out, const Logger::ptr &logger, LogLevel::Level level, const LogEvent::ptr &event) override
         {
-            os << "\t";
+            out.append('\t');
         }
 
     private:
@@ -593,14 +1473,17 @@ namespace fatdog
 
     std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)
     {
-        std::stringstream ss;
+        LogBuffer out;
+        format(out, logger, level, event);
+        return out.str();
+    }
 
+    void LogFormatter::format(LogBuffer &out, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const LogEvent::ptr &event)
+    {
         for (auto &it : m_items)
         {
-            it->format(ss, logger, level, event);
+            it->format(out, logger, level, event);
         }
-
-        return ss.str();
     }
 
     LoggerManager::LoggerManager()
@@ -640,14 +1523,25 @@ namespace fatdog
 
     struct LogAppenderDefine
     {
-        int type = 0; //1 File, 2 Stdout
+        int type = 0; //1 File, 2 Stdout, 3 Binary
         LogLevel::Level level = LogLevel::UNKNOWN;
         std::string formatter;
         std::string file;
+        // rotation of File and Binary, 0 is the appender's default
+        uint64_t max_size = 0;
+        uint32_t max_files = 0;
+        std::string rotate = "none";
+        bool compress = false;
+        // AsyncLogAppender around it
+        bool async = false;
+        uint32_t queue_size = 256 * 1024;
+        std::string overflow = "drop";
 
         bool operator==(const LogAppenderDefine &oth) const
         {
-            return type == oth.type && level == oth.level && formatter == oth.formatter && file == oth.file;
+            return type == oth.type && level == oth.level && formatter == oth.formatter && file == oth.file
+                && max_size == oth.max_size && max_files == oth.max_files && rotate == oth.rotate
+                && compress == oth.compress && async == oth.async && queue_size == oth.queue_size && overflow == oth.overflow;
         }
     };
 
@@ -660,7 +1554,7 @@ namespace fatdog
 
         bool operator==(const LogDefine &oth) const
         {
-            return name == oth.name && level == oth.level && formatter == oth.formatter && appenders == appenders;
+            return name == oth.name && level == oth.level && formatter == oth.formatter && appenders == oth.appenders;
         }
 
         bool operator<(const LogDefine &oth) const
@@ -698,6 +1592,22 @@ namespace fatdog
                         lad.level = LogLevel::FromString(na["level"].as<std::string>());
                         lad.formatter = na["formatter"].as<std::string>();
                         lad.file = na["file"].as<std::string>();
+                        if (na["max_size"].IsDefined())
+                        {
+                            lad.max_size = na["max_size"].as<uint64_t>();
+                        }
+                        if (na["max_files"].IsDefined())
+                        {
+                            lad.max_files = na["max_files"].as<uint32_t>();
+                        }
+                        if (na["rotate"].IsDefined())
+                        {
+                            lad.rotate = na["rotate"].as<std::string>();
+                        }
+                        if (na["compress"].IsDefined())
+                        {
+                            lad.compress = na["compress"].as<bool>();
+                        }
                     }
                     else if (appenderType == "StdoutLogAppender")
                     {
@@ -705,6 +1615,33 @@ namespace fatdog
                         lad.level = LogLevel::FromString(na["level"].as<std::string>());
                         lad.formatter = na["formatter"].as<std::string>();
                     }
+                    else if (appenderType == "BinaryLogAppender")
+                    {
+                        // records are not formatted, the formatter is logcat's -p
+                        lad.type = 3;
+                        lad.level = LogLevel::FromString(na["level"].as<std::string>());
+                        lad.file = na["file"].as<std::string>();
+                        if (na["max_size"].IsDefined())
+                        {
+                            lad.max_size = na["max_size"].as<uint64_t>();
+                        }
+                        if (na["max_files"].IsDefined())
+                        {
+                            lad.max_files = na["max_files"].as<uint32_t>();
+                        }
+                    }
+                    if (na["async"].IsDefined())
+                    {
+                        lad.async = na["async"].as<bool>();
+                    }
+                    if (na["queue_size"].IsDefined())
+                    {
+                        lad.queue_size = na["queue_size"].as<uint32_t>();
+                    }
+                    if (na["overflow"].IsDefined())
+                    {
+                        lad.overflow = na["overflow"].as<std::string>();
+                    }
                     ld.appenders.push_back(lad);
                 }
                 vec.insert(ld);
@@ -735,13 +1672,42 @@ namespace fatdog
                     {
                         na["type"] = "FileLogAppender";
                         na["file"] = a.file;
+                        if (a.max_size)
+                        {
+                            na["max_size"] = a.max_size;
+                        }
+                        if (a.rotate != "none")
+                        {
+                            na["rotate"] = a.rotate;
+                        }
+                        if (a.max_files)
+                        {
+                            na["max_files"] = a.max_files;
+                        }
+                        if (a.compress)
+                        {
+                            na["compress"] = true;
+                        }
                     }
                     else if (a.type == 2)
                     {
                         na["type"] = "StdoutLogAppender";
                     }
+                    else if (a.type == 3)
+                    {
+                        na["type"] = "BinaryLogAppender";
+                        na["file"] = a.file;
+                        na["max_size"] = a.max_size;
+                        na["max_files"] = a.max_files;
+                    }
                     na["level"] = LogLevel::ToString(a.level);
                     na["formatter"] = a.formatter;
+                    if (a.async)
+                    {
+                        na["async"] = true;
+                        na["queue_size"] = a.queue_size;
+                        na["overflow"] = a.overflow;
+                    }
                     n["appenders"].push_back(na);
                 }
                 node.push_back(n);
@@ -759,6 +1725,17 @@ namespace fatdog
     {
         LogIniter()
         {
+            // SIGHUP reopens the log files, unless the program has its own handler
+            struct sigaction sa;
+            if (!sigaction(SIGHUP, nullptr, &sa) && sa.sa_handler == SIG_DFL)
+            {
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = OnSighup;
+                sa.sa_flags = SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                sigaction(SIGHUP, &sa, nullptr);
+            }
+
             g_log_defines->addListener([](const std::set<LogDefine> &old_value,
                                           const std::set<LogDefine> &new_value) {
                 FATDOG_LOG_INFO(FATDOG_LOG_ROOT()) << "on_logger_conf_changed";
@@ -771,13 +1748,15 @@ namespace fatdog
                         //新增logger
                         logger = FATDOG_LOG_NAME(i.name);
                     }
+                    else if (i == *it)
+                    {
+                        //没变的logger
+                        continue;
+                    }
                     else
                     {
-                        if (!(i == *it))
-                        {
-                            //修改的logger
-                            logger = FATDOG_LOG_NAME(i.name);
-                        }
+                        //修改的logger
+                        logger = FATDOG_LOG_NAME(i.name);
                     }
                     logger->setLevel(i.level);
                     if (!i.formatter.empty())
@@ -791,12 +1770,22 @@ namespace fatdog
                         fatdog::LogAppender::ptr ap;
                         if (a.type == 1)
                         {
-                            ap.reset(new FileLogAppender(a.file));
+                            ap.reset(new FileLogAppender(a.file, LogLevel::INFO, a.max_size, FileLogAppender::RotateFromString(a.rotate),
+                                                         a.max_files, a.compress));
                         }
                         else if (a.type == 2)
                         {
                             ap.reset(new StdoutLogAppender);
                         }
+                        else if (a.type == 3)
+                        {
+                            ap.reset(new BinaryLogAppender(a.file, a.max_size ? a.max_size : 64 * 1024 * 1024,
+                                                           a.max_files ? a.max_files : 5));
+                        }
+                        if (a.async)
+                        {
+                            ap.reset(new AsyncLogAppender(ap, a.queue_size, AsyncLogAppender::OverflowFromString(a.overflow)));
+                        }
                         ap->setLevel(a.level);
                         if (!a.formatter.empty())
                         {
@@ -9,8 +9,13 @@
 #include <set>
 #include <map>
 #include <fstream>
+#include <atomic>
+
+#include <stdarg.h>
+#include <sys/uio.h>
 
 #include "util.h"
+#include "clock.h"
 #include "thread.h"
 #include "singleton.h"
 
@@ -24,9 +29,20 @@ LogFormatter: 负责格式化日志信息，处于接收端到输出端的中间
 Logger::log 调用 LogAppender::log ，后者调用 LogFormatter::format 返回格式化的字符串
 */
 
+/*
+编译期日志级别: 低于 FATDOG_LOG_MIN_LEVEL 的语句条件恒假, 编译器整条删掉, logger 和 << 后面的表达式都不会求值.
+0 UNKNOWN(全留) 1 DEBUG 2 INFO 3 WARN 4 ERROR 5 FATAL, 例如 -DFATDOG_LOG_MIN_LEVEL=2 去掉所有 DEBUG
+*/
+#ifndef FATDOG_LOG_MIN_LEVEL
+#define FATDOG_LOG_MIN_LEVEL 0
+#endif
+
+#define FATDOG_LOG_ENABLED(logger, level) \
+    ((level) >= FATDOG_LOG_MIN_LEVEL && logger->getLevel() <= (level))
+
 #define FATDOG_LOG_LEVEL(logger, level) \
-    if (logger->getLevel() <= level)    \
-    fatdog::LogEventWrapper(fatdog::LogEvent::ptr(new fatdog::LogEvent(logger, level, __FILE__, __LINE__, 0, fatdog::GetThreadId(), fatdog::GetFiberId(), time(0), fatdog::Thread::GetName()))).getSS()
+    if (FATDOG_LOG_ENABLED(logger, level)) \
+    fatdog::LogEventWrapper(logger, level, __FILE__, __LINE__, 0, fatdog::GetThreadId(), fatdog::GetFiberId(), fatdog::Clock::WallSeconds(), fatdog::Thread::GetName()).getSS()
 
 #define FATDOG_LOG_DEBUG(logger) FATDOG_LOG_LEVEL(logger, fatdog::LogLevel::DEBUG)
 #define FATDOG_LOG_INFO(logger) FATDOG_LOG_LEVEL(logger, fatdog::LogLevel::INFO)
@@ -35,8 +51,8 @@ Logger::log 调用 LogAppender::log ，后者调用 LogFormatter::format 返回
 #define FATDOG_LOG_FATAL(logger) FATDOG_LOG_LEVEL(logger, fatdog::LogLevel::FATAL)
 
 #define FATDOG_LOG_FMT(logger, level, fmt, ...) \
-    if (logger->getLevel() <= level)            \
-    fatdog::LogEventWrapper(fatdog::LogEvent::ptr(new fatdog::LogEvent(logger, level, __FILE__, __LINE__, 0, fatdog::GetThreadId(), fatdog::GetFiberId(), time(0), fatdog::Thread::GetName()))).getEvent()->format(fmt, __VA_ARGS__)
+    if (FATDOG_LOG_ENABLED(logger, level))      \
+    fatdog::LogEventWrapper(logger, level, __FILE__, __LINE__, 0, fatdog::GetThreadId(), fatdog::GetFiberId(), fatdog::Clock::WallSeconds(), fatdog::Thread::GetName()).getEvent()->format(fmt, __VA_ARGS__)
 
 #define FATDOG_LOG_FMT_DEBUG(logger, fmt, ...) FATDOG_LOG_FMT(logger, fatdog::LogLevel::DEBUG, fmt, __VA_ARGS__)
 #define FATDOG_LOG_FMT_INFO(logger, fmt, ...) FATDOG_LOG_FMT(logger, fatdog::LogLevel::INFO, fmt, __VA_ARGS__)
@@ -44,6 +60,23 @@ Logger::log 调用 LogAppender::log ，后者调用 LogFormatter::format 返回
 #define FATDOG_LOG_FMT_ERROR(logger, fmt, ...) FATDOG_LOG_FMT(logger, fatdog::LogLevel::ERROR, fmt, __VA_ARGS__)
 #define FATDOG_LOG_FMT_FATAL(logger, fmt, ...) FATDOG_LOG_FMT(logger, fatdog::LogLevel::FATAL, fmt, __VA_ARGS__)
 
+/*
+限流, 每个调用点一个 LogRateLimit(lambda 里的 static, 常量初始化, 没有锁).
+EVERY_N 每 n 条写 1 条, EVERY_MS 每 ms 毫秒最多写 1 条. 写出的那条末尾带上
+"(suppressed N)", N 是上一条之后被丢掉的条数
+    FATDOG_LOG_EVERY_MS(g_logger, fatdog::LogLevel::ERROR, 1000) << "accept errno=" << errno;
+*/
+#define FATDOG_LOG_SITE_LIMIT() \
+    ([]() -> fatdog::LogRateLimit & { static fatdog::LogRateLimit s; return s; }())
+
+#define FATDOG_LOG_LIMITED(logger, level, pass) \
+    if (FATDOG_LOG_ENABLED(logger, level))       \
+    if (uint64_t fatdog_log_pass_ = pass)        \
+    fatdog::LogEventWrapper(logger, level, __FILE__, __LINE__, 0, fatdog::GetThreadId(), fatdog::GetFiberId(), fatdog::Clock::WallSeconds(), fatdog::Thread::GetName()).setSuppressed(fatdog_log_pass_ - 1).getSS()
+
+#define FATDOG_LOG_EVERY_N(logger, level, n) FATDOG_LOG_LIMITED(logger, level, FATDOG_LOG_SITE_LIMIT().everyN(n))
+#define FATDOG_LOG_EVERY_MS(logger, level, ms) FATDOG_LOG_LIMITED(logger, level, FATDOG_LOG_SITE_LIMIT().everyMS(ms))
+
 namespace fatdog
 {
     class LogAppender;
@@ -67,13 +100,68 @@ namespace fatdog
         static Level FromString(const std::string &str);
     };
 
+    /*
+     * growable char buffer which keeps its memory across clear(), log records are built
+     * and formatted in these. it is also a streambuf, so LogStream puts operator<< output
+     * straight into it.
+    */
+    class LogBuffer : public std::streambuf
+    {
+    public:
+        LogBuffer(size_t capacity = 256);
+
+        void clear() { setp(&m_data[0], &m_data[0] + m_data.size()); }
+        const char *data() const { return pbase(); }
+        size_t size() const { return pptr() - pbase(); }
+        size_t capacity() const { return m_data.size(); }
+        // clear() and give back memory beyond capacity
+        void shrink(size_t capacity);
+        std::string str() const { return std::string(data(), size()); }
+
+        void append(const char *str, size_t len);
+        void append(const char *str);
+        void append(const std::string &str) { append(str.data(), str.size()); }
+        void append(char c);
+        void appendUInt(uint64_t v);
+        void appendFormat(const char *fmt, va_list ap);
+
+    protected:
+        int_type overflow(int_type c) override;
+        std::streamsize xsputn(const char *s, std::streamsize n) override;
+
+    private:
+        void reserve(size_t len);
+
+    private:
+        std::vector<char> m_data;
+    };
+
+    class LogStream : public std::ostream
+    {
+    public:
+        LogStream();
+
+        // empty, and the formatting flags of a fresh stream
+        void reset();
+        LogBuffer &buffer() { return m_buffer; }
+
+    private:
+        LogBuffer m_buffer;
+    };
+
     class LogEvent
     {
+        friend class LogEventWrapper;
+
     public:
         typedef std::shared_ptr<LogEvent> ptr;
 
         LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string &thread_name);
 
+        // an event of the calling thread's pool which nobody else holds, reset to these values.
+        // the log macros use this, so a record costs no allocation once the pool is warm
+        static LogEvent::ptr Acquire(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string &thread_name);
+
         const char *getFile() const { return m_filename; }
         uint32_t getLine() const { return m_line; }
         uint32_t getElapse() const { return m_elapse; }
@@ -81,10 +169,11 @@ namespace fatdog
         uint32_t getFiberId() const { return m_fiberID; }
         uint64_t getTime() const { return m_time; }
         const std::string &getThreadName() const { return m_threadName; }
-        std::string getContent() const { return m_ss.str(); }
-        std::shared_ptr<Logger> getLogger() const { return m_logger; }
+        std::string getContent() { return m_ss.buffer().str(); }
+        LogBuffer &getContentBuffer() { return m_ss.buffer(); }
+        const std::shared_ptr<Logger> &getLogger() const { return m_logger; }
         LogLevel::Level getLevel() const { return m_level; }
-        std::stringstream &getSS() { return m_ss; }
+        std::ostream &getSS() { return m_ss; }
 
         void format(const char *fmt, ...);
 
@@ -103,7 +192,9 @@ namespace fatdog
         // 日志等级
         LogLevel::Level m_level;
         // 日志内容流
-        std::stringstream m_ss;
+        LogStream m_ss;
+        // from Acquire(), let go of the logger once logged
+        bool m_pooled = false;
     };
 
     class LogEventWrapper
@@ -115,13 +206,41 @@ namespace fatdog
             : m_event(event)
         {
         }
+        LogEventWrapper(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string &thread_name)
+            : m_event(LogEvent::Acquire(logger, level, file, line, elapse, thread_id, fiber_id, time, thread_name))
+        {
+        }
         ~LogEventWrapper();
 
-        std::stringstream &getSS() { return m_event->getSS(); }
+        std::ostream &getSS() { return m_event->getSS(); }
         LogEvent::ptr getEvent() { return m_event; }
+        // records a rate limit dropped before this one, noted at the end of the message
+        LogEventWrapper &setSuppressed(uint64_t n)
+        {
+            m_suppressed = n;
+            return *this;
+        }
 
     private:
         LogEvent::ptr m_event;
+        uint64_t m_suppressed = 0;
+    };
+
+    // per call site state of FATDOG_LOG_EVERY_N/EVERY_MS
+    class LogRateLimit
+    {
+    public:
+        // 0 drops the record, otherwise 1 + the number dropped since the last one let through
+        uint64_t everyN(uint64_t n);
+        uint64_t everyMS(uint64_t ms);
+
+    private:
+        uint64_t pass();
+
+    private:
+        std::atomic<uint64_t> m_count = {0};
+        std::atomic<uint64_t> m_last = {0}; // Clock::CoarseMS() of the last one let through
+        std::atomic<uint64_t> m_suppressed = {0};
     };
 
     class Logger : public std::enable_shared_from_this<Logger>
@@ -142,7 +261,7 @@ namespace fatdog
         void log(LogLevel::Level level, LogEvent::ptr event);
 
     public:
-        std::string getName() const { return m_name; }
+        const std::string &getName() const { return m_name; }
 
         LogLevel::Level getLevel() const { return m_level; }
         void setLevel(const LogLevel::Level level) { m_level = level; }
@@ -185,6 +304,8 @@ namespace fatdog
         void setLevel(const LogLevel::Level level) { m_level = level; }
 
         virtual void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) = 0;
+        // records already formatted, AsyncLogAppender hands its batches over here
+        virtual void write(const iovec *iov, int iovcnt) = 0;
         virtual std::string toYamlString() = 0;
 
     protected:
@@ -204,26 +325,145 @@ namespace fatdog
         }
 
         virtual void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+        void write(const iovec *iov, int iovcnt) override;
         std::string toYamlString() override;
     };
 
+    /*
+     * 轮转: 超过 max_size 字节, 或到了整点/零点(本地时间), 把文件改名成
+     * file.<打开时间 %Y%m%d-%H%M%S> 再打开一个新的. max_files 个以外最旧的删掉(0 全留),
+     * compress 时改名后的文件由后台线程压成 .gz.
+     * 只在轮转和 SIGHUP(ReopenAll) 时重新打开, 外部 logrotate 改名后要发 SIGHUP
+    */
     class FileLogAppender : public LogAppender
     {
     public:
         typedef std::shared_ptr<FileLogAppender> ptr;
-        FileLogAppender(const std::string &filename, LogLevel::Level level = LogLevel::INFO);
+
+        enum Rotate
+        {
+            ROTATE_NONE,
+            ROTATE_HOURLY,
+            ROTATE_DAILY
+        };
+        // "none", "hour", "day"
+        static Rotate RotateFromString(const std::string &str);
+        static std::string ToString(Rotate rotate);
+
+        FileLogAppender(const std::string &filename, LogLevel::Level level = LogLevel::INFO, uint64_t max_size = 0,
+                        Rotate rotate = ROTATE_NONE, uint32_t max_files = 0, bool compress = false);
+        ~FileLogAppender();
         void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+        void write(const iovec *iov, int iovcnt) override;
         std::string toYamlString() override;
 
         bool reopen();
 
+        // 所有 FileLogAppender 在下次写之前重新打开. 只动一个原子变量, 可以在信号处理函数里调,
+        // 没有别人装 SIGHUP 的话, 日志模块会把它装到 SIGHUP 上
+        static void ReopenAll();
+
+    private:
+        // 该轮转或重新打开了就做, 写之前调
+        void check();
+        void rotate();
+        // 只留 max_files 个轮转出去的文件
+        void removeOld();
+        void setPeriod(time_t opened);
+
     private:
         /// 文件路径
         std::string m_filename;
-        /// 文件流
-        std::ofstream m_filestream;
-        /// 上次重新打开时间
-        uint64_t m_lastTime = 0;
+        /// O_APPEND, reopen() 用 dup2 原地替换, 写的线程不用加锁
+        int m_fd = -1;
+
+        uint64_t m_maxSize;
+        Rotate m_rotate;
+        uint32_t m_maxFiles;
+        bool m_compress;
+
+        /// 轮转和 reopen 一次一个, 写的线程不拿
+        Mutex m_rotateMutex;
+        /// 当前文件的字节数
+        std::atomic<uint64_t> m_size = {0};
+        /// 当前文件的打开时间, 轮转出去的文件名用它
+        std::atomic<time_t> m_opened = {0};
+        /// 按时间轮转的下一个时刻, 0 不按时间
+        std::atomic<time_t> m_nextRotate = {0};
+        /// 见过的 ReopenAll() 次数
+        std::atomic<uint32_t> m_reopenSeq = {0};
+    };
+
+    /*
+     * wraps another appender so that a log call never waits for the disk.
+     *
+     * the caller formats the record with this appender's formatter and copies it into a byte
+     * ring owned by its thread, so producers never contend. a writer thread hands all
+     * pending bytes to the wrapped appender's write() in one batch, every 100ms or as soon
+     * as a ring is half full. records of one thread stay in order, records of different
+     * threads interleave batch by batch.
+     *
+     * a full ring either drops the record (DROP, the count is logged later) or waits for the
+     * writer (BLOCK). FATAL records, flush() and the destructor wait until everything logged
+     * before them is written.
+    */
+    class AsyncLogAppender : public LogAppender
+    {
+        friend struct AsyncLogLocal;
+
+    public:
+        typedef std::shared_ptr<AsyncLogAppender> ptr;
+
+        enum Overflow
+        {
+            DROP,
+            BLOCK
+        };
+
+        static Overflow OverflowFromString(const std::string &str);
+        static std::string ToString(Overflow overflow);
+
+        // queue_size is the ring size of each thread in bytes
+        AsyncLogAppender(LogAppender::ptr appender, size_t queue_size = 256 * 1024, Overflow overflow = DROP);
+        ~AsyncLogAppender();
+
+        void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+        void write(const iovec *iov, int iovcnt) override;
+        std::string toYamlString() override;
+
+        void flush();
+
+        LogAppender::ptr getAppender() const { return m_appender; }
+        size_t getQueueSize() const { return m_queueSize; }
+        Overflow getOverflow() const { return m_overflow; }
+        uint64_t getDropped() const { return m_droppedTotal; }
+
+    private:
+        struct Ring;
+
+        Ring *getRing();
+        void push(const iovec *iov, int iovcnt, bool wait);
+        void wakeup();
+        void run();
+        void drain();
+
+    private:
+        LogAppender::ptr m_appender;
+        size_t m_queueSize;
+        Overflow m_overflow;
+        uint64_t m_id;
+
+        Mutex m_ringsMutex;
+        std::vector<std::shared_ptr<Ring>> m_rings;
+
+        Thread::ptr m_thread;
+        Semaphore m_sem;
+        std::atomic<bool> m_notified = {false};
+        std::atomic<bool> m_stopping = {false};
+        std::atomic<uint64_t> m_flushRequest = {0};
+        std::atomic<uint64_t> m_flushDone = {0};
+        std::atomic<uint64_t> m_dropped = {0}; // not reported yet
+        std::atomic<uint64_t> m_droppedTotal = {0};
     };
 
     class LogFormatter
@@ -250,6 +490,8 @@ namespace fatdog
         LogFormatter(const std::string &pattern = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n");
 
         std::string format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+        // append to out, nothing is allocated once out is large enough
+        void format(LogBuffer &out, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const LogEvent::ptr &event);
         void init();
 
         bool isError() const { return m_error; }
@@ -263,7 +505,7 @@ namespace fatdog
 
             virtual ~FormatItem() {}
 
-            virtual void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) = 0;
+            virtual void format(LogBuffer &out, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const LogEvent::ptr &event) = 0;
         };
 
     private:
@@ -3,6 +3,8 @@
 #include "macro.h"
 #include "thread.h"
 #include "hook.h"
+#include "config.h"
+#include "clock.h"
 
 namespace fatdog
 {
@@ -10,11 +12,29 @@ namespace fatdog
 
     static thread_local Scheduler *t_scheduler = nullptr;
     static thread_local Fiber *t_main_fiber = nullptr; // current scheduler's main fiber
+    static thread_local int t_queue_index = -1;         // index of current thread's WorkQueue in t_scheduler
+    static thread_local uint32_t t_pop_tick = 0;
+
+    static ConfigVar<uint32_t>::ptr g_scheduler_inject_queue_size =
+        Config::lookUp("scheduler.inject_queue_size", (uint32_t)(8 * 1024), "scheduler inject queue size");
+
+    // tasks taken from the inject queue at a time
+    static const size_t s_drain_batch = 32;
+    // look at the inject queue first every so many pops, or a busy local queue starves it
+    static const uint32_t s_inject_check_interval = 61;
 
     Scheduler::Scheduler(const std::string &name, uint32_t threads, bool use_caller)
-        : m_name(name)
+        : m_name(name), m_injectQueue(g_scheduler_inject_queue_size->getValue())
     {
         FATDOG_ASSERT(threads > 0);
+
+        // one queue for every thread which will call run(), including the caller
+        m_queues.resize(threads);
+        for (size_t i = 0; i < m_queues.size(); ++i)
+        {
+            m_queues[i] = new WorkQueue;
+        }
+
         if (use_caller)
         {
             fatdog::Thread::SetName(m_name);
@@ -25,6 +45,11 @@ namespace fatdog
             m_rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this), 1024 * 1024, true));
             t_main_fiber = m_rootFiber.get();
             m_rootThread = fatdog::GetThreadId();
+
+            // caller always owns the first queue
+            m_queues[0]->thread = m_rootThread;
+            m_claimedQueues = 1;
+            t_queue_index = 0;
         }
         else
         {
@@ -39,6 +64,12 @@ namespace fatdog
         if (GetThis() == this)
         {
             t_scheduler = nullptr;
+            t_queue_index = -1;
+        }
+
+        for (size_t i = 0; i < m_queues.size(); ++i)
+        {
+            delete m_queues[i];
         }
         FATDOG_LOG_INFO(g_logger) << "Scheduler::~Scheduler()";
     }
@@ -148,7 +179,12 @@ namespace fatdog
         {
             // because each thread will call Scheduler::run(), they mush have their own main fiber
             t_main_fiber = Fiber::GetThis().get();
+
+            t_queue_index = m_claimedQueues++;
+            FATDOG_ASSERT(t_queue_index < (int)m_queues.size());
+            m_queues[t_queue_index]->thread = fatdog::GetThreadId();
         }
+        Clock::Update();
 
         Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
         Fiber::ptr cb_fiber;
@@ -159,29 +195,16 @@ namespace fatdog
             ft.reset();
             bool is_active = false;
             bool tickle_me = false;
-            {
-                auto it = m_fibers.begin();
-                while (it != m_fibers.end())
-                {
-                    if (it->thread != -1 && it->thread != fatdog::GetThreadId())
-                    {
-                        ++it;
-                        tickle_me = true;
-                        continue;
-                    }
-
-                    if (it->fiber && it->fiber->getState() == Fiber::EXEC)
-                    {
-                        ++it;
-                        continue;
-                    }
 
-                    ft = *it;
-                    m_fibers.erase(it);
-                    ++m_activeThreadCount;
-                    is_active = true;
-                    break;
-                }
+            // count as active before popping, so stopping() never sees a task in nobody's hands
+            ++m_activeThreadCount;
+            if (pop(ft, tickle_me))
+            {
+                is_active = true;
+            }
+            else
+            {
+                --m_activeThreadCount;
             }
 
             if (tickle_me)
@@ -189,8 +212,15 @@ namespace fatdog
                 tickle();
             }
 
+            if (is_active && Clock::UpdateOnSwitch())
+            {
+                Clock::Update();
+            }
+
             if (ft.fiber && ft.fiber->getState() != Fiber::TERM && ft.fiber->getState() != Fiber::EXCEPT)
             {
+                // cleared only after the state is settled, see pop()
+                m_queues[t_queue_index]->running = ft.fiber.get();
                 ft.fiber->swapIn();
                 --m_activeThreadCount;
 
@@ -202,6 +232,7 @@ namespace fatdog
                 {
                     ft.fiber->setState(Fiber::HOLD);
                 }
+                m_queues[t_queue_index]->running = nullptr;
                 ft.reset();
             }
             else if (ft.cb)
@@ -212,9 +243,10 @@ namespace fatdog
                 }
                 else
                 {
-                    cb_fiber.reset(new Fiber(ft.cb));
+                    cb_fiber.reset(new Fiber(ft.cb, 0, false, m_sharedStack));
                 }
                 ft.reset();
+                m_queues[t_queue_index]->running = cb_fiber.get();
                 cb_fiber->swapIn();
                 --m_activeThreadCount;
                 if (cb_fiber->getState() == Fiber::READY)
@@ -231,6 +263,7 @@ namespace fatdog
                     cb_fiber->setState(Fiber::HOLD);
                     cb_fiber.reset();
                 }
+                m_queues[t_queue_index]->running = nullptr;
             }
             else
             {
@@ -245,21 +278,343 @@ namespace fatdog
                     break;
                 }
 
+                m_queues[t_queue_index]->idle = true;
                 ++m_idleThreadCount;
                 idle_fiber->swapIn();
                 --m_idleThreadCount;
+                m_queues[t_queue_index]->idle = false;
                 if (idle_fiber->getState() != Fiber::TERM && idle_fiber->getState() != Fiber::EXCEPT)
                 {
                     idle_fiber->setState(Fiber::HOLD);
                 }
             }
         }
+        Clock::Invalidate();
         FATDOG_LOG_INFO(g_logger) << "Scheduler::run bye";
     }
 
+    bool Scheduler::hasLocalWork()
+    {
+        if (m_injectQueue.size())
+        {
+            return true;
+        }
+        if (t_queue_index == -1)
+        {
+            return false;
+        }
+        WorkQueue *q = m_queues[t_queue_index];
+        WorkQueue::MutexType::Lock lock(q->mutex);
+        return !q->tasks.empty();
+    }
+
     bool Scheduler::stopping()
     {
-        return m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+        return m_stopping && m_taskCount == 0 && m_activeThreadCount == 0;
+    }
+
+    int Scheduler::getRunningQueue(Fiber *fiber)
+    {
+        for (size_t i = 0; i < m_queues.size(); ++i)
+        {
+            if (m_queues[i]->running == fiber)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int Scheduler::getQueueIndex(int thread)
+    {
+        for (size_t i = 0; i < m_queues.size(); ++i)
+        {
+            if (m_queues[i]->thread == thread)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    bool Scheduler::push(FiberAndThread &ft)
+    {
+        if (ft.fiber && ft.thread == -1)
+        {
+            ft.thread = ft.fiber->getPinnedThread(); // shared stack fiber can't move
+        }
+
+        int idx = -1;
+        if (ft.thread != -1)
+        {
+            idx = getQueueIndex(ft.thread);
+        }
+        bool to_owner = idx != -1;
+        if (idx == -1 && t_scheduler == this && t_queue_index != -1)
+        {
+            idx = t_queue_index;
+        }
+        if (idx == -1)
+        {
+            // foreign thread, no lock on the way in
+            ++m_taskCount;
+            if (m_injectQueue.push(ft))
+            {
+                return true;
+            }
+            --m_taskCount;
+            idx = m_nextQueue++ % m_queues.size();
+        }
+
+        WorkQueue *q = m_queues[idx];
+        bool need_tickle = false;
+        {
+            WorkQueue::MutexType::Lock lock(q->mutex);
+            need_tickle = q->tasks.empty();
+            ++m_taskCount;
+            q->tasks.push_back(std::move(ft));
+        }
+        if (to_owner)
+        {
+            // a tickle could wake a thread which can't run it
+            wakeOwner(idx);
+            return false;
+        }
+        return need_tickle;
+    }
+
+    bool Scheduler::push(std::vector<FiberAndThread> &fts)
+    {
+        for (auto &ft : fts)
+        {
+            if (ft.fiber && ft.fiber->getPinnedThread() != -1)
+            {
+                // pinned fibers go to their own threads one by one
+                bool need_tickle = false;
+                for (auto &i : fts)
+                {
+                    need_tickle = push(i) || need_tickle;
+                }
+                return need_tickle;
+            }
+        }
+
+        size_t idx = 0;
+        if (t_scheduler == this && t_queue_index != -1)
+        {
+            idx = t_queue_index;
+        }
+        else
+        {
+            m_taskCount += fts.size();
+            if (m_injectQueue.push(fts.begin(), fts.end()))
+            {
+                return true;
+            }
+            m_taskCount -= fts.size();
+            idx = m_nextQueue++ % m_queues.size();
+        }
+
+        WorkQueue *q = m_queues[idx];
+        WorkQueue::MutexType::Lock lock(q->mutex);
+        bool need_tickle = q->tasks.empty();
+        m_taskCount += fts.size();
+        for (auto &ft : fts)
+        {
+            q->tasks.push_back(std::move(ft));
+        }
+        return need_tickle;
+    }
+
+    bool Scheduler::drain()
+    {
+        std::vector<FiberAndThread> got;
+        FiberAndThread ft;
+        while (got.size() < s_drain_batch && m_injectQueue.pop(ft))
+        {
+            got.push_back(std::move(ft));
+        }
+
+        if (got.empty())
+        {
+            return false;
+        }
+
+        WorkQueue *q = m_queues[t_queue_index];
+        WorkQueue::MutexType::Lock lock(q->mutex);
+        for (auto &i : got)
+        {
+            q->tasks.push_back(std::move(i));
+        }
+        return true;
+    }
+
+    bool Scheduler::pop(FiberAndThread &ft, bool &tickle_me)
+    {
+        FATDOG_ASSERT(t_queue_index != -1);
+        WorkQueue *q = m_queues[t_queue_index];
+        if (++t_pop_tick % s_inject_check_interval == 0)
+        {
+            drain();
+        }
+        int self = q->thread;
+
+        bool found = false;
+        std::vector<FiberAndThread> others; // pinned to other threads
+        std::vector<std::pair<int, FiberAndThread>> running; // still running on other threads
+        {
+            WorkQueue::MutexType::Lock lock(q->mutex);
+            // look at every task at most once, tasks pushed back below must not be seen again
+            for (size_t n = q->tasks.size(); n > 0 && !found; --n)
+            {
+                FiberAndThread t = std::move(q->tasks.front());
+                q->tasks.pop_front();
+
+                if (t.thread != -1 && t.thread != self)
+                {
+                    --m_taskCount;
+                    others.push_back(std::move(t));
+                    continue;
+                }
+
+                // still running on another thread, e.g. scheduled before it swapped out.
+                // hand it over to that thread, it looks at its queue right after the switch
+                if (t.fiber && t.fiber->getState() == Fiber::EXEC)
+                {
+                    int to = getRunningQueue(t.fiber.get());
+                    if (to == -1 || to == t_queue_index)
+                    {
+                        q->tasks.push_back(std::move(t));
+                        tickle_me = true;
+                        continue;
+                    }
+                    --m_taskCount;
+                    running.push_back(std::make_pair(to, std::move(t)));
+                    continue;
+                }
+
+                --m_taskCount;
+                ft = std::move(t);
+                found = true;
+            }
+        }
+
+        for (auto &t : others)
+        {
+            int to = getQueueIndex(t.thread);
+            if (to == -1)
+            {
+                // owner hasn't entered run() yet, keep it here
+                to = t_queue_index;
+            }
+            {
+                WorkQueue::MutexType::Lock lock(m_queues[to]->mutex);
+                ++m_taskCount;
+                m_queues[to]->tasks.push_back(std::move(t));
+            }
+            if (to == t_queue_index)
+            {
+                tickle_me = true;
+            }
+            else
+            {
+                wakeOwner(to);
+            }
+        }
+
+        for (auto &i : running)
+        {
+            WorkQueue *to = m_queues[i.first];
+            Fiber *fiber = i.second.fiber.get();
+            {
+                WorkQueue::MutexType::Lock lock(to->mutex);
+                ++m_taskCount;
+                to->tasks.push_back(std::move(i.second));
+            }
+            if (to->running != fiber)
+            {
+                // it may have gone idle without seeing the task
+                wakeOwner(i.first);
+            }
+        }
+
+        if (found)
+        {
+            return true;
+        }
+
+        if (drain())
+        {
+            return pop(ft, tickle_me);
+        }
+
+        for (size_t i = 1; i < m_queues.size(); ++i)
+        {
+            if (steal((t_queue_index + i) % m_queues.size(), tickle_me))
+            {
+                return pop(ft, tickle_me);
+            }
+        }
+        return false;
+    }
+
+    bool Scheduler::steal(size_t victim, bool &tickle_more)
+    {
+        WorkQueue *from = m_queues[victim];
+        std::vector<FiberAndThread> stolen;
+        bool left = false;
+        {
+            WorkQueue::MutexType::Lock lock(from->mutex);
+            size_t want = (from->tasks.size() + 1) / 2;
+            auto it = from->tasks.end();
+            while (it != from->tasks.begin() && stolen.size() < want)
+            {
+                --it;
+                if (it->thread != -1 || (it->fiber && it->fiber->getState() == Fiber::EXEC))
+                {
+                    continue;
+                }
+                stolen.push_back(std::move(*it));
+                it = from->tasks.erase(it);
+            }
+            // one tickle woke us for the whole batch, pass the rest on to another idle thread
+            if (!stolen.empty() && !from->tasks.empty())
+            {
+                tickle_more = true;
+            }
+            left = !from->tasks.empty();
+        }
+
+        if (left)
+        {
+            // what we can't take is pinned there or running there, only the owner can
+            wakeOwner(victim);
+        }
+
+        if (stolen.empty())
+        {
+            return false;
+        }
+
+        // taken from the tail, put them back in their original order
+        WorkQueue *to = m_queues[t_queue_index];
+        WorkQueue::MutexType::Lock lock(to->mutex);
+        for (auto it = stolen.rbegin(); it != stolen.rend(); ++it)
+        {
+            to->tasks.push_back(std::move(*it));
+        }
+        return true;
+    }
+
+    void Scheduler::wakeOwner(size_t idx)
+    {
+        WorkQueue *q = m_queues[idx];
+        // pairs with idle = true then hasLocalWork() in the owner: either it sees the
+        // task or we see it idle
+        if ((t_scheduler != this || (int)idx != t_queue_index) && q->idle)
+        {
+            tickleThread(q->thread);
+        }
     }
 
     void Scheduler::tickle()
@@ -267,6 +622,11 @@ namespace fatdog
         FATDOG_LOG_INFO(g_logger) << "tickle";
     }
 
+    void Scheduler::tickleThread(int thread)
+    {
+        tickle();
+    }
+
     void Scheduler::idle()
     {
         FATDOG_LOG_INFO(g_logger) << "idle";
@@ -5,10 +5,12 @@
 #include <string>
 #include <functional>
 #include <vector>
-#include <list>
+#include <deque>
+#include <atomic>
 
 #include "fiber.h"
 #include "thread.h"
+#include "lockfree_queue.h"
 
 /*
  * scheduler's purpose is to coordinate fibers.
@@ -32,6 +34,18 @@
  *          it should be.
  * 
  * scene3, with inject and spawn threads(i.e. use_caller = true, threads > 1)
+ *
+ * run queues:
+ *      every thread that calls run() owns one WorkQueue. schedule() from inside a
+ *      scheduler thread pushes to that thread's own queue, from a foreign thread it
+ *      picks a queue round-robin. a task pinned to a thread (thread != -1) always goes
+ *      to the queue of that thread. when a thread's own queue runs dry it steals half
+ *      of the unpinned tasks from the tail of a sibling's queue. nobody else can take a
+ *      pinned task, so pushing one to a sleeping owner wakes that owner, tickleThread().
+ *
+ *      threads which don't belong to the scheduler (main thread, plain Thread, timers fired
+ *      elsewhere) post into a bounded lock-free inject queue instead, workers drain it into
+ *      their own queue before stealing. if it is full, fall back to a run queue.
 */
 
 namespace fatdog
@@ -45,6 +59,12 @@ namespace fatdog
         virtual ~Scheduler();
 
         const std::string &getName() const { return m_name; }
+        // tasks queued, not counting the ones running
+        size_t getTaskCount() const { return m_taskCount; }
+
+        // callbacks run on shared stack fibers, see Fiber. set it before start()
+        void setSharedStack(bool v) { m_sharedStack = v; }
+        bool isSharedStack() const { return m_sharedStack; }
 
         void start();
         void stop();
@@ -56,12 +76,12 @@ namespace fatdog
         template <class FiberOrCb>
         void schedule(FiberOrCb f, int thread = -1)
         {
-            bool need_tickle = m_fibers.empty();
+            bool need_tickle = false;
 
             FiberAndThread ft(f, thread);
             if (ft.fiber || ft.cb)
             {
-                m_fibers.push_back({f, thread});
+                need_tickle = push(ft);
             }
 
             if (need_tickle)
@@ -70,14 +90,25 @@ namespace fatdog
             }
         }
 
+        // the whole range is published at once, see BoundedQueue::push(begin, end)
         template <class InputIterator>
         void schedule(InputIterator begin, InputIterator end)
         {
+            std::vector<FiberAndThread> fts;
             while (begin != end)
             {
-                schedule(*begin, -1);
+                FiberAndThread ft(*begin, -1);
+                if (ft.fiber || ft.cb)
+                {
+                    fts.push_back(std::move(ft));
+                }
                 ++begin;
             }
+
+            if (!fts.empty() && push(fts))
+            {
+                tickle();
+            }
         }
 
     private:
@@ -111,14 +142,47 @@ namespace fatdog
             int thread;
         };
 
+        // one per thread which calls run()
+        struct WorkQueue
+        {
+            typedef Spinlock MutexType;
+
+            MutexType mutex;
+            std::deque<FiberAndThread> tasks;
+            std::atomic<int> thread = {-1}; // owner's thread id, -1 until the owner enters run()
+            std::atomic<Fiber *> running = {nullptr}; // fiber the owner is executing
+            std::atomic<bool> idle = {false};         // owner is in idle(), may be blocked
+        };
+
+        bool push(FiberAndThread &ft); // return true if the target queue was empty
+        bool push(std::vector<FiberAndThread> &fts);
+        bool pop(FiberAndThread &ft, bool &tickle_me);
+        bool drain(); // move tasks from the inject queue to current thread's queue
+        bool steal(size_t victim, bool &tickle_more);
+        int getQueueIndex(int thread);
+        int getRunningQueue(Fiber *fiber); // queue of the thread executing fiber, or -1
+        // only the owner may run what was put in queue idx, wake it if it sleeps
+        void wakeOwner(size_t idx);
+
     protected:
         virtual void tickle();
+        /*
+         * wake this very thread. tickle() wakes whichever idle thread the backend picks,
+         * that one can't run tasks pinned to another thread. default is tickle()
+        */
+        virtual void tickleThread(int thread);
         void run();
         void setThis();
         virtual void idle();
         virtual bool stopping(); // indicate if can stop
 
         bool hasIdleThreads() { return m_idleThreadCount > 0; }
+        /*
+         * current thread's queue or the inject queue has tasks. tickle() may skip the
+         * wakeup while a thread is on its way to idle, so idle() checks this after the
+         * thread counts as idle and doesn't block if true.
+        */
+        bool hasLocalWork();
 
     protected:
         size_t m_threadCount = 0;
@@ -131,7 +195,12 @@ namespace fatdog
         std::string m_name;
         Fiber::ptr m_rootFiber;
         std::vector<Thread::ptr> m_threads;
-        std::list<FiberAndThread> m_fibers;
+        std::vector<WorkQueue *> m_queues;
+        BoundedQueue<FiberAndThread> m_injectQueue;
+        std::atomic<size_t> m_taskCount = {0};    // tasks in all queues
+        std::atomic<size_t> m_nextQueue = {0};    // round-robin cursor for foreign threads
+        std::atomic<size_t> m_claimedQueues = {0}; // queues already owned by a thread
+        bool m_sharedStack = false;
     };
 } // namespace fatdog
 
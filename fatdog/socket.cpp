@@ -47,6 +47,34 @@ namespace fatdog
         return sock;
     }
 
+    Socket::ptr Socket::CreateFromFd(int fd, bool listening)
+    {
+        int family = 0, type = 0, protocol = 0;
+        auto get = [fd](int option, int &value) {
+            socklen_t len = sizeof(value);
+            return getsockopt(fd, SOL_SOCKET, option, &value, &len) == 0;
+        };
+        if (!get(SO_DOMAIN, family) || !get(SO_TYPE, type) || !get(SO_PROTOCOL, protocol))
+        {
+            FATDOG_LOG_ERROR(g_logger) << "CreateFromFd(" << fd << ") not a socket errno="
+                                       << errno << " errstr=" << strerror(errno);
+            return nullptr;
+        }
+        // the hook's sockets are non blocking underneath, a received one may not be
+        int flags = fcntl_f(fd, F_GETFL, 0);
+        if (!(flags & O_NONBLOCK))
+        {
+            fcntl_f(fd, F_SETFL, flags | O_NONBLOCK);
+        }
+        FdMgr::GetInstance()->add(fd, true, true);
+
+        Socket::ptr sock(new Socket(family, type, protocol));
+        sock->m_sock = fd;
+        sock->m_isConnected = !listening;
+        sock->getLocalAddress();
+        return sock;
+    }
+
     Socket::Socket(int family, int type, int protocol)
         : m_sock(-1), m_family(family), m_type(type), m_protocol(protocol), m_isConnected(false)
     {
@@ -122,37 +150,81 @@ namespace fatdog
 
     Socket::ptr Socket::accept()
     {
-        Socket::ptr sock(new Socket(m_family, m_type, m_protocol));
-        int newsock = ::accept(m_sock, nullptr, nullptr);
+        sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int newsock = ::accept4(m_sock, (sockaddr *)&peer, &peer_len, SOCK_CLOEXEC);
         if (newsock == -1)
         {
             FATDOG_LOG_ERROR(g_logger) << "accept(" << m_sock << ") errno="
                                        << errno << " errstr=" << strerror(errno);
             return nullptr;
         }
-        if (sock->init(newsock))
+        return accepted(newsock, (sockaddr *)&peer, peer_len);
+    }
+
+    size_t Socket::accept(std::vector<Socket::ptr> &socks, size_t max)
+    {
+        Socket::ptr first = accept();
+        if (!first)
         {
-            return sock;
+            return 0;
         }
-        return nullptr;
+        socks.push_back(first);
+
+        // the rest straight from the kernel, that needs the listening socket non blocking
+        // underneath (made by the hook), a blocking one would wait for the next client
+        FdCtx::ptr ctx = FdMgr::GetInstance()->get(m_sock);
+        if (!ctx || !ctx->getSysNonblock())
+        {
+            return 1;
+        }
+        size_t n = 1;
+        while (n < max)
+        {
+            sockaddr_storage peer;
+            socklen_t peer_len = sizeof(peer);
+            int newsock = accept4_f(m_sock, (sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (newsock == -1)
+            {
+                if (errno != EAGAIN && errno != EINTR)
+                {
+                    FATDOG_LOG_DEBUG(g_logger) << "accept(" << m_sock << ") errno="
+                                               << errno << " errstr=" << strerror(errno);
+                }
+                break;
+            }
+            FdMgr::GetInstance()->add(newsock, true, true);
+            Socket::ptr sock = accepted(newsock, (sockaddr *)&peer, peer_len);
+            if (sock)
+            {
+                socks.push_back(sock);
+                ++n;
+            }
+        }
+        return n;
     }
 
-    bool Socket::init(int sock)
+    Socket::ptr Socket::accepted(int sock, const sockaddr *peer, socklen_t peer_len)
     {
         FdCtx::ptr ctx = FdMgr::GetInstance()->get(sock);
-        if (ctx && ctx->isSocket() && !ctx->isClose())
+        if (!ctx || !ctx->isSocket() || ctx->isClose())
         {
-            m_sock = sock;
-            m_isConnected = true;
-            initSock();
-            getLocalAddress();
-            getRemoteAddress();
-            return true;
+            ::close(sock);
+            return nullptr;
         }
-        return false;
+        // no initSock(): SO_REUSEADDR means nothing on an accepted socket and TCP_NODELAY
+        // comes from the listening one. the local address is looked up when asked for
+        Socket::ptr rt(new Socket(m_family, m_type, m_protocol));
+        rt->m_sock = sock;
+        rt->m_isConnected = true;
+        if (peer->sa_family == AF_INET && peer_len >= sizeof(sockaddr_in))
+        {
+            rt->m_remoteAddress = Address::Create(peer, peer_len);
+        }
+        return rt;
     }
 
-    bool Socket::bind(const Address::ptr addr)
+    bool Socket::bind(const Address::ptr addr, bool reuse_port)
     {
         if (!isValid())
         {
@@ -162,6 +234,10 @@ namespace fatdog
                 return false;
             }
         }
+        if (reuse_port && !setOption(SOL_SOCKET, SO_REUSEPORT, 1))
+        {
+            return false;
+        }
 
         if (addr->getFamily() != m_family)
         {
@@ -258,11 +334,86 @@ namespace fatdog
         return false;
     }
 
+    bool Socket::shutdown(int how)
+    {
+        return m_sock != -1 && ::shutdown(m_sock, how) == 0;
+    }
+
+    bool Socket::sendFds(const std::vector<int> &fds)
+    {
+        if (fds.empty() || fds.size() > MAX_FDS)
+        {
+            return false;
+        }
+        // the count goes along as data, a message with only control data isn't sent
+        uint32_t count = fds.size();
+        iovec iov;
+        iov.iov_base = &count;
+        iov.iov_len = sizeof(count);
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+        if (::sendmsg(m_sock, &msg, MSG_NOSIGNAL) != sizeof(count))
+        {
+            FATDOG_LOG_ERROR(g_logger) << "sendFds sock=" << m_sock << " errno=" << errno
+                                       << " errstr=" << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    bool Socket::recvFds(std::vector<int> &fds)
+    {
+        uint32_t count = 0;
+        iovec iov;
+        iov.iov_base = &count;
+        iov.iov_len = sizeof(count);
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * MAX_FDS));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+        ssize_t n = ::recvmsg(m_sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n != sizeof(count))
+        {
+            FATDOG_LOG_ERROR(g_logger) << "recvFds sock=" << m_sock << " rt=" << n << " errno=" << errno
+                                       << " errstr=" << strerror(errno);
+            return false;
+        }
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                size_t got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int *data = (const int *)CMSG_DATA(cmsg);
+                fds.insert(fds.end(), data, data + got);
+            }
+        }
+        if ((msg.msg_flags & MSG_CTRUNC) || fds.size() != count)
+        {
+            FATDOG_LOG_ERROR(g_logger) << "recvFds sock=" << m_sock << " got " << fds.size()
+                                       << " of " << count << " fds";
+            return false;
+        }
+        return true;
+    }
+
     int Socket::send(const void *buffer, size_t length, int flags)
     {
         if (isConnected())
         {
-            return ::send(m_sock, buffer, length, flags);
+            return ::send(m_sock, buffer, length, flags | MSG_NOSIGNAL);
         }
         return -1;
     }
@@ -275,7 +426,7 @@ namespace fatdog
             memset(&msg, 0, sizeof(msg));
             msg.msg_iov = (iovec *)buffers;
             msg.msg_iovlen = length;
-            return ::sendmsg(m_sock, &msg, flags);
+            return ::sendmsg(m_sock, &msg, flags | MSG_NOSIGNAL);
         }
         return -1;
     }
@@ -284,7 +435,7 @@ namespace fatdog
     {
         if (isConnected())
         {
-            return ::sendto(m_sock, buffer, length, flags, to->getAddr(), to->getAddrLen());
+            return ::sendto(m_sock, buffer, length, flags | MSG_NOSIGNAL, to->getAddr(), to->getAddrLen());
         }
         return -1;
     }
@@ -299,7 +450,7 @@ namespace fatdog
             msg.msg_iovlen = length;
             msg.msg_name = to->getAddr();
             msg.msg_namelen = to->getAddrLen();
-            return ::sendmsg(m_sock, &msg, flags);
+            return ::sendmsg(m_sock, &msg, flags | MSG_NOSIGNAL);
         }
         return -1;
     }
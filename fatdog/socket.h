@@ -1,7 +1,9 @@
 #ifndef __FATDOG_SOCKET_H__
 #define __FATDOG_SOCKET_H__
 
+#include <atomic>
 #include <memory>
+#include <vector>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -38,6 +40,8 @@ namespace fatdog
 
         static Socket::ptr CreateUnixTCPSocket();
         static Socket::ptr CreateUnixUDPSocket();
+        // wraps an open socket, e.g. one received with recvFds(). nullptr if fd is none
+        static Socket::ptr CreateFromFd(int fd, bool listening = true);
 
         Socket(int family, int type, int protocol = 0);
         ~Socket();
@@ -64,12 +68,19 @@ namespace fatdog
         }
 
         Socket::ptr accept();
+        // waits for one connection like accept(), then takes whatever else is in the
+        // backlog without waiting, max in all. returns how many were added to socks
+        size_t accept(std::vector<Socket::ptr> &socks, size_t max);
 
-        bool bind(const Address::ptr addr);
+        // reuse_port: SO_REUSEPORT, several sockets may listen on the same address
+        bool bind(const Address::ptr addr, bool reuse_port = false);
         bool connect(const Address::ptr addr, uint64_t timeout_ms = -1);
         bool listen(int backlog = SOMAXCONN);
         bool close();
+        // safe from any thread, wakes whoever waits on the socket
+        bool shutdown(int how = SHUT_RDWR);
 
+        // MSG_NOSIGNAL is always added, a peer that went away is -1 with EPIPE, not SIGPIPE
         int send(const void *buffer, size_t length, int flags = 0);
         int send(const iovec *buffers, size_t length, int flags = 0);
         int sendTo(const void *buffer, size_t length, const Address::ptr to, int flags = 0);
@@ -80,6 +91,14 @@ namespace fatdog
         int recvFrom(void *buffer, size_t length, Address::ptr from, int flags = 0);
         int recvFrom(iovec *buffers, size_t length, Address::ptr from, int flags = 0);
 
+        // pass open fds to the peer of a unix socket (SCM_RIGHTS), the peer gets its own
+        // copies. at most MAX_FDS at a time
+        static const size_t MAX_FDS = 253;
+        bool sendFds(const std::vector<int> &fds);
+        // appends the fds of one sendFds() to fds. false on eof or error, fds may still
+        // hold some then, the caller closes them
+        bool recvFds(std::vector<int> &fds);
+
         Address::ptr getRemoteAddress();
         Address::ptr getLocalAddress();
 
@@ -88,6 +107,9 @@ namespace fatdog
         int getProtocol() const { return m_protocol; }
 
         bool isConnected() const { return m_isConnected; }
+        // a server connection waiting for its next request, see TcpServer::setIdle()
+        bool isIdle() const { return m_idle; }
+        void setIdle(bool v) { m_idle = v; }
         bool isValid() const;
         int getError();
 
@@ -102,7 +124,8 @@ namespace fatdog
     private:
         void initSock();
         void newSock();
-        bool init(int sock);
+        // a socket accept4() returned, peer is the address it filled in
+        Socket::ptr accepted(int sock, const sockaddr *peer, socklen_t peer_len);
 
     private:
         int m_sock;
@@ -110,6 +133,7 @@ namespace fatdog
         int m_type;
         int m_protocol;
         bool m_isConnected;
+        std::atomic<bool> m_idle = {false};
 
         Address::ptr m_localAddress;
         Address::ptr m_remoteAddress;
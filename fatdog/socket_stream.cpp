@@ -1,4 +1,6 @@
 #include "socket_stream.h"
+#include <limits.h>
+#include <algorithm>
 
 namespace fatdog
 {
@@ -71,6 +73,38 @@ namespace fatdog
         return rt;
     }
 
+    int SocketStream::writevFixSize(iovec *iovs, size_t count, int flags)
+    {
+        if (!isConnected())
+        {
+            return -1;
+        }
+        size_t total = 0;
+        size_t pos = 0;
+        while (pos < count)
+        {
+            int rt = m_socket->send(iovs + pos, std::min(count - pos, (size_t)IOV_MAX), flags);
+            if (rt <= 0)
+            {
+                return -1;
+            }
+            total += rt;
+            // skip what was sent, a partial one continues where it stopped
+            size_t sent = rt;
+            while (pos < count && sent >= iovs[pos].iov_len)
+            {
+                sent -= iovs[pos].iov_len;
+                ++pos;
+            }
+            if (sent > 0)
+            {
+                iovs[pos].iov_base = (char *)iovs[pos].iov_base + sent;
+                iovs[pos].iov_len -= sent;
+            }
+        }
+        return total;
+    }
+
     void SocketStream::close()
     {
         if (m_socket)
@@ -19,6 +19,8 @@ namespace fatdog
         virtual int write(const void *buffer, size_t length) override;
         virtual int write(ByteArray::ptr ba, size_t length) override;
         virtual void close() override;
+        // all of iovs, iovs is changed on the way. length written or -1
+        int writevFixSize(iovec *iovs, size_t count, int flags = 0);
 
         Socket::ptr getSocket() const { return m_socket; }
         bool isConnected() const;
@@ -0,0 +1,239 @@
+#include "stack_allocator.h"
+
+#include "config.h"
+#include "log.h"
+#include "macro.h"
+
+#include <atomic>
+#include <vector>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace fatdog
+{
+    static Logger::ptr g_logger = FATDOG_LOG_NAME("system");
+
+    static ConfigVar<std::string>::ptr g_fiber_stack_allocator =
+        Config::lookUp("fiber.stack_allocator", std::string("pool"), "fiber stack allocator, malloc|mmap|pool");
+
+    static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
+        Config::lookUp("fiber.stack_size", (uint32_t)(1024 * 1024), "fiber stack size");
+
+    static ConfigVar<uint64_t>::ptr g_fiber_stack_pool_max =
+        Config::lookUp("fiber.stack_pool_max", (uint64_t)(64 * 1024 * 1024), "max bytes of stacks cached per thread");
+
+    static MallocStackAllocator s_malloc_allocator;
+    static MmapStackAllocator s_mmap_allocator;
+    static PooledStackAllocator s_pooled_allocator;
+
+    static std::atomic<StackAllocator *> s_default_allocator{&s_pooled_allocator};
+    static std::atomic<size_t> s_default_stack_size{1024 * 1024};
+    static std::atomic<size_t> s_pool_max{64 * 1024 * 1024};
+
+    struct StackAllocatorIniter
+    {
+        StackAllocatorIniter()
+        {
+            g_fiber_stack_allocator->addListener([](const std::string &old_value, const std::string &new_value) {
+                StackAllocator *a = StackAllocator::Get(new_value);
+                if (!a)
+                {
+                    FATDOG_LOG_ERROR(g_logger) << "unknown fiber.stack_allocator " << new_value
+                                               << ", keep " << s_default_allocator.load()->getName();
+                    return;
+                }
+                s_default_allocator = a;
+            });
+            g_fiber_stack_size->addListener([](const uint32_t &old_value, const uint32_t &new_value) {
+                s_default_stack_size = new_value;
+            });
+            g_fiber_stack_pool_max->addListener([](const uint64_t &old_value, const uint64_t &new_value) {
+                s_pool_max = new_value;
+            });
+        }
+    };
+
+    static StackAllocatorIniter __stack_allocator_init;
+
+    StackAllocator *StackAllocator::Get(const std::string &name)
+    {
+        if (name == "malloc")
+        {
+            return &s_malloc_allocator;
+        }
+        else if (name == "mmap")
+        {
+            return &s_mmap_allocator;
+        }
+        else if (name == "pool")
+        {
+            return &s_pooled_allocator;
+        }
+        return nullptr;
+    }
+
+    StackAllocator *StackAllocator::GetDefault()
+    {
+        return s_default_allocator;
+    }
+
+    size_t StackAllocator::GetDefaultStackSize()
+    {
+        return s_default_stack_size;
+    }
+
+    void *MallocStackAllocator::alloc(size_t size)
+    {
+        return malloc(size);
+    }
+
+    void MallocStackAllocator::dealloc(void *p, size_t size)
+    {
+        free(p);
+    }
+
+    size_t MmapStackAllocator::GetPageSize()
+    {
+        static size_t s_page_size = sysconf(_SC_PAGESIZE);
+        return s_page_size;
+    }
+
+    // [guard page][stack ...], the stack grows down into the guard page
+    void *MmapStackAllocator::alloc(size_t size)
+    {
+        size_t page = GetPageSize();
+        size_t len = (size + page - 1) / page * page + page;
+        void *base = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            FATDOG_LOG_ERROR(g_logger) << "mmap stack size=" << size
+                                       << " errno=" << errno << " errstr=" << strerror(errno);
+            return nullptr;
+        }
+        if (mprotect(base, page, PROT_NONE))
+        {
+            FATDOG_LOG_ERROR(g_logger) << "mprotect stack guard errno=" << errno
+                                       << " errstr=" << strerror(errno);
+        }
+        return (char *)base + page;
+    }
+
+    void MmapStackAllocator::dealloc(void *p, size_t size)
+    {
+        size_t page = GetPageSize();
+        size_t len = (size + page - 1) / page * page + page;
+        if (munmap((char *)p - page, len))
+        {
+            FATDOG_LOG_ERROR(g_logger) << "munmap stack size=" << size
+                                       << " errno=" << errno << " errstr=" << strerror(errno);
+        }
+    }
+
+    // size classes 16K, 32K, ... 8M
+    static const size_t s_min_class_shift = 14;
+    static const size_t s_class_count = 10;
+
+    static int ClassIndex(size_t size)
+    {
+        for (size_t i = 0; i < s_class_count; ++i)
+        {
+            if (size <= ((size_t)1 << (s_min_class_shift + i)))
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    struct StackPool
+    {
+        std::vector<void *> free[s_class_count];
+        size_t cached = 0;
+
+        ~StackPool();
+
+        // release cached stacks, biggest first, until no more than target bytes remain
+        void trim(size_t target)
+        {
+            for (int i = s_class_count - 1; i >= 0 && cached > target; --i)
+            {
+                size_t size = (size_t)1 << (s_min_class_shift + i);
+                while (!free[i].empty() && cached > target)
+                {
+                    s_mmap_allocator.dealloc(free[i].back(), size);
+                    free[i].pop_back();
+                    cached -= size;
+                }
+            }
+        }
+    };
+
+    // stacks can still be released after the pool of a thread is gone (thread_local
+    // destruction order), they are unmapped directly then
+    static thread_local bool t_pool_dead = false;
+    static thread_local StackPool t_pool;
+
+    StackPool::~StackPool()
+    {
+        trim(0);
+        t_pool_dead = true;
+    }
+
+    size_t PooledStackAllocator::ClassSize(size_t size)
+    {
+        int idx = ClassIndex(size);
+        if (idx == -1)
+        {
+            size_t page = GetPageSize();
+            return (size + page - 1) / page * page;
+        }
+        return (size_t)1 << (s_min_class_shift + idx);
+    }
+
+    size_t PooledStackAllocator::GetCachedBytes()
+    {
+        return t_pool_dead ? 0 : t_pool.cached;
+    }
+
+    void *PooledStackAllocator::alloc(size_t size)
+    {
+        int idx = ClassIndex(size);
+        if (idx != -1 && !t_pool_dead && !t_pool.free[idx].empty())
+        {
+            void *p = t_pool.free[idx].back();
+            t_pool.free[idx].pop_back();
+            t_pool.cached -= ClassSize(size);
+            return p;
+        }
+        return MmapStackAllocator::alloc(ClassSize(size));
+    }
+
+    void PooledStackAllocator::dealloc(void *p, size_t size)
+    {
+        int idx = ClassIndex(size);
+        size_t class_size = ClassSize(size);
+        if (idx == -1 || t_pool_dead)
+        {
+            MmapStackAllocator::dealloc(p, class_size);
+            return;
+        }
+
+        size_t max = s_pool_max;
+        if (t_pool.cached + class_size > max)
+        {
+            // trim to low water, so a thread hovering at the limit doesn't map and unmap every time
+            t_pool.trim(max / 2);
+            if (t_pool.cached + class_size > max)
+            {
+                MmapStackAllocator::dealloc(p, class_size);
+                return;
+            }
+        }
+        t_pool.free[idx].push_back(p);
+        t_pool.cached += class_size;
+    }
+} // namespace fatdog
@@ -0,0 +1,69 @@
+#ifndef __FATDOG_STACK_ALLOCATOR_H__
+#define __FATDOG_STACK_ALLOCATOR_H__
+
+#include <stddef.h>
+#include <string>
+
+namespace fatdog
+{
+    /*
+     * where fiber stacks come from, picked by config "fiber.stack_allocator":
+     *      malloc  plain malloc/free
+     *      mmap    every stack mapped on its own, with a PROT_NONE guard page below it,
+     *              overflow faults at once instead of scribbling over the heap
+     *      pool    mmap stacks cached per thread by size class and reused by later fibers.
+     *              once a thread caches more than "fiber.stack_pool_max" bytes it trims
+     *              down to half of that
+     *
+     * a stack may be released on another thread than the one it came from, the stack
+     * then simply goes to that thread's pool.
+    */
+    class StackAllocator
+    {
+    public:
+        virtual ~StackAllocator() {}
+
+        // size is the usable size, return the lowest address of the stack
+        virtual void *alloc(size_t size) = 0;
+        // size must be the one passed to alloc()
+        virtual void dealloc(void *p, size_t size) = 0;
+        virtual const char *getName() const = 0;
+
+    public:
+        static StackAllocator *Get(const std::string &name); // nullptr for unknown name
+        static StackAllocator *GetDefault();                 // "fiber.stack_allocator"
+        static size_t GetDefaultStackSize();                 // "fiber.stack_size"
+    };
+
+    class MallocStackAllocator : public StackAllocator
+    {
+    public:
+        void *alloc(size_t size) override;
+        void dealloc(void *p, size_t size) override;
+        const char *getName() const override { return "malloc"; }
+    };
+
+    class MmapStackAllocator : public StackAllocator
+    {
+    public:
+        void *alloc(size_t size) override;
+        void dealloc(void *p, size_t size) override;
+        const char *getName() const override { return "mmap"; }
+
+        static size_t GetPageSize();
+    };
+
+    class PooledStackAllocator : public MmapStackAllocator
+    {
+    public:
+        void *alloc(size_t size) override;
+        void dealloc(void *p, size_t size) override;
+        const char *getName() const override { return "pool"; }
+
+        // stacks of size are served from class ClassSize(size), bigger ones bypass the pool
+        static size_t ClassSize(size_t size);
+        static size_t GetCachedBytes(); // cached by current thread
+    };
+} // namespace fatdog
+
+#endif
@@ -9,7 +9,7 @@ namespace fatdog
         size_t left = length;
         while (left > 0)
         {
-            size_t len = read((char *)buffer + offset, left);
+            int len = read((char *)buffer + offset, left);
             if (len <= 0)
             {
                 return len;
@@ -25,7 +25,7 @@ namespace fatdog
         size_t left = length;
         while (left > 0)
         {
-            size_t len = read(ba, left);
+            int len = read(ba, left);
             if (len <= 0)
             {
                 return len;
@@ -41,7 +41,7 @@ namespace fatdog
         size_t left = length;
         while (left > 0)
         {
-            size_t len = write((const char *)buffer + offset, left);
+            int len = write((const char *)buffer + offset, left);
             if (len <= 0)
             {
                 return len;
@@ -57,7 +57,7 @@ namespace fatdog
         size_t left = length;
         while (left > 0)
         {
-            size_t len = write(ba, left);
+            int len = write(ba, left);
             if (len <= 0)
             {
                 return len;
@@ -1,16 +1,76 @@
 #include "tcp_server.h"
+#include "clock.h"
 #include "config.h"
 #include "log.h"
 
+#include <signal.h>
+#include <unistd.h>
+
 namespace fatdog
 {
 
     static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
 
+    static ConfigVar<uint32_t>::ptr g_tcp_server_accept_batch =
+        Config::lookUp("tcp_server.accept_batch", (uint32_t)64, "max connections taken from the backlog per wakeup");
+
+    static ConfigVar<uint32_t>::ptr g_tcp_server_max_connections =
+        Config::lookUp("tcp_server.max_connections", (uint32_t)0, "connections served at once, 0 no limit");
+
+    static ConfigVar<uint32_t>::ptr g_tcp_server_max_run_queue =
+        Config::lookUp("tcp_server.max_run_queue", (uint32_t)0, "tasks queued on a worker before new connections are refused, 0 no limit");
+
+    static ConfigVar<uint32_t>::ptr g_tcp_server_resume_percent =
+        Config::lookUp("tcp_server.resume_percent", (uint32_t)90, "overload ends below this percent of the limits");
+
+    static ConfigVar<bool>::ptr g_tcp_server_pause_on_overload =
+        Config::lookUp("tcp_server.pause_on_overload", false, "stop accepting while overloaded instead of refusing");
+
+    // how often a paused accept loop looks at the load again
+    static const uint64_t s_pause_check_ms = 10;
+
+    // a connection shut down under a writer (drain() past its deadline, a client gone)
+    // must fail the write, not kill the process. sendfile() and friends take no
+    // MSG_NOSIGNAL, so SIGPIPE is ignored, unless the program has its own handler
+    static bool IgnoreSigpipe()
+    {
+        struct sigaction sa;
+        if (!sigaction(SIGPIPE, nullptr, &sa) && sa.sa_handler == SIG_DFL)
+        {
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = SIG_IGN;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGPIPE, &sa, nullptr);
+        }
+        return true;
+    }
+
     TcpServer::TcpServer(fatdog::IOManager *woker,
                          fatdog::IOManager *accept_woker)
         : m_worker(woker), m_acceptWorker(accept_woker), m_recvTimeout(60 * 1000 * 2), m_name("fatdog/1.0.0"), m_isStop(true)
     {
+        initLimits();
+    }
+
+    TcpServer::TcpServer(const std::vector<fatdog::IOManager *> &reactors)
+        : m_worker(reactors.at(0)), m_acceptWorker(reactors.at(0)), m_reactors(reactors), m_recvTimeout(60 * 1000 * 2),
+          m_name("fatdog/1.0.0"), m_isStop(true)
+    {
+        initLimits();
+    }
+
+    void TcpServer::initLimits()
+    {
+        for (size_t i = 0; i < std::max(m_reactors.size(), (size_t)1); ++i)
+        {
+            m_clients.emplace_back(new ClientSet);
+        }
+        static bool s_sigpipe_ignored = IgnoreSigpipe();
+        (void)s_sigpipe_ignored;
+        m_maxConnections = g_tcp_server_max_connections->getValue();
+        m_maxRunQueue = g_tcp_server_max_run_queue->getValue();
+        m_resumePercent = g_tcp_server_resume_percent->getValue();
+        m_pauseOnOverload = g_tcp_server_pause_on_overload->getValue();
     }
 
     TcpServer::~TcpServer()
@@ -34,29 +94,43 @@ namespace fatdog
     {
         for (auto &addr : addrs)
         {
-            Socket::ptr sock = Socket::CreateTCP(addr);
-            if (!sock->bind(addr))
-            {
-                FATDOG_LOG_ERROR(g_logger) << "bind fail errno="
-                                           << errno << " errstr=" << strerror(errno)
-                                           << " addr=[" << addr->toString() << "]";
-                fails.push_back(addr);
-                continue;
-            }
-            if (!sock->listen())
+            // a socket per reactor, unix sockets can't share an address and stay on the first
+            bool reuse_port = isMultiReactor() && addr->getFamily() != AF_UNIX;
+            size_t copies = reuse_port ? m_reactors.size() : 1;
+            Address::ptr bind_addr = addr;
+            for (size_t i = 0; i < copies; ++i)
             {
-                FATDOG_LOG_ERROR(g_logger) << "listen fail errno="
-                                           << errno << " errstr=" << strerror(errno)
-                                           << " addr=[" << addr->toString() << "]";
-                fails.push_back(addr);
-                continue;
+                Socket::ptr sock = Socket::CreateTCP(bind_addr);
+                if (!sock->bind(bind_addr, reuse_port))
+                {
+                    FATDOG_LOG_ERROR(g_logger) << "bind fail errno="
+                                               << errno << " errstr=" << strerror(errno)
+                                               << " addr=[" << addr->toString() << "]";
+                    fails.push_back(addr);
+                    break;
+                }
+                if (!sock->listen())
+                {
+                    FATDOG_LOG_ERROR(g_logger) << "listen fail errno="
+                                               << errno << " errstr=" << strerror(errno)
+                                               << " addr=[" << addr->toString() << "]";
+                    fails.push_back(addr);
+                    break;
+                }
+                // port 0: the others take the port the first one got
+                bind_addr = sock->getLocalAddress();
+                m_socks.push_back(sock);
+                if (isMultiReactor())
+                {
+                    m_sockReactors.push_back(m_reactors[i]);
+                }
             }
-            m_socks.push_back(sock);
         }
 
         if (!fails.empty())
         {
             m_socks.clear();
+            m_sockReactors.clear();
             return false;
         }
 
@@ -69,18 +143,67 @@ namespace fatdog
 
     void TcpServer::startAccept(Socket::ptr sock)
     {
+        // a reactor keeps the connections on its own (single) thread
+        IOManager *worker = isMultiReactor() ? IOManager::GetThis() : m_worker;
+        ClientSet *set = clientsOf(worker);
+        std::vector<Socket::ptr> clients;
+        std::vector<Socket::ptr> served;
+        std::vector<std::function<void()>> cbs;
+        bool overloaded = false;
         while (!m_isStop)
         {
-            Socket::ptr client = sock->accept();
-            if (client)
+            if (m_pauseOnOverload)
+            {
+                bool was = overloaded;
+                overloaded = isOverloaded(worker, overloaded, 0);
+                if (overloaded != was)
+                {
+                    m_pauses += overloaded;
+                    FATDOG_LOG_WARN(g_logger) << *sock << (overloaded ? " overloaded, pause accepting" : " resume accepting")
+                                              << " connections=" << m_connections << " run_queue=" << worker->getTaskCount();
+                }
+                if (overloaded)
+                {
+                    usleep(s_pause_check_ms * 1000);
+                    continue;
+                }
+            }
+
+            // drain the backlog, the whole batch goes to the worker in one schedule()
+            // no more than there is room for, the rest stays in the backlog (and is refused
+            // one by one, unless paused by then)
+            size_t batch = std::min((size_t)std::max(g_tcp_server_accept_batch->getValue(), 1u), room(worker));
+            if (sock->accept(clients, batch))
             {
-                client->setRecvTimeout(m_recvTimeout);
-                m_worker->schedule(std::bind(&TcpServer::handleClient,
-                                             shared_from_this(), client));
+                for (auto &client : clients)
+                {
+                    overloaded = isOverloaded(worker, overloaded, cbs.size());
+                    if (overloaded)
+                    {
+                        ++m_rejected;
+                        rejectClient(client);
+                        continue;
+                    }
+                    ++m_connections;
+                    client->setRecvTimeout(m_recvTimeout);
+                    cbs.push_back(std::bind(&TcpServer::serveClient,
+                                            shared_from_this(), client, set));
+                    served.push_back(client);
+                }
+                {
+                    Mutex::Lock lock(set->mutex);
+                    set->clients.insert(served.begin(), served.end());
+                }
+                worker->schedule(cbs.begin(), cbs.end());
+                served.clear();
+                // nothing here may keep a connection open
+                cbs.clear();
+                clients.clear();
             }
             else
             {
-                FATDOG_LOG_ERROR(g_logger) << "accept errno=" << errno
+                // e.g. EMFILE comes back at once every round, one line a second is enough
+                FATDOG_LOG_EVERY_MS(g_logger, fatdog::LogLevel::ERROR, 1000) << "accept errno=" << errno
                                            << " errstr=" << strerror(errno);
             }
         }
@@ -93,10 +216,11 @@ namespace fatdog
             return true;
         }
         m_isStop = false;
-        for (auto &sock : m_socks)
+        m_draining = false;
+        for (size_t i = 0; i < m_socks.size(); ++i)
         {
-            m_acceptWorker->schedule(std::bind(&TcpServer::startAccept,
-                                               shared_from_this(), sock));
+            acceptorOf(i)->schedule(std::bind(&TcpServer::startAccept,
+                                              shared_from_this(), m_socks[i]));
         }
         return true;
     }
@@ -105,14 +229,18 @@ namespace fatdog
     {
         m_isStop = true;
         auto self = shared_from_this();
-        m_acceptWorker->schedule([this, self]() {
-            for (auto &sock : m_socks)
-            {
+        // each socket is closed by the IOManager whose epoll waits on it
+        std::vector<Socket::ptr> socks;
+        socks.swap(m_socks);
+        for (size_t i = 0; i < socks.size(); ++i)
+        {
+            Socket::ptr sock = socks[i];
+            acceptorOf(i)->schedule([self, sock]() {
                 sock->cancelAll();
                 sock->close();
-            }
-            m_socks.clear();
-        });
+            });
+        }
+        m_sockReactors.clear();
     }
 
     void TcpServer::handleClient(Socket::ptr client)
@@ -120,4 +248,194 @@ namespace fatdog
         FATDOG_LOG_INFO(g_logger) << "handleClient: " << *client;
     }
 
+    void TcpServer::rejectClient(Socket::ptr client)
+    {
+        client->close();
+    }
+
+    bool TcpServer::isOverloaded(IOManager *worker, bool overloaded, size_t queued) const
+    {
+        // the limits themselves to get in, resume_percent of them to get out
+        uint64_t percent = overloaded ? m_resumePercent.load() : 100;
+        uint64_t max_conn = m_maxConnections;
+        uint64_t max_queue = m_maxRunQueue;
+        if (max_conn && m_connections * 100 >= max_conn * percent)
+        {
+            return true;
+        }
+        if (max_queue && (worker->getTaskCount() + queued) * 100 >= max_queue * percent)
+        {
+            return true;
+        }
+        return false;
+    }
+
+    size_t TcpServer::room(IOManager *worker) const
+    {
+        size_t rt = ~0ull;
+        uint64_t connections = m_connections;
+        uint64_t tasks = worker->getTaskCount();
+        if (m_maxConnections)
+        {
+            rt = std::min(rt, (size_t)(m_maxConnections > connections ? m_maxConnections - connections : 0));
+        }
+        if (m_maxRunQueue)
+        {
+            rt = std::min(rt, (size_t)(m_maxRunQueue > tasks ? m_maxRunQueue - tasks : 0));
+        }
+        return std::max(rt, (size_t)1);
+    }
+
+    TcpServer::ClientSet *TcpServer::clientsOf(IOManager *worker) const
+    {
+        for (size_t i = 0; i < m_reactors.size(); ++i)
+        {
+            if (m_reactors[i] == worker)
+            {
+                return m_clients[i].get();
+            }
+        }
+        return m_clients[0].get();
+    }
+
+    void TcpServer::serveClient(Socket::ptr client, ClientSet *set)
+    {
+        handleClient(client);
+        {
+            Mutex::Lock lock(set->mutex);
+            set->clients.erase(client);
+        }
+        --m_connections;
+    }
+
+    bool TcpServer::setIdle(const Socket::ptr &client, bool idle)
+    {
+        // drain() sets m_draining before it looks at the flags, so either it sees this
+        // one idle and shuts the socket down, or we see it draining
+        client->setIdle(idle);
+        return !(idle && m_draining);
+    }
+
+    bool TcpServer::drain(uint64_t timeout_ms)
+    {
+        uint64_t deadline = Clock::NowMS() + timeout_ms;
+        stop();
+        m_draining = true;
+        // the idle ones see eof at once, the busy ones isDraining() after their request
+        for (auto &set : m_clients)
+        {
+            Mutex::Lock lock(set->mutex);
+            for (auto &i : set->clients)
+            {
+                if (i->isIdle())
+                {
+                    i->shutdown(SHUT_RD);
+                }
+            }
+        }
+        while (m_connections && Clock::NowMS() < deadline)
+        {
+            usleep(s_pause_check_ms * 1000);
+        }
+        if (!m_connections)
+        {
+            FATDOG_LOG_INFO(g_logger) << m_name << " drained";
+            return true;
+        }
+
+        size_t count = 0;
+        for (auto &set : m_clients)
+        {
+            Mutex::Lock lock(set->mutex);
+            for (auto &i : set->clients)
+            {
+                i->shutdown(SHUT_RDWR);
+            }
+            count += set->clients.size();
+        }
+        FATDOG_LOG_WARN(g_logger) << m_name << " drain timed out, shut down " << count << " connections";
+        return false;
+    }
+
+    bool TcpServer::handOffListeners(const std::string &unix_path, uint64_t timeout_ms)
+    {
+        std::vector<int> fds;
+        for (auto &sock : m_socks)
+        {
+            fds.push_back(sock->getSocket());
+        }
+        if (fds.empty() || fds.size() > Socket::MAX_FDS)
+        {
+            FATDOG_LOG_ERROR(g_logger) << "handOffListeners: can't pass " << fds.size() << " sockets";
+            return false;
+        }
+
+        ::unlink(unix_path.c_str());
+        Socket::ptr ctl = Socket::CreateUnixTCPSocket();
+        if (!ctl->bind(UnixAddress::ptr(new UnixAddress(unix_path))) || !ctl->listen(1))
+        {
+            return false;
+        }
+        ctl->setRecvTimeout(timeout_ms);
+        Socket::ptr peer = ctl->accept();
+        ctl->close();
+        ::unlink(unix_path.c_str());
+        if (!peer)
+        {
+            FATDOG_LOG_ERROR(g_logger) << "handOffListeners: nobody came to " << unix_path;
+            return false;
+        }
+
+        // the ack says the new process holds them, ours may close from then on
+        char ack = 0;
+        peer->setRecvTimeout(timeout_ms);
+        if (!peer->sendFds(fds) || peer->recv(&ack, 1) != 1)
+        {
+            FATDOG_LOG_ERROR(g_logger) << "handOffListeners: " << unix_path << " took no sockets";
+            return false;
+        }
+        FATDOG_LOG_INFO(g_logger) << "handed " << fds.size() << " listening sockets over " << unix_path;
+        return true;
+    }
+
+    bool TcpServer::takeOverListeners(const std::string &unix_path)
+    {
+        Socket::ptr ctl = Socket::CreateUnixTCPSocket();
+        if (!ctl->connect(UnixAddress::ptr(new UnixAddress(unix_path))))
+        {
+            return false;
+        }
+        std::vector<int> fds;
+        bool ok = ctl->recvFds(fds);
+        std::vector<Socket::ptr> socks;
+        for (int fd : fds)
+        {
+            Socket::ptr sock = ok ? Socket::CreateFromFd(fd) : nullptr;
+            if (!sock)
+            {
+                ok = false;
+                ::close(fd);
+                continue;
+            }
+            socks.push_back(sock);
+        }
+        if (!ok)
+        {
+            return false;
+        }
+
+        char ack = 1;
+        ctl->send(&ack, 1);
+        for (size_t i = 0; i < socks.size(); ++i)
+        {
+            m_socks.push_back(socks[i]);
+            if (isMultiReactor())
+            {
+                m_sockReactors.push_back(m_reactors[i % m_reactors.size()]);
+            }
+            FATDOG_LOG_INFO(g_logger) << "took over listening " << *socks[i];
+        }
+        return true;
+    }
+
 } // namespace fatdog
@@ -1,8 +1,11 @@
 #ifndef __FATDOG_TCP_SERVER_H__
 #define __FATDOG_TCP_SERVER_H__
 
+#include <atomic>
 #include <memory>
 #include <functional>
+#include <unordered_set>
+#include <vector>
 #include "address.h"
 #include "iomanager.h"
 #include "socket.h"
@@ -15,13 +18,40 @@ namespace fatdog
     {
     public:
         typedef std::shared_ptr<TcpServer> ptr;
+        // accept_woker accepts, woker serves the connections
         TcpServer(fatdog::IOManager *woker = fatdog::IOManager::GetThis(), fatdog::IOManager *accept_woker = fatdog::IOManager::GetThis());
+        /*
+         * multi reactor: every IOManager in reactors (one thread each is the point) listens on
+         * its own SO_REUSEPORT socket per bound address, the kernel spreads new connections
+         * over them. a connection is served by the reactor which accepted it, on its thread
+         * and its epoll, for its whole life, nothing crosses threads. reactors must outlive
+         * the server
+        */
+        TcpServer(const std::vector<fatdog::IOManager *> &reactors);
         virtual ~TcpServer();
 
         virtual bool bind(fatdog::Address::ptr addr);
         virtual bool bind(const std::vector<Address::ptr> &addrs, std::vector<Address::ptr> &fails);
         virtual bool start();
+        // closes the listening sockets, connections carry on
         virtual void stop();
+        /*
+         * graceful shutdown: stop(), close the connections idle between requests (see
+         * setIdle()) and let the others finish, isDraining() tells them to stop after the
+         * current request. whatever is left at the deadline is shut down. true if all
+         * finished in time. blocks the calling fiber, or thread outside a scheduler
+        */
+        virtual bool drain(uint64_t timeout_ms);
+        bool isDraining() const { return m_draining; }
+
+        /*
+         * zero downtime restart. the old process calls handOffListeners(), which waits on
+         * the unix socket path for the new one and passes it the listening sockets. the new
+         * process calls takeOverListeners() instead of bind(), then start(). both sides now
+         * accept on the same sockets, the old one goes on with drain(). run them in a fiber
+        */
+        bool handOffListeners(const std::string &unix_path, uint64_t timeout_ms = 10 * 1000);
+        bool takeOverListeners(const std::string &unix_path);
 
         uint64_t getRecvTimeout() const { return m_recvTimeout; }
         std::string getName() const { return m_name; }
@@ -29,18 +59,81 @@ namespace fatdog
         void setName(const std::string &v) { m_name = v; }
 
         bool isStop() const { return m_isStop; }
+        // the listening sockets, e.g. for the port bound to port 0
+        std::vector<Socket::ptr> getSocks() const { return m_socks; }
+        bool isMultiReactor() const { return !m_reactors.empty(); }
+
+        /*
+         * admission control, 0 is no limit. the server is overloaded once it serves
+         * max_connections, or the IOManager a new connection would go to has max_run_queue
+         * tasks queued. it stays so until both are below resume_percent of their limit.
+         * meanwhile new connections are handed to rejectClient() without a fiber, or with
+         * pause_on_overload not accepted at all, they wait in the kernel backlog.
+         * defaults come from tcp_server.* in the config
+        */
+        uint32_t getMaxConnections() const { return m_maxConnections; }
+        uint32_t getMaxRunQueue() const { return m_maxRunQueue; }
+        uint32_t getResumePercent() const { return m_resumePercent; }
+        bool isPauseOnOverload() const { return m_pauseOnOverload; }
+        void setMaxConnections(uint32_t v) { m_maxConnections = v; }
+        void setMaxRunQueue(uint32_t v) { m_maxRunQueue = v; }
+        void setResumePercent(uint32_t v) { m_resumePercent = v; }
+        void setPauseOnOverload(bool v) { m_pauseOnOverload = v; }
+
+        // being served now, rejected so far, times accepting was paused
+        uint64_t getConnections() const { return m_connections; }
+        uint64_t getRejected() const { return m_rejected; }
+        uint64_t getPauses() const { return m_pauses; }
 
     protected:
         virtual void handleClient(Socket::ptr client);
         virtual void startAccept(Socket::ptr sock);
+        // runs on the accepting fiber, must not wait. closes client
+        virtual void rejectClient(Socket::ptr client);
+        // client waits for its next request (true) or works on one. drain() closes idle
+        // connections, false means it is draining and the caller should give up client.
+        // no lock, it only flips the socket's flag
+        bool setIdle(const Socket::ptr &client, bool idle);
+
+    private:
+        // connections being served, one set per reactor (just one with an acceptor and
+        // workers), reactors don't contend to add or drop theirs
+        struct ClientSet
+        {
+            Mutex mutex;
+            std::unordered_set<Socket::ptr> clients;
+        };
+
+        // the IOManager accepting on m_socks[sock]
+        IOManager *acceptorOf(size_t sock) const { return m_reactors.empty() ? m_acceptWorker : m_sockReactors[sock]; }
+        void initLimits();
+        // overloaded is the state so far, queued the tasks about to be added to worker
+        bool isOverloaded(IOManager *worker, bool overloaded, size_t queued) const;
+        // connections that can be taken before the limits, at least 1
+        size_t room(IOManager *worker) const;
+        ClientSet *clientsOf(IOManager *worker) const;
+        void serveClient(Socket::ptr client, ClientSet *set);
 
     private:
         std::vector<Socket::ptr> m_socks;
         IOManager *m_worker;
         IOManager *m_acceptWorker;
+        std::vector<IOManager *> m_reactors;
+        std::vector<IOManager *> m_sockReactors; // by m_socks index, multi reactor only
         uint64_t m_recvTimeout;
         std::string m_name;
         bool m_isStop;
+
+        std::atomic<uint32_t> m_maxConnections = {0};
+        std::atomic<uint32_t> m_maxRunQueue = {0};
+        std::atomic<uint32_t> m_resumePercent = {90};
+        std::atomic<bool> m_pauseOnOverload = {false};
+        std::atomic<uint64_t> m_connections = {0};
+        std::atomic<uint64_t> m_rejected = {0};
+        std::atomic<uint64_t> m_pauses = {0};
+
+        std::vector<std::unique_ptr<ClientSet>> m_clients; // by m_reactors index
+        std::atomic<bool> m_draining = {false};
     };
 
 } // namespace fatdog
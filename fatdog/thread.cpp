@@ -1,4 +1,8 @@
 #include "thread.h"
+
+#include <errno.h>
+#include <time.h>
+
 #include "util.h"
 #include "log.h"
 
@@ -31,6 +35,32 @@ namespace fatdog
         }
     }
 
+    bool Semaphore::waitFor(uint64_t ms)
+    {
+        // a monotonic deadline, a wall clock jump neither stretches nor cuts the wait
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ++ts.tv_sec;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (sem_clockwait(&m_sem, CLOCK_MONOTONIC, &ts))
+        {
+            if (errno == ETIMEDOUT)
+            {
+                return false;
+            }
+            if (errno != EINTR)
+            {
+                throw std::logic_error("sem_clockwait error");
+            }
+        }
+        return true;
+    }
+
     int Semaphore::notify()
     {
         if (sem_post(&m_sem))
@@ -24,6 +24,8 @@ namespace fatdog
 
         int wait();   // sub 1
         int notify(); // add 1
+        // wait() for at most ms, false on timeout
+        bool waitFor(uint64_t ms);
 
     private:
         sem_t m_sem;
@@ -1,8 +1,286 @@
 #include "timer.h"
 #include "util.h"
+#include "clock.h"
+
+#include <algorithm>
 
 namespace fatdog
 {
+    /*
+     * slots of level 0 are 1ms wide, of level n (1..4) 2^(8+6(n-1))ms. a timer lives on
+     * the lowest level whose span covers its distance from current, when current
+     * crosses a slot boundary of level n that slot is cascaded down. a bitmap per level
+     * finds non empty slots without walking them.
+    */
+    struct TimerManager::Wheel
+    {
+        static const int ROOT_BITS = 8;
+        static const int ROOT_SIZE = 1 << ROOT_BITS;
+        static const uint64_t ROOT_MASK = ROOT_SIZE - 1;
+        static const int LEVEL_BITS = 6;
+        static const int LEVEL_SIZE = 1 << LEVEL_BITS;
+        static const uint64_t LEVEL_MASK = LEVEL_SIZE - 1;
+        static const int LEVELS = 4; // above the root
+        static const uint64_t MAX_SPAN = (1ull << (ROOT_BITS + LEVELS * LEVEL_BITS)) - 1;
+
+        Timer *root[ROOT_SIZE] = {};
+        uint64_t rootBits[ROOT_SIZE / 64] = {};
+        Timer *levels[LEVELS][LEVEL_SIZE] = {};
+        uint64_t levelBits[LEVELS] = {};
+        uint64_t current; // next tick to expire
+        size_t count = 0;
+
+        Wheel(uint64_t now)
+            : current(now)
+        {
+        }
+
+        ~Wheel()
+        {
+            for (int i = 0; i < ROOT_SIZE; ++i)
+            {
+                release(root[i]);
+            }
+            for (int l = 0; l < LEVELS; ++l)
+            {
+                for (int i = 0; i < LEVEL_SIZE; ++i)
+                {
+                    release(levels[l][i]);
+                }
+            }
+        }
+
+        // ms covered by one slot of level (1..LEVELS)
+        static int Shift(int level) { return ROOT_BITS + (level - 1) * LEVEL_BITS; }
+
+        Timer *&slot(int level, int index)
+        {
+            return level == 0 ? root[index] : levels[level - 1][index];
+        }
+
+        void setBit(int level, int index)
+        {
+            if (level == 0)
+            {
+                rootBits[index / 64] |= 1ull << (index % 64);
+            }
+            else
+            {
+                levelBits[level - 1] |= 1ull << index;
+            }
+        }
+
+        void clearBit(int level, int index)
+        {
+            if (level == 0)
+            {
+                rootBits[index / 64] &= ~(1ull << (index % 64));
+            }
+            else
+            {
+                levelBits[level - 1] &= ~(1ull << index);
+            }
+        }
+
+        void link(Timer *t)
+        {
+            int level = 0;
+            int index = 0;
+            uint64_t expires = t->m_next;
+            if (expires <= current)
+            {
+                index = current & ROOT_MASK; // already due, next tick
+            }
+            else if (expires - current <= ROOT_MASK)
+            {
+                index = expires & ROOT_MASK;
+            }
+            else
+            {
+                if (expires - current > MAX_SPAN)
+                {
+                    expires = current + MAX_SPAN; // parked on the top level, placed again when cascaded
+                }
+                level = 1;
+                while (level < LEVELS && expires - current >= (1ull << Shift(level + 1)))
+                {
+                    ++level;
+                }
+                index = (expires >> Shift(level)) & LEVEL_MASK;
+            }
+
+            Timer *&head = slot(level, index);
+            t->m_wheelPrev = nullptr;
+            t->m_wheelNext = head;
+            if (head)
+            {
+                head->m_wheelPrev = t;
+            }
+            head = t;
+            setBit(level, index);
+            t->m_wheelLevel = level;
+            t->m_wheelIndex = index;
+            ++count;
+        }
+
+        void unlink(Timer *t)
+        {
+            Timer *&head = slot(t->m_wheelLevel, t->m_wheelIndex);
+            if (t->m_wheelPrev)
+            {
+                t->m_wheelPrev->m_wheelNext = t->m_wheelNext;
+            }
+            else
+            {
+                head = t->m_wheelNext;
+            }
+            if (t->m_wheelNext)
+            {
+                t->m_wheelNext->m_wheelPrev = t->m_wheelPrev;
+            }
+            if (!head)
+            {
+                clearBit(t->m_wheelLevel, t->m_wheelIndex);
+            }
+            t->m_wheelPrev = t->m_wheelNext = nullptr;
+            t->m_wheelLevel = -1;
+            --count;
+        }
+
+        // detach a whole slot, return its list
+        Timer *take(int level, int index)
+        {
+            Timer *list = slot(level, index);
+            slot(level, index) = nullptr;
+            clearBit(level, index);
+            for (Timer *t = list; t; t = t->m_wheelNext)
+            {
+                t->m_wheelLevel = -1;
+                --count;
+            }
+            return list;
+        }
+
+        static void release(Timer *list)
+        {
+            while (list)
+            {
+                Timer *next = list->m_wheelNext;
+                list->m_wheelPrev = list->m_wheelNext = nullptr;
+                list->m_wheelLevel = -1;
+                list->m_wheelSelf.reset(); // may free list
+                list = next;
+            }
+        }
+
+        // move the slot of level that current just entered down, return its index
+        int cascade(int level)
+        {
+            int index = (current >> Shift(level)) & LEVEL_MASK;
+            Timer *list = take(level, index);
+            while (list)
+            {
+                Timer *next = list->m_wheelNext;
+                link(list);
+                list = next;
+            }
+            return index;
+        }
+
+        // every timer due at or before now
+        void expire(uint64_t now, std::vector<Timer::ptr> &expired)
+        {
+            while (current <= now)
+            {
+                if (!count)
+                {
+                    current = now + 1;
+                    break;
+                }
+
+                int index = current & ROOT_MASK;
+                if (index == 0)
+                {
+                    for (int level = 1; level <= LEVELS && cascade(level) == 0; ++level)
+                        ;
+                }
+
+                Timer *list = take(0, index);
+                while (list)
+                {
+                    Timer *next = list->m_wheelNext;
+                    list->m_wheelPrev = list->m_wheelNext = nullptr;
+                    expired.push_back(std::move(list->m_wheelSelf));
+                    list = next;
+                }
+
+                // jump over empty ticks, but stop at the next boundary to cascade
+                uint64_t boundary = (current | ROOT_MASK) + 1;
+                int next_index = findRoot(index + 1);
+                uint64_t target = next_index == -1 ? boundary : current + (next_index - index);
+                current = std::min(target, now + 1);
+            }
+        }
+
+        // first non empty root slot in [from, ROOT_SIZE), -1 if none
+        int findRoot(int from) const
+        {
+            for (int w = from / 64; w < ROOT_SIZE / 64; ++w)
+            {
+                uint64_t bits = rootBits[w];
+                if (w == from / 64)
+                {
+                    bits &= ~0ull << (from % 64);
+                }
+                if (bits)
+                {
+                    return w * 64 + __builtin_ctzll(bits);
+                }
+            }
+            return -1;
+        }
+
+        // earliest tick something may expire at, never later than the real one. ~0ull if empty
+        uint64_t nextExpire() const
+        {
+            if (!count)
+            {
+                return ~0ull;
+            }
+
+            int cur = current & ROOT_MASK;
+            int index = findRoot(cur);
+            if (index != -1)
+            {
+                return current + (index - cur); // nothing on upper levels can be earlier
+            }
+
+            uint64_t next = ~0ull;
+            index = findRoot(0);
+            if (index != -1)
+            {
+                next = current + (ROOT_SIZE - cur) + index; // wrapped, after the boundary
+            }
+
+            for (int level = 1; level <= LEVELS; ++level)
+            {
+                uint64_t bits = levelBits[level - 1];
+                if (!bits)
+                {
+                    continue;
+                }
+                // the slot current is in was cascaded already, look from the one after it
+                int shift = Shift(level);
+                int from = (((current >> shift) & LEVEL_MASK) + 1) & LEVEL_MASK;
+                uint64_t rotated = from ? (bits >> from) | (bits << (LEVEL_SIZE - from)) : bits;
+                uint64_t distance = __builtin_ctzll(rotated) + 1;
+                uint64_t at = ((current >> shift) + distance) << shift;
+                next = std::min(next, at);
+            }
+            return next;
+        }
+    };
+
     bool TimerManager::Timer::Comparator::operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const
     {
         if (!lhs && !rhs)
@@ -32,7 +310,7 @@ namespace fatdog
                                bool recurring, TimerManager *manager)
         : m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager)
     {
-        m_next = fatdog::GetCurrentMS() + m_ms;
+        m_next = fatdog::Clock::CoarseMS() + m_ms;
     }
 
     TimerManager::Timer::Timer(uint64_t next)
@@ -42,11 +320,11 @@ namespace fatdog
 
     bool TimerManager::Timer::cancel()
     {
+        TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
         if (m_cb)
         {
             m_cb = nullptr;
-            auto it = m_manager->m_timers.find(shared_from_this());
-            m_manager->m_timers.erase(it);
+            m_manager->removeTimer(this);
             return true;
         }
         return false;
@@ -54,18 +332,17 @@ namespace fatdog
 
     bool TimerManager::Timer::refresh()
     {
+        TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
         if (!m_cb)
         {
             return false;
         }
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if (it == m_manager->m_timers.end())
+        if (!m_manager->removeTimer(this))
         {
             return false;
         }
-        m_manager->m_timers.erase(it);
-        m_next = fatdog::GetCurrentMS() + m_ms;
-        m_manager->m_timers.insert(shared_from_this());
+        m_next = fatdog::Clock::CoarseMS() + m_ms;
+        m_manager->insertTimer(shared_from_this());
         return true;
     }
 
@@ -76,20 +353,19 @@ namespace fatdog
             return true;
         }
 
+        TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
         if (!m_cb)
         {
             return false;
         }
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if (it == m_manager->m_timers.end())
+        if (!m_manager->removeTimer(this))
         {
             return false;
         }
-        m_manager->m_timers.erase(it);
         uint64_t start = 0;
         if (from_now)
         {
-            start = fatdog::GetCurrentMS();
+            start = fatdog::Clock::CoarseMS();
         }
         else
         {
@@ -97,22 +373,32 @@ namespace fatdog
         }
         m_ms = ms;
         m_next = start + m_ms;
-        m_manager->addTimer(shared_from_this());
+        m_manager->addTimer(shared_from_this(), lock);
         return true;
     }
 
-    TimerManager::TimerManager()
+    TimerManager::TimerManager(Type type)
+        : m_type(type)
     {
+        if (m_type == WHEEL)
+        {
+            m_wheel = new Wheel(fatdog::Clock::CoarseMS());
+        }
     }
 
     TimerManager::~TimerManager()
     {
+        if (m_wheel)
+        {
+            delete m_wheel;
+        }
     }
 
     TimerManager::Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring)
     {
         Timer::ptr timer(new Timer(ms, cb, recurring, this));
-        addTimer(timer);
+        RWMutexType::WriteLock lock(m_mutex);
+        addTimer(timer, lock);
         return timer;
     }
 
@@ -132,49 +418,73 @@ namespace fatdog
 
     uint64_t TimerManager::getNextTimer()
     {
+        RWMutexType::ReadLock lock(m_mutex);
         m_tickled = false;
-        if (m_timers.empty())
+        uint64_t next = 0;
+        if (m_wheel)
         {
-            return ~0ull;
+            next = m_wheel->nextExpire();
+        }
+        else if (!m_timers.empty())
+        {
+            next = (*m_timers.begin())->getNext();
         }
+        else
+        {
+            next = ~0ull;
+        }
+        lock.unlock();
 
-        const TimerManager::Timer::ptr &next = *m_timers.begin();
-        uint64_t now_ms = fatdog::GetCurrentMS();
-        if (now_ms >= next->getNext())
+        if (next == ~0ull)
+        {
+            return ~0ull;
+        }
+        uint64_t now_ms = fatdog::Clock::CoarseMS();
+        if (now_ms >= next)
         {
             return 0;
         }
         else
         {
-            return next->getNext() - now_ms;
+            return next - now_ms;
         }
     }
 
     void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs)
     {
-        uint64_t now_ms = fatdog::GetCurrentMS();
+        uint64_t now_ms = fatdog::Clock::CoarseMS();
         std::vector<Timer::ptr> expired;
         {
-            if (m_timers.empty())
+            RWMutexType::ReadLock lock(m_mutex);
+            // an empty wheel still moves current up to now, or the next expire() walks stale ticks
+            if (m_wheel ? m_wheel->count == 0 && m_wheel->current > now_ms : m_timers.empty())
             {
                 return;
             }
         }
 
-        if (m_timers.empty())
+        RWMutexType::WriteLock lock(m_mutex);
+        if (m_wheel)
         {
-            return;
+            m_wheel->expire(now_ms, expired);
         }
-
-        Timer::ptr now_timer(new Timer(now_ms));
-        auto it = m_timers.lower_bound(now_timer); // https://en.cppreference.com/w/cpp/container/set/lower_bound
-        while (it != m_timers.end() && (*it)->getNext() == now_ms)
+        else
         {
-            ++it;
+            if (m_timers.empty())
+            {
+                return;
+            }
+
+            Timer::ptr now_timer(new Timer(now_ms));
+            auto it = m_timers.lower_bound(now_timer); // https://en.cppreference.com/w/cpp/container/set/lower_bound
+            while (it != m_timers.end() && (*it)->getNext() == now_ms)
+            {
+                ++it;
+            }
+            expired.insert(expired.begin(), m_timers.begin(), it);
+            m_timers.erase(m_timers.begin(), it);
         }
-        expired.insert(expired.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
-        cbs.reserve(expired.size());
+        cbs.reserve(cbs.size() + expired.size());
 
         for (auto &timer : expired)
         {
@@ -182,7 +492,7 @@ namespace fatdog
             if (timer->getRecurring())
             {
                 timer->getNext() = now_ms + timer->getMs();
-                m_timers.insert(timer);
+                insertTimer(timer);
             }
             else
             {
@@ -191,14 +501,14 @@ namespace fatdog
         }
     }
 
-    void TimerManager::addTimer(TimerManager::Timer::ptr val)
+    void TimerManager::addTimer(TimerManager::Timer::ptr val, RWMutexType::WriteLock &lock)
     {
-        auto it = m_timers.insert(val).first;
-        bool at_front = (it == m_timers.begin()) && !m_tickled;
+        bool at_front = insertTimer(val) && !m_tickled;
         if (at_front)
         {
             m_tickled = true;
         }
+        lock.unlock();
 
         if (at_front)
         {
@@ -206,8 +516,43 @@ namespace fatdog
         }
     }
 
+    bool TimerManager::insertTimer(const Timer::ptr &val)
+    {
+        if (m_wheel)
+        {
+            bool at_front = val->m_next < m_wheel->nextExpire();
+            val->m_wheelSelf = val;
+            m_wheel->link(val.get());
+            return at_front;
+        }
+        auto it = m_timers.insert(val).first;
+        return it == m_timers.begin();
+    }
+
+    bool TimerManager::removeTimer(Timer *val)
+    {
+        if (m_wheel)
+        {
+            if (val->m_wheelLevel == -1)
+            {
+                return false;
+            }
+            m_wheel->unlink(val);
+            val->m_wheelSelf.reset(); // the caller still holds val
+            return true;
+        }
+        auto it = m_timers.find(val->shared_from_this());
+        if (it == m_timers.end())
+        {
+            return false;
+        }
+        m_timers.erase(it);
+        return true;
+    }
+
     bool TimerManager::hasTimer()
     {
-        return !m_timers.empty();
+        RWMutexType::ReadLock lock(m_mutex);
+        return m_wheel ? m_wheel->count != 0 : !m_timers.empty();
     }
-} // namespace fatdog
\ No newline at end of file
+} // namespace fatdog
@@ -1,18 +1,40 @@
 #ifndef __FATDOG_TIMER_H__
 #define __FATDOG_TIMER_H__
 
+#include <atomic>
 #include <memory>
 #include <set>
 #include <vector>
 #include <functional>
 
+#include "thread.h"
+
 namespace fatdog
 {
+    /*
+     * two ways to keep timers, picked per manager when constructed:
+     *      SET     std::set ordered by expire time, O(log n) add and cancel
+     *      WHEEL   hierarchical timing wheel with 1ms ticks (256 slots, then 4 levels
+     *              of 64, ~49 days), O(1) add, cancel and refresh. expiry moves whole
+     *              slots at once, timers further away are cascaded down as time passes.
+     *              getNextTimer() may report a bit early for far away timers, the
+     *              wakeup then just cascades them.
+    */
     class TimerManager
     {
     public:
+        typedef RWMutex RWMutexType;
+
+        enum Type
+        {
+            SET,
+            WHEEL
+        };
+
         class Timer : public std::enable_shared_from_this<Timer>
         {
+            friend class TimerManager;
+
         public:
             typedef std::shared_ptr<Timer> ptr;
             Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager *manager);
@@ -39,10 +61,17 @@ namespace fatdog
             uint64_t m_next = 0; // 精确时间
             std::function<void()> m_cb;
             TimerManager *m_manager = nullptr;
+
+            // 时间轮的槽是侵入式双向链表，删除 O(1)
+            Timer *m_wheelPrev = nullptr;
+            Timer *m_wheelNext = nullptr;
+            int m_wheelLevel = -1; // -1 不在轮上
+            int m_wheelIndex = 0;
+            Timer::ptr m_wheelSelf; // 在轮上时持有自己
         };
 
     public:
-        TimerManager();
+        TimerManager(Type type = SET);
         virtual ~TimerManager();
 
         Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
@@ -50,16 +79,27 @@ namespace fatdog
         uint64_t getNextTimer();
         void listExpiredCb(std::vector<std::function<void()>> &cbs);
         bool hasTimer();
+        Type getTimerType() const { return m_type; }
 
     protected:
         virtual void onTimerInsertedAtFront() = 0;
-        void addTimer(Timer::ptr val);
+        void addTimer(Timer::ptr val, RWMutexType::WriteLock &lock);
+
+    private:
+        struct Wheel;
+
+        // with m_mutex held. insertTimer() returns true if val expires first now
+        bool insertTimer(const Timer::ptr &val);
+        bool removeTimer(Timer *val);
 
     private:
+        RWMutexType m_mutex;
+        Type m_type;
         std::set<Timer::ptr, Timer::Comparator> m_timers;
+        Wheel *m_wheel = nullptr;
         /// 是否触发onTimerInsertedAtFront
-        bool m_tickled = false;
+        std::atomic<bool> m_tickled = {false};
     };
 } // namespace fatdog
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,344 @@
+#include "uring.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef FATDOG_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+namespace fatdog
+{
+    static Logger::ptr g_logger = FATDOG_LOG_NAME("system");
+
+#if defined(FATDOG_HAVE_IO_URING) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+    static int io_uring_setup(uint32_t entries, io_uring_params *p)
+    {
+        return syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+                              const void *arg, size_t argsz)
+    {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+    }
+
+    IoUring::IoUring()
+    {
+    }
+
+    IoUring::~IoUring()
+    {
+        if (m_sqes)
+        {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if (m_cqPtr && m_cqPtr != m_sqPtr)
+        {
+            munmap(m_cqPtr, m_cqSize);
+        }
+        if (m_sqPtr)
+        {
+            munmap(m_sqPtr, m_sqSize);
+        }
+        if (m_fd != -1)
+        {
+            close(m_fd);
+        }
+    }
+
+    bool IoUring::init(uint32_t entries)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        m_fd = io_uring_setup(entries, &p);
+        if (m_fd < 0)
+        {
+            FATDOG_LOG_WARN(g_logger) << "io_uring_setup(" << entries << ") errno=" << errno
+                                      << " errstr=" << strerror(errno);
+            m_fd = -1;
+            return false;
+        }
+        if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+        {
+            FATDOG_LOG_WARN(g_logger) << "io_uring features=" << p.features << " lack EXT_ARG or NODROP";
+            return false;
+        }
+
+        m_sqSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        m_cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_sqSize = m_cqSize = std::max(m_sqSize, m_cqSize);
+        }
+
+        m_sqPtr = mmap(nullptr, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sqPtr == MAP_FAILED)
+        {
+            m_sqPtr = nullptr;
+            return false;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_cqPtr = m_sqPtr;
+        }
+        else
+        {
+            m_cqPtr = mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (m_cqPtr == MAP_FAILED)
+            {
+                m_cqPtr = nullptr;
+                return false;
+            }
+        }
+
+        m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+        {
+            return false;
+        }
+        m_sqes = (io_uring_sqe *)sqes;
+
+        char *sq = (char *)m_sqPtr;
+        m_sqHead = (uint32_t *)(sq + p.sq_off.head);
+        m_sqTail = (uint32_t *)(sq + p.sq_off.tail);
+        m_sqMask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+        m_sqEntries = p.sq_entries;
+        m_sqLocalTail = *m_sqTail;
+        // sqes are used in ring order, so the index array is the identity
+        uint32_t *array = (uint32_t *)(sq + p.sq_off.array);
+        for (uint32_t i = 0; i < m_sqEntries; ++i)
+        {
+            array[i] = i;
+        }
+
+        char *cq = (char *)m_cqPtr;
+        m_cqHead = (uint32_t *)(cq + p.cq_off.head);
+        m_cqTail = (uint32_t *)(cq + p.cq_off.tail);
+        m_cqMask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+        m_cqes = cq + p.cq_off.cqes;
+        return true;
+    }
+
+    io_uring_sqe *IoUring::getSqe()
+    {
+        uint32_t head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if (m_sqLocalTail - head >= m_sqEntries)
+        {
+            return nullptr;
+        }
+        io_uring_sqe *sqe = &m_sqes[m_sqLocalTail & m_sqMask];
+        ++m_sqLocalTail;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    void IoUring::publish()
+    {
+        __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+    }
+
+    uint32_t IoUring::pending() const
+    {
+        return __atomic_load_n(m_sqTail, __ATOMIC_ACQUIRE) - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    }
+
+    int IoUring::submit()
+    {
+        uint32_t n = pending();
+        if (!n)
+        {
+            return 0;
+        }
+        int rt = 0;
+        do
+        {
+            rt = io_uring_enter(m_fd, n, 0, 0, nullptr, 0);
+        } while (rt < 0 && errno == EINTR);
+        if (rt < 0)
+        {
+            FATDOG_LOG_ERROR(g_logger) << "io_uring_enter submit=" << n << " errno=" << errno
+                                       << " errstr=" << strerror(errno);
+        }
+        return rt;
+    }
+
+    int IoUring::wait(uint64_t timeout_ms, const sigset_t *sigmask)
+    {
+        __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = timeout_ms % 1000 * 1000 * 1000;
+
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask = (uint64_t)sigmask;
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)&ts;
+
+        int rt = io_uring_enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        return rt < 0 ? -1 : 0;
+    }
+
+    uint32_t IoUring::reap(Completion *cqes, uint32_t max)
+    {
+        io_uring_cqe *ring = (io_uring_cqe *)m_cqes;
+        uint32_t head = *m_cqHead;
+        uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        uint32_t n = 0;
+        while (head != tail && n < max)
+        {
+            io_uring_cqe &cqe = ring[head & m_cqMask];
+            cqes[n].user_data = cqe.user_data;
+            cqes[n].res = cqe.res;
+            ++n;
+            ++head;
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    static_assert(sizeof(IoUring::Timespec) == sizeof(__kernel_timespec), "Timespec layout");
+
+    static void prep_rw(io_uring_sqe *sqe, int op, int fd, const void *addr, uint32_t len, uint64_t off)
+    {
+        sqe->opcode = op;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)addr;
+        sqe->len = len;
+        sqe->off = off;
+    }
+
+    void IoUring::PrepPollAdd(io_uring_sqe *sqe, int fd, bool write)
+    {
+        prep_rw(sqe, IORING_OP_POLL_ADD, fd, nullptr, 0, 0);
+        sqe->poll32_events = write ? POLLOUT : POLLIN;
+    }
+
+    void IoUring::PrepCancel(io_uring_sqe *sqe, uint64_t user_data)
+    {
+        prep_rw(sqe, IORING_OP_ASYNC_CANCEL, -1, (void *)user_data, 0, 0);
+    }
+
+    void IoUring::PrepLinkTimeout(io_uring_sqe *sqe, const Timespec *ts)
+    {
+        prep_rw(sqe, IORING_OP_LINK_TIMEOUT, -1, ts, 1, 0);
+    }
+
+    // offset -1 means the file position, sockets ignore it
+    void IoUring::PrepRead(io_uring_sqe *sqe, int fd, void *buf, size_t count)
+    {
+        prep_rw(sqe, IORING_OP_READ, fd, buf, count, (uint64_t)-1);
+    }
+
+    void IoUring::PrepWrite(io_uring_sqe *sqe, int fd, const void *buf, size_t count)
+    {
+        prep_rw(sqe, IORING_OP_WRITE, fd, buf, count, (uint64_t)-1);
+    }
+
+    void IoUring::PrepReadv(io_uring_sqe *sqe, int fd, const iovec *iov, int iovcnt)
+    {
+        prep_rw(sqe, IORING_OP_READV, fd, iov, iovcnt, (uint64_t)-1);
+    }
+
+    void IoUring::PrepWritev(io_uring_sqe *sqe, int fd, const iovec *iov, int iovcnt)
+    {
+        prep_rw(sqe, IORING_OP_WRITEV, fd, iov, iovcnt, (uint64_t)-1);
+    }
+
+    void IoUring::PrepRecv(io_uring_sqe *sqe, int fd, void *buf, size_t len, int flags)
+    {
+        prep_rw(sqe, IORING_OP_RECV, fd, buf, len, 0);
+        sqe->msg_flags = flags;
+    }
+
+    void IoUring::PrepSend(io_uring_sqe *sqe, int fd, const void *buf, size_t len, int flags)
+    {
+        prep_rw(sqe, IORING_OP_SEND, fd, buf, len, 0);
+        sqe->msg_flags = flags;
+    }
+
+    void IoUring::PrepRecvmsg(io_uring_sqe *sqe, int fd, msghdr *msg, int flags)
+    {
+        prep_rw(sqe, IORING_OP_RECVMSG, fd, msg, 1, 0);
+        sqe->msg_flags = flags;
+    }
+
+    void IoUring::PrepSendmsg(io_uring_sqe *sqe, int fd, const msghdr *msg, int flags)
+    {
+        prep_rw(sqe, IORING_OP_SENDMSG, fd, msg, 1, 0);
+        sqe->msg_flags = flags;
+    }
+
+    void IoUring::PrepAccept(io_uring_sqe *sqe, int fd, sockaddr *addr, socklen_t *addrlen, int flags)
+    {
+        prep_rw(sqe, IORING_OP_ACCEPT, fd, addr, 0, (uint64_t)addrlen);
+        sqe->accept_flags = flags;
+    }
+
+    void IoUring::PrepConnect(io_uring_sqe *sqe, int fd, const sockaddr *addr, socklen_t addrlen)
+    {
+        prep_rw(sqe, IORING_OP_CONNECT, fd, addr, 0, addrlen);
+    }
+
+    void IoUring::SetUserData(io_uring_sqe *sqe, uint64_t user_data)
+    {
+        sqe->user_data = user_data;
+    }
+
+    void IoUring::SetLink(io_uring_sqe *sqe)
+    {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+
+#else
+
+    IoUring::IoUring() {}
+    IoUring::~IoUring() {}
+
+    bool IoUring::init(uint32_t entries)
+    {
+        FATDOG_LOG_WARN(g_logger) << "built without io_uring";
+        return false;
+    }
+
+    io_uring_sqe *IoUring::getSqe() { return nullptr; }
+    void IoUring::publish() {}
+    uint32_t IoUring::pending() const { return 0; }
+    int IoUring::submit() { return 0; }
+
+    int IoUring::wait(uint64_t timeout_ms, const sigset_t *sigmask)
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    uint32_t IoUring::reap(Completion *cqes, uint32_t max) { return 0; }
+
+    void IoUring::PrepPollAdd(io_uring_sqe *sqe, int fd, bool write) {}
+    void IoUring::PrepCancel(io_uring_sqe *sqe, uint64_t user_data) {}
+    void IoUring::PrepLinkTimeout(io_uring_sqe *sqe, const Timespec *ts) {}
+    void IoUring::PrepRead(io_uring_sqe *sqe, int fd, void *buf, size_t count) {}
+    void IoUring::PrepWrite(io_uring_sqe *sqe, int fd, const void *buf, size_t count) {}
+    void IoUring::PrepReadv(io_uring_sqe *sqe, int fd, const iovec *iov, int iovcnt) {}
+    void IoUring::PrepWritev(io_uring_sqe *sqe, int fd, const iovec *iov, int iovcnt) {}
+    void IoUring::PrepRecv(io_uring_sqe *sqe, int fd, void *buf, size_t len, int flags) {}
+    void IoUring::PrepSend(io_uring_sqe *sqe, int fd, const void *buf, size_t len, int flags) {}
+    void IoUring::PrepRecvmsg(io_uring_sqe *sqe, int fd, msghdr *msg, int flags) {}
+    void IoUring::PrepSendmsg(io_uring_sqe *sqe, int fd, const msghdr *msg, int flags) {}
+    void IoUring::PrepAccept(io_uring_sqe *sqe, int fd, sockaddr *addr, socklen_t *addrlen, int flags) {}
+    void IoUring::PrepConnect(io_uring_sqe *sqe, int fd, const sockaddr *addr, socklen_t addrlen) {}
+    void IoUring::SetUserData(io_uring_sqe *sqe, uint64_t user_data) {}
+    void IoUring::SetLink(io_uring_sqe *sqe) {}
+
+#endif
+} // namespace fatdog
@@ -0,0 +1,110 @@
+#ifndef __FATDOG_URING_H__
+#define __FATDOG_URING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "noncopyable.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FATDOG_HAVE_IO_URING 1
+#endif
+#endif
+
+struct io_uring_sqe;
+
+namespace fatdog
+{
+    /*
+     * thin io_uring wrapper on raw syscalls (no liburing): map the rings, hand out sqes,
+     * submit, wait and reap. it does no locking, IOManager serializes the sq side and
+     * the cq side on its own.
+     *
+     * init() fails, and the caller should fall back to epoll, when the kernel lacks
+     * io_uring or IORING_FEAT_EXT_ARG (5.11) which wait() needs for its timeout.
+    */
+    class IoUring : Noncopyable
+    {
+    public:
+        struct Completion
+        {
+            uint64_t user_data;
+            int32_t res;
+        };
+
+        // same layout as __kernel_timespec
+        struct Timespec
+        {
+            int64_t tv_sec;
+            long long tv_nsec;
+        };
+
+        IoUring();
+        ~IoUring();
+
+        bool init(uint32_t entries);
+
+        // a zeroed sqe, nullptr when the sq is full. it is not seen by the kernel before publish()
+        io_uring_sqe *getSqe();
+        void publish();
+
+        // sqes published but not submitted yet, only a hint with concurrent submitters
+        uint32_t pending() const;
+        // submit published sqes, return how many the kernel took or -1
+        int submit();
+        // wait for at least one completion or timeout_ms, return 0, -1 with errno (ETIME, EINTR).
+        // sigmask, if given, is the signal mask while waiting, like epoll_pwait
+        int wait(uint64_t timeout_ms, const sigset_t *sigmask = nullptr);
+        // copy out up to max completions and consume them
+        uint32_t reap(Completion *cqes, uint32_t max);
+
+        uint32_t getEntries() const { return m_sqEntries; }
+
+    public:
+        // fill a sqe from getSqe(), so callers don't need <linux/io_uring.h>
+        static void PrepPollAdd(io_uring_sqe *sqe, int fd, bool write);
+        static void PrepCancel(io_uring_sqe *sqe, uint64_t user_data);
+        // ts must live until the sqe is submitted
+        static void PrepLinkTimeout(io_uring_sqe *sqe, const Timespec *ts);
+        static void PrepRead(io_uring_sqe *sqe, int fd, void *buf, size_t count);
+        static void PrepWrite(io_uring_sqe *sqe, int fd, const void *buf, size_t count);
+        static void PrepReadv(io_uring_sqe *sqe, int fd, const iovec *iov, int iovcnt);
+        static void PrepWritev(io_uring_sqe *sqe, int fd, const iovec *iov, int iovcnt);
+        static void PrepRecv(io_uring_sqe *sqe, int fd, void *buf, size_t len, int flags);
+        static void PrepSend(io_uring_sqe *sqe, int fd, const void *buf, size_t len, int flags);
+        static void PrepRecvmsg(io_uring_sqe *sqe, int fd, msghdr *msg, int flags);
+        static void PrepSendmsg(io_uring_sqe *sqe, int fd, const msghdr *msg, int flags);
+        static void PrepAccept(io_uring_sqe *sqe, int fd, sockaddr *addr, socklen_t *addrlen, int flags);
+        static void PrepConnect(io_uring_sqe *sqe, int fd, const sockaddr *addr, socklen_t addrlen);
+
+        static void SetUserData(io_uring_sqe *sqe, uint64_t user_data);
+        static void SetLink(io_uring_sqe *sqe); // the next sqe is linked to this one
+
+    private:
+        int m_fd = -1;
+
+        void *m_sqPtr = nullptr;
+        size_t m_sqSize = 0;
+        void *m_cqPtr = nullptr;
+        size_t m_cqSize = 0;
+        io_uring_sqe *m_sqes = nullptr;
+        size_t m_sqesSize = 0;
+
+        uint32_t *m_sqHead = nullptr;
+        uint32_t *m_sqTail = nullptr;
+        uint32_t m_sqMask = 0;
+        uint32_t m_sqEntries = 0;
+        uint32_t m_sqLocalTail = 0; // sqes handed out, published by publish()
+
+        uint32_t *m_cqHead = nullptr;
+        uint32_t *m_cqTail = nullptr;
+        uint32_t m_cqMask = 0;
+        void *m_cqes = nullptr;
+    };
+} // namespace fatdog
+
+#endif
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "fiber.h"
@@ -11,9 +12,23 @@ namespace fatdog
 {
     fatdog::Logger::ptr g_logger = FATDOG_LOG_NAME("system");
 
+    // gettid is a syscall, every log record asks for it. a forked child has a new tid
+    static thread_local pid_t t_tid = 0;
+
+    static void ResetThreadId()
+    {
+        t_tid = 0;
+    }
+
     pid_t GetThreadId()
     {
-        return syscall(SYS_gettid);
+        if (!t_tid)
+        {
+            static int s_atfork = pthread_atfork(nullptr, nullptr, ResetThreadId);
+            (void)s_atfork;
+            t_tid = syscall(SYS_gettid);
+        }
+        return t_tid;
     }
 
     uint32_t GetFiberId()
@@ -0,0 +1,163 @@
+#include "../fatdog/channel.h"
+#include "../fatdog/iomanager.h"
+#include "../fatdog/log.h"
+#include "../fatdog/macro.h"
+#include "../fatdog/clock.h"
+#include "../fatdog/util.h"
+
+#include <atomic>
+#include <iostream>
+
+static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
+
+// producers -> double -> sum, closing each stage when the one before is done
+void test_pipeline(size_t capacity)
+{
+    const int producers = 4;
+    const int items = 20000;
+    fatdog::Channel<int> numbers(capacity);
+    fatdog::Channel<long> doubled(capacity);
+    std::atomic<int> producing = {producers};
+    long sum = 0;
+
+    uint64_t begin = fatdog::GetCurrentUS();
+    {
+        fatdog::IOManager iom("pipeline", 2, false);
+        for (int p = 0; p < producers; ++p)
+        {
+            iom.schedule([&, p]() {
+                for (int i = p; i < items; i += producers)
+                {
+                    FATDOG_ASSERT(numbers.send(i + 1));
+                }
+                if (--producing == 0)
+                {
+                    numbers.close();
+                }
+            });
+        }
+        iom.schedule([&]() {
+            int v;
+            while (numbers.recv(v))
+            {
+                doubled.send(v * 2L);
+            }
+            doubled.close();
+        });
+        iom.schedule([&]() {
+            long v;
+            while (doubled.recv(v))
+            {
+                sum += v;
+            }
+        });
+    }
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+    std::cout << "pipeline capacity=" << capacity << " sum=" << sum << " " << used * 1000.0 / items << "ns/item" << std::endl;
+    FATDOG_ASSERT(sum == (long)items * (items + 1));
+    FATDOG_ASSERT(!numbers.send(1));
+}
+
+// unbuffered send returns after the receiver took it, and fails once closed
+void test_unbuffered()
+{
+    fatdog::Channel<int> ch;
+    std::atomic<int> received = {0};
+    bool closed_send = true;
+    {
+        fatdog::IOManager iom("unbuffered", 1, false);
+        iom.schedule([&]() {
+            for (int i = 0; i < 10; ++i)
+            {
+                FATDOG_ASSERT(ch.send(i));
+                FATDOG_ASSERT(received == i + 1);
+            }
+            // nobody receives this one
+            closed_send = ch.send(100);
+        });
+        iom.schedule([&]() {
+            for (int i = 0; i < 10; ++i)
+            {
+                int v;
+                FATDOG_ASSERT(ch.recv(v) && v == i);
+                ++received;
+                fatdog::Fiber::YieldToReady();
+            }
+            iom.addTimer(50, [&]() { ch.close(); });
+        });
+    }
+    std::cout << "unbuffered received=" << received << " closed_send=" << closed_send << std::endl;
+    FATDOG_ASSERT(received == 10 && !closed_send);
+}
+
+void test_select()
+{
+    fatdog::Channel<int> a(4);
+    fatdog::Channel<std::string> b(4);
+    std::vector<int> order;
+    {
+        fatdog::IOManager iom("select", 1, false);
+        iom.schedule([&]() {
+            int x;
+            std::string y;
+            // nothing comes within 30ms
+            uint64_t begin = fatdog::Clock::NowMS();
+            FATDOG_ASSERT(fatdog::ChannelSelect().recv(a, x).recv(b, y).wait(30) == -1);
+            FATDOG_ASSERT(fatdog::Clock::NowMS() - begin >= 25);
+
+            for (int i = 0; i < 4; ++i)
+            {
+                int rt = fatdog::ChannelSelect().recv(a, x).recv(b, y).wait(1000);
+                FATDOG_ASSERT(rt == 0 || rt == 1);
+                order.push_back(rt);
+            }
+            FATDOG_ASSERT(fatdog::ChannelSelect().recv(a, x).recv(b, y).wait(1000) == -2);
+        });
+        iom.addTimer(60, [&]() {
+            a.send(1);
+            b.send("b");
+        });
+        iom.addTimer(80, [&]() {
+            b.send("c");
+            a.send(2);
+            a.close();
+            b.close();
+        });
+    }
+    std::cout << "select got " << order.size() << std::endl;
+    FATDOG_ASSERT(order.size() == 4);
+}
+
+// a plain thread receives what fibers send, with a timeout
+void test_thread()
+{
+    fatdog::Channel<int> ch(2);
+    fatdog::IOManager iom("thread", 1, false);
+    iom.schedule([&]() {
+        for (int i = 0; i < 100; ++i)
+        {
+            ch.send(i);
+        }
+    });
+    int v;
+    for (int i = 0; i < 100; ++i)
+    {
+        FATDOG_ASSERT(ch.recv(v, 1000) == 1 && v == i);
+    }
+    FATDOG_ASSERT(ch.recv(v, 20) == 0);
+    ch.close();
+    FATDOG_ASSERT(ch.recv(v, 20) == -1);
+    std::cout << "thread ok" << std::endl;
+}
+
+int main()
+{
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+
+    test_pipeline(64);
+    test_pipeline(0);
+    test_unbuffered();
+    test_select();
+    test_thread();
+    return 0;
+}
@@ -1,10 +1,18 @@
 #include "../fatdog/util.h"
 
+#include "../fatdog/config.h"
 #include "../fatdog/log.h"
 #include "../fatdog/macro.h"
 #include "../fatdog/fiber.h"
+#include "../fatdog/scheduler.h"
 #include "../fatdog/thread.h"
 
+#include <atomic>
+#include <iostream>
+#include <vector>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
 #include <ucontext.h>
 #include <unistd.h>
 
@@ -126,11 +134,236 @@ void test_ucontext2()
     setcontext(&context);
 }
 
+static size_t rss_kb()
+{
+    long size = 0;
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        // size, then resident
+        if (fscanf(f, "%ld %ld", &size, &pages) != 2)
+        {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return pages * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+static std::atomic<int> s_held{0};
+
+static void touch_stack()
+{
+    volatile char buf[4096];
+    buf[0] = buf[sizeof(buf) - 1] = 1;
+    ++s_held;
+    fatdog::Fiber::YieldToHold();
+}
+
+// a round creates `count` fibers on this thread and parks them all in a scheduler at
+// once, then lets them finish and releases them here. the second round shows what
+// reuse buys
+void test_stack_allocator(const std::string &name, int count, int rounds)
+{
+    fatdog::Config::lookUp<std::string>("fiber.stack_allocator")->setValue(name);
+    FATDOG_ASSERT(fatdog::StackAllocator::GetDefault()->getName() == name);
+
+    for (int r = 0; r < rounds; ++r)
+    {
+        fatdog::Scheduler sc("stack", 1, false);
+        sc.start();
+        s_held = 0;
+
+        size_t rss_begin = rss_kb();
+        uint64_t begin = fatdog::GetCurrentUS();
+        std::vector<fatdog::Fiber::ptr> fibers;
+        for (int i = 0; i < count; ++i)
+        {
+            fibers.push_back(fatdog::Fiber::ptr(new fatdog::Fiber(&touch_stack, 64 * 1024)));
+        }
+        sc.schedule(fibers.begin(), fibers.end());
+        while (s_held != count)
+        {
+            usleep(1000);
+        }
+        size_t rss = rss_kb() - rss_begin;
+        sc.schedule(fibers.begin(), fibers.end());
+        sc.stop();
+        fibers.clear();
+        uint64_t used = fatdog::GetCurrentUS() - begin;
+
+        std::cout << "stack_allocator=" << name << " round=" << r
+                  << " fibers=" << count << " used=" << used << "us"
+                  << " rss_grow=" << rss << "KB"
+                  << " pool_cached=" << fatdog::PooledStackAllocator::GetCachedBytes() / 1024 << "KB"
+                  << std::endl;
+    }
+}
+
+static std::atomic<size_t> s_saved{0};
+
+static void check_stack()
+{
+    volatile char buf[1024];
+    char v = (char)fatdog::Fiber::GetFiberId();
+    for (size_t i = 0; i < sizeof(buf); ++i)
+    {
+        buf[i] = v;
+    }
+    ++s_held;
+    fatdog::Fiber::YieldToHold();
+    for (size_t i = 0; i < sizeof(buf); ++i)
+    {
+        FATDOG_ASSERT(buf[i] == v);
+    }
+}
+
+// parked shared stack fibers only keep their live stack, and get it back intact
+void test_shared_stack(int count, uint32_t threads)
+{
+    fatdog::Scheduler sc("shared", threads, false);
+    sc.start();
+    s_held = 0;
+
+    size_t rss_begin = rss_kb();
+    uint64_t begin = fatdog::GetCurrentUS();
+    std::vector<fatdog::Fiber::ptr> fibers;
+    for (int i = 0; i < count; ++i)
+    {
+        fibers.push_back(fatdog::Fiber::ptr(new fatdog::Fiber(&check_stack, 0, false, true)));
+    }
+    sc.schedule(fibers.begin(), fibers.end());
+    while (s_held != count)
+    {
+        usleep(1000);
+    }
+    size_t rss = rss_kb() - rss_begin;
+    size_t saved = 0;
+    for (auto &i : fibers)
+    {
+        saved += i->getSavedStackSize();
+    }
+    sc.schedule(fibers.begin(), fibers.end());
+    sc.stop();
+    fibers.clear();
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+
+    std::cout << "shared_stack threads=" << threads << " fibers=" << count
+              << " used=" << used << "us"
+              << " rss_grow=" << rss << "KB"
+              << " saved=" << saved / 1024 << "KB"
+              << std::endl;
+}
+
+static void overflow(int depth)
+{
+    volatile char buf[1024];
+    buf[0] = depth;
+    overflow(depth + 1);
+    // read after the call, the frame stays live and the compiler can't drop it
+    buf[1] = buf[0];
+}
+
+// running off the end of an mmap stack must hit the guard page
+void test_stack_guard()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        fatdog::Fiber::GetThis();
+        fatdog::Config::lookUp<std::string>("fiber.stack_allocator")->setValue("mmap");
+        fatdog::Fiber::ptr fiber(new fatdog::Fiber(std::bind(&overflow, 0), 64 * 1024));
+        fiber->call();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    FATDOG_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    std::cout << "stack guard ok" << std::endl;
+}
+
+static const int s_switch_count = 1000 * 1000;
+static fatdog::Fiber::ptr s_bench_fiber;
+
+static void bench_fiber_run()
+{
+    for (int i = 0; i < s_switch_count; ++i)
+    {
+        s_bench_fiber->back();
+    }
+}
+
+// call() + back() is two switches
+void bench_fiber_switch()
+{
+    fatdog::Fiber::GetThis();
+    s_bench_fiber.reset(new fatdog::Fiber(&bench_fiber_run, 0, true));
+
+    uint64_t begin = fatdog::GetCurrentUS();
+    for (int i = 0; i <= s_switch_count; ++i)
+    {
+        s_bench_fiber->call();
+    }
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+    s_bench_fiber.reset();
+
+    std::cout << "fiber switch backend=" << fatdog::ContextBackend()
+              << " switches=" << 2 * s_switch_count << " used=" << used << "us"
+              << " switches/s=" << (used ? 2ULL * s_switch_count * 1000 * 1000 / used : 0)
+              << std::endl;
+}
+
+static ucontext_t s_bench_uc[2];
+
+static void bench_ucontext_run()
+{
+    while (true)
+    {
+        swapcontext(&s_bench_uc[1], &s_bench_uc[0]);
+    }
+}
+
+// raw swapcontext, what Fiber paid before the asm backend
+void bench_ucontext_switch()
+{
+    std::vector<char> stack(64 * 1024);
+    getcontext(&s_bench_uc[1]);
+    s_bench_uc[1].uc_link = nullptr;
+    s_bench_uc[1].uc_stack.ss_sp = &stack[0];
+    s_bench_uc[1].uc_stack.ss_size = stack.size();
+    makecontext(&s_bench_uc[1], &bench_ucontext_run, 0);
+
+    uint64_t begin = fatdog::GetCurrentUS();
+    for (int i = 0; i < s_switch_count; ++i)
+    {
+        swapcontext(&s_bench_uc[0], &s_bench_uc[1]);
+    }
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+
+    std::cout << "raw swapcontext"
+              << " switches=" << 2 * s_switch_count << " used=" << used << "us"
+              << " switches/s=" << (used ? 2ULL * s_switch_count * 1000 * 1000 / used : 0)
+              << std::endl;
+}
+
 int main()
 {
+    // fibers log creation at INFO
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+    bench_fiber_switch();
+    bench_ucontext_switch();
+    for (auto &i : {"malloc", "mmap", "pool"})
+    {
+        test_stack_allocator(i, 10000, 2);
+    }
+    test_shared_stack(10000, 1);
+    test_shared_stack(10000, 2);
+    test_stack_guard();
+
     // test_backtrace();
     // test_ucontext1();
-     test_ucontext2();
+    // test_ucontext2();
 
     // thread_run();
 
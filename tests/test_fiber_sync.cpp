@@ -0,0 +1,192 @@
+#include "../fatdog/fiber_sync.h"
+#include "../fatdog/scheduler.h"
+#include "../fatdog/log.h"
+#include "../fatdog/macro.h"
+#include "../fatdog/util.h"
+
+#include <atomic>
+#include <deque>
+#include <iostream>
+
+static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
+
+// fibers yield while holding the lock, so others really wait on it
+void test_mutex()
+{
+    fatdog::FiberMutex mutex;
+    int counter = 0;
+    const int fibers = 50;
+    const int loops = 200;
+    {
+        fatdog::Scheduler sc("mutex", 4, false);
+        sc.start();
+        for (int i = 0; i < fibers; ++i)
+        {
+            sc.schedule([&mutex, &counter]() {
+                for (int j = 0; j < loops; ++j)
+                {
+                    fatdog::FiberMutex::Lock lock(mutex);
+                    int v = counter;
+                    fatdog::Fiber::YieldToReady();
+                    counter = v + 1;
+                }
+            });
+        }
+        // a plain thread takes it too, it blocks on a semaphore instead
+        for (int j = 0; j < loops; ++j)
+        {
+            fatdog::FiberMutex::Lock lock(mutex);
+            ++counter;
+        }
+        sc.stop();
+    }
+    std::cout << "mutex counter " << counter << std::endl;
+    FATDOG_ASSERT(counter == (fibers + 1) * loops);
+}
+
+void test_condition()
+{
+    fatdog::FiberMutex mutex;
+    fatdog::FiberCondition cond;
+    std::deque<int> queue;
+    const int items = 10000;
+    const int consumers = 8;
+    std::atomic<long> sum = {0};
+    {
+        fatdog::Scheduler sc("cond", 2, false);
+        sc.start();
+        for (int i = 0; i < consumers; ++i)
+        {
+            sc.schedule([&]() {
+                while (true)
+                {
+                    fatdog::FiberMutex::Lock lock(mutex);
+                    while (queue.empty())
+                    {
+                        cond.wait(mutex);
+                    }
+                    int v = queue.front();
+                    queue.pop_front();
+                    if (v < 0)
+                    {
+                        return;
+                    }
+                    sum += v;
+                }
+            });
+        }
+        sc.schedule([&]() {
+            for (int i = 1; i <= items; ++i)
+            {
+                fatdog::FiberMutex::Lock lock(mutex);
+                queue.push_back(i);
+                cond.notify();
+            }
+            fatdog::FiberMutex::Lock lock(mutex);
+            for (int i = 0; i < consumers; ++i)
+            {
+                queue.push_back(-1);
+            }
+            cond.notifyAll();
+        });
+        sc.stop();
+    }
+    std::cout << "condition sum " << sum << std::endl;
+    FATDOG_ASSERT(sum == (long)items * (items + 1) / 2);
+}
+
+void test_semaphore()
+{
+    fatdog::FiberSemaphore sem(3);
+    std::atomic<int> inside = {0};
+    std::atomic<int> most = {0};
+    std::atomic<int> done = {0};
+    {
+        fatdog::Scheduler sc("sem", 4, false);
+        sc.start();
+        for (int i = 0; i < 100; ++i)
+        {
+            sc.schedule([&]() {
+                sem.wait();
+                int n = ++inside;
+                int m = most;
+                while (n > m && !most.compare_exchange_weak(m, n))
+                {
+                }
+                fatdog::Fiber::YieldToReady();
+                --inside;
+                sem.notify();
+                ++done;
+            });
+        }
+        sc.stop();
+    }
+    std::cout << "semaphore most " << most << std::endl;
+    FATDOG_ASSERT(done == 100 && most <= 3 && most > 0);
+}
+
+// writers keep a == b, readers must never see them apart
+void test_rwmutex()
+{
+    fatdog::FiberRWMutex mutex;
+    long a = 0, b = 0;
+    std::atomic<long> reads = {0};
+    {
+        fatdog::Scheduler sc("rw", 4, false);
+        sc.start();
+        for (int i = 0; i < 40; ++i)
+        {
+            bool writer = i % 4 == 0;
+            sc.schedule([&, writer]() {
+                for (int j = 0; j < 200; ++j)
+                {
+                    if (writer)
+                    {
+                        fatdog::FiberRWMutex::WriteLock lock(mutex);
+                        ++a;
+                        fatdog::Fiber::YieldToReady();
+                        ++b;
+                    }
+                    else
+                    {
+                        fatdog::FiberRWMutex::ReadLock lock(mutex);
+                        long x = a;
+                        fatdog::Fiber::YieldToReady();
+                        FATDOG_ASSERT(x == a && a == b);
+                        ++reads;
+                    }
+                }
+            });
+        }
+        sc.stop();
+    }
+    std::cout << "rwmutex a=" << a << " reads=" << reads << std::endl;
+    FATDOG_ASSERT(a == 10 * 200 && b == a && reads == 30 * 200);
+}
+
+template <class MutexType>
+void bench_uncontended(const char *name, int n)
+{
+    MutexType mutex;
+    uint64_t begin = fatdog::GetCurrentUS();
+    for (int i = 0; i < n; ++i)
+    {
+        typename MutexType::Lock lock(mutex);
+    }
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+    std::cout << name << " lock+unlock " << used * 1000.0 / n << "ns" << std::endl;
+}
+
+int main()
+{
+    // every fiber creation logs at DEBUG
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+
+    test_mutex();
+    test_condition();
+    test_semaphore();
+    test_rwmutex();
+    bench_uncontended<fatdog::Mutex>("Mutex", 1000000);
+    bench_uncontended<fatdog::FiberMutex>("FiberMutex", 1000000);
+    return 0;
+}
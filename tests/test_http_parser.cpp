@@ -1,5 +1,6 @@
 #include "../fatdog/http/http_parser.h"
 #include "../fatdog/log.h"
+#include "../fatdog/macro.h"
 
 static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
 
@@ -18,9 +19,33 @@ void test_request()
                                << " is_finished=" << parser.isFinished()
                                << " total=" << tmp.size()
                                << " content_length=" << parser.getContentLength();
-    tmp.resize(tmp.size() - s);
     FATDOG_LOG_INFO(g_logger) << parser.getData()->toString();
-    FATDOG_LOG_INFO(g_logger) << tmp;
+    FATDOG_LOG_INFO(g_logger) << tmp.substr(s);
+}
+
+// the same request arriving a few bytes at a time, tokens cut between reads
+void test_request_split()
+{
+    fatdog::http::HttpRequestParser parser;
+    std::string tmp = test_request_data;
+    size_t head = tmp.find("\r\n\r\n") + 4;
+    size_t s = 0;
+    for (size_t len = 3; !parser.isFinished() && len <= tmp.size(); len += 3)
+    {
+        s = parser.execute(&tmp[0], len);
+        // everything fed is taken, up to the end of the head
+        FATDOG_ASSERT(!parser.hasError());
+        FATDOG_ASSERT(s == std::min(len, head));
+    }
+    FATDOG_ASSERT(parser.isFinished());
+    FATDOG_ASSERT(s == head);
+    fatdog::http::HttpRequest::ptr req = parser.getData();
+    fatdog::http::StringView host;
+    FATDOG_ASSERT(req->getPathView() == "/");
+    FATDOG_ASSERT(req->getHeaderView("HOST", host) && host == "www.baidu.top");
+    FATDOG_ASSERT(parser.getContentLength() == 10);
+    FATDOG_ASSERT(!req->isClose());
+    FATDOG_LOG_INFO(g_logger) << "split rt=" << s << " path=" << req->getPathView() << " host=" << host;
 }
 
 const char test_response_data[] = "HTTP/1.1 200 OK\r\n"
@@ -59,6 +84,7 @@ void test_response()
 int main(int argc, char **argv)
 {
     test_request();
+    test_request_split();
     FATDOG_LOG_INFO(g_logger) << "--------------";
     test_response();
     return 0;
@@ -1,5 +1,13 @@
 #include "../fatdog/http/http_server.h"
+#include "../fatdog/http/static_file_servlet.h"
+#include "../fatdog/clock.h"
+#include "../fatdog/config.h"
 #include "../fatdog/log.h"
+#include "../fatdog/macro.h"
+
+#include <algorithm>
+#include <atomic>
+#include <arpa/inet.h>
 
 static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
 
@@ -56,10 +64,493 @@ void run()
     server->start();
 }
 
+// an HttpServer on its own one-thread IOManager, on 127.0.0.1 and a port the kernel picks.
+// add servlets, start(), connect() as many clients as needed
+class ServerFixture
+{
+public:
+    ServerFixture()
+        : m_iom("http", 1, false), m_server(new fatdog::http::HttpServer(true, &m_iom, &m_iom))
+    {
+    }
+    ~ServerFixture() { m_server->stop(); }
+
+    fatdog::http::HttpServer::ptr server() const { return m_server; }
+    fatdog::http::ServletDispatch::ptr dispatch() const { return m_server->getServletDispatch(); }
+
+    void start()
+    {
+        run([&]() {
+            FATDOG_ASSERT(m_server->bind(fatdog::Address::LookupAny("127.0.0.1:0")));
+            FATDOG_ASSERT(m_server->start());
+        });
+        auto addr = std::dynamic_pointer_cast<fatdog::IPAddress>(m_server->getSocks().at(0)->getLocalAddress());
+        FATDOG_ASSERT(addr);
+        m_port = addr->getPort();
+    }
+
+    // runs cb in a fiber of the server's IOManager, waits for it
+    void run(std::function<void()> cb)
+    {
+        fatdog::Semaphore sem;
+        m_iom.schedule([&]() {
+            cb();
+            sem.notify();
+        });
+        sem.wait();
+    }
+
+    // a plain blocking client socket
+    int connect() const
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        FATDOG_ASSERT(::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+        return fd;
+    }
+
+private:
+    fatdog::IOManager m_iom;
+    fatdog::http::HttpServer::ptr m_server;
+    uint16_t m_port = 0;
+};
+
+// pipelined http requests, more than fit in one input buffer, the last one cut in two writes.
+// the answers come back in order
+static void pipeline()
+{
+    ServerFixture http;
+    http.dispatch()->addGlobServlet("/*", [](fatdog::http::HttpRequest::ptr req, fatdog::http::HttpResponse::ptr rsp,
+                                                       fatdog::http::HttpSession::ptr session) {
+        rsp->setBody(req->getPath() + " " + req->getHeader("x-seq") + " " + req->getBody() + "\n");
+        return 0;
+    });
+    http.start();
+
+    const int n = 200;
+    std::string reqs;
+    std::string expect;
+    for (int i = 0; i < n; ++i)
+    {
+        std::string seq = std::to_string(i);
+        if (i % 3 == 0)
+        {
+            reqs += "POST /p" + seq + " HTTP/1.1\r\nHost: x\r\nX-Seq: " + seq + "\r\nContent-Length: 4\r\n\r\nbody";
+            expect += "/p" + seq + " " + seq + " body\n";
+        }
+        else
+        {
+            reqs += "GET /g" + seq + " HTTP/1.1\r\nHost: x\r\nX-Seq: " + seq + "\r\n\r\n";
+            expect += "/g" + seq + " " + seq + " \n";
+        }
+    }
+    reqs += "GET /last HTTP/1.1\r\nConnection: close\r\n\r\n";
+    expect += "/last  \n";
+    int fd = http.connect();
+    size_t cut = reqs.size() - 10;
+    FATDOG_ASSERT(::write(fd, reqs.c_str(), cut) == (ssize_t)cut);
+    usleep(50 * 1000);
+    FATDOG_ASSERT(::write(fd, reqs.c_str() + cut, reqs.size() - cut) == (ssize_t)(reqs.size() - cut));
+
+    std::string rsp;
+    char buf[4096];
+    ssize_t len;
+    while ((len = ::read(fd, buf, sizeof(buf))) > 0)
+    {
+        rsp.append(buf, len);
+    }
+    ::close(fd);
+    // bodies in the order sent
+    std::string bodies;
+    size_t pos = 0;
+    int count = 0;
+    while ((pos = rsp.find("\r\n\r\n", pos)) != std::string::npos)
+    {
+        pos += 4;
+        size_t end = rsp.find('\n', pos);
+        FATDOG_ASSERT(end != std::string::npos);
+        bodies += rsp.substr(pos, end + 1 - pos);
+        pos = end + 1;
+        ++count;
+    }
+    std::cout << "pipeline: " << reqs.size() << " bytes of requests, " << count << " responses" << std::endl;
+    FATDOG_ASSERT(count == n + 1);
+    FATDOG_ASSERT(bodies == expect);
+
+    // a chunked body isn't taken for the next request: the one before is answered, then 501
+    fd = http.connect();
+    reqs = "GET /before HTTP/1.1\r\nX-Seq: 1\r\n\r\n"
+           "POST /chunked HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+           "1d\r\nGET /smuggled HTTP/1.1\r\n\r\n\r\n0\r\n\r\n";
+    FATDOG_ASSERT(::write(fd, reqs.c_str(), reqs.size()) == (ssize_t)reqs.size());
+    rsp.clear();
+    while ((len = ::read(fd, buf, sizeof(buf))) > 0)
+    {
+        rsp.append(buf, len);
+    }
+    ::close(fd);
+    FATDOG_ASSERT(rsp.find("/before 1 \n") != std::string::npos);
+    FATDOG_ASSERT(rsp.find("501 Not Implemented") != std::string::npos);
+    FATDOG_ASSERT(rsp.find("smuggled") == std::string::npos);
+    std::cout << "pipeline: chunked request refused" << std::endl;
+
+    // a content-length we can't trust: the one before is answered, then 400 and close
+    const char *bad[] = {"Content-Length: 5x\r\n", "Content-Length: -1\r\n", "Content-Length: \r\n",
+                         "Content-Length: 4\r\nContent-Length: 40\r\n",
+                         "Content-Length: 99999999999999999999\r\n"};
+    for (const char *cl : bad)
+    {
+        fd = http.connect();
+        reqs = std::string("GET /before HTTP/1.1\r\nX-Seq: 2\r\n\r\n") +
+               "POST /bad HTTP/1.1\r\n" + cl + "\r\n" +
+               "GET /smuggled HTTP/1.1\r\n\r\n";
+        FATDOG_ASSERT(::write(fd, reqs.c_str(), reqs.size()) == (ssize_t)reqs.size());
+        rsp.clear();
+        while ((len = ::read(fd, buf, sizeof(buf))) > 0)
+        {
+            rsp.append(buf, len);
+        }
+        ::close(fd);
+        FATDOG_ASSERT(rsp.find("/before 2 \n") != std::string::npos);
+        FATDOG_ASSERT(rsp.find("400 Bad Request") != std::string::npos);
+        FATDOG_ASSERT(rsp.find("/bad") == std::string::npos);
+        FATDOG_ASSERT(rsp.find("smuggled") == std::string::npos);
+    }
+
+    // repeated with the same value is fine
+    fd = http.connect();
+    reqs = "POST /dup HTTP/1.1\r\nX-Seq: 3\r\nContent-Length: 4\r\ncontent-length: 4\r\nConnection: close\r\n\r\nbody";
+    FATDOG_ASSERT(::write(fd, reqs.c_str(), reqs.size()) == (ssize_t)reqs.size());
+    rsp.clear();
+    while ((len = ::read(fd, buf, sizeof(buf))) > 0)
+    {
+        rsp.append(buf, len);
+    }
+    ::close(fd);
+    FATDOG_ASSERT(rsp.find("/dup 3 body\n") != std::string::npos);
+    std::cout << "pipeline: bad content-length refused" << std::endl;
+}
+
+// the body of the next response, its head (lowercased) in head_out. no_body for HEAD
+static std::string ReadHttpResponse(int fd, std::string &rest, std::string *head_out = nullptr, bool no_body = false)
+{
+    std::string rsp = rest;
+    char buf[65536];
+    size_t head;
+    while ((head = rsp.find("\r\n\r\n")) == std::string::npos)
+    {
+        ssize_t len = ::read(fd, buf, sizeof(buf));
+        FATDOG_ASSERT(len > 0);
+        rsp.append(buf, len);
+    }
+    head += 4;
+    std::string lower = rsp.substr(0, head);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (head_out)
+    {
+        *head_out = lower;
+    }
+    std::string body;
+    size_t pos = head;
+    auto need = [&](size_t n) {
+        while (rsp.size() < n)
+        {
+            ssize_t len = ::read(fd, buf, sizeof(buf));
+            FATDOG_ASSERT(len > 0);
+            rsp.append(buf, len);
+        }
+    };
+    if (no_body)
+    {
+    }
+    else if (lower.find("transfer-encoding: chunked") != std::string::npos)
+    {
+        while (true)
+        {
+            size_t eol;
+            while ((eol = rsp.find("\r\n", pos)) == std::string::npos)
+            {
+                need(rsp.size() + 1);
+            }
+            size_t size = strtoul(rsp.c_str() + pos, nullptr, 16);
+            need(eol + 2 + size + 2);
+            body.append(rsp, eol + 2, size);
+            pos = eol + 2 + size + 2;
+            if (size == 0)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        size_t cl = lower.find("content-length: ");
+        size_t size = cl == std::string::npos ? 0 : strtoul(lower.c_str() + cl + 16, nullptr, 10);
+        need(head + size);
+        body = rsp.substr(head, size);
+        pos = head + size;
+    }
+    rest = rsp.substr(pos);
+    return body;
+}
+
+// a big upload read through the body stream, one left unread, chunked and fixed length
+// downloads, all on one keep-alive connection
+static void stream()
+{
+    ServerFixture http;
+    auto sd = http.dispatch();
+    sd->addServlet("/upload", [](fatdog::http::HttpRequest::ptr req, fatdog::http::HttpResponse::ptr rsp,
+                                 fatdog::http::HttpSession::ptr session) {
+        fatdog::Stream::ptr body = req->getBodyStream();
+        uint64_t total = 0;
+        uint64_t sum = 0;
+        char buf[1000];
+        int len;
+        while (body && (len = body->read(buf, sizeof(buf))) > 0)
+        {
+            total += len;
+            for (int i = 0; i < len; ++i)
+            {
+                sum += (uint8_t)buf[i];
+            }
+        }
+        rsp->setBody(std::to_string(total) + " " + std::to_string(sum));
+        return 0;
+    });
+    sd->addServlet("/ignore", [](fatdog::http::HttpRequest::ptr req, fatdog::http::HttpResponse::ptr rsp,
+                                 fatdog::http::HttpSession::ptr session) {
+        rsp->setBody("ignored");
+        return 0;
+    });
+    sd->addServlet("/chunked", [](fatdog::http::HttpRequest::ptr req, fatdog::http::HttpResponse::ptr rsp,
+                                  fatdog::http::HttpSession::ptr session) {
+        auto out = session->beginResponse(rsp);
+        for (int i = 0; i < 1000; ++i)
+        {
+            std::string line = std::to_string(i) + "\n";
+            FATDOG_ASSERT(out->writeFixSize(line.c_str(), line.size()) == (int)line.size());
+        }
+        return 0;
+    });
+    sd->addServlet("/fixed", [](fatdog::http::HttpRequest::ptr req, fatdog::http::HttpResponse::ptr rsp,
+                                fatdog::http::HttpSession::ptr session) {
+        std::string data(300000, 'x');
+        auto out = session->beginResponse(rsp, data.size());
+        FATDOG_ASSERT(out->writeFixSize(data.c_str(), data.size()) == (int)data.size());
+        out->close();
+        return 0;
+    });
+    http.start();
+
+    std::string upload(4 * 1024 * 1024, 0);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < upload.size(); ++i)
+    {
+        upload[i] = (char)(i * 7);
+        sum += (uint8_t)upload[i];
+    }
+    int fd = http.connect();
+    std::string rest;
+    std::string head = "POST /upload HTTP/1.1\r\nContent-Length: " + std::to_string(upload.size()) + "\r\n\r\n";
+    FATDOG_ASSERT(::write(fd, head.c_str(), head.size()) == (ssize_t)head.size());
+    for (size_t pos = 0; pos < upload.size();)
+    {
+        ssize_t len = ::write(fd, upload.c_str() + pos, upload.size() - pos);
+        FATDOG_ASSERT(len > 0);
+        pos += len;
+    }
+    std::string body = ReadHttpResponse(fd, rest);
+    std::cout << "upload: " << body << std::endl;
+    FATDOG_ASSERT(body == std::to_string(upload.size()) + " " + std::to_string(sum));
+
+    // the unread body is skipped, the next request still parses
+    std::string reqs = "POST /ignore HTTP/1.1\r\nContent-Length: 100000\r\n\r\n" + std::string(100000, 'y') +
+                       "GET /chunked HTTP/1.1\r\n\r\n"
+                       "GET /fixed HTTP/1.1\r\nConnection: close\r\n\r\n";
+    for (size_t pos = 0; pos < reqs.size();)
+    {
+        ssize_t len = ::write(fd, reqs.c_str() + pos, reqs.size() - pos);
+        FATDOG_ASSERT(len > 0);
+        pos += len;
+    }
+    FATDOG_ASSERT(ReadHttpResponse(fd, rest) == "ignored");
+    std::string expect;
+    for (int i = 0; i < 1000; ++i)
+    {
+        expect += std::to_string(i) + "\n";
+    }
+    body = ReadHttpResponse(fd, rest);
+    std::cout << "chunked: " << body.size() << " bytes" << std::endl;
+    FATDOG_ASSERT(body == expect);
+    body = ReadHttpResponse(fd, rest);
+    std::cout << "fixed: " << body.size() << " bytes" << std::endl;
+    FATDOG_ASSERT(body == std::string(300000, 'x'));
+    char c;
+    FATDOG_ASSERT(rest.empty() && ::read(fd, &c, 1) == 0);
+    ::close(fd);
+}
+
+static std::string HeaderOf(const std::string &head, const std::string &name)
+{
+    size_t pos = head.find("\r\n" + name + ": ");
+    if (pos == std::string::npos)
+    {
+        return "";
+    }
+    pos += name.size() + 4;
+    return head.substr(pos, head.find("\r\n", pos) - pos);
+}
+
+// StaticFileServlet on one keep-alive connection: whole file, HEAD, ranges, If-None-Match,
+// missing files and a path out of the root, then a file changed behind the cache
+static void static_file()
+{
+    fatdog::Config::lookUp<uint32_t>("http.static_file.cache_ttl")->setValue(50);
+    const std::string root = "/tmp/fatdog_test_static";
+    FATDOG_ASSERT(system(("mkdir -p " + root).c_str()) == 0);
+    std::string data(200000, 0);
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        data[i] = 'a' + i % 26;
+    }
+    auto write_file = [&](const std::string &content) {
+        FILE *f = fopen((root + "/a.txt").c_str(), "wb");
+        FATDOG_ASSERT(f && fwrite(content.c_str(), 1, content.size(), f) == content.size());
+        fclose(f);
+    };
+    write_file(data);
+    // out of the root through a symlink
+    FATDOG_ASSERT(system(("ln -sf /etc/passwd " + root + "/link").c_str()) == 0);
+
+    ServerFixture http;
+    http.server()->setName("static-test");
+    http.dispatch()->addGlobServlet("/static/*", fatdog::http::StaticFileServlet::ptr(new fatdog::http::StaticFileServlet(root, "/static")));
+    http.start();
+
+    int fd = http.connect();
+    std::string rest;
+    std::string head;
+    auto get = [&](const std::string &req, bool no_body = false) {
+        FATDOG_ASSERT(::write(fd, req.c_str(), req.size()) == (ssize_t)req.size());
+        return ReadHttpResponse(fd, rest, &head, no_body);
+    };
+    std::string body = get("GET /static/a.txt HTTP/1.1\r\n\r\n");
+    FATDOG_ASSERT(head.find("200 ok") != std::string::npos && body == data);
+    FATDOG_ASSERT(HeaderOf(head, "content-type") == "text/plain; charset=utf-8");
+    std::string etag = HeaderOf(head, "etag");
+    std::cout << "static: " << body.size() << " bytes etag " << etag << std::endl;
+
+    get("HEAD /static/a.txt HTTP/1.1\r\n\r\n", true);
+    FATDOG_ASSERT(HeaderOf(head, "content-length") == std::to_string(data.size()));
+
+    body = get("GET /static/a.txt HTTP/1.1\r\nRange: bytes=100-199\r\n\r\n");
+    FATDOG_ASSERT(head.find("206 partial content") != std::string::npos && body == data.substr(100, 100));
+    FATDOG_ASSERT(HeaderOf(head, "content-range") == "bytes 100-199/200000");
+    body = get("GET /static/a.txt HTTP/1.1\r\nRange: bytes=-10\r\n\r\n");
+    FATDOG_ASSERT(body == data.substr(data.size() - 10));
+    body = get("GET /static/a.txt HTTP/1.1\r\nRange: bytes=199990-\r\n\r\n");
+    FATDOG_ASSERT(body == data.substr(199990));
+    get("GET /static/a.txt HTTP/1.1\r\nRange: bytes=300000-\r\n\r\n");
+    FATDOG_ASSERT(head.find("416") != std::string::npos && HeaderOf(head, "content-range") == "bytes */200000");
+    // a range for another version of the file: all of it
+    body = get("GET /static/a.txt HTTP/1.1\r\nRange: bytes=0-9\r\nIf-Range: \"old\"\r\n\r\n");
+    FATDOG_ASSERT(body == data);
+
+    get("GET /static/a.txt HTTP/1.1\r\nIf-None-Match: \"x\", " + etag + "\r\n\r\n");
+    FATDOG_ASSERT(head.find("304") != std::string::npos);
+    get("GET /static/missing.txt HTTP/1.1\r\n\r\n");
+    FATDOG_ASSERT(head.find("404") != std::string::npos);
+    get("GET /static/../../etc/passwd HTTP/1.1\r\n\r\n");
+    FATDOG_ASSERT(head.find("404") != std::string::npos);
+    get("GET /static/%2e%2e/%2E%2E/etc/passwd HTTP/1.1\r\n\r\n");
+    FATDOG_ASSERT(head.find("404") != std::string::npos);
+    get("GET /static/link HTTP/1.1\r\n\r\n");
+    FATDOG_ASSERT(head.find("404") != std::string::npos);
+    body = get("GET /static/x/../%61.txt HTTP/1.1\r\nRange: bytes=0-2\r\n\r\n");
+    FATDOG_ASSERT(body == "abc" && HeaderOf(head, "server") == "static-test");
+    get("POST /static/a.txt HTTP/1.1\r\n\r\n");
+    FATDOG_ASSERT(head.find("405") != std::string::npos);
+
+    // changed under the cache, seen once the entry is older than the ttl
+    write_file("changed");
+    usleep(100 * 1000);
+    body = get("GET /static/a.txt HTTP/1.1\r\n\r\n");
+    FATDOG_ASSERT(body == "changed" && HeaderOf(head, "etag") != etag);
+    get("GET /static/a.txt HTTP/1.1\r\nIf-None-Match: " + etag + "\r\n\r\n");
+    FATDOG_ASSERT(head.find("200 ok") != std::string::npos);
+    std::cout << "static: ranges, 304, 404, 405, 416 and a changed file ok" << std::endl;
+    ::close(fd);
+    FATDOG_ASSERT(system(("rm -rf " + root).c_str()) == 0);
+}
+
+// drain(): an idle keep-alive connection is closed at once, a servlet still writing at
+// the deadline gets an error, not SIGPIPE
+static void drain()
+{
+    ServerFixture http;
+    http.start();
+    int idle = http.connect();
+    const char req[] = "GET / HTTP/1.1\r\nHost: x\r\n\r\n";
+    FATDOG_ASSERT(::write(idle, req, sizeof(req) - 1) == sizeof(req) - 1);
+    char buf[4096];
+    FATDOG_ASSERT(::read(idle, buf, sizeof(buf)) > 0);
+    uint64_t start = fatdog::Clock::NowMS();
+    FATDOG_ASSERT(http.server()->drain(2000));
+    FATDOG_ASSERT(::read(idle, buf, sizeof(buf)) == 0);
+    uint64_t used = fatdog::Clock::NowMS() - start;
+    std::cout << "drain: idle connection closed in " << used << "ms" << std::endl;
+    FATDOG_ASSERT(used < 500);
+    ::close(idle);
+
+    ServerFixture writer;
+    std::atomic<int> write_rt = {1};
+    writer.dispatch()->addServlet("/flood", [&](fatdog::http::HttpRequest::ptr req, fatdog::http::HttpResponse::ptr rsp,
+                                                fatdog::http::HttpSession::ptr session) {
+        auto out = session->beginResponse(rsp);
+        std::string data(65536, 'z');
+        int rt;
+        while ((rt = out->writeFixSize(data.c_str(), data.size())) > 0)
+            ;
+        write_rt = rt;
+        return 0;
+    });
+    writer.start();
+    int slow = writer.connect();
+    const char flood[] = "GET /flood HTTP/1.1\r\nHost: x\r\n\r\n";
+    FATDOG_ASSERT(::write(slow, flood, sizeof(flood) - 1) == sizeof(flood) - 1);
+    // read a little, then no more, the servlet blocks on a full send buffer
+    FATDOG_ASSERT(::read(slow, buf, sizeof(buf)) > 0);
+    FATDOG_ASSERT(!writer.server()->drain(200));
+    for (int i = 0; i < 100 && write_rt > 0; ++i)
+    {
+        usleep(10 * 1000);
+    }
+    std::cout << "drain: write after the deadline returned " << write_rt << std::endl;
+    FATDOG_ASSERT(write_rt < 0);
+    ::close(slow);
+}
+
 int main(int argc, char **argv)
 {
-    fatdog::IOManager iom("aoaoao~", 1, true);
-    woker.reset(new fatdog::IOManager("worker", 3, false));
-    iom.schedule(run);
+    // the example above, serving until killed
+    if (argc > 1 && std::string(argv[1]) == "serve")
+    {
+        fatdog::IOManager iom("aoaoao~", 1, true);
+        woker.reset(new fatdog::IOManager("worker", 3, false));
+        iom.schedule(run);
+        return 0;
+    }
+
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+    FATDOG_LOG_NAME("system")->setLevel(fatdog::LogLevel::WARN);
+    pipeline();
+    stream();
+    static_file();
+    drain();
     return 0;
 }
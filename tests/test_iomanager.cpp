@@ -1,6 +1,9 @@
+#include "../fatdog/clock.h"
+#include "../fatdog/config.h"
 #include "../fatdog/iomanager.h"
 #include "../fatdog/log.h"
 #include "../fatdog/macro.h"
+#include "../fatdog/util.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -8,8 +11,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <iostream>
+#include <algorithm>
 #include <sys/epoll.h>
+#include <sys/time.h>
 #include <string.h>
+#include <time.h>
 
 static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
 
@@ -59,7 +65,7 @@ void test1() {
 
 fatdog::TimerManager::Timer::ptr s_timer;
 void test_timer() {
-    fatdog::IOManager iom("lala", 1);
+    fatdog::IOManager iom("lala", 1, true, fatdog::TimerManager::WHEEL);
     s_timer = iom.addTimer(1000, [](){
         static int i = 0;
         FATDOG_LOG_INFO(g_logger) << "hello timer i=" << i;
@@ -74,9 +80,268 @@ void test_timer() {
     }, true);
 }
 
+// hooked socket io on loopback: accept, echo ping-pong, recv timeout, close
+void test_backend(const std::string& backend, int rounds) {
+    fatdog::Config::lookUp<std::string>("iomanager.backend")->setValue(backend);
+    fatdog::IOManager iom("echo_" + backend, 2, false);
+    std::cout << "backend " << backend << " -> "
+              << (iom.getBackend() == fatdog::IOManager::IO_URING ? "io_uring" : "epoll") << std::endl;
+
+    iom.schedule([&iom, rounds]() {
+        int lsock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        FATDOG_ASSERT(!bind(lsock, (sockaddr*)&addr, sizeof(addr)));
+        FATDOG_ASSERT(!listen(lsock, 16));
+        socklen_t len = sizeof(addr);
+        getsockname(lsock, (sockaddr*)&addr, &len);
+
+        iom.schedule([lsock]() {
+            int c = accept(lsock, nullptr, nullptr);
+            FATDOG_ASSERT(c >= 0);
+            char buf[64];
+            ssize_t n;
+            while((n = recv(c, buf, sizeof(buf), 0)) > 0) {
+                FATDOG_ASSERT(send(c, buf, n, 0) == n);
+            }
+            close(c);
+            close(lsock);
+        });
+
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        int rt = connect(sock, (sockaddr*)&addr, sizeof(addr));
+        FATDOG_ASSERT2(!rt, "connect errno=" << errno << " " << strerror(errno));
+
+        timeval tv = {0, 100 * 1000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char buf[64];
+        uint64_t begin = fatdog::GetCurrentMS();
+        FATDOG_ASSERT(read(sock, buf, sizeof(buf)) == -1 && errno == ETIMEDOUT);
+        std::cout << "  recv timeout after " << fatdog::GetCurrentMS() - begin << "ms" << std::endl;
+
+        begin = fatdog::GetCurrentMS();
+        for(int i = 0; i < rounds; ++i) {
+            FATDOG_ASSERT(write(sock, &i, sizeof(i)) == sizeof(i));
+            int v = -1;
+            ssize_t n = read(sock, &v, sizeof(v));
+            FATDOG_ASSERT2(n == sizeof(v) && v == i, "read=" << n << " v=" << v << " i=" << i << " errno=" << errno);
+        }
+        uint64_t used = fatdog::GetCurrentMS() - begin;
+        std::cout << "  " << rounds << " round trips " << used << "ms "
+                  << (used ? rounds * 1000 / used : 0) << "/s" << std::endl;
+        close(sock);
+        std::cout << "  tickle sent=" << iom.getTickleSent()
+                  << " coalesced=" << iom.getTickleCoalesced() << std::endl;
+    });
+}
+
+// bursts of tasks from a foreign thread, most tickles should fold into one in flight
+void test_tickle(int threads, int bursts, int tasks) {
+    std::atomic<int> done{0};
+    fatdog::IOManager iom("tickle", threads, false);
+    uint64_t begin = fatdog::GetCurrentMS();
+    for(int i = 0; i < bursts; ++i) {
+        for(int j = 0; j < tasks; ++j) {
+            iom.schedule([&done]() { ++done; });
+        }
+        usleep(100);
+    }
+    while(done != bursts * tasks) {
+        usleep(1000);
+    }
+    std::cout << "tickle threads=" << threads << " tasks=" << done
+              << " " << fatdog::GetCurrentMS() - begin << "ms"
+              << " sent=" << iom.getTickleSent()
+              << " coalesced=" << iom.getTickleCoalesced() << std::endl;
+}
+
+// a task pinned to one idle thread, while the others sleep too, must wake that thread and
+// not wait for epoll's MAX_TIMEOUT. from a foreign thread and from a sibling worker
+void test_pinned(const std::string& backend, int threads, int rounds) {
+    fatdog::Config::lookUp<std::string>("iomanager.backend")->setValue(backend);
+    fatdog::IOManager iom("pinned_" + backend, threads, false);
+    std::vector<int> tids;
+    fatdog::Mutex mutex;
+    while((int)tids.size() < threads) {
+        iom.schedule([&]() {
+            fatdog::Mutex::Lock lock(mutex);
+            if(std::find(tids.begin(), tids.end(), fatdog::GetThreadId()) == tids.end()) {
+                tids.push_back(fatdog::GetThreadId());
+            }
+        });
+        usleep(1000);
+    }
+    uint64_t max_us = 0;
+    for(int i = 0; i < rounds; ++i) {
+        int to = tids[i % threads];
+        // everybody asleep
+        usleep(20 * 1000);
+        fatdog::Semaphore sem;
+        uint64_t begin = fatdog::GetCurrentUS();
+        auto task = [&sem, to]() {
+            FATDOG_ASSERT(fatdog::GetThreadId() == to);
+            sem.notify();
+        };
+        if(i % 2) {
+            iom.schedule(task, to);
+        } else {
+            // from another worker
+            int from = tids[(i + 1) % threads];
+            iom.schedule([&iom, task, to]() { iom.schedule(task, to); }, from);
+        }
+        sem.wait();
+        max_us = std::max(max_us, fatdog::GetCurrentUS() - begin);
+    }
+    std::cout << "pinned " << backend << " threads=" << threads << " rounds=" << rounds
+              << " max_latency=" << max_us << "us" << std::endl;
+    FATDOG_ASSERT(max_us < 500 * 1000);
+}
+
+// TimerManager without an IOManager, time is driven by hand through listExpiredCb()
+class ManualTimers : public fatdog::TimerManager {
+public:
+    ManualTimers(Type type) : TimerManager(type) {}
+    void onTimerInsertedAtFront() override {}
+};
+
+// random timers, some cancelled, some recurring: each must fire on time and only once.
+// set and wheel run side by side on the same schedule
+void test_timer_expire() {
+    ManualTimers set(fatdog::TimerManager::SET);
+    ManualTimers wheel(fatdog::TimerManager::WHEEL);
+    ManualTimers* tms[2] = {&set, &wheel};
+    const int count = 2000;
+    std::vector<uint64_t> due(count), fired[2];
+    std::vector<fatdog::TimerManager::Timer::ptr> timers[2];
+    int ticks[2] = {0, 0};
+    uint64_t begin = fatdog::Clock::NowMS();
+    srand(1);
+    for(int i = 0; i < count; ++i) {
+        // mostly short, some beyond the first wheel levels
+        uint64_t ms = (i % 10 == 0) ? rand() % 20000 : rand() % 600;
+        due[i] = begin + ms;
+    }
+    for(int k = 0; k < 2; ++k) {
+        fired[k].resize(count, 0);
+        for(int i = 0; i < count; ++i) {
+            uint64_t* f = &fired[k][i];
+            timers[k].push_back(tms[k]->addTimer(due[i] - begin, [f]() { *f = fatdog::Clock::NowMS(); }));
+        }
+        for(int i = 0; i < count; i += 7) {
+            timers[k][i]->cancel();
+        }
+        int* t = &ticks[k];
+        timers[k].push_back(tms[k]->addTimer(50, [t]() { ++*t; }, true));
+    }
+
+    while(fatdog::Clock::NowMS() < begin + 21000) {
+        uint64_t next = std::min(set.getNextTimer(), wheel.getNextTimer());
+        usleep((next == ~0ull ? 100 : std::min<uint64_t>(next, 100)) * 1000);
+        for(int k = 0; k < 2; ++k) {
+            std::vector<std::function<void()>> cbs;
+            tms[k]->listExpiredCb(cbs);
+            for(auto& cb : cbs) {
+                cb();
+            }
+        }
+    }
+    for(int k = 0; k < 2; ++k) {
+        timers[k].back()->cancel();
+        uint64_t max_late = 0;
+        for(int i = 0; i < count; ++i) {
+            if(i % 7 == 0) {
+                FATDOG_ASSERT(!fired[k][i]);
+                continue;
+            }
+            FATDOG_ASSERT2(fired[k][i] >= due[i], "i=" << i << " early " << due[i] - fired[k][i]);
+            max_late = std::max(max_late, fired[k][i] - due[i]);
+        }
+        // a recurring timer restarts from when it ran, the lateness of every round adds up
+        FATDOG_ASSERT2(ticks[k] >= 21000 / 50 * 9 / 10, "ticks=" << ticks[k]);
+        std::cout << "timer " << (k ? "wheel" : "set") << " max_late=" << max_late << "ms"
+                  << " recurring ticks=" << ticks[k] << std::endl;
+    }
+}
+
+template<class F>
+static void bench_clock(const char* name, F f, int n) {
+    uint64_t sum = 0;
+    uint64_t begin = fatdog::Clock::NowNS();
+    for(int i = 0; i < n; ++i) {
+        sum += f();
+    }
+    uint64_t used = fatdog::Clock::NowNS() - begin;
+    std::cout << "  " << name << " " << (double)used / n << "ns/call (" << (sum & 1) << ")" << std::endl;
+}
+
+void test_clock() {
+    std::cout << "clock" << std::endl;
+    const int n = 5000000;
+    bench_clock("GetCurrentMS", []() { return fatdog::GetCurrentMS(); }, n);
+    bench_clock("Clock::NowMS", []() { return fatdog::Clock::NowMS(); }, n);
+    fatdog::Clock::Update();
+    bench_clock("Clock::CoarseMS", []() { return fatdog::Clock::CoarseMS(); }, n);
+    fatdog::Clock::Invalidate();
+    bench_clock("time(0)", []() { return (uint64_t)time(0); }, n);
+    bench_clock("Clock::WallSeconds", []() { return (uint64_t)fatdog::Clock::WallSeconds(); }, n);
+
+    fatdog::Config::lookUp<bool>("clock.tsc")->setValue(true);
+    uint64_t last = 0;
+    uint64_t begin = fatdog::GetCurrentMS();
+    // calibrates during the first 100ms, then re-scales every second
+    while(fatdog::GetCurrentMS() < begin + 2500) {
+        uint64_t now = fatdog::Clock::NowNS();
+        FATDOG_ASSERT(now >= last);
+        last = now;
+    }
+    if(fatdog::Clock::IsTscEnabled()) {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        int64_t diff = (int64_t)fatdog::Clock::NowNS() - (int64_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+        std::cout << "  tsc vs CLOCK_MONOTONIC " << diff << "ns" << std::endl;
+        FATDOG_ASSERT(diff < 1000000 && diff > -1000000);
+        bench_clock("Clock::NowMS tsc", []() { return fatdog::Clock::NowMS(); }, n);
+    } else {
+        std::cout << "  no invariant tsc" << std::endl;
+    }
+    fatdog::Config::lookUp<bool>("clock.tsc")->setValue(false);
+}
+
+// per-I/O pattern: add a recv timeout, cancel it when the data comes
+void bench_timer(fatdog::TimerManager::Type type, int live, int ops) {
+    ManualTimers tm(type);
+    std::vector<fatdog::TimerManager::Timer::ptr> timers(live);
+    for(int i = 0; i < live; ++i) {
+        timers[i] = tm.addTimer(30000 + i % 1000, [](){});
+    }
+    uint64_t begin = fatdog::GetCurrentUS();
+    for(int i = 0; i < ops; ++i) {
+        auto& t = timers[i % live];
+        t->cancel();
+        t = tm.addTimer(30000 + i % 1000, [](){});
+    }
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+    std::cout << "bench_timer " << (type == fatdog::TimerManager::WHEEL ? "wheel" : "set")
+              << " live=" << live << " ops=" << ops << " used=" << used << "us"
+              << " ops/s=" << (used ? ops * 1000000ull / used : 0) << std::endl;
+}
+
 int main(int argc, char** argv) {
     FATDOG_LOG_INFO(g_logger) << "let's start";
     // test1();
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+    test_backend("epoll", 20000);
+    test_backend("io_uring", 20000);
+    test_tickle(4, 1000, 64);
+    test_pinned("epoll", 4, 40);
+    test_pinned("io_uring", 4, 40);
+    test_clock();
+    bench_timer(fatdog::TimerManager::SET, 1000000, 1000000);
+    bench_timer(fatdog::TimerManager::WHEEL, 1000000, 1000000);
+    test_timer_expire();
+    g_logger->setLevel(fatdog::LogLevel::DEBUG);
     test_timer();
     FATDOG_LOG_INFO(g_logger) << "let's end";
     return 0;
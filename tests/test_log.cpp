@@ -3,9 +3,21 @@
 #include <string>
 #include <vector>
 #include <stdarg.h>
+#include <string.h>
+
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "../fatdog/log.h"
+#include "../fatdog/binary_log.h"
 #include "../fatdog/config.h"
+#include "../fatdog/macro.h"
 
 void init(std::string m_pattern)
 {
@@ -313,6 +325,350 @@ void test5()
     FATDOG_LOG_FMT_INFO(FATDOG_LOG_NAME("balala"), "a a a %s %d %f", "miao", 1, 2.34);
 }
 
+static size_t count_lines(const std::string &file)
+{
+    std::ifstream in(file);
+    std::string line;
+    size_t n = 0;
+    while (std::getline(in, line))
+    {
+        ++n;
+    }
+    return n;
+}
+
+// several threads through one appender, every line ends up in the file
+static uint64_t log_lines(fatdog::LogAppender::ptr appender, int threads, int lines)
+{
+    fatdog::Logger::ptr logger(new fatdog::Logger("async"));
+    logger->setFormatter("%d%T%t%T%m%n");
+    logger->addAppender(appender);
+
+    uint64_t begin = fatdog::GetCurrentUS();
+    std::vector<fatdog::Thread::ptr> thrs;
+    for (int i = 0; i < threads; ++i)
+    {
+        thrs.push_back(fatdog::Thread::ptr(new fatdog::Thread("log_" + std::to_string(i), [logger, lines]() {
+            for (int j = 0; j < lines; ++j)
+            {
+                FATDOG_LOG_INFO(logger) << "line " << j << " of a log record which is about as long as a real one";
+            }
+        })));
+    }
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    return fatdog::GetCurrentUS() - begin;
+}
+
+void test6()
+{
+    const int threads = 4;
+    const int lines = 100000;
+    unlink("log_sync.txt");
+    unlink("log_async.txt");
+
+    uint64_t used = log_lines(fatdog::LogAppender::ptr(new fatdog::FileLogAppender("log_sync.txt")), threads, lines);
+    std::cout << "sync  " << used * 1000.0 / (threads * lines) << "ns/record" << std::endl;
+    FATDOG_ASSERT(count_lines("log_sync.txt") == (size_t)threads * lines);
+
+    {
+        fatdog::AsyncLogAppender::ptr async(new fatdog::AsyncLogAppender(
+            fatdog::LogAppender::ptr(new fatdog::FileLogAppender("log_async.txt")), 1024 * 1024, fatdog::AsyncLogAppender::BLOCK));
+        used = log_lines(async, threads, lines);
+        std::cout << "async " << used * 1000.0 / (threads * lines) << "ns/record" << std::endl;
+        FATDOG_ASSERT(async->getDropped() == 0);
+        // FATAL does not return before it is on disk
+        fatdog::Logger::ptr logger(new fatdog::Logger("async"));
+        logger->addAppender(async);
+        FATDOG_LOG_FATAL(logger) << "fatal";
+        FATDOG_ASSERT(count_lines("log_async.txt") == (size_t)threads * lines + 1);
+    }
+
+    // a tiny ring which drops, the count shows up in the file
+    unlink("log_async.txt");
+    {
+        fatdog::AsyncLogAppender::ptr async(new fatdog::AsyncLogAppender(
+            fatdog::LogAppender::ptr(new fatdog::FileLogAppender("log_async.txt")), 4096, fatdog::AsyncLogAppender::DROP));
+        log_lines(async, threads, lines / 10);
+        std::cout << "dropped " << async->getDropped() << std::endl;
+    }
+    std::cout << "lines " << count_lines("log_async.txt") << std::endl;
+    unlink("log_sync.txt");
+    unlink("log_async.txt");
+}
+
+// EVENT records in a binary log file, -1 if it is broken
+static long count_binary_events(const std::string &file)
+{
+    std::ifstream in(file, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < fatdog::BinaryLog::HEADER_SIZE || memcmp(data.data(), fatdog::BinaryLog::MAGIC, 8))
+    {
+        return -1;
+    }
+    long n = 0;
+    size_t off = fatdog::BinaryLog::HEADER_SIZE;
+    while (off + fatdog::BinaryLog::RECORD_HEADER_SIZE <= data.size())
+    {
+        uint32_t size;
+        memcpy(&size, &data[off], 4);
+        if (!size)
+        {
+            break;
+        }
+        if (size % 4 || off + size > data.size())
+        {
+            return -1;
+        }
+        n += data[off + 4] == fatdog::BinaryLog::EVENT;
+        off += size;
+    }
+    return n;
+}
+
+void test7()
+{
+    const int threads = 4;
+    const int lines = 100000;
+    const int files = 32;
+    auto remove = [files]() {
+        unlink("log_binary.bin");
+        for (int i = 1; i <= files; ++i)
+        {
+            unlink(("log_binary.bin." + std::to_string(i)).c_str());
+        }
+    };
+    remove();
+
+    // 4MB files, rotates a few times on the way, every record ends up in one of them
+    {
+        fatdog::LogAppender::ptr appender(new fatdog::BinaryLogAppender("log_binary.bin", 4 * 1024 * 1024, files));
+        uint64_t used = log_lines(appender, threads, lines);
+        std::cout << "binary " << used * 1000.0 / (threads * lines) << "ns/record" << std::endl;
+    }
+    long events = count_binary_events("log_binary.bin");
+    int rotated = 0;
+    for (int i = 1; i <= files; ++i)
+    {
+        long n = count_binary_events("log_binary.bin." + std::to_string(i));
+        if (n < 0)
+        {
+            break;
+        }
+        events += n;
+        ++rotated;
+    }
+    std::cout << "binary files " << rotated + 1 << " events " << events << std::endl;
+    FATDOG_ASSERT(rotated > 0 && rotated < files);
+    FATDOG_ASSERT(events == (long)threads * lines);
+    remove();
+}
+
+// keeps the messages
+class MemoryLogAppender : public fatdog::LogAppender
+{
+public:
+    void log(fatdog::Logger::ptr logger, fatdog::LogLevel::Level level, fatdog::LogEvent::ptr event) override
+    {
+        fatdog::Mutex::Lock lock(m_mutex);
+        m_lines.push_back(event->getContent());
+    }
+    void write(const iovec *iov, int iovcnt) override {}
+    std::string toYamlString() override { return ""; }
+
+    fatdog::Mutex m_mutex;
+    std::vector<std::string> m_lines;
+};
+
+void test8()
+{
+    fatdog::Logger::ptr logger(new fatdog::Logger("limit", fatdog::LogLevel::DEBUG));
+    std::shared_ptr<MemoryLogAppender> appender(new MemoryLogAppender);
+    logger->addAppender(appender);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        FATDOG_LOG_EVERY_N(logger, fatdog::LogLevel::INFO, 10) << "every_n " << i;
+    }
+    std::cout << "every_n " << appender->m_lines.size() << " " << appender->m_lines.back() << std::endl;
+    FATDOG_ASSERT(appender->m_lines.size() == 10);
+    FATDOG_ASSERT(appender->m_lines[0] == "every_n 0");
+    FATDOG_ASSERT(appender->m_lines[1] == "every_n 10 (suppressed 9)");
+
+    // 4 threads for 250ms, one line per 100ms goes through
+    appender->m_lines.clear();
+    std::vector<fatdog::Thread::ptr> thrs;
+    for (int i = 0; i < 4; ++i)
+    {
+        thrs.push_back(fatdog::Thread::ptr(new fatdog::Thread("limit_" + std::to_string(i), [logger]() {
+            uint64_t end = fatdog::Clock::NowMS() + 250;
+            while (fatdog::Clock::NowMS() < end)
+            {
+                FATDOG_LOG_EVERY_MS(logger, fatdog::LogLevel::INFO, 100) << "every_ms";
+                usleep(100);
+            }
+        })));
+    }
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    std::cout << "every_ms " << appender->m_lines.size() << " " << appender->m_lines.back() << std::endl;
+    FATDOG_ASSERT(appender->m_lines.size() >= 2 && appender->m_lines.size() <= 4);
+
+    // a level below the logger's is not counted either
+    appender->m_lines.clear();
+    logger->setLevel(fatdog::LogLevel::WARN);
+    for (int i = 0; i < 10; ++i)
+    {
+        FATDOG_LOG_EVERY_N(logger, fatdog::LogLevel::INFO, 2) << "hidden";
+    }
+    FATDOG_ASSERT(appender->m_lines.empty());
+}
+
+static std::vector<std::string> list_dir(const std::string &dir)
+{
+    std::vector<std::string> names;
+    DIR *d = opendir(dir.c_str());
+    while (dirent *e = d ? readdir(d) : nullptr)
+    {
+        if (e->d_name[0] != '.')
+        {
+            names.push_back(e->d_name);
+        }
+    }
+    if (d)
+    {
+        closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static void remove_dir(const std::string &dir)
+{
+    for (auto &i : list_dir(dir))
+    {
+        unlink((dir + "/" + i).c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+void test9()
+{
+    remove_dir("log_rotate");
+    mkdir("log_rotate", 0755);
+    {
+        fatdog::Logger::ptr logger(new fatdog::Logger("rotate"));
+        logger->setFormatter("%d%T%m%n");
+        logger->addAppender(fatdog::LogAppender::ptr(new fatdog::FileLogAppender(
+            "log_rotate/log.txt", fatdog::LogLevel::INFO, 64 * 1024, fatdog::FileLogAppender::ROTATE_DAILY, 3, true)));
+        // ~100 bytes a line, about 6 rotations
+        for (int i = 0; i < 4000; ++i)
+        {
+            FATDOG_LOG_INFO(logger) << "line " << i << " of a log record which is about as long as a real one, or a bit longer";
+        }
+
+        // SIGHUP: moved away by someone else, the next line goes to a new file
+        rename("log_rotate/log.txt", "log_rotate/moved");
+        raise(SIGHUP);
+        FATDOG_LOG_INFO(logger) << "after sighup";
+        FATDOG_ASSERT(count_lines("log_rotate/log.txt") == 1);
+        unlink("log_rotate/moved");
+    }
+
+    // the gzip threads finish in the background
+    std::vector<std::string> names;
+    for (int i = 0; i < 200; ++i)
+    {
+        names = list_dir("log_rotate");
+        if (std::all_of(names.begin(), names.end(), [](const std::string &n) {
+                return n == "log.txt" || (n.size() > 3 && n.compare(n.size() - 3, 3, ".gz") == 0);
+            }))
+        {
+            break;
+        }
+        usleep(10 * 1000);
+    }
+    for (auto &i : names)
+    {
+        std::cout << "rotate " << i << std::endl;
+    }
+    FATDOG_ASSERT(names.size() == 4 && names[0] == "log.txt");
+    for (size_t i = 1; i < 4; ++i)
+    {
+        // each one a whole file of lines
+        gzFile in = gzopen(("log_rotate/" + names[i]).c_str(), "rb");
+        char buf[4096];
+        size_t size = 0;
+        int n;
+        char last = 0;
+        while ((n = gzread(in, buf, sizeof(buf))) > 0)
+        {
+            size += n;
+            last = buf[n - 1];
+        }
+        gzclose(in);
+        FATDOG_ASSERT(size >= 64 * 1024 && last == '\n');
+    }
+    remove_dir("log_rotate");
+}
+
+// formats every record and throws it away, what's left is the cost of the log path itself
+class NullLogAppender : public fatdog::LogAppender
+{
+public:
+    NullLogAppender(bool legacy)
+        : m_legacy(legacy)
+    {
+    }
+
+    void log(fatdog::Logger::ptr logger, fatdog::LogLevel::Level level, fatdog::LogEvent::ptr event) override
+    {
+        if (m_legacy)
+        {
+            m_bytes += m_formatter->format(logger, level, event).size();
+            return;
+        }
+        m_buffer.clear();
+        m_formatter->format(m_buffer, logger, level, event);
+        m_bytes += m_buffer.size();
+    }
+    void write(const iovec *iov, int iovcnt) override {}
+    std::string toYamlString() override { return ""; }
+
+    bool m_legacy;
+    fatdog::LogBuffer m_buffer;
+    size_t m_bytes = 0;
+};
+
+// legacy: a new LogEvent per record and the std::string formatter, as the macros did before
+void bench_log(int n, bool legacy)
+{
+    fatdog::Logger::ptr logger(new fatdog::Logger("bench"));
+    std::shared_ptr<NullLogAppender> appender(new NullLogAppender(legacy));
+    logger->addAppender(appender);
+
+    uint64_t begin = fatdog::GetCurrentUS();
+    for (int i = 0; i < n; ++i)
+    {
+        if (legacy)
+        {
+            fatdog::LogEventWrapper(fatdog::LogEvent::ptr(new fatdog::LogEvent(logger, fatdog::LogLevel::INFO, __FILE__, __LINE__, 0, fatdog::GetThreadId(), fatdog::GetFiberId(), time(0), fatdog::Thread::GetName()))).getSS()
+                << "request " << i << " from " << "127.0.0.1:8080" << " took " << 1.5 << "ms";
+        }
+        else
+        {
+            FATDOG_LOG_INFO(logger) << "request " << i << " from " << "127.0.0.1:8080" << " took " << 1.5 << "ms";
+        }
+    }
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+    std::cout << (legacy ? "legacy" : "fast") << " log path " << used * 1000.0 / n << "ns/record ("
+              << appender->m_bytes / n << " bytes)" << std::endl;
+}
+
 int main()
 {
     // std::string str = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";
@@ -326,6 +682,12 @@ int main()
     // test3();
     // test4();
     test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    bench_log(1000000, true);
+    bench_log(1000000, false);
 
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,13 @@
 #include "../fatdog/scheduler.h"
 #include "../fatdog/log.h"
 #include "../fatdog/macro.h"
+#include "../fatdog/util.h"
+
+#include <atomic>
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
 
 static fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
 
@@ -18,7 +25,103 @@ void test1_1()
     sc.stop();
 }
 
-int main()
+static std::atomic<uint64_t> s_done{0};
+
+// every root task fans out into children from inside a worker, so both the
+// local queues and stealing get exercised
+void bench_child()
+{
+    ++s_done;
+}
+
+void bench_root(fatdog::Scheduler *sc, int children)
+{
+    for (int i = 0; i < children; ++i)
+    {
+        sc->schedule(&bench_child);
+    }
+    ++s_done;
+}
+
+void bench_schedule(uint32_t threads, int roots, int children)
+{
+    s_done = 0;
+    fatdog::Scheduler sc("bench", threads, false);
+    sc.start();
+
+    uint64_t begin = fatdog::GetCurrentUS();
+    for (int i = 0; i < roots; ++i)
+    {
+        sc.schedule(std::bind(&bench_root, &sc, children));
+    }
+    sc.stop();
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+
+    uint64_t total = (uint64_t)roots * (children + 1);
+    FATDOG_ASSERT(s_done == total);
+    std::cout << "bench_schedule threads=" << threads
+              << " tasks=" << total
+              << " used=" << used << "us"
+              << " tasks/s=" << (used ? total * 1000 * 1000 / used : 0)
+              << std::endl;
+}
+
+// plain threads outside the scheduler post single tasks and batches concurrently,
+// nothing may be lost or run twice
+void bench_inject(uint32_t threads, int producers, int tasks)
+{
+    s_done = 0;
+    fatdog::Scheduler sc("inject", threads, false);
+    sc.start();
+
+    uint64_t begin = fatdog::GetCurrentUS();
+    std::vector<fatdog::Thread::ptr> thrs;
+    for (int i = 0; i < producers; ++i)
+    {
+        thrs.push_back(fatdog::Thread::ptr(new fatdog::Thread("producer_" + std::to_string(i), [&sc, tasks]() {
+            std::vector<std::function<void()>> batch(16, &bench_child);
+            for (int j = 0; j < tasks; j += 32)
+            {
+                for (int k = 0; k < 16; ++k)
+                {
+                    sc.schedule(&bench_child);
+                }
+                sc.schedule(batch.begin(), batch.end());
+            }
+        })));
+    }
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    sc.stop();
+    uint64_t used = fatdog::GetCurrentUS() - begin;
+
+    uint64_t total = (uint64_t)producers * ((tasks + 31) / 32 * 32);
+    FATDOG_ASSERT(s_done == total);
+    std::cout << "bench_inject threads=" << threads
+              << " producers=" << producers
+              << " tasks=" << total
+              << " used=" << used << "us"
+              << " tasks/s=" << (used ? total * 1000 * 1000 / used : 0)
+              << std::endl;
+}
+
+// usage: test_scheduler [max_threads], max_threads defaults to online cpus
+int main(int argc, char **argv)
 {
     test1_1();
-}
\ No newline at end of file
+
+    uint32_t max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    // scheduler logs every fiber creation at INFO, keep it out of the numbers
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+    for (uint32_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        bench_schedule(threads, 1000, 100);
+    }
+    for (uint32_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        bench_inject(threads, 4, 20000);
+    }
+}
@@ -1,6 +1,15 @@
 #include "../fatdog/tcp_server.h"
 #include "../fatdog/iomanager.h"
+#include "../fatdog/clock.h"
+#include "../fatdog/config.h"
 #include "../fatdog/log.h"
+#include "../fatdog/macro.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <arpa/inet.h>
+#include <poll.h>
 
 fatdog::Logger::ptr g_logger = FATDOG_LOG_ROOT();
 
@@ -20,8 +29,360 @@ void run()
     }
     tcp_server->start();
 }
+
+// closes every connection right away (or after hold_ms), connections per second is all that is measured
+class CloseServer : public fatdog::TcpServer
+{
+public:
+    uint64_t hold_ms = 0;
+    char tag = 0; // sent first if set
+
+    CloseServer(fatdog::IOManager *worker, fatdog::IOManager *accept_worker)
+        : TcpServer(worker, accept_worker)
+    {
+    }
+    CloseServer(const std::vector<fatdog::IOManager *> &reactors)
+        : TcpServer(reactors)
+    {
+    }
+
+protected:
+    void handleClient(fatdog::Socket::ptr client) override
+    {
+        if (tag)
+        {
+            client->send(&tag, 1);
+        }
+        if (hold_ms)
+        {
+            usleep(hold_ms * 1000);
+        }
+        client->close();
+    }
+};
+
+// plain blocking threads: connect, wait for the server's close, again
+static uint64_t RunClients(uint16_t port, int clients, int seconds)
+{
+    std::atomic<uint64_t> done = {0};
+    std::atomic<bool> stop = {false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < clients; ++i)
+    {
+        threads.emplace_back([&]() {
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            while (!stop)
+            {
+                int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0)
+                {
+                    char c;
+                    if (::read(fd, &c, 1) == 0)
+                    {
+                        ++done;
+                    }
+                }
+                ::close(fd);
+            }
+        });
+    }
+    sleep(seconds);
+    stop = true;
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    return done;
+}
+
+// a deploy: count connections land at once, the ms until the server closed them all
+static uint64_t Storm(uint16_t port, int count)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    uint64_t start = fatdog::Clock::NowMS();
+    std::vector<int> fds;
+    for (int i = 0; i < count; ++i)
+    {
+        // the kernel completes the handshake, the server has yet to accept
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            fds.push_back(fd);
+        }
+        else
+        {
+            ::close(fd);
+        }
+    }
+    for (int fd : fds)
+    {
+        char c;
+        ::read(fd, &c, 1);
+        ::close(fd);
+    }
+    return fatdog::Clock::NowMS() - start;
+}
+
+// one acceptor handing connections to n workers, then n reactors accepting on their own
+static void bench(int n, int seconds, int clients, int batch)
+{
+    if (batch > 0)
+    {
+        fatdog::Config::lookUp<uint32_t>("tcp_server.accept_batch")->setValue(batch);
+    }
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+    FATDOG_LOG_NAME("system")->setLevel(fatdog::LogLevel::WARN);
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        std::vector<fatdog::IOManager *> ioms;
+        fatdog::TcpServer::ptr server;
+        if (mode == 0)
+        {
+            ioms.push_back(new fatdog::IOManager("accept", 1, false));
+            ioms.push_back(new fatdog::IOManager("worker", n, false));
+            server.reset(new CloseServer(ioms[1], ioms[0]));
+        }
+        else
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                ioms.push_back(new fatdog::IOManager("reactor_" + std::to_string(i), 1, false));
+            }
+            server.reset(new CloseServer(ioms));
+        }
+
+        const uint16_t port = 8034;
+        auto addr = fatdog::Address::LookupAny("127.0.0.1:" + std::to_string(port));
+        // bind in a fiber like run(), the hook only makes sockets created there non blocking
+        bool ok = false;
+        fatdog::Semaphore sem;
+        ioms[0]->schedule([&]() {
+            ok = server->bind(addr) && server->start();
+            sem.notify();
+        });
+        sem.wait();
+        if (!ok)
+        {
+            FATDOG_LOG_ERROR(g_logger) << "bench bind fail";
+            return;
+        }
+
+        uint64_t storm = Storm(port, 1000);
+        uint64_t start = fatdog::Clock::NowMS();
+        uint64_t count = RunClients(port, clients, seconds);
+        uint64_t used = fatdog::Clock::NowMS() - start;
+        std::cout << (mode == 0 ? "acceptor + workers" : "reactors") << " n=" << n
+                  << " clients=" << clients << ": " << count << " connections, "
+                  << count * 1000 / (used ? used : 1) << " conn/s, storm of 1000 closed in "
+                  << storm << "ms" << std::endl;
+
+        server->stop();
+        server.reset();
+        for (auto iom : ioms)
+        {
+            delete iom;
+        }
+    }
+}
+
+// 20 clients against max_connections 10 while each connection is held 300ms. refused first,
+// then with pause_on_overload they wait in the backlog until there is room
+static void overload()
+{
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+    FATDOG_LOG_NAME("system")->setLevel(fatdog::LogLevel::WARN);
+    fatdog::IOManager iom("overload", 1, false);
+    std::shared_ptr<CloseServer> server(new CloseServer(&iom, &iom));
+    server->hold_ms = 300;
+    server->setMaxConnections(10);
+    const uint16_t port = 8035;
+    bool ok = false;
+    fatdog::Semaphore sem;
+    iom.schedule([&]() {
+        ok = server->bind(fatdog::Address::LookupAny("127.0.0.1:" + std::to_string(port))) && server->start();
+        sem.notify();
+    });
+    sem.wait();
+    FATDOG_ASSERT(ok);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int pause = 0; pause < 2; ++pause)
+    {
+        server->setPauseOnOverload(pause);
+        uint64_t rejected = server->getRejected();
+        std::vector<int> fds;
+        for (int i = 0; i < 20; ++i)
+        {
+            int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            FATDOG_ASSERT(::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+            fds.push_back(fd);
+        }
+        // refused ones are closed at once, served ones after hold_ms
+        uint64_t start = fatdog::Clock::NowMS();
+        int fast = 0;
+        std::vector<pollfd> pfds;
+        for (int fd : fds)
+        {
+            pfds.push_back({fd, POLLIN, 0});
+        }
+        for (size_t done = 0; done < pfds.size();)
+        {
+            ::poll(&pfds[0], pfds.size(), -1);
+            for (auto &p : pfds)
+            {
+                if (p.fd >= 0 && p.revents)
+                {
+                    ::close(p.fd);
+                    p.fd = -1;
+                    ++done;
+                    fast += fatdog::Clock::NowMS() - start < 150;
+                }
+            }
+        }
+        uint64_t used = fatdog::Clock::NowMS() - start;
+        std::cout << (pause ? "pause" : "refuse") << ": rejected=" << server->getRejected() - rejected
+                  << " closed_at_once=" << fast << " pauses=" << server->getPauses()
+                  << " all done in " << used << "ms" << std::endl;
+        if (pause)
+        {
+            // served in two rounds of 10
+            FATDOG_ASSERT(server->getRejected() == rejected);
+            FATDOG_ASSERT(server->getPauses() >= 1);
+            FATDOG_ASSERT(used >= 2 * server->hold_ms);
+        }
+        else
+        {
+            FATDOG_ASSERT(server->getRejected() - rejected == 10);
+            FATDOG_ASSERT(fast >= 10);
+        }
+        // the client sees the close before handleClient() returns
+        for (int i = 0; i < 100 && server->getConnections(); ++i)
+        {
+            usleep(10 * 1000);
+        }
+        FATDOG_ASSERT(server->getConnections() == 0);
+    }
+    server->stop();
+}
+
+static int Connect(uint16_t port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    FATDOG_ASSERT(::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+// runs cb in a fiber of iom, waits for it
+static void RunIn(fatdog::IOManager &iom, std::function<void()> cb)
+{
+    fatdog::Semaphore sem;
+    iom.schedule([&]() {
+        cb();
+        sem.notify();
+    });
+    sem.wait();
+}
+
+// old server hands its listening socket to a new one and drains, then drain deadlines
+static void restart()
+{
+    g_logger->setLevel(fatdog::LogLevel::WARN);
+    FATDOG_LOG_NAME("system")->setLevel(fatdog::LogLevel::WARN);
+    fatdog::IOManager old_iom("old", 1, false);
+    fatdog::IOManager new_iom("new", 1, false);
+    const uint16_t port = 8036;
+    const std::string path = "/tmp/fatdog_test_handoff.sock";
+    char c = 0;
+
+    std::shared_ptr<CloseServer> old_server(new CloseServer(&old_iom, &old_iom));
+    old_server->tag = 'A';
+    old_server->hold_ms = 300;
+    std::shared_ptr<CloseServer> new_server(new CloseServer(&new_iom, &new_iom));
+    new_server->tag = 'B';
+    RunIn(old_iom, [&]() {
+        FATDOG_ASSERT(old_server->bind(fatdog::Address::LookupAny("127.0.0.1:" + std::to_string(port))));
+        FATDOG_ASSERT(old_server->start());
+    });
+    int busy = Connect(port);
+    FATDOG_ASSERT(::read(busy, &c, 1) == 1 && c == 'A');
+
+    bool handed = false;
+    fatdog::Semaphore handed_sem;
+    old_iom.schedule([&]() {
+        handed = old_server->handOffListeners(path);
+        handed_sem.notify();
+    });
+    usleep(100 * 1000);
+    RunIn(new_iom, [&]() {
+        FATDOG_ASSERT(new_server->takeOverListeners(path));
+        FATDOG_ASSERT(new_server->start());
+    });
+    handed_sem.wait();
+    FATDOG_ASSERT(handed);
+
+    // the busy connection finishes, everything new lands on the new server
+    uint64_t start = fatdog::Clock::NowMS();
+    FATDOG_ASSERT(old_server->drain(2000));
+    FATDOG_ASSERT(::read(busy, &c, 1) == 0);
+    ::close(busy);
+    std::cout << "handoff: old drained in " << fatdog::Clock::NowMS() - start << "ms" << std::endl;
+    for (int i = 0; i < 5; ++i)
+    {
+        int fd = Connect(port);
+        FATDOG_ASSERT(::read(fd, &c, 1) == 1 && c == 'B');
+        ::close(fd);
+    }
+
+    // a connection that won't finish is shut down at the deadline
+    new_server->hold_ms = 3000;
+    int stuck = Connect(port);
+    FATDOG_ASSERT(::read(stuck, &c, 1) == 1 && c == 'B');
+    start = fatdog::Clock::NowMS();
+    FATDOG_ASSERT(!new_server->drain(200));
+    FATDOG_ASSERT(::read(stuck, &c, 1) == 0);
+    uint64_t used = fatdog::Clock::NowMS() - start;
+    std::cout << "deadline: shut down after " << used << "ms" << std::endl;
+    FATDOG_ASSERT(used < 1000);
+    ::close(stuck);
+}
+
 int main(int argc, char **argv)
 {
+    if (argc > 1 && std::string(argv[1]) == "restart")
+    {
+        restart();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "overload")
+    {
+        overload();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "bench")
+    {
+        bench(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atoi(argv[3]) : 3, argc > 4 ? atoi(argv[4]) : 8,
+              argc > 5 ? atoi(argv[5]) : 0);
+        return 0;
+    }
     fatdog::IOManager iom("lala", 2);
     iom.schedule(run);
     return 0;
@@ -0,0 +1,159 @@
+// decode BinaryLogAppender files back into text
+//      fatdog_logcat [-p pattern] file...
+// files are decoded one after the other, pass the oldest first (file.2 file.1 file)
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+
+#include "fatdog/log.h"
+#include "fatdog/binary_log.h"
+
+struct Site
+{
+    std::string file;
+    int line = 0;
+};
+
+static uint32_t ReadU32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static bool Decode(const std::string &filename, fatdog::LogFormatter &formatter)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    if (!ifs)
+    {
+        fprintf(stderr, "fatdog_logcat: can't open %s\n", filename.c_str());
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (data.size() < fatdog::BinaryLog::HEADER_SIZE || memcmp(data.data(), fatdog::BinaryLog::MAGIC, 8) ||
+        ReadU32(&data[8]) != fatdog::BinaryLog::VERSION)
+    {
+        fprintf(stderr, "fatdog_logcat: %s is not a binary log\n", filename.c_str());
+        return false;
+    }
+    const char *begin = data.data();
+    size_t end = data.size();
+    uint32_t header_size = ReadU32(&data[12]);
+
+    // definitions first, they may come after the events using them
+    std::map<uint32_t, Site> sites;
+    std::map<uint32_t, std::string> names;
+    std::map<std::string, fatdog::Logger::ptr> loggers;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        size_t off = header_size;
+        while (off + fatdog::BinaryLog::RECORD_HEADER_SIZE <= end)
+        {
+            const char *p = begin + off;
+            uint32_t size = ReadU32(p);
+            if (size == 0)
+            {
+                break; // never written
+            }
+            if (size < fatdog::BinaryLog::RECORD_HEADER_SIZE || size % 4 || off + size > end)
+            {
+                fprintf(stderr, "fatdog_logcat: %s broken record at %zu\n", filename.c_str(), off);
+                break;
+            }
+            off += size;
+            uint8_t type = p[4];
+            uint8_t level = p[5];
+            uint16_t padding;
+            memcpy(&padding, p + 6, 2);
+            const char *body = p + fatdog::BinaryLog::RECORD_HEADER_SIZE;
+            size_t body_len = size - fatdog::BinaryLog::RECORD_HEADER_SIZE - padding;
+
+            if (pass == 0 && type == fatdog::BinaryLog::SITE && body_len >= 8)
+            {
+                Site &site = sites[ReadU32(body)];
+                site.line = ReadU32(body + 4);
+                site.file.assign(body + 8, body_len - 8);
+            }
+            else if (pass == 0 && type == fatdog::BinaryLog::NAME && body_len >= 4)
+            {
+                names[ReadU32(body)].assign(body + 4, body_len - 4);
+            }
+            else if (pass == 1 && type == fatdog::BinaryLog::EVENT &&
+                     size - padding >= fatdog::BinaryLog::EVENT_SIZE)
+            {
+                const char *msg = p + fatdog::BinaryLog::EVENT_SIZE;
+                size_t msg_len = size - padding - fatdog::BinaryLog::EVENT_SIZE;
+                uint32_t site_id = ReadU32(body);
+                if (!site_id)
+                {
+                    // text which was already formatted
+                    fwrite(msg, 1, msg_len, stdout);
+                    continue;
+                }
+                uint64_t time;
+                memcpy(&time, body + 24, 8);
+
+                const Site &site = sites[site_id];
+                const std::string &name = names[ReadU32(body + 4)];
+                fatdog::Logger::ptr &logger = loggers[name];
+                if (!logger)
+                {
+                    logger.reset(new fatdog::Logger(name));
+                }
+                fatdog::LogEvent::ptr event(new fatdog::LogEvent(logger, (fatdog::LogLevel::Level)level,
+                                                                 site.file.c_str(), site.line, ReadU32(body + 20),
+                                                                 ReadU32(body + 12), ReadU32(body + 16), time,
+                                                                 names[ReadU32(body + 8)]));
+                event->getContentBuffer().append(msg, msg_len);
+
+                fatdog::LogBuffer out;
+                formatter.format(out, logger, (fatdog::LogLevel::Level)level, event);
+                fwrite(out.data(), 1, out.size(), stdout);
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    fatdog::LogFormatter::ptr formatter(new fatdog::LogFormatter);
+    int opt;
+    while ((opt = getopt(argc, argv, "p:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            formatter.reset(new fatdog::LogFormatter(optarg));
+            if (formatter->isError())
+            {
+                fprintf(stderr, "fatdog_logcat: bad pattern %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p pattern] file...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-p pattern] file...\n", argv[0]);
+        return 1;
+    }
+
+    int rt = 0;
+    for (int i = optind; i < argc; ++i)
+    {
+        if (!Decode(argv[i], *formatter))
+        {
+            rt = 1;
+        }
+    }
+    return rt;
+}